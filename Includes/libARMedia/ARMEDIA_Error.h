@@ -56,6 +56,8 @@ typedef enum
     ARMEDIA_ERROR_ENCAPSULER_BAD_VIDEO_SAMPLE, /**< Error in audio sample header */
     ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR, /**< File error while encapsulating */
     ARMEDIA_ERROR_ENCAPSULER_BAD_TIMESTAMP, /**< Timestamp is before previous sample */
+    ARMEDIA_ERROR_ENCAPSULER_QUEUE_FULL, /**< Writer queue is full, frame dropped */
+    ARMEDIA_ERROR_ENCAPSULER_DISK_FULL, /**< No space left on the storage, frame dropped */
 
 } eARMEDIA_ERROR;
 
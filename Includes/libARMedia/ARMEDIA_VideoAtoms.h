@@ -85,7 +85,7 @@ ftyp -> specific
 pvat -> specific
 mdat -> specific (include freeAtom if needed)
 moov -> empty
- |- mvhd -> specific
+ |- mvhd -> specific (version 1 when the duration needs 64 bits, as tkhd and mdhd)
  |- trak -> empty
  |   |- tkhd -> specific
  |   \- mdia -> empty
@@ -116,10 +116,10 @@ void freeAtom (movie_atom_t **atom);
 /* SPECIFIC */
 movie_atom_t *ftypAtomForFormatAndCodecWithOffset (eARMEDIA_ENCAPSULER_VIDEO_CODEC codec, off_t *offset);
 movie_atom_t *mdatAtomForFormatWithVideoSize (uint64_t videoSize);
-movie_atom_t *mvhdAtomFromFpsNumFramesAndDate (uint32_t timescale, uint32_t duration, time_t date);
-movie_atom_t *tkhdAtomWithResolutionNumFramesFpsAndDate (uint32_t w, uint32_t h, uint32_t timescale, uint32_t duration, time_t date, eARMEDIA_VIDEOATOM_MEDIATYPE type);
+movie_atom_t *mvhdAtomFromFpsNumFramesAndDate (uint32_t timescale, uint64_t duration, time_t date);
+movie_atom_t *tkhdAtomWithResolutionNumFramesFpsAndDate (uint32_t w, uint32_t h, uint32_t timescale, uint64_t duration, time_t date, eARMEDIA_VIDEOATOM_MEDIATYPE type);
 movie_atom_t *cdscAtomGen (uint32_t *target_track_id, uint32_t target_track_id_count);
-movie_atom_t *mdhdAtomFromFpsNumFramesAndDate (uint32_t timescale, uint32_t duration, time_t date);
+movie_atom_t *mdhdAtomFromFpsNumFramesAndDate (uint32_t timescale, uint64_t duration, time_t date);
 movie_atom_t *hdlrAtomForMdia (eARMEDIA_VIDEOATOM_MEDIATYPE type);
 movie_atom_t *vmhdAtomGen (void);
 movie_atom_t *smhdAtomGen (void);
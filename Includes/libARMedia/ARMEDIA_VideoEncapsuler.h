@@ -39,15 +39,16 @@
 #define _ARMEDAI_VIDEOENCAPSULER_H_
 #include <stdio.h>
 #include <dirent.h>
+#include <sys/uio.h>
 #include <libARDiscovery/ARDiscovery.h>
 
 #define ARMEDIA_ENCAPSULER_METADATA_STSD_INFO_SIZE (100)
 #define ARMEDIA_ENCAPSULER_VIDEO_PATH_SIZE      (256)
-#define ARMEDIA_ENCAPSULER_FRAMES_COUNT_LIMIT   (131072)
 
 #define COUNT_WAITING_FOR_IFRAME_AS_AN_ERROR    (0)
 
-#define ARMEDIA_ENCAPSULER_VERSION_NUMBER       (5)
+#define ARMEDIA_ENCAPSULER_VERSION_NUMBER       (7)
+/* Frame infos of the version 5 info files, still read by ARMEDIA_VideoEncapsuler_TryFixMediaFile() */
 #define ARMEDIA_ENCAPSULER_INFO_PATTERN        "%c:%lld:%c:%u|"
 #define ARMEDIA_ENCAPSULER_AUDIO_INFO_TAG      'a'
 #define ARMEDIA_ENCAPSULER_VIDEO_INFO_TAG      'v'
@@ -56,6 +57,21 @@
 
 #define ARMEDIA_ENCAPSULER_AVC_NALU_COUNT_MAX   (128)
 
+#define ARMEDIA_ENCAPSULER_DIRECT_IO_ALIGNMENT  (4096)
+
+#define ARMEDIA_ENCAPSULER_DEFAULT_FINISH_MEMORY_LIMIT  (256 * 1024)
+#define ARMEDIA_ENCAPSULER_MIN_FINISH_MEMORY_LIMIT      (4096)
+#define ARMEDIA_ENCAPSULER_MAX_FINISH_THREAD_COUNT      (4)
+
+#define ARMEDIA_ENCAPSULER_DEFAULT_CHUNK_MAX_SIZE       (1024 * 1024)
+
+#define ARMEDIA_ENCAPSULER_DEFAULT_CHECKPOINT_INTERVAL  (4096) // infos between two checkpoints
+
+#define ARMEDIA_ENCAPSULER_DEFAULT_TS_BATCH_SIZE        (348 * 188) // 348 transport packets
+/* Format identifiers of the registration descriptors of the private streams of a transport stream */
+#define ARMEDIA_ENCAPSULER_TS_AUDIO_FORMAT_ID           "LPCM"
+#define ARMEDIA_ENCAPSULER_TS_METADATA_FORMAT_ID        "ARMD"
+
 #define ARMEDIA_ENCAPSULER_UNTIMED_METADATA_MAKER_SIZE          (50)
 #define ARMEDIA_ENCAPSULER_UNTIMED_METADATA_MODEL_SIZE          (50)
 #define ARMEDIA_ENCAPSULER_UNTIMED_METADATA_MODEL_ID_SIZE       (5)
@@ -84,7 +100,8 @@
 static inline int ARMEDIA_ENCAPSULER_FAILED (eARMEDIA_ERROR error)
 {
     if (ARMEDIA_OK == error ||
-        ARMEDIA_ERROR_ENCAPSULER_WAITING_FOR_IFRAME == error)
+        ARMEDIA_ERROR_ENCAPSULER_WAITING_FOR_IFRAME == error ||
+        ARMEDIA_ERROR_ENCAPSULER_QUEUE_FULL == error)
     {
         return 0;
     }
@@ -94,7 +111,8 @@ static inline int ARMEDIA_ENCAPSULER_FAILED (eARMEDIA_ERROR error)
 static inline int ARMEDIA_ENCAPSULER_SUCCEEDED (eARMEDIA_ERROR error)
 {
     if (ARMEDIA_OK == error ||
-        ARMEDIA_ERROR_ENCAPSULER_WAITING_FOR_IFRAME == error)
+        ARMEDIA_ERROR_ENCAPSULER_WAITING_FOR_IFRAME == error ||
+        ARMEDIA_ERROR_ENCAPSULER_QUEUE_FULL == error)
     {
         return 1;
     }
@@ -118,6 +136,31 @@ typedef enum
 	ARMEDIA_ENCAPSULER_FRAME_TYPE_MAX
 } eARMEDIA_ENCAPSULER_FRAME_TYPE;
 
+typedef enum
+{
+    ARMEDIA_ENCAPSULER_OVERFLOW_POLICY_BLOCK = 0,   /* wait for the writer thread to free a slot */
+    ARMEDIA_ENCAPSULER_OVERFLOW_POLICY_DROP,        /* drop the frame (and the next frames until an I-frame) */
+    ARMEDIA_ENCAPSULER_OVERFLOW_POLICY_MAX
+} eARMEDIA_ENCAPSULER_OVERFLOW_POLICY;
+
+typedef enum
+{
+    ARMEDIA_ENCAPSULER_DURABILITY_GOP = 0,          /* sync before each I-frame (every 10 frames in MJPEG) */
+    ARMEDIA_ENCAPSULER_DURABILITY_PERIOD,           /* sync every N milliseconds of media */
+    ARMEDIA_ENCAPSULER_DURABILITY_SIZE,             /* sync every N bytes of media */
+    ARMEDIA_ENCAPSULER_DURABILITY_NEVER,            /* only sync the file headers, let the system write back the rest */
+    ARMEDIA_ENCAPSULER_DURABILITY_MAX
+} eARMEDIA_ENCAPSULER_DURABILITY;
+
+typedef enum
+{
+    ARMEDIA_ENCAPSULER_FASTSTART_METHOD_NONE = 0,           /* the moov atom was already before the mdat atom */
+    ARMEDIA_ENCAPSULER_FASTSTART_METHOD_FREE_SPACE,         /* the moov atom was written in the free atoms before the mdat atom */
+    ARMEDIA_ENCAPSULER_FASTSTART_METHOD_INSERT_RANGE,       /* space was inserted in place before the mdat atom */
+    ARMEDIA_ENCAPSULER_FASTSTART_METHOD_COPY,               /* the media was copied with the moov atom before the mdat atom */
+    ARMEDIA_ENCAPSULER_FASTSTART_METHOD_MAX
+} eARMEDIA_ENCAPSULER_FASTSTART_METHOD;
+
 typedef struct ARMEDIA_VideoEncapsuler_t ARMEDIA_VideoEncapsuler_t;
 
 typedef struct {
@@ -135,6 +178,28 @@ typedef struct {
     uint32_t avc_insert_ps;            /* if not null, insert SPS and PPS before this frame */
 } ARMEDIA_Frame_Header_t;
 
+typedef struct {
+    eARMEDIA_ENCAPSULER_VIDEO_CODEC codec;
+    uint16_t width;
+    uint16_t height;
+    uint64_t timestamp;                /* in microseconds */
+    eARMEDIA_ENCAPSULER_FRAME_TYPE frame_type;               /* I-frame, P-frame, JPEG-frame */
+    const struct iovec *iov;           /* H.264: one NALU per entry, with or without its 3 or 4-byte start code
+                                        * MJPEG: frame data, in one or more parts */
+    uint32_t iov_count;
+    uint32_t avc_insert_ps;            /* if not null, insert SPS and PPS before this frame */
+} ARMEDIA_Frame_Iov_Header_t;
+
+typedef struct {
+    eARMEDIA_ENCAPSULER_VIDEO_CODEC codec;
+    uint32_t frame_size;               /* Amount of data written in the reserved buffer */
+    uint16_t width;
+    uint16_t height;
+    uint64_t timestamp;                /* in microseconds */
+    eARMEDIA_ENCAPSULER_FRAME_TYPE frame_type;               /* I-frame, P-frame, JPEG-frame */
+    uint32_t avc_insert_ps;            /* if not null, insert SPS and PPS before this frame */
+} ARMEDIA_Frame_Info_t;
+
 typedef enum {
     ACODEC_PCM
 } eARMEDIA_ENCAPSULER_AUDIO_CODEC;
@@ -202,6 +267,33 @@ typedef struct {
  */
 typedef void (*ARMEDIA_VideoEncapsuler_Callback)(const char *path, int unused);
 
+/**
+ * @brief Callback called by the finish worker as the media is being completed
+ * The calls are never concurrent, but they may come from the threads writing the
+ * sample tables (see ARMEDIA_VideoEncapsuler_SetFinishThreadCount()).
+ * @param percent Completion of the finish, from 0 to 100 (100 once the media is renamed)
+ * @param userData Pointer given to ARMEDIA_VideoEncapsuler_FinishAsync() or ARMEDIA_VideoEncapsuler_TryFixDirectory()
+ */
+typedef void (*ARMEDIA_VideoEncapsuler_FinishProgressCallback_t)(uint8_t percent, void *userData);
+
+/**
+ * @brief Callback called by the finish worker once the media is completed
+ * @param mediaPath Path of the media given to ARMEDIA_VideoEncapsuler_New()
+ * @param error ARMEDIA_OK if the media is complete, otherwise the media is removed
+ * @param userData Pointer given to ARMEDIA_VideoEncapsuler_FinishAsync() or ARMEDIA_VideoEncapsuler_TryFixDirectory()
+ */
+typedef void (*ARMEDIA_VideoEncapsuler_FinishCallback_t)(const char *mediaPath, eARMEDIA_ERROR error, void *userData);
+
+/**
+ * @brief Callback called by ARMEDIA_VideoEncapsuler_Finish() once the moov atom is written
+ * @param mediaPath Path of the media given to ARMEDIA_VideoEncapsuler_New()
+ * @param fastStart 1 if the moov atom was written in the space reserved before the mdat atom,
+ * 0 if it did not fit and was written at the end of the file
+ * @param moovSize Size of the moov atom in bytes
+ * @param userData Pointer given to ARMEDIA_VideoEncapsuler_SetFastStart()
+ */
+typedef void (*ARMEDIA_VideoEncapsuler_FastStartCallback_t)(const char *mediaPath, uint8_t fastStart, uint32_t moovSize, void *userData);
+
 /**
  * @brief Create a new ARMedia encapsuler
  * @warning This function allocate memory
@@ -243,6 +335,7 @@ eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_SetMetadataInfo (ARMEDIA_VideoEncapsuler_
 
 /**
  * @brief Set the video untimed metadata
+ * The metadata atoms are built by this call, not by ARMEDIA_VideoEncapsuler_Finish().
  * @param encapsuler ARMedia video encapsuler created by ARMEDIA_VideoEncapsuler_new()
  * @param metadata Untimed metadata
  * @return Possible return values are in eARMEDIA_ERROR
@@ -251,12 +344,279 @@ eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_SetUntimedMetadata (ARMEDIA_VideoEncapsul
 
 /**
  * @brief Set the video thumbnail to include in metadata
+ * The file is read by this call when it exists; it is read again by
+ * ARMEDIA_VideoEncapsuler_Finish() only if it is modified in the meantime.
  * @param encapsuler ARMedia video encapsuler created by ARMEDIA_VideoEncapsuler_new()
  * @param file File path (JPEG format only)
  * @return Possible return values are in eARMEDIA_ERROR
  */
 eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_SetVideoThumbnail (ARMEDIA_VideoEncapsuler_t *encapsuler, const char *file);
 
+/**
+ * @brief Write the frames from a dedicated writer thread
+ * Once enabled, ARMEDIA_VideoEncapsuler_AddFrame() and ARMEDIA_VideoEncapsuler_AddSample()
+ * only copy the frame into a bounded queue, which is written to the files by a writer thread.
+ * Must be called before the first frame is added.
+ * @param encapsuler ARMedia video encapsuler created by ARMEDIA_VideoEncapsuler_new()
+ * @param queueSize Maximum number of frames/samples waiting to be written (0 to write synchronously)
+ * @param overflowPolicy What to do with a new frame when the queue is full.
+ * With ARMEDIA_ENCAPSULER_OVERFLOW_POLICY_DROP, ARMEDIA_ERROR_ENCAPSULER_QUEUE_FULL is returned for dropped frames.
+ * @return Possible return values are in eARMEDIA_ERROR
+ */
+eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_SetAsyncWriter (ARMEDIA_VideoEncapsuler_t *encapsuler, uint32_t queueSize, eARMEDIA_ENCAPSULER_OVERFLOW_POLICY overflowPolicy);
+
+/**
+ * @brief Write the media data with direct I/O (O_DIRECT), bypassing the page cache
+ * The data is copied into two aligned staging buffers: one is filled while the other
+ * one is written. The unaligned end of the data is written through the page cache
+ * on each sync and when the recording is finished.
+ * Must be called before the first frame is added.
+ * @param encapsuler ARMedia video encapsuler created by ARMEDIA_VideoEncapsuler_new()
+ * @param bufferSize Size of each staging buffer, multiple of ARMEDIA_ENCAPSULER_DIRECT_IO_ALIGNMENT
+ * (eg. 4 KiB or the erase block size of the storage, like 512 KiB), 0 to disable direct I/O
+ * @return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR if the file system does not support direct I/O,
+ * other possible return values are in eARMEDIA_ERROR
+ */
+eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_SetDirectIo (ARMEDIA_VideoEncapsuler_t *encapsuler, uint32_t bufferSize);
+
+/**
+ * @brief Preallocate the media data ahead of the write position
+ * The space is reserved by increments of preallocationSize bytes so that the file is
+ * less fragmented, and a full storage is reported with ARMEDIA_ERROR_ENCAPSULER_DISK_FULL
+ * before a frame is recorded instead of leaving a truncated frame in the media.
+ * The unused space is released by ARMEDIA_VideoEncapsuler_Finish() and
+ * ARMEDIA_VideoEncapsuler_TryFixMediaFile(). Preallocation is silently disabled
+ * if the file system does not support it.
+ * Must be called before the first frame is added. Default is 0 (no preallocation).
+ * @param encapsuler ARMedia video encapsuler created by ARMEDIA_VideoEncapsuler_new()
+ * @param preallocationSize Size of each preallocation in bytes (eg. 32 MiB), 0 to disable preallocation
+ * @return Possible return values are in eARMEDIA_ERROR
+ */
+eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_SetPreallocation (ARMEDIA_VideoEncapsuler_t *encapsuler, uint32_t preallocationSize);
+
+/**
+ * @brief Set the memory used by ARMEDIA_VideoEncapsuler_Finish() to write the sample tables
+ * The tables are not built in memory: they are produced from the frame infos kept
+ * while recording and written in windows of memoryLimit bytes, so finishing a long
+ * recording needs the same memory as a short one. A bigger window means fewer writes.
+ * The memory is shared between the finish threads.
+ * Can be called at any time before ARMEDIA_VideoEncapsuler_Finish().
+ * @param encapsuler ARMedia video encapsuler created by ARMEDIA_VideoEncapsuler_new()
+ * @param memoryLimit Size of the window in bytes, at least ARMEDIA_ENCAPSULER_MIN_FINISH_MEMORY_LIMIT,
+ * 0 for ARMEDIA_ENCAPSULER_DEFAULT_FINISH_MEMORY_LIMIT
+ * @return Possible return values are in eARMEDIA_ERROR
+ */
+eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_SetFinishMemoryLimit (ARMEDIA_VideoEncapsuler_t *encapsuler, uint32_t memoryLimit);
+
+/**
+ * @brief Set the number of threads used by ARMEDIA_VideoEncapsuler_Finish() to build the sample tables
+ * The tables of the video, metadata and audio tracks are independent: they are
+ * counted, then written at their place in the moov atom, on up to threadCount
+ * threads (the finishing thread included). The moov atom is the same whatever the
+ * number of threads.
+ * Can be called at any time before ARMEDIA_VideoEncapsuler_Finish().
+ * @param encapsuler ARMedia video encapsuler created by ARMEDIA_VideoEncapsuler_new()
+ * @param threadCount Number of threads, up to ARMEDIA_ENCAPSULER_MAX_FINISH_THREAD_COUNT,
+ * 1 to finish on the calling thread only, 0 for the number of processors
+ * @return Possible return values are in eARMEDIA_ERROR
+ */
+eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_SetFinishThreadCount (ARMEDIA_VideoEncapsuler_t *encapsuler, uint32_t threadCount);
+
+/**
+ * @brief Reserve space for the moov atom before the mdat atom (fast start)
+ * A free atom of reservedSize bytes is written between the pvat and mdat atoms.
+ * ARMEDIA_VideoEncapsuler_Finish() writes the moov atom there when it fits, so that
+ * players can start the playback without reading the end of the file. Otherwise the
+ * moov atom is written at the end of the file and the space stays a free atom.
+ * The reserved space is kept when a media is recovered by ARMEDIA_VideoEncapsuler_TryFixMediaFile().
+ * Must be called before the first frame is added.
+ * @param encapsuler ARMedia video encapsuler created by ARMEDIA_VideoEncapsuler_new()
+ * @param reservedSize Size of the reserved space in bytes (see ARMEDIA_VideoEncapsuler_EstimateMoovSize()),
+ * 0 to write the moov atom at the end of the file
+ * @param callback Callback reporting where the moov atom was written (may be NULL)
+ * @param userData Pointer given to the callback
+ * @return Possible return values are in eARMEDIA_ERROR
+ */
+eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_SetFastStart (ARMEDIA_VideoEncapsuler_t *encapsuler, uint32_t reservedSize, ARMEDIA_VideoEncapsuler_FastStartCallback_t callback, void *userData);
+
+/**
+ * @brief Estimate the size of the moov atom of a recording
+ * The estimate is an upper bound for the sample tables, as long as the frame rate
+ * and the audio chunk rate are not exceeded. The thumbnail is not included: its size
+ * must be added when one is set.
+ * @param frameRate Video frames per second
+ * @param duration Duration of the recording in seconds
+ * @param hasMetadata 1 if a timed metadata block is added with each frame
+ * @param audioChunkRate Audio chunks per second, 0 without audio
+ * @return Size of the moov atom in bytes, UINT32_MAX if it does not fit a 32 bits size
+ */
+uint32_t ARMEDIA_VideoEncapsuler_EstimateMoovSize (uint32_t frameRate, uint32_t duration, uint8_t hasMetadata, uint32_t audioChunkRate);
+
+/**
+ * @brief Group the consecutive samples of each track into chunks
+ * By default each video frame, metadata block and audio sample is a chunk of the
+ * media, with its own chunk offset entry. With chunking, the samples of each track
+ * are kept in memory and written together as one chunk, which shrinks the stsc and
+ * stco/co64 tables and lets players read the media with fewer, larger reads.
+ * The chunks of all the tracks are written once the oldest one spans durationMs,
+ * so that the audio and video written side by side are at most durationMs apart;
+ * a chunk is also written alone once it reaches maxSize bytes.
+ * The samples are copied, and a crash can lose up to durationMs more media
+ * (see ARMEDIA_VideoEncapsuler_GetDataLossWindow()).
+ * Must be called before the first frame is added.
+ * @param encapsuler ARMedia video encapsuler created by ARMEDIA_VideoEncapsuler_new()
+ * @param durationMs Maximum duration of a chunk in milliseconds, 0 to write each sample as a chunk
+ * @param maxSize Size in bytes from which a chunk is written, 0 for ARMEDIA_ENCAPSULER_DEFAULT_CHUNK_MAX_SIZE
+ * @return Possible return values are in eARMEDIA_ERROR
+ */
+eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_SetChunking (ARMEDIA_VideoEncapsuler_t *encapsuler, uint32_t durationMs, uint32_t maxSize);
+
+/**
+ * @brief Snap the video and metadata frame durations to the nominal frame duration
+ * By default each change of the duration between two frames starts a new entry of
+ * the time to sample (stts) table, so a few microseconds of jitter on the capture
+ * timestamps make the table grow with the recording. With a tolerance, the frames
+ * get the nominal duration (1 / fps) as long as their presentation time stays
+ * within toleranceUs of their capture timestamp: the error is carried to the next
+ * frames, so the video never drifts from the audio. Larger gaps (dropped frames)
+ * are kept.
+ * Must be called before the first frame is added.
+ * @param encapsuler ARMedia video encapsuler created by ARMEDIA_VideoEncapsuler_new()
+ * @param toleranceUs Maximum error of the presentation times in microseconds, less than half a frame duration, 0 to keep the captured durations
+ * @return Possible return values are in eARMEDIA_ERROR
+ */
+eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_SetTimestampTolerance (ARMEDIA_VideoEncapsuler_t *encapsuler, uint32_t toleranceUs);
+
+/**
+ * @brief Record a fragmented MP4 media, playable up to its last written fragment
+ * Instead of a moov atom written by ARMEDIA_VideoEncapsuler_Finish() from the
+ * infos file, the media starts with a moov atom declaring the tracks, written
+ * with the first fragment, followed by self-contained fragments (moof and mdat
+ * atoms). A fragment is closed on the first sync frame once it spans durationMs,
+ * and is kept in memory until then. Each fragment is synced to the storage unless
+ * the durability policy is ARMEDIA_ENCAPSULER_DURABILITY_NEVER, so a crash loses
+ * at most the fragment being recorded: the media is written directly under its
+ * final name, without infos file, and never needs ARMEDIA_VideoEncapsuler_TryFixMediaFile().
+ * The audio must start before the first fragment is written, and the fast start
+ * layout (ARMEDIA_VideoEncapsuler_SetFastStart()) is not available.
+ * Must be called before the first frame is added.
+ * @param encapsuler ARMedia video encapsuler created by ARMEDIA_VideoEncapsuler_new()
+ * @param durationMs Minimum duration of a fragment in milliseconds, 0 for a fragment per GOP
+ * @return Possible return values are in eARMEDIA_ERROR
+ */
+eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_SetFragmentation (ARMEDIA_VideoEncapsuler_t *encapsuler, uint32_t durationMs);
+
+/**
+ * @brief Record an MPEG-2 transport stream instead of an MP4 media
+ * The frames and samples are cut into 188-byte transport packets as they are
+ * added, and written in batches of batchSize bytes, so the media never needs
+ * to be finalized: it is written directly under its final name, without infos
+ * file, and is valid up to its last written packet. The batch is written before
+ * each sync of the durability policy (ARMEDIA_VideoEncapsuler_SetDurabilityPolicy()).
+ * The program holds the H.264 video (stream_type 0x1b, with an access unit
+ * delimiter before each frame) and, as private PES packets (stream_type 0x06,
+ * stream_id 0xbd), the PCM audio and the timed metadata. Their PMT entries have
+ * a registration descriptor (ARMEDIA_ENCAPSULER_TS_AUDIO_FORMAT_ID or
+ * ARMEDIA_ENCAPSULER_TS_METADATA_FORMAT_ID) followed by a descriptor of tag 0x80:
+ * - audio: frequency (32 bits), channel count (16 bits), bits per sample (8 bits),
+ *   flags (8 bits, 0x01 for little-endian samples)
+ * - metadata: block size (32 bits), then the MIME format, without terminating null
+ * The untimed metadata, the thumbnail and the pvat description are not recorded.
+ * The MJPEG codec is not supported, nor the chunking, the fragmentation and the
+ * fast start layout. With a full writer queue and the
+ * ARMEDIA_ENCAPSULER_OVERFLOW_POLICY_DROP policy, a frame or sample is dropped
+ * if the batch has to be written before it.
+ * Must be called before the first frame is added.
+ * @param encapsuler ARMedia video encapsuler created by ARMEDIA_VideoEncapsuler_new()
+ * @param batchSize Size of the writes in bytes (rounded down to whole packets),
+ * 0 for ARMEDIA_ENCAPSULER_DEFAULT_TS_BATCH_SIZE
+ * @return Possible return values are in eARMEDIA_ERROR
+ */
+eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_SetTransportStream (ARMEDIA_VideoEncapsuler_t *encapsuler, uint32_t batchSize);
+
+/**
+ * @brief Split the recording into segments of bounded size or duration
+ * Once the current segment reaches maxSize bytes (with an estimate of its
+ * moov atom) or maxDurationMs, it ends before the next I-frame, which starts
+ * the next segment: the encapsuler keeps recording in a new media, without
+ * dropping frames, and the previous one is finished in the background as with
+ * ARMEDIA_VideoEncapsuler_FinishAsync(). The next segment is opened and set up
+ * with the settings of the encapsuler during the segment before, so the cut
+ * only swaps the files. The audio samples captured before the cut and added
+ * after it still go to the previous segment, which is only finished once a
+ * sample captured after the cut is added (or on the next cut or the finish).
+ * The segment n (from 1 for the second one) is named after the media path
+ * with a "_%03u" suffix before the extension, and shares the run UUID and
+ * date of the encapsuler. ARMEDIA_VideoEncapsuler_Finish()
+ * finishes the last segment; ARMEDIA_VideoEncapsuler_FinishAsyncWait() waits
+ * for the previous ones. As a segment only ends on an I-frame, maxSize must
+ * leave room for a GOP below any file size limit (e.g. 4 GB on FAT32).
+ * Must be called before the first frame is added.
+ * @param encapsuler ARMedia video encapsuler created by ARMEDIA_VideoEncapsuler_new()
+ * @param maxSize Size of a segment in bytes, 0 for no limit
+ * @param maxDurationMs Duration of a segment in milliseconds, 0 for no limit (both 0 to record a single media)
+ * @param finishCallback Function called from the finish thread with the result of each previous segment, or NULL
+ * @param userData Pointer given to finishCallback
+ * @return Possible return values are in eARMEDIA_ERROR
+ */
+eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_SetSegmentation (ARMEDIA_VideoEncapsuler_t *encapsuler, uint64_t maxSize, uint32_t maxDurationMs,
+                                                        ARMEDIA_VideoEncapsuler_FinishCallback_t finishCallback, void *userData);
+
+/**
+ * @brief Set when the recorded data is synced to the storage
+ * A crash loses at most what was written since the last sync; the media can still be
+ * recovered with ARMEDIA_VideoEncapsuler_TryFixMediaFile() whatever the policy.
+ * Must be called before the first frame is added. Default is ARMEDIA_ENCAPSULER_DURABILITY_GOP.
+ * @param encapsuler ARMedia video encapsuler created by ARMEDIA_VideoEncapsuler_new()
+ * @param policy Sync policy
+ * @param value Period in milliseconds for ARMEDIA_ENCAPSULER_DURABILITY_PERIOD,
+ * size in bytes for ARMEDIA_ENCAPSULER_DURABILITY_SIZE, unused otherwise
+ * @return Possible return values are in eARMEDIA_ERROR
+ */
+eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_SetDurabilityPolicy (ARMEDIA_VideoEncapsuler_t *encapsuler, eARMEDIA_ENCAPSULER_DURABILITY policy, uint32_t value);
+
+/**
+ * @brief Set how often the sample tables are checkpointed in the infos file
+ * ARMEDIA_VideoEncapsuler_TryFixMediaFile() loads the last checkpoint and only
+ * replays the frame infos written after it, so the recovery time does not grow
+ * with the recording. A checkpoint takes about 5 bytes per frame, sample or
+ * metadata block since the previous one.
+ * Must be called before the first frame is added. Default is ARMEDIA_ENCAPSULER_DEFAULT_CHECKPOINT_INTERVAL.
+ * @param encapsuler ARMedia video encapsuler created by ARMEDIA_VideoEncapsuler_new()
+ * @param interval Number of frames, samples and metadata blocks between two checkpoints, 0 to disable the checkpoints
+ * @return Possible return values are in eARMEDIA_ERROR
+ */
+eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_SetCheckpointInterval (ARMEDIA_VideoEncapsuler_t *encapsuler, uint32_t interval);
+
+/**
+ * @brief Get the worst-case data loss window implied by the durability policy
+ * This is the longest media duration that a crash can lose: the longest interval between
+ * two syncs seen so far (or the system writeback delay when never syncing),
+ * plus the content of the writer queue.
+ * @param encapsuler ARMedia video encapsuler created by ARMEDIA_VideoEncapsuler_new()
+ * @param[out] windowMs Data loss window in milliseconds (0 if it can not be estimated yet)
+ * @return Possible return values are in eARMEDIA_ERROR
+ */
+eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_GetDataLossWindow (ARMEDIA_VideoEncapsuler_t *encapsuler, uint32_t *windowMs);
+
+/**
+ * @brief Get the state of the writer queue
+ * @param encapsuler ARMedia video encapsuler created by ARMEDIA_VideoEncapsuler_new()
+ * @param[out] depth Number of frames/samples waiting to be written (may be NULL)
+ * @param[out] maxDepth Highest depth reached since the beginning of the recording (may be NULL)
+ * @param[out] droppedCount Number of frames/samples dropped because the queue was full (may be NULL)
+ * @return Possible return values are in eARMEDIA_ERROR
+ */
+eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_GetQueueDepth (ARMEDIA_VideoEncapsuler_t *encapsuler, uint32_t *depth, uint32_t *maxDepth, uint32_t *droppedCount);
+
+/**
+ * @brief Wait until all the frames and samples already added are written to the files
+ * ARMEDIA_VideoEncapsuler_Finish() does it implicitly.
+ * @param encapsuler ARMedia video encapsuler created by ARMEDIA_VideoEncapsuler_new()
+ * @return Possible return values are in eARMEDIA_ERROR
+ */
+eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_Flush (ARMEDIA_VideoEncapsuler_t *encapsuler);
+
 /**
  * Add a video frame to an encapsulated video
  * The actual writing of the video will start on the first given I-Frame slice. (after that, each frame will be written)
@@ -269,6 +629,44 @@ eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_SetVideoThumbnail (ARMEDIA_VideoEncapsule
  */
 eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_AddFrame (ARMEDIA_VideoEncapsuler_t *encapsuler, ARMEDIA_Frame_Header_t *frameHeader, const void *metadataBuffer);
 
+/**
+ * Same as ARMEDIA_VideoEncapsuler_AddFrame(), with the frame given as a list of buffers
+ * The NALU sizes replace the start codes in a small scratch area and the whole sample
+ * is written with a single system call (unless an asynchronous writer is used).
+ * Empty entries are skipped, a NULL entry of non-zero length is rejected (ARMEDIA_ERROR_BAD_PARAMETER).
+ * @brief Add a new video frame given as an iovec list to the encapsulated media
+ * @param encapsuler ARMedia video encapsuler created by ARMEDIA_VideoEncapsuler_new()
+ * @param frameHeader Pointer to the video frame header to add
+ * @param metadataBuffer Pointer to metadata to add to video file, NULL if not supported on product
+ * @return Possible return values are in eARMEDIA_ERROR
+ */
+eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_AddFrameIov (ARMEDIA_VideoEncapsuler_t *encapsuler, const ARMEDIA_Frame_Iov_Header_t *frameHeader, const void *metadataBuffer);
+
+/**
+ * Get a buffer of the encapsuler to encode the next frame into
+ * The buffer belongs to the encapsuler and stays valid until ARMEDIA_VideoEncapsuler_CommitFrame()
+ * or the next reservation.
+ * @brief Reserve a buffer for the next video frame
+ * @param encapsuler ARMedia video encapsuler created by ARMEDIA_VideoEncapsuler_new()
+ * @param size Maximum size of the frame
+ * @param[out] buffer Pointer on the reserved buffer (page aligned)
+ * @return Possible return values are in eARMEDIA_ERROR
+ */
+eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_ReserveFrame (ARMEDIA_VideoEncapsuler_t *encapsuler, uint32_t size, uint8_t **buffer);
+
+/**
+ * Add the frame written in the buffer given by ARMEDIA_VideoEncapsuler_ReserveFrame()
+ * H.264 frames are in Annex-B format. When all their start codes are 4 bytes long, the
+ * start codes are replaced by the NALU sizes in the buffer, which is then written
+ * without any copy (unless an asynchronous writer is used).
+ * @brief Add the video frame of the reserved buffer to the encapsulated media
+ * @param encapsuler ARMedia video encapsuler created by ARMEDIA_VideoEncapsuler_new()
+ * @param frameInfo Infos of the frame written in the buffer
+ * @param metadataBuffer Pointer to metadata to add to video file, NULL if not supported on product
+ * @return Possible return values are in eARMEDIA_ERROR
+ */
+eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_CommitFrame (ARMEDIA_VideoEncapsuler_t *encapsuler, const ARMEDIA_Frame_Info_t *frameInfo, const void *metadataBuffer);
+
 /**
  * Add an audio sample to the encapsulated data
  * @brief Add a new audio sample to the encapsulated media
@@ -285,6 +683,29 @@ eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_AddSample (ARMEDIA_VideoEncapsuler_t* enc
  */
 eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_Finish (ARMEDIA_VideoEncapsuler_t **encapsuler);
 
+/**
+ * Compute, write and close the video on a library-owned worker thread
+ * The encapsuler is handed to the worker and set to NULL: the function returns
+ * immediately and a new encapsuler can be created on the same storage, with a
+ * different media path. The queued encapsulers are finished in order.
+ * The callbacks are called from the worker thread.
+ * @param encapsuler ARMedia video encapsuler created by ARMEDIA_VideoEncapsuler_new()
+ * @param progressCallback Callback receiving the completion percentage, can be NULL
+ * @param finishCallback Callback receiving the media path and the result of the finish, can be NULL
+ * @param userData Pointer given to the callbacks
+ * @return ARMEDIA_OK if the encapsuler was queued, otherwise it is left untouched
+ */
+eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_FinishAsync (ARMEDIA_VideoEncapsuler_t **encapsuler,
+                                                    ARMEDIA_VideoEncapsuler_FinishProgressCallback_t progressCallback,
+                                                    ARMEDIA_VideoEncapsuler_FinishCallback_t finishCallback,
+                                                    void *userData);
+
+/**
+ * Wait until the encapsulers given to ARMEDIA_VideoEncapsuler_FinishAsync() are finished
+ * Must not be called from the finish callbacks
+ */
+void ARMEDIA_VideoEncapsuler_FinishAsyncWait (void);
+
 /**
  * Set the current GPS position for further recordings
  * @param latitude current latitude
@@ -300,6 +721,45 @@ void ARMEDIA_VideoEncapsuler_SetGPSInfos (ARMEDIA_VideoEncapsuler_t* encapsuler,
  */
 int ARMEDIA_VideoEncapsuler_TryFixMediaFile (const char *infoFilePath);
 
+/**
+ * @brief Fix all the interrupted recordings of a directory
+ * Each infos file (METAFILE_EXT) of the directory is given to
+ * ARMEDIA_VideoEncapsuler_TryFixMediaFile() on a pool of threads. The smallest
+ * recordings are fixed first so that most medias are available early. Each
+ * recording is fixed on a single thread, so that no more than threadCount
+ * threads are used. The directory must not contain recordings in progress.
+ * The callbacks are never concurrent, but they are called from the threads of the pool.
+ * @param directory Directory of the recordings
+ * @param threadCount Maximum number of recordings fixed at the same time (0 for the default)
+ * @param progressCallback Callback receiving the completion percentage, weighted by the sizes of the recordings, can be NULL
+ * @param fixCallback Callback receiving the path of each media and the result of its fix
+ * (ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR if the recording could not be fixed and was removed), can be NULL
+ * @param userData Pointer given to the callbacks
+ * @param[out] fixedCount Number of medias fixed (may be NULL)
+ * @return ARMEDIA_OK once all the recordings are processed, or an error code
+ */
+eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_TryFixDirectory (const char *directory, uint32_t threadCount,
+                                                        ARMEDIA_VideoEncapsuler_FinishProgressCallback_t progressCallback,
+                                                        ARMEDIA_VideoEncapsuler_FinishCallback_t fixCallback,
+                                                        void *userData, uint32_t *fixedCount);
+
+/**
+ * @brief Move the moov atom of a finished media before its mdat atom
+ * The moov atom is written in the free atoms before the mdat atom when they are
+ * big enough (see ARMEDIA_VideoEncapsuler_SetFastStart()), else in space inserted
+ * in place before the mdat atom when the file system supports it, else the media
+ * is copied next to the original then renamed over it. The chunk offsets are
+ * patched accordingly, the stco atoms of a copy are rewritten as co64 atoms
+ * when its offsets no longer fit in 32 bits. Only the moov atom is loaded in
+ * memory: the peak memory grows with its size (about twice this size when the
+ * stco atoms are rewritten), whatever the size of the media.
+ * @param mediaPath Full path to the media
+ * @param forceCopy Do not modify the media in place, always write a copy
+ * @param[out] method Method used to move the moov atom (may be NULL)
+ * @return ARMEDIA_OK on success, or an error code
+ */
+eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_FastStartMediaFile (const char *mediaPath, uint8_t forceCopy, eARMEDIA_ENCAPSULER_FASTSTART_METHOD *method);
+
 /**
  * Add atom in file.
  * @param FILE video file descriptor. The file descriptor MUST BE OPENED WITH APPEND OPTION
@@ -0,0 +1,478 @@
+/*
+    Copyright (C) 2014 Parrot SA
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the
+      distribution.
+    * Neither the name of Parrot nor the names
+      of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written
+      permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+    "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+    LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+    FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+    COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+    BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+    OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+    AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+    OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+    SUCH DAMAGE.
+*/
+/**
+ * @file ARMEDIA_AtomTree.c
+ * @brief Lazy atom tree used to write the moov atom.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include "ARMEDIA_AtomTree.h"
+#include "ARMEDIA_TaskPool.h"
+
+// Number of buffers written by each writev()
+#define ATOMTREE_IOV_COUNT (64)
+
+// Smallest window given to each generator thread
+#define ATOMTREE_MIN_WINDOW_SIZE (4096)
+
+struct ARMEDIA_AtomTree_Node_t
+{
+    char tag[ARMEDIA_ATOM_TAG_SIZE];
+    uint8_t header[8]; // size and tag, filled when the tree is written
+    uint8_t prefix[ARMEDIA_ATOMTREE_PREFIX_SIZE];
+    size_t prefixSize;
+    const uint8_t *data;
+    uint64_t dataSize;
+    uint8_t *ownedData; // data taken over from a movie_atom_t, freed with the node
+    ARMEDIA_AtomTree_Generator_t generator; // produces the data when set
+    void *context;
+    int error; // a child could not be created
+    ARMEDIA_AtomTree_Node_t *firstChild;
+    ARMEDIA_AtomTree_Node_t *lastChild;
+    ARMEDIA_AtomTree_Node_t *next;
+};
+
+// Data of a generated node, written at its place once the rest of the tree is written
+typedef struct
+{
+    ARMEDIA_AtomTree_Node_t *node;
+    int fd;
+    off_t offset;
+    size_t windowSize;
+    int error;
+} ARMEDIA_AtomTree_Job_t;
+
+typedef struct
+{
+    int fd;
+    struct iovec iov[ATOMTREE_IOV_COUNT];
+    int count;
+    int error;
+    ARMEDIA_AtomTree_Job_t *jobs;
+    uint32_t jobCount;
+} ARMEDIA_AtomTree_Writer_t;
+
+ARMEDIA_AtomTree_Node_t *ARMEDIA_AtomTree_New (const char *tag, const void *prefix, size_t prefixSize, const void *data, size_t dataSize)
+{
+    ARMEDIA_AtomTree_Node_t *node;
+
+    if ((NULL == tag) || (ARMEDIA_ATOMTREE_PREFIX_SIZE < prefixSize))
+    {
+        return NULL;
+    }
+    node = calloc (1, sizeof (ARMEDIA_AtomTree_Node_t));
+    if (NULL == node)
+    {
+        return NULL;
+    }
+    memcpy (node->tag, tag, ARMEDIA_ATOM_TAG_SIZE);
+    if (NULL != prefix)
+    {
+        memcpy (node->prefix, prefix, prefixSize);
+        node->prefixSize = prefixSize;
+    }
+    if (NULL != data)
+    {
+        node->data = data;
+        node->dataSize = dataSize;
+    }
+    return node;
+}
+
+ARMEDIA_AtomTree_Node_t *ARMEDIA_AtomTree_NewTable (const char *tag, uint32_t count, const void *entries, size_t entrySize)
+{
+    uint32_t prefix[2];
+
+    prefix[0] = 0; // version & flags
+    prefix[1] = htonl (count);
+    return ARMEDIA_AtomTree_New (tag, prefix, sizeof (prefix), entries, (size_t)count * entrySize);
+}
+
+ARMEDIA_AtomTree_Node_t *ARMEDIA_AtomTree_NewGenerated (const char *tag, const void *prefix, size_t prefixSize, uint64_t dataSize, ARMEDIA_AtomTree_Generator_t generator, void *context)
+{
+    ARMEDIA_AtomTree_Node_t *node;
+
+    if (NULL == generator)
+    {
+        return NULL;
+    }
+    node = ARMEDIA_AtomTree_New (tag, prefix, prefixSize, NULL, 0);
+    if (NULL != node)
+    {
+        node->dataSize = dataSize;
+        node->generator = generator;
+        node->context = context;
+    }
+    return node;
+}
+
+void ARMEDIA_AtomTree_Append (ARMEDIA_AtomTree_Node_t *parent, ARMEDIA_AtomTree_Node_t *child)
+{
+    if (NULL == parent)
+    {
+        ARMEDIA_AtomTree_Delete (&child);
+        return;
+    }
+    if (NULL == child)
+    {
+        parent->error = 1;
+        return;
+    }
+    if (NULL == parent->lastChild)
+    {
+        parent->firstChild = child;
+    }
+    else
+    {
+        parent->lastChild->next = child;
+    }
+    parent->lastChild = child;
+}
+
+void ARMEDIA_AtomTree_Prepend (ARMEDIA_AtomTree_Node_t *parent, ARMEDIA_AtomTree_Node_t *child)
+{
+    if (NULL == parent)
+    {
+        ARMEDIA_AtomTree_Delete (&child);
+        return;
+    }
+    if (NULL == child)
+    {
+        parent->error = 1;
+        return;
+    }
+    child->next = parent->firstChild;
+    parent->firstChild = child;
+    if (NULL == parent->lastChild)
+    {
+        parent->lastChild = child;
+    }
+}
+
+ARMEDIA_AtomTree_Node_t *ARMEDIA_AtomTree_NewFromAtom (movie_atom_t **atom)
+{
+    ARMEDIA_AtomTree_Node_t *node = NULL;
+
+    if ((NULL != atom) && (NULL != *atom))
+    {
+        node = ARMEDIA_AtomTree_New ((*atom)->tag, NULL, 0, NULL, 0);
+        if (NULL != node)
+        {
+            node->ownedData = (*atom)->data;
+            node->data = (*atom)->data;
+            node->dataSize = (NULL != (*atom)->data) ? (size_t)((*atom)->size - 8) : 0;
+            (*atom)->data = NULL;
+        }
+        freeAtom (atom);
+    }
+    return node;
+}
+
+void ARMEDIA_AtomTree_AppendAtom (ARMEDIA_AtomTree_Node_t *parent, movie_atom_t **atom)
+{
+    ARMEDIA_AtomTree_Append (parent, ARMEDIA_AtomTree_NewFromAtom (atom));
+}
+
+uint64_t ARMEDIA_AtomTree_GetSize (const ARMEDIA_AtomTree_Node_t *node)
+{
+    const ARMEDIA_AtomTree_Node_t *child;
+    uint64_t size = 8 + node->prefixSize + node->dataSize;
+
+    for (child = node->firstChild; NULL != child; child = child->next)
+    {
+        size += ARMEDIA_AtomTree_GetSize (child);
+    }
+    return size;
+}
+
+static int ARMEDIA_AtomTree_Check (const ARMEDIA_AtomTree_Node_t *node, uint32_t *generated)
+{
+    const ARMEDIA_AtomTree_Node_t *child;
+
+    if (node->error)
+    {
+        return -1;
+    }
+    if (NULL != node->generator)
+    {
+        (*generated)++;
+    }
+    for (child = node->firstChild; NULL != child; child = child->next)
+    {
+        if (0 != ARMEDIA_AtomTree_Check (child, generated))
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void ARMEDIA_AtomTree_Submit (ARMEDIA_AtomTree_Writer_t *writer)
+{
+    struct iovec *iov = writer->iov;
+    int count = writer->count;
+
+    while ((0 < count) && !writer->error)
+    {
+        ssize_t written = writev (writer->fd, iov, count);
+        if ((0 > written) && (EINTR == errno))
+        {
+            continue;
+        }
+        if (0 >= written)
+        {
+            writer->error = 1;
+            break;
+        }
+        // Skip what was written, a short write resumes in the middle of a buffer
+        while ((0 < count) && ((size_t)written >= iov->iov_len))
+        {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (0 < count)
+        {
+            iov->iov_base = (uint8_t *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    writer->count = 0;
+}
+
+static void ARMEDIA_AtomTree_Add (ARMEDIA_AtomTree_Writer_t *writer, const void *data, size_t size)
+{
+    if (0 == size)
+    {
+        return;
+    }
+    if (ATOMTREE_IOV_COUNT == writer->count)
+    {
+        ARMEDIA_AtomTree_Submit (writer);
+    }
+    writer->iov[writer->count].iov_base = (void *)data;
+    writer->iov[writer->count].iov_len = size;
+    writer->count++;
+}
+
+static void ARMEDIA_AtomTree_Skip (ARMEDIA_AtomTree_Writer_t *writer, ARMEDIA_AtomTree_Node_t *node)
+{
+    ARMEDIA_AtomTree_Job_t *job = &writer->jobs[writer->jobCount++];
+    off_t end;
+
+    // The pending buffers are written first: the file offset is then the offset of the data
+    ARMEDIA_AtomTree_Submit (writer);
+    job->node = node;
+    job->fd = writer->fd;
+    job->error = 0;
+    end = lseek (writer->fd, (off_t)node->dataSize, SEEK_CUR);
+    if (0 > end)
+    {
+        writer->error = 1;
+        job->offset = 0;
+    }
+    else
+    {
+        job->offset = end - (off_t)node->dataSize;
+    }
+}
+
+static int ARMEDIA_AtomTree_PWrite (int fd, const uint8_t *data, size_t size, off_t offset)
+{
+    while (0 < size)
+    {
+        ssize_t written = pwrite (fd, data, size, offset);
+        if ((0 > written) && (EINTR == errno))
+        {
+            continue;
+        }
+        if (0 >= written)
+        {
+            return -1;
+        }
+        data += written;
+        size -= written;
+        offset += written;
+    }
+    return 0;
+}
+
+static void ARMEDIA_AtomTree_Generate (void *context)
+{
+    ARMEDIA_AtomTree_Job_t *job = (ARMEDIA_AtomTree_Job_t *)context;
+    ARMEDIA_AtomTree_Node_t *node = job->node;
+    uint8_t *window = malloc (job->windowSize);
+    uint64_t generated = 0;
+    size_t size;
+
+    if (NULL == window)
+    {
+        job->error = 1;
+        return;
+    }
+    while (!job->error && (0 != (size = node->generator (node->context, window, job->windowSize))))
+    {
+        if ((generated + size > node->dataSize) ||
+            (0 != ARMEDIA_AtomTree_PWrite (job->fd, window, size, job->offset + (off_t)generated)))
+        {
+            job->error = 1;
+        }
+        generated += size;
+    }
+    if (generated != node->dataSize)
+    {
+        job->error = 1;
+    }
+    free (window);
+}
+
+static int ARMEDIA_AtomTree_CompareJobs (const void *a, const void *b)
+{
+    uint64_t sizeA = ((const ARMEDIA_AtomTree_Job_t *)a)->node->dataSize;
+    uint64_t sizeB = ((const ARMEDIA_AtomTree_Job_t *)b)->node->dataSize;
+
+    // Largest first
+    return (sizeA < sizeB) - (sizeA > sizeB);
+}
+
+static void ARMEDIA_AtomTree_Gather (ARMEDIA_AtomTree_Writer_t *writer, ARMEDIA_AtomTree_Node_t *node)
+{
+    ARMEDIA_AtomTree_Node_t *child;
+    uint32_t sizeNE = htonl ((uint32_t)ARMEDIA_AtomTree_GetSize (node));
+
+    memcpy (&node->header[0], &sizeNE, sizeof (sizeNE));
+    memcpy (&node->header[4], node->tag, ARMEDIA_ATOM_TAG_SIZE);
+    ARMEDIA_AtomTree_Add (writer, node->header, sizeof (node->header));
+    ARMEDIA_AtomTree_Add (writer, node->prefix, node->prefixSize);
+    if (NULL != node->generator)
+    {
+        ARMEDIA_AtomTree_Skip (writer, node);
+    }
+    else
+    {
+        ARMEDIA_AtomTree_Add (writer, node->data, (size_t)node->dataSize);
+    }
+    for (child = node->firstChild; NULL != child; child = child->next)
+    {
+        ARMEDIA_AtomTree_Gather (writer, child);
+    }
+}
+
+int ARMEDIA_AtomTree_WriteToFile (ARMEDIA_AtomTree_Node_t **root, FILE *file, size_t windowSize, uint32_t threadCount)
+{
+    ARMEDIA_AtomTree_Writer_t writer;
+    uint32_t generated = 0;
+    uint64_t size;
+    off_t start;
+    uint32_t i;
+
+    if ((NULL == root) || (NULL == *root) || (NULL == file))
+    {
+        return -1;
+    }
+    size = ARMEDIA_AtomTree_GetSize (*root);
+    writer.jobs = NULL;
+    writer.jobCount = 0;
+    if ((UINT32_MAX < size) || (0 != ARMEDIA_AtomTree_Check (*root, &generated)) ||
+        ((0 != generated) && (NULL == (writer.jobs = calloc (generated, sizeof (ARMEDIA_AtomTree_Job_t))))))
+    {
+        ARMEDIA_AtomTree_Delete (root);
+        return -1;
+    }
+
+    // The tree is written to the file descriptor, bypassing the stdio buffer.
+    // The generated data is skipped, then produced by the pool threads.
+    fflush (file);
+    start = ftello (file);
+    writer.fd = fileno (file);
+    writer.count = 0;
+    writer.error = ((0 > start) || (start != lseek (writer.fd, start, SEEK_SET)));
+    ARMEDIA_AtomTree_Gather (&writer, *root);
+    ARMEDIA_AtomTree_Submit (&writer);
+
+    if (!writer.error && (0 != writer.jobCount))
+    {
+        // Each thread has its own window, the memory used stays below windowSize
+        if (0 == threadCount)
+        {
+            threadCount = ARMEDIA_TaskPool_GetDefaultThreadCount ();
+        }
+        if (writer.jobCount < threadCount)
+        {
+            threadCount = writer.jobCount;
+        }
+        while ((1 < threadCount) && (ATOMTREE_MIN_WINDOW_SIZE > windowSize / threadCount))
+        {
+            threadCount--;
+        }
+        for (i = 0; i < writer.jobCount; i++)
+        {
+            writer.jobs[i].windowSize = windowSize / threadCount;
+        }
+        qsort (writer.jobs, writer.jobCount, sizeof (ARMEDIA_AtomTree_Job_t), ARMEDIA_AtomTree_CompareJobs);
+        ARMEDIA_TaskPool_Run (ARMEDIA_AtomTree_Generate, writer.jobs, sizeof (ARMEDIA_AtomTree_Job_t), writer.jobCount, threadCount);
+        for (i = 0; i < writer.jobCount; i++)
+        {
+            writer.error |= writer.jobs[i].error;
+        }
+    }
+    ARMEDIA_AtomTree_Delete (root);
+    free (writer.jobs);
+
+    if (writer.error || (0 != fseeko (file, start + (off_t)size, SEEK_SET)))
+    {
+        return -1;
+    }
+    return 0;
+}
+
+void ARMEDIA_AtomTree_Delete (ARMEDIA_AtomTree_Node_t **root)
+{
+    ARMEDIA_AtomTree_Node_t *child, *next;
+
+    if ((NULL == root) || (NULL == *root))
+    {
+        return;
+    }
+    for (child = (*root)->firstChild; NULL != child; child = next)
+    {
+        next = child->next;
+        ARMEDIA_AtomTree_Delete (&child);
+    }
+    free ((*root)->ownedData);
+    free (*root);
+    *root = NULL;
+}
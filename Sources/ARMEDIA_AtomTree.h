@@ -0,0 +1,162 @@
+/*
+    Copyright (C) 2014 Parrot SA
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the
+      distribution.
+    * Neither the name of Parrot nor the names
+      of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written
+      permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+    "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+    LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+    FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+    COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+    BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+    OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+    AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+    OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+    SUCH DAMAGE.
+*/
+/**
+ * @file ARMEDIA_AtomTree.h
+ * @brief Lazy atom tree used to write the moov atom (private).
+ *
+ * Unlike insertAtomIntoAtom(), which copies each child into its container,
+ * the nodes only record their children and their payload. The sizes are
+ * computed bottom-up when the tree is written, and the whole tree is
+ * written with writev(): the payloads (including the sample tables) are
+ * never copied.
+ *
+ * The payload of a node is a small inline prefix (version, flags, entry
+ * count...) followed by data owned by the caller, then the children.
+ * The data of a node can also be produced while the tree is written, by a
+ * generator called repeatedly to fill a window of fixed size: the tables
+ * of a long recording are then written without ever being in memory.
+ * The generated data of the nodes is independent: it is produced on a few
+ * threads once the rest of the tree is written, each node at its offset.
+ */
+#ifndef _ARMEDIA_ATOMTREE_H_
+#define _ARMEDIA_ATOMTREE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <libARMedia/ARMedia.h>
+
+#define ARMEDIA_ATOMTREE_PREFIX_SIZE (16)
+
+typedef struct ARMEDIA_AtomTree_Node_t ARMEDIA_AtomTree_Node_t;
+
+/**
+ * @brief Produce the next part of the data of a node
+ * The generators of different nodes may be called at the same time from
+ * different threads, the calls for one node are sequential.
+ * @param context context given to ARMEDIA_AtomTree_NewGenerated()
+ * @param buffer window to fill
+ * @param size size of the window in bytes
+ * @return Number of bytes written to the window, 0 once all the data is produced
+ */
+typedef size_t (*ARMEDIA_AtomTree_Generator_t) (void *context, uint8_t *buffer, size_t size);
+
+/**
+ * @brief Create a node
+ * @param tag atom tag (4 characters)
+ * @param prefix first bytes of the payload, copied (may be NULL)
+ * @param prefixSize size of the prefix, up to ARMEDIA_ATOMTREE_PREFIX_SIZE
+ * @param data rest of the payload, not copied: must be valid until the tree is written (may be NULL)
+ * @param dataSize size of the data in bytes
+ * @return The new node, NULL on error
+ */
+ARMEDIA_AtomTree_Node_t *ARMEDIA_AtomTree_New (const char *tag, const void *prefix, size_t prefixSize, const void *data, size_t dataSize);
+
+/**
+ * @brief Create a full atom node holding a table (version and flags 0, entry count, entries)
+ * @param tag atom tag (4 characters)
+ * @param count number of entries
+ * @param entries entries in network byte order, not copied (see ARMEDIA_AtomTree_New())
+ * @param entrySize size of one entry in bytes
+ * @return The new node, NULL on error
+ */
+ARMEDIA_AtomTree_Node_t *ARMEDIA_AtomTree_NewTable (const char *tag, uint32_t count, const void *entries, size_t entrySize);
+
+/**
+ * @brief Create a node whose data is produced when the tree is written
+ * @param tag atom tag (4 characters)
+ * @param prefix first bytes of the payload, copied (may be NULL)
+ * @param prefixSize size of the prefix, up to ARMEDIA_ATOMTREE_PREFIX_SIZE
+ * @param dataSize total size of the data produced by the generator
+ * @param generator data generator, must produce exactly dataSize bytes
+ * @param context generator context, must be valid until the tree is written
+ * @return The new node, NULL on error
+ */
+ARMEDIA_AtomTree_Node_t *ARMEDIA_AtomTree_NewGenerated (const char *tag, const void *prefix, size_t prefixSize, uint64_t dataSize, ARMEDIA_AtomTree_Generator_t generator, void *context);
+
+/**
+ * @brief Append a child to a node
+ * A NULL child (failed allocation) makes the write of the tree fail.
+ * @param parent the node
+ * @param child the child, owned by the parent from now on
+ */
+void ARMEDIA_AtomTree_Append (ARMEDIA_AtomTree_Node_t *parent, ARMEDIA_AtomTree_Node_t *child);
+
+/**
+ * @brief Insert a child before the other children of a node
+ * A NULL child (failed allocation) makes the write of the tree fail.
+ * @param parent the node
+ * @param child the child, owned by the parent from now on
+ */
+void ARMEDIA_AtomTree_Prepend (ARMEDIA_AtomTree_Node_t *parent, ARMEDIA_AtomTree_Node_t *child);
+
+/**
+ * @brief Create a node from an atom built by the ARMEDIA_VideoAtoms generators
+ * The data of the atom is taken over without copy.
+ * @param atom address of the atom pointer, set to NULL (the atom is freed)
+ * @return The new node, NULL on error
+ */
+ARMEDIA_AtomTree_Node_t *ARMEDIA_AtomTree_NewFromAtom (movie_atom_t **atom);
+
+/**
+ * @brief Append an atom built by the ARMEDIA_VideoAtoms generators to a node
+ * The data of the atom is taken over without copy.
+ * @param parent the node
+ * @param atom address of the atom pointer, set to NULL (the atom is freed)
+ */
+void ARMEDIA_AtomTree_AppendAtom (ARMEDIA_AtomTree_Node_t *parent, movie_atom_t **atom);
+
+/**
+ * @brief Get the size of a node and its children
+ * @param node the node
+ * @return Size of the atom in bytes, header included
+ */
+uint64_t ARMEDIA_AtomTree_GetSize (const ARMEDIA_AtomTree_Node_t *node);
+
+/**
+ * @brief Write a tree at the current position of a file
+ * The file position is set to the end of the written tree.
+ * @param root address of the root pointer, set to NULL (the tree is freed)
+ * @param file the file
+ * @param windowSize memory used by the generators, shared between the threads
+ * (allocated only if the tree has generated nodes)
+ * @param threadCount maximum number of threads running the generators (0 for the default)
+ * @return 0 on success, -1 on error
+ */
+int ARMEDIA_AtomTree_WriteToFile (ARMEDIA_AtomTree_Node_t **root, FILE *file, size_t windowSize, uint32_t threadCount);
+
+/**
+ * @brief Free a tree
+ * @param root address of the root pointer, set to NULL
+ */
+void ARMEDIA_AtomTree_Delete (ARMEDIA_AtomTree_Node_t **root);
+
+#endif /* _ARMEDIA_ATOMTREE_H_ */
@@ -0,0 +1,352 @@
+/*
+    Copyright (C) 2014 Parrot SA
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the
+      distribution.
+    * Neither the name of Parrot nor the names
+      of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written
+      permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+    "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+    LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+    FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+    COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+    BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+    OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+    AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+    OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+    SUCH DAMAGE.
+*/
+/**
+ * @file ARMEDIA_DirectWriter.c
+ * @brief Direct I/O output of the media data.
+ */
+
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+#endif
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // O_DIRECT
+#endif
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libARSAL/ARSAL_Print.h>
+#include <libARSAL/ARSAL_Sem.h>
+#include <libARSAL/ARSAL_Thread.h>
+#include "ARMEDIA_DirectWriter.h"
+
+#define ARMEDIA_DIRECTWRITER_TAG "ARMEDIA DirectWriter"
+
+#define DIRECTWRITER_ERROR(...)                                         \
+    do {                                                                \
+        ARSAL_PRINT (ARSAL_PRINT_ERROR, ARMEDIA_DIRECTWRITER_TAG, "error: " __VA_ARGS__); \
+    } while (0)
+
+#define DIRECTWRITER_LOAD(PTR) __atomic_load_n (PTR, __ATOMIC_ACQUIRE)
+#define DIRECTWRITER_STORE(PTR, VAL) __atomic_store_n (PTR, VAL, __ATOMIC_RELEASE)
+
+struct ARMEDIA_DirectWriter_t
+{
+    int fd;             // O_DIRECT descriptor
+    int bufferedFd;
+    size_t bufferSize;
+    uint8_t *buffers[2];
+    int current;        // buffer being filled
+    size_t fill;        // bytes staged in the current buffer
+    off_t blockStart;   // file offset of the current buffer (aligned)
+    int positioned;     // blockStart is valid
+
+    // Buffer written by the thread
+    uint8_t *flightBuffer;
+    size_t flightSize;
+    off_t flightOffset;
+    int stop;
+    int error;
+    ARSAL_Sem_t submitSem;
+    ARSAL_Sem_t doneSem;    // posted when no buffer is in flight
+    ARSAL_Thread_t thread;
+    int threadStarted;
+};
+
+static int ARMEDIA_DirectWriter_PWrite (int fd, const uint8_t *data, size_t size, off_t offset)
+{
+    while (size > 0)
+    {
+        ssize_t ret = pwrite (fd, data, size, offset);
+        if (ret < 0)
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+            return -1;
+        }
+        if (0 == ret)
+        {
+            return -1;
+        }
+        data += ret;
+        size -= ret;
+        offset += ret;
+    }
+    return 0;
+}
+
+static void *ARMEDIA_DirectWriter_ThreadRun (void *arg)
+{
+    ARMEDIA_DirectWriter_t *writer = (ARMEDIA_DirectWriter_t *)arg;
+
+    for (;;)
+    {
+        ARSAL_Sem_Wait (&writer->submitSem);
+        if (DIRECTWRITER_LOAD (&writer->stop))
+        {
+            break;
+        }
+        if (0 != ARMEDIA_DirectWriter_PWrite (writer->fd, writer->flightBuffer, writer->flightSize, writer->flightOffset))
+        {
+            DIRECTWRITER_ERROR ("Unable to write %zu bytes at %lld: %s", writer->flightSize, (long long)writer->flightOffset, strerror (errno));
+            DIRECTWRITER_STORE (&writer->error, ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR);
+        }
+        ARSAL_Sem_Post (&writer->doneSem);
+    }
+
+    return NULL;
+}
+
+ARMEDIA_DirectWriter_t *ARMEDIA_DirectWriter_New (const char *path, int bufferedFd, size_t bufferSize, eARMEDIA_ERROR *error)
+{
+    ARMEDIA_DirectWriter_t *writer;
+    int i;
+
+    if ((NULL == path) || (0 == bufferSize) || (0 != bufferSize % ARMEDIA_DIRECTWRITER_ALIGNMENT))
+    {
+        *error = ARMEDIA_ERROR_BAD_PARAMETER;
+        return NULL;
+    }
+
+    writer = calloc (1, sizeof (ARMEDIA_DirectWriter_t));
+    if (NULL == writer)
+    {
+        DIRECTWRITER_ERROR ("Unable to allocate direct writer");
+        *error = ARMEDIA_ERROR_ENCAPSULER;
+        return NULL;
+    }
+    writer->bufferedFd = bufferedFd;
+    writer->bufferSize = bufferSize;
+    writer->error = ARMEDIA_OK;
+    ARSAL_Sem_Init (&writer->submitSem, 0, 0);
+    ARSAL_Sem_Init (&writer->doneSem, 0, 1);
+
+#if defined(O_DIRECT)
+    writer->fd = open (path, O_WRONLY | O_DIRECT);
+#elif defined(F_NOCACHE)
+    writer->fd = open (path, O_WRONLY);
+    if ((writer->fd >= 0) && (-1 == fcntl (writer->fd, F_NOCACHE, 1)))
+    {
+        close (writer->fd);
+        writer->fd = -1;
+    }
+#else
+    writer->fd = -1;
+    errno = ENOTSUP;
+#endif
+    if (writer->fd < 0)
+    {
+        DIRECTWRITER_ERROR ("Unable to open %s for direct I/O: %s", path, strerror (errno));
+        *error = ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+        ARMEDIA_DirectWriter_Delete (&writer);
+        return NULL;
+    }
+
+    for (i = 0; i < 2; i++)
+    {
+        void *buffer = NULL;
+        if (0 != posix_memalign (&buffer, ARMEDIA_DIRECTWRITER_ALIGNMENT, bufferSize))
+        {
+            DIRECTWRITER_ERROR ("Unable to allocate %zu bytes staging buffer", bufferSize);
+            *error = ARMEDIA_ERROR_ENCAPSULER;
+            ARMEDIA_DirectWriter_Delete (&writer);
+            return NULL;
+        }
+        writer->buffers[i] = buffer;
+    }
+
+    if (0 != ARSAL_Thread_Create (&writer->thread, ARMEDIA_DirectWriter_ThreadRun, writer))
+    {
+        DIRECTWRITER_ERROR ("Unable to create direct writer thread");
+        *error = ARMEDIA_ERROR_ENCAPSULER;
+        ARMEDIA_DirectWriter_Delete (&writer);
+        return NULL;
+    }
+    writer->threadStarted = 1;
+
+    *error = ARMEDIA_OK;
+    return writer;
+}
+
+eARMEDIA_ERROR ARMEDIA_DirectWriter_Delete (ARMEDIA_DirectWriter_t **writer)
+{
+    ARMEDIA_DirectWriter_t *w;
+    eARMEDIA_ERROR error = ARMEDIA_OK;
+
+    if ((NULL == writer) || (NULL == *writer))
+    {
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
+    w = *writer;
+
+    if (w->threadStarted)
+    {
+        error = ARMEDIA_DirectWriter_Flush (w);
+        DIRECTWRITER_STORE (&w->stop, 1);
+        ARSAL_Sem_Post (&w->submitSem);
+        ARSAL_Thread_Join (w->thread, NULL);
+        ARSAL_Thread_Destroy (&w->thread);
+    }
+    ARSAL_Sem_Destroy (&w->submitSem);
+    ARSAL_Sem_Destroy (&w->doneSem);
+    free (w->buffers[0]);
+    free (w->buffers[1]);
+    if (w->fd >= 0)
+    {
+        close (w->fd);
+    }
+    free (w);
+    *writer = NULL;
+
+    return error;
+}
+
+/* Hand the full current buffer over to the thread and switch to the other one */
+static eARMEDIA_ERROR ARMEDIA_DirectWriter_Submit (ARMEDIA_DirectWriter_t *writer)
+{
+    // Wait until the other buffer is written
+    ARSAL_Sem_Wait (&writer->doneSem);
+    writer->flightBuffer = writer->buffers[writer->current];
+    writer->flightSize = writer->fill;
+    writer->flightOffset = writer->blockStart;
+    ARSAL_Sem_Post (&writer->submitSem);
+
+    writer->current = !writer->current;
+    writer->blockStart += writer->fill;
+    writer->fill = 0;
+
+    return DIRECTWRITER_LOAD (&writer->error);
+}
+
+eARMEDIA_ERROR ARMEDIA_DirectWriter_Flush (ARMEDIA_DirectWriter_t *writer)
+{
+    eARMEDIA_ERROR error = ARMEDIA_OK;
+    size_t aligned, tail;
+    uint8_t *buffer = writer->buffers[writer->current];
+
+    // Wait for the buffer in flight
+    ARSAL_Sem_Wait (&writer->doneSem);
+    ARSAL_Sem_Post (&writer->doneSem);
+
+    aligned = writer->fill & ~((size_t)ARMEDIA_DIRECTWRITER_ALIGNMENT - 1);
+    tail = writer->fill - aligned;
+    if ((0 != aligned) && (0 != ARMEDIA_DirectWriter_PWrite (writer->fd, buffer, aligned, writer->blockStart)))
+    {
+        DIRECTWRITER_ERROR ("Unable to write %zu bytes: %s", aligned, strerror (errno));
+        error = ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+    }
+    if ((ARMEDIA_OK == error) && (0 != tail) &&
+        (0 != ARMEDIA_DirectWriter_PWrite (writer->bufferedFd, buffer + aligned, tail, writer->blockStart + aligned)))
+    {
+        DIRECTWRITER_ERROR ("Unable to write %zu bytes: %s", tail, strerror (errno));
+        error = ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+    }
+    if (ARMEDIA_OK == error)
+    {
+        // Keep the partial block staged: it is written again once complete
+        memmove (buffer, buffer + aligned, tail);
+        writer->blockStart += aligned;
+        writer->fill = tail;
+    }
+    else
+    {
+        DIRECTWRITER_STORE (&writer->error, error);
+    }
+
+    return (ARMEDIA_OK != error) ? error : DIRECTWRITER_LOAD (&writer->error);
+}
+
+eARMEDIA_ERROR ARMEDIA_DirectWriter_Write (ARMEDIA_DirectWriter_t *writer, off_t position, const struct iovec *iov, int count)
+{
+    eARMEDIA_ERROR error = ARMEDIA_OK;
+    int i;
+
+    if (!writer->positioned || (position != writer->blockStart + (off_t)writer->fill))
+    {
+        // Start a new block, with the data already in the file before the position
+        ssize_t ret = 0;
+        if (writer->positioned)
+        {
+            error = ARMEDIA_DirectWriter_Flush (writer);
+            if (ARMEDIA_OK != error)
+            {
+                return error;
+            }
+        }
+        writer->blockStart = position & ~((off_t)ARMEDIA_DIRECTWRITER_ALIGNMENT - 1);
+        writer->fill = position - writer->blockStart;
+        if (0 != writer->fill)
+        {
+            ret = pread (writer->bufferedFd, writer->buffers[writer->current], writer->fill, writer->blockStart);
+            if (ret < 0)
+            {
+                DIRECTWRITER_ERROR ("Unable to read the block at %lld: %s", (long long)writer->blockStart, strerror (errno));
+                return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+            }
+        }
+        // Past the end of the file, the block is made of zeros
+        memset (writer->buffers[writer->current] + ret, 0, writer->fill - ret);
+        writer->positioned = 1;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        const uint8_t *data = iov[i].iov_base;
+        size_t size = iov[i].iov_len;
+        while (size > 0)
+        {
+            size_t len = writer->bufferSize - writer->fill;
+            if (len > size)
+            {
+                len = size;
+            }
+            memcpy (writer->buffers[writer->current] + writer->fill, data, len);
+            writer->fill += len;
+            data += len;
+            size -= len;
+            if (writer->fill == writer->bufferSize)
+            {
+                error = ARMEDIA_DirectWriter_Submit (writer);
+                if (ARMEDIA_OK != error)
+                {
+                    return error;
+                }
+            }
+        }
+    }
+
+    return DIRECTWRITER_LOAD (&writer->error);
+}
@@ -0,0 +1,93 @@
+/*
+    Copyright (C) 2014 Parrot SA
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the
+      distribution.
+    * Neither the name of Parrot nor the names
+      of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written
+      permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+    "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+    LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+    FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+    COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+    BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+    OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+    AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+    OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+    SUCH DAMAGE.
+*/
+/**
+ * @file ARMEDIA_DirectWriter.h
+ * @brief Direct I/O output of the media data (private).
+ *
+ * The media data is copied into aligned staging buffers, which are written
+ * with O_DIRECT once full, bypassing the page cache. Two buffers are used:
+ * one is filled while the other one is written by a dedicated thread.
+ * The unaligned tail of the data is written through the page cache when the
+ * writer is flushed, and written again with O_DIRECT once its block is full.
+ */
+#ifndef _ARMEDIA_DIRECTWRITER_H_
+#define _ARMEDIA_DIRECTWRITER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <libARMedia/ARMEDIA_Error.h>
+
+// Alignment of the file offsets, sizes and buffers of the direct writes
+#define ARMEDIA_DIRECTWRITER_ALIGNMENT (4096)
+
+typedef struct ARMEDIA_DirectWriter_t ARMEDIA_DirectWriter_t;
+
+/**
+ * @brief Create a new direct writer
+ * @param path path of the file to write
+ * @param bufferedFd descriptor of the same file, used for the unaligned parts
+ * @param bufferSize size of each staging buffer, multiple of ARMEDIA_DIRECTWRITER_ALIGNMENT
+ * @param[out] error pointer on the error output
+ * @return Pointer on the new direct writer, NULL on error (or if direct I/O is not supported)
+ */
+ARMEDIA_DirectWriter_t *ARMEDIA_DirectWriter_New (const char *path, int bufferedFd, size_t bufferSize, eARMEDIA_ERROR *error);
+
+/**
+ * @brief Flush and free a direct writer
+ * @param writer address of the pointer on the direct writer
+ * @return The first write error, if any
+ */
+eARMEDIA_ERROR ARMEDIA_DirectWriter_Delete (ARMEDIA_DirectWriter_t **writer);
+
+/**
+ * @brief Write data at a position of the file
+ * The data is only staged, it is written when a buffer is full or on flush.
+ * Writing anywhere else than after the previous write flushes the writer first.
+ * @param writer the direct writer
+ * @param position file offset of the data
+ * @param iov data to write
+ * @param count number of iov entries
+ * @return Possible return values are in eARMEDIA_ERROR
+ */
+eARMEDIA_ERROR ARMEDIA_DirectWriter_Write (ARMEDIA_DirectWriter_t *writer, off_t position, const struct iovec *iov, int count);
+
+/**
+ * @brief Write all the staged data to the file
+ * The full blocks are written with O_DIRECT, the last partial block through
+ * the page cache. The file is not synced.
+ * @param writer the direct writer
+ * @return Possible return values are in eARMEDIA_ERROR
+ */
+eARMEDIA_ERROR ARMEDIA_DirectWriter_Flush (ARMEDIA_DirectWriter_t *writer);
+
+#endif /* _ARMEDIA_DIRECTWRITER_H_ */
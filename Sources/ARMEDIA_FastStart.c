@@ -0,0 +1,739 @@
+/*
+    Copyright (C) 2014 Parrot SA
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the
+      distribution.
+    * Neither the name of Parrot nor the names
+      of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written
+      permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+    "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+    LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+    FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+    COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+    BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+    OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+    AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+    OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+    SUCH DAMAGE.
+*/
+/**
+ * @file ARMEDIA_FastStart.c
+ * @brief Move the moov atom of a recorded media before its mdat atom.
+ *
+ * Medias recorded without the fast start space have their moov atom at the
+ * end of the file. The moov atom is read with createDataFromFile(), its chunk
+ * offsets are patched, then it is written before the mdat atom:
+ *  - in the free atoms just before the mdat atom if they are big enough,
+ *  - else in space inserted in place before the mdat atom
+ *    (FALLOC_FL_INSERT_RANGE, the data is not copied),
+ *  - else in a copy of the media (copy_file_range(), which the file system
+ *    can do without reading the data), renamed over the original. When the
+ *    chunk offsets no longer fit in 32 bits, the stco atoms of the copy are
+ *    widened to co64 atoms, which moves the mdat atom a bit further.
+ * Only the moov atom is held in memory, the data is never read in full: the
+ * peak memory grows with the size of the moov atom (twice this size while
+ * the stco atoms are widened).
+ */
+
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+#endif
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // fallocate()
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+#include <libARSAL/ARSAL_Print.h>
+#include <libARDiscovery/ARDiscovery.h>
+#include <libARMedia/ARMedia.h>
+#include <libARMedia/ARMEDIA_VideoEncapsuler.h>
+
+#define ARMEDIA_FASTSTART_TAG "ARMEDIA FastStart"
+
+#define FASTSTART_ERROR(...)                                            \
+    do {                                                                \
+        ARSAL_PRINT (ARSAL_PRINT_ERROR, ARMEDIA_FASTSTART_TAG, "error: " __VA_ARGS__); \
+    } while (0)
+
+// Suffix of the copy of the media, renamed over the media once complete
+#define FASTSTART_COPY_EXT "-faststart.tmp"
+
+// Buffer used to copy the data when copy_file_range() is not available
+#define FASTSTART_COPY_BUFFER_SIZE (1024 * 1024)
+
+#if defined(__linux__) && !(defined(__ANDROID__) && (__ANDROID_API__ < 21)) && defined(FALLOC_FL_INSERT_RANGE)
+#define FASTSTART_HAVE_INSERT_RANGE (1)
+#endif
+
+#if defined(__linux__) && defined(SYS_copy_file_range)
+#define FASTSTART_HAVE_COPY_FILE_RANGE (1)
+#endif
+
+// Top level atom
+typedef struct
+{
+    char tag[ARMEDIA_ATOM_TAG_SIZE];
+    off_t offset;
+    uint64_t size; // header included
+} ARMEDIA_FastStart_Atom_t;
+
+// Top level layout of a media
+typedef struct
+{
+    off_t fileSize;
+    ARMEDIA_FastStart_Atom_t moov;
+    ARMEDIA_FastStart_Atom_t mdat;
+    off_t freeStart;    // start of the free atoms just before the mdat atom
+    int moovIsLast;     // nothing follows the moov atom
+} ARMEDIA_FastStart_Layout_t;
+
+static int ARMEDIA_FastStart_PRead (int fd, uint8_t *data, size_t size, off_t offset)
+{
+    while (0 < size)
+    {
+        ssize_t ret = pread (fd, data, size, offset);
+        if ((0 > ret) && (EINTR == errno))
+        {
+            continue;
+        }
+        if (0 >= ret)
+        {
+            return -1;
+        }
+        data += ret;
+        size -= ret;
+        offset += ret;
+    }
+    return 0;
+}
+
+static int ARMEDIA_FastStart_PWrite (int fd, const uint8_t *data, size_t size, off_t offset)
+{
+    while (0 < size)
+    {
+        ssize_t ret = pwrite (fd, data, size, offset);
+        if ((0 > ret) && (EINTR == errno))
+        {
+            continue;
+        }
+        if (0 >= ret)
+        {
+            return -1;
+        }
+        data += ret;
+        size -= ret;
+        offset += ret;
+    }
+    return 0;
+}
+
+static int ARMEDIA_FastStart_WriteHeader (int fd, uint32_t size, const char *tag, off_t offset)
+{
+    uint8_t header[8];
+    uint32_t sizeNE = htonl (size);
+
+    memcpy (header, &sizeNE, sizeof (sizeNE));
+    memcpy (&header[4], tag, ARMEDIA_ATOM_TAG_SIZE);
+    return ARMEDIA_FastStart_PWrite (fd, header, sizeof (header), offset);
+}
+
+static int ARMEDIA_FastStart_ReadLayout (int fd, ARMEDIA_FastStart_Layout_t *layout)
+{
+    struct stat st;
+    off_t offset = 0;
+    off_t freeRun = -1;
+
+    memset (layout, 0, sizeof (*layout));
+    if (0 != fstat (fd, &st))
+    {
+        return -1;
+    }
+    layout->fileSize = st.st_size;
+    layout->moov.offset = -1;
+    layout->mdat.offset = -1;
+
+    while (offset + 8 <= layout->fileSize)
+    {
+        ARMEDIA_FastStart_Atom_t atom;
+        uint8_t header[16];
+        uint32_t size32;
+
+        if (0 != ARMEDIA_FastStart_PRead (fd, header, 8, offset))
+        {
+            return -1;
+        }
+        memcpy (&size32, header, sizeof (size32));
+        size32 = ntohl (size32);
+        memcpy (atom.tag, &header[4], ARMEDIA_ATOM_TAG_SIZE);
+        atom.offset = offset;
+        if (1 == size32)
+        {
+            uint32_t high, low;
+            if (0 != ARMEDIA_FastStart_PRead (fd, &header[8], 8, offset + 8))
+            {
+                return -1;
+            }
+            memcpy (&high, &header[8], sizeof (high));
+            memcpy (&low, &header[12], sizeof (low));
+            atom.size = ((uint64_t)ntohl (high) << 32) | ntohl (low);
+        }
+        else if (0 == size32)
+        {
+            atom.size = layout->fileSize - offset; // up to the end of the file
+        }
+        else
+        {
+            atom.size = size32;
+        }
+        if ((8 > atom.size) || ((uint64_t)(layout->fileSize - offset) < atom.size))
+        {
+            FASTSTART_ERROR ("Invalid atom %.4s at %lld", atom.tag, (long long)offset);
+            return -1;
+        }
+
+        if ((0 == memcmp (atom.tag, "free", 4)) || (0 == memcmp (atom.tag, "skip", 4)))
+        {
+            if (0 > freeRun)
+            {
+                freeRun = offset;
+            }
+        }
+        else
+        {
+            if ((0 == memcmp (atom.tag, "moov", 4)) && (0 > layout->moov.offset))
+            {
+                layout->moov = atom;
+            }
+            else if ((0 == memcmp (atom.tag, "mdat", 4)) && (0 > layout->mdat.offset))
+            {
+                layout->mdat = atom;
+                layout->freeStart = (0 <= freeRun) ? freeRun : offset;
+            }
+            freeRun = -1;
+        }
+        offset += (off_t)atom.size;
+    }
+
+    if ((0 > layout->moov.offset) || (0 > layout->mdat.offset))
+    {
+        FASTSTART_ERROR ("No moov or mdat atom");
+        return -1;
+    }
+    layout->moovIsLast = (layout->moov.offset + (off_t)layout->moov.size == layout->fileSize);
+    return 0;
+}
+
+// Atoms holding the stco and co64 atoms
+static int ARMEDIA_FastStart_IsContainer (const char *tag)
+{
+    return (0 == memcmp (tag, "trak", 4)) || (0 == memcmp (tag, "mdia", 4)) ||
+        (0 == memcmp (tag, "minf", 4)) || (0 == memcmp (tag, "stbl", 4));
+}
+
+/* Add delta to the chunk offsets of the stco and co64 atoms found at or
+ * after from. When apply is 0, only check that the offsets still fit: -2 when
+ * an stco offset would not. */
+static int ARMEDIA_FastStart_PatchOffsets (uint8_t *data, uint64_t size, off_t from, int64_t delta, int apply)
+{
+    uint64_t pos = 0;
+
+    while (pos + 8 <= size)
+    {
+        uint32_t atomSize, count, i;
+        uint8_t *payload = &data[pos + 8];
+        uint64_t payloadSize;
+        int ret;
+        const char *tag = (const char *)&data[pos + 4];
+
+        memcpy (&atomSize, &data[pos], sizeof (atomSize));
+        atomSize = ntohl (atomSize);
+        if ((8 > atomSize) || (size - pos < atomSize))
+        {
+            return -1;
+        }
+        payloadSize = atomSize - 8;
+
+        if (ARMEDIA_FastStart_IsContainer (tag))
+        {
+            ret = ARMEDIA_FastStart_PatchOffsets (payload, payloadSize, from, delta, apply);
+            if (0 != ret)
+            {
+                return ret;
+            }
+        }
+        else if ((0 == memcmp (tag, "stco", 4)) || (0 == memcmp (tag, "co64", 4)))
+        {
+            size_t entrySize = ('s' == tag[0]) ? sizeof (uint32_t) : sizeof (uint64_t);
+            if (8 > payloadSize)
+            {
+                return -1;
+            }
+            memcpy (&count, &payload[4], sizeof (count));
+            count = ntohl (count);
+            if ((payloadSize - 8) / entrySize < count)
+            {
+                return -1;
+            }
+            for (i = 0; i < count; i++)
+            {
+                uint8_t *entry = &payload[8 + (size_t)i * entrySize];
+                uint32_t high = 0, low;
+                uint64_t offset;
+
+                if (sizeof (uint64_t) == entrySize)
+                {
+                    memcpy (&high, entry, sizeof (high));
+                    memcpy (&low, entry + 4, sizeof (low));
+                    high = ntohl (high);
+                }
+                else
+                {
+                    memcpy (&low, entry, sizeof (low));
+                }
+                offset = ((uint64_t)high << 32) | ntohl (low);
+                if (offset < (uint64_t)from)
+                {
+                    continue;
+                }
+                offset += delta;
+                if ((sizeof (uint32_t) == entrySize) && (UINT32_MAX < offset))
+                {
+                    // The stco atom would have to become a co64 atom
+                    return -2;
+                }
+                if (apply)
+                {
+                    high = htonl ((uint32_t)(offset >> 32));
+                    low = htonl ((uint32_t)(offset & 0xffffffff));
+                    if (sizeof (uint64_t) == entrySize)
+                    {
+                        memcpy (entry, &high, sizeof (high));
+                        memcpy (entry + 4, &low, sizeof (low));
+                    }
+                    else
+                    {
+                        memcpy (entry, &low, sizeof (low));
+                    }
+                }
+            }
+        }
+        pos += atomSize;
+    }
+    return 0;
+}
+
+/* Copy the atoms of data to widened with their stco atoms rewritten as co64
+ * atoms and their containers resized. When widened is NULL, only compute the
+ * size of the copy. */
+static int ARMEDIA_FastStart_WidenOffsets (const uint8_t *data, uint64_t size, uint8_t *widened, uint64_t *widenedSize)
+{
+    uint64_t pos = 0, out = 0;
+
+    while (pos + 8 <= size)
+    {
+        uint32_t atomSize, count, sizeNE, i;
+        const uint8_t *payload = &data[pos + 8];
+        const char *tag = (const char *)&data[pos + 4];
+        const char *newTag = tag;
+        uint64_t newSize;
+
+        memcpy (&atomSize, &data[pos], sizeof (atomSize));
+        atomSize = ntohl (atomSize);
+        if ((8 > atomSize) || (size - pos < atomSize))
+        {
+            return -1;
+        }
+
+        if (ARMEDIA_FastStart_IsContainer (tag))
+        {
+            if (0 != ARMEDIA_FastStart_WidenOffsets (payload, atomSize - 8, (NULL != widened) ? &widened[out + 8] : NULL, &newSize))
+            {
+                return -1;
+            }
+            newSize += 8;
+        }
+        else if (0 == memcmp (tag, "stco", 4))
+        {
+            if (16 > atomSize)
+            {
+                return -1;
+            }
+            memcpy (&count, &payload[4], sizeof (count));
+            count = ntohl (count);
+            if ((atomSize - 16) / sizeof (uint32_t) < count)
+            {
+                return -1;
+            }
+            newSize = 16 + (uint64_t)count * sizeof (uint64_t);
+            newTag = "co64";
+            if (NULL != widened)
+            {
+                // Version, flags and entry count are kept, each offset gets a zero high word
+                memcpy (&widened[out + 8], payload, 8);
+                for (i = 0; i < count; i++)
+                {
+                    memset (&widened[out + 16 + (size_t)i * 8], 0, 4);
+                    memcpy (&widened[out + 20 + (size_t)i * 8], &payload[8 + (size_t)i * 4], 4);
+                }
+            }
+        }
+        else
+        {
+            newSize = atomSize;
+            if (NULL != widened)
+            {
+                memcpy (&widened[out + 8], payload, atomSize - 8);
+            }
+        }
+
+        if (UINT32_MAX < newSize)
+        {
+            return -1;
+        }
+        if (NULL != widened)
+        {
+            sizeNE = htonl ((uint32_t)newSize);
+            memcpy (&widened[out], &sizeNE, sizeof (sizeNE));
+            memcpy (&widened[out + 4], newTag, ARMEDIA_ATOM_TAG_SIZE);
+        }
+        out += newSize;
+        pos += atomSize;
+    }
+    *widenedSize = out;
+    return 0;
+}
+
+static int ARMEDIA_FastStart_WriteMoov (int fd, const uint8_t *payload, uint64_t moovSize, off_t offset)
+{
+    if (0 != ARMEDIA_FastStart_WriteHeader (fd, (uint32_t)moovSize, "moov", offset))
+    {
+        return -1;
+    }
+    return ARMEDIA_FastStart_PWrite (fd, payload, (size_t)(moovSize - 8), offset + 8);
+}
+
+// Drop the old moov atom at the end of the file, or make it a free atom
+static int ARMEDIA_FastStart_RemoveOldMoov (int fd, const ARMEDIA_FastStart_Layout_t *layout, off_t shift)
+{
+    if (layout->moovIsLast)
+    {
+        return ftruncate (fd, layout->moov.offset + shift);
+    }
+    return ARMEDIA_FastStart_PWrite (fd, (const uint8_t *)"free", 4, layout->moov.offset + shift + 4);
+}
+
+static int ARMEDIA_FastStart_CopyRange (int src, off_t srcOffset, int dst, off_t dstOffset, uint64_t size, uint8_t **buffer)
+{
+#if defined(FASTSTART_HAVE_COPY_FILE_RANGE)
+    while (0 < size)
+    {
+        loff_t in = srcOffset, out = dstOffset;
+        ssize_t ret = syscall (SYS_copy_file_range, src, &in, dst, &out, (size_t)((SSIZE_MAX < size) ? SSIZE_MAX : size), 0);
+        if ((0 > ret) && (EINTR == errno))
+        {
+            continue;
+        }
+        if (0 > ret)
+        {
+            if ((ENOSYS == errno) || (EXDEV == errno) || (EINVAL == errno) || (EOPNOTSUPP == errno))
+            {
+                break; // copied through the buffer
+            }
+            return -1;
+        }
+        if (0 == ret)
+        {
+            return -1;
+        }
+        srcOffset += ret;
+        dstOffset += ret;
+        size -= ret;
+    }
+#endif
+    while (0 < size)
+    {
+        size_t chunk = (FASTSTART_COPY_BUFFER_SIZE < size) ? FASTSTART_COPY_BUFFER_SIZE : (size_t)size;
+        if ((NULL == *buffer) && (NULL == (*buffer = malloc (FASTSTART_COPY_BUFFER_SIZE))))
+        {
+            return -1;
+        }
+        if ((0 != ARMEDIA_FastStart_PRead (src, *buffer, chunk, srcOffset)) ||
+            (0 != ARMEDIA_FastStart_PWrite (dst, *buffer, chunk, dstOffset)))
+        {
+            return -1;
+        }
+        srcOffset += chunk;
+        dstOffset += chunk;
+        size -= chunk;
+    }
+    return 0;
+}
+
+// Layout of the copy: atoms before the free atoms, moov, then mdat and what follows
+static eARMEDIA_ERROR ARMEDIA_FastStart_Copy (const char *mediaPath, int fd, const ARMEDIA_FastStart_Layout_t *layout, const uint8_t *payload, uint64_t moovSize)
+{
+    char copyPath[ARMEDIA_ENCAPSULER_VIDEO_PATH_SIZE];
+    off_t mdatOffset = layout->freeStart + (off_t)moovSize;
+    off_t moovEnd = layout->moov.offset + (off_t)layout->moov.size;
+    uint8_t *buffer = NULL;
+    struct stat st;
+    struct timeval times[2];
+    int copyFd;
+    int ret;
+
+    snprintf (copyPath, sizeof (copyPath), "%s%s", mediaPath, FASTSTART_COPY_EXT);
+    if (0 != fstat (fd, &st))
+    {
+        return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+    }
+    copyFd = open (copyPath, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 0777);
+    if (0 > copyFd)
+    {
+        FASTSTART_ERROR ("Unable to create %s: %s", copyPath, strerror (errno));
+        return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+    }
+
+    ret = ARMEDIA_FastStart_CopyRange (fd, 0, copyFd, 0, layout->freeStart, &buffer);
+    ret = ret || ARMEDIA_FastStart_WriteMoov (copyFd, payload, moovSize, layout->freeStart);
+    ret = ret || ARMEDIA_FastStart_CopyRange (fd, layout->mdat.offset, copyFd, mdatOffset, layout->moov.offset - layout->mdat.offset, &buffer);
+    ret = ret || ARMEDIA_FastStart_CopyRange (fd, moovEnd, copyFd, mdatOffset + (layout->moov.offset - layout->mdat.offset), layout->fileSize - moovEnd, &buffer);
+    ret = ret || fsync (copyFd);
+    free (buffer);
+
+    // Keep the dates of the recording
+    times[0].tv_sec = st.st_atime;
+    times[0].tv_usec = 0;
+    times[1].tv_sec = st.st_mtime;
+    times[1].tv_usec = 0;
+    futimes (copyFd, times);
+    ret = close (copyFd) || ret;
+
+    if ((0 != ret) || (0 != rename (copyPath, mediaPath)))
+    {
+        FASTSTART_ERROR ("Unable to write %s: %s", copyPath, strerror (errno));
+        unlink (copyPath);
+        return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+    }
+    return ARMEDIA_OK;
+}
+
+#if defined(FASTSTART_HAVE_INSERT_RANGE)
+/* Insert space before the mdat atom. The inserted range must be aligned on
+ * the file system blocks: it starts at the block holding the free atoms, whose
+ * first bytes (end of the previous atoms) are written back at their place. */
+static int ARMEDIA_FastStart_InsertRange (int fd, const ARMEDIA_FastStart_Layout_t *layout, uint8_t *payload, off_t *inserted)
+{
+    struct stat st;
+    off_t blockSize, start, length, needed;
+    uint8_t *head = NULL;
+    size_t headSize;
+    int ret;
+
+    if ((0 != fstat (fd, &st)) || (0 >= st.st_blksize))
+    {
+        return -1;
+    }
+    blockSize = st.st_blksize;
+    start = layout->freeStart - layout->freeStart % blockSize;
+    needed = (off_t)layout->moov.size + 8 - (layout->mdat.offset - layout->freeStart);
+    length = (needed + blockSize - 1) / blockSize * blockSize;
+    headSize = (size_t)(layout->freeStart - start);
+
+    if (0 != ARMEDIA_FastStart_PatchOffsets (payload, layout->moov.size - 8, layout->mdat.offset, length, 0))
+    {
+        return -1;
+    }
+    if ((0 != headSize) &&
+        ((NULL == (head = malloc (headSize))) || (0 != ARMEDIA_FastStart_PRead (fd, head, headSize, start))))
+    {
+        free (head);
+        return -1;
+    }
+    do
+    {
+        ret = fallocate (fd, FALLOC_FL_INSERT_RANGE, start, length);
+    } while ((0 != ret) && (EINTR == errno));
+    if (0 != ret)
+    {
+        // Not supported by the file system: the media is copied
+        free (head);
+        return -1;
+    }
+
+    *inserted = length;
+    ARMEDIA_FastStart_PatchOffsets (payload, layout->moov.size - 8, layout->mdat.offset, length, 1);
+    ret = ARMEDIA_FastStart_PWrite (fd, head, headSize, start);
+    ret = ret || ARMEDIA_FastStart_WriteMoov (fd, payload, layout->moov.size, layout->freeStart);
+    ret = ret || ARMEDIA_FastStart_WriteHeader (fd, (uint32_t)(layout->mdat.offset + length - layout->freeStart - (off_t)layout->moov.size),
+                                                "free", layout->freeStart + (off_t)layout->moov.size);
+    free (head);
+    return ret ? -2 : 0;
+}
+#endif
+
+eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_FastStartMediaFile (const char *mediaPath, uint8_t forceCopy, eARMEDIA_ENCAPSULER_FASTSTART_METHOD *method)
+{
+    eARMEDIA_ERROR error = ARMEDIA_OK;
+    eARMEDIA_ENCAPSULER_FASTSTART_METHOD localMethod = ARMEDIA_ENCAPSULER_FASTSTART_METHOD_NONE;
+    ARMEDIA_FastStart_Layout_t layout;
+    FILE *file;
+    int fd;
+    uint8_t *payload = NULL;
+    uint32_t payloadSize = 0;
+    off_t available;
+    off_t shift = 0;
+    int ret;
+
+    if (NULL == mediaPath)
+    {
+        FASTSTART_ERROR ("mediaPath pointer must not be null");
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
+    file = fopen (mediaPath, forceCopy ? "rb" : "r+b");
+    if (NULL == file)
+    {
+        FASTSTART_ERROR ("Unable to open %s: %s", mediaPath, strerror (errno));
+        return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+    }
+    fd = fileno (file);
+
+    if (0 != ARMEDIA_FastStart_ReadLayout (fd, &layout))
+    {
+        error = ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+    }
+    else if (layout.moov.offset < layout.mdat.offset)
+    {
+        // Already fast start
+        fclose (file);
+        if (NULL != method)
+        {
+            *method = localMethod;
+        }
+        return ARMEDIA_OK;
+    }
+    else if ((UINT32_MAX < layout.moov.size) ||
+             (NULL == (payload = createDataFromFile (file, "moov", &payloadSize))) ||
+             (layout.moov.size - 8 != payloadSize))
+    {
+        FASTSTART_ERROR ("Unable to read the moov atom of %s", mediaPath);
+        error = ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+    }
+
+    available = layout.mdat.offset - layout.freeStart;
+    if ((ARMEDIA_OK == error) && !forceCopy &&
+        (((off_t)layout.moov.size == available) || ((off_t)layout.moov.size + 8 <= available)))
+    {
+        // The chunk offsets do not change
+        localMethod = ARMEDIA_ENCAPSULER_FASTSTART_METHOD_FREE_SPACE;
+        ret = ARMEDIA_FastStart_WriteMoov (fd, payload, layout.moov.size, layout.freeStart);
+        if ((0 == ret) && ((off_t)layout.moov.size != available))
+        {
+            ret = ARMEDIA_FastStart_WriteHeader (fd, (uint32_t)(available - (off_t)layout.moov.size), "free", layout.freeStart + (off_t)layout.moov.size);
+        }
+        if (0 != ret)
+        {
+            error = ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+        }
+    }
+#if defined(FASTSTART_HAVE_INSERT_RANGE)
+    else if ((ARMEDIA_OK == error) && !forceCopy)
+    {
+        ret = ARMEDIA_FastStart_InsertRange (fd, &layout, payload, &shift);
+        if (0 == ret)
+        {
+            localMethod = ARMEDIA_ENCAPSULER_FASTSTART_METHOD_INSERT_RANGE;
+        }
+        else if (-2 == ret)
+        {
+            FASTSTART_ERROR ("Unable to write the moov atom of %s, the media is corrupted", mediaPath);
+            error = ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+        }
+    }
+#endif
+
+    if ((ARMEDIA_OK == error) && (ARMEDIA_ENCAPSULER_FASTSTART_METHOD_NONE != localMethod))
+    {
+        // The new moov atom is complete: the old one can be dropped
+        if ((0 != fsync (fd)) || (0 != ARMEDIA_FastStart_RemoveOldMoov (fd, &layout, shift)) || (0 != fsync (fd)))
+        {
+            error = ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+        }
+    }
+    else if (ARMEDIA_OK == error)
+    {
+        uint64_t moovSize = layout.moov.size;
+        int64_t delta = (int64_t)layout.freeStart + (int64_t)moovSize - (int64_t)layout.mdat.offset;
+
+        localMethod = ARMEDIA_ENCAPSULER_FASTSTART_METHOD_COPY;
+        ret = ARMEDIA_FastStart_PatchOffsets (payload, payloadSize, layout.mdat.offset, delta, 0);
+        if (-2 == ret)
+        {
+            // The offsets no longer fit in the stco atoms: they become co64 atoms, the mdat atom moves further
+            uint64_t widenedSize = 0;
+            uint8_t *widened = NULL;
+
+            ret = ARMEDIA_FastStart_WidenOffsets (payload, payloadSize, NULL, &widenedSize);
+            if ((0 == ret) && ((UINT32_MAX - 8 < widenedSize) || (NULL == (widened = malloc ((size_t)widenedSize)))))
+            {
+                ret = -1;
+            }
+            if ((0 == ret) && (0 == ARMEDIA_FastStart_WidenOffsets (payload, payloadSize, widened, &widenedSize)))
+            {
+                free (payload);
+                payload = widened;
+                payloadSize = (uint32_t)widenedSize;
+                moovSize = widenedSize + 8;
+                delta = (int64_t)layout.freeStart + (int64_t)moovSize - (int64_t)layout.mdat.offset;
+                ret = ARMEDIA_FastStart_PatchOffsets (payload, payloadSize, layout.mdat.offset, delta, 0);
+            }
+            else
+            {
+                free (widened);
+                ret = -1;
+            }
+        }
+        if (0 != ret)
+        {
+            FASTSTART_ERROR ("Unable to patch the chunk offsets of %s", mediaPath);
+            error = ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+        }
+        else
+        {
+            ARMEDIA_FastStart_PatchOffsets (payload, payloadSize, layout.mdat.offset, delta, 1);
+            error = ARMEDIA_FastStart_Copy (mediaPath, fd, &layout, payload, moovSize);
+        }
+    }
+
+    free (payload);
+    fclose (file);
+    if ((ARMEDIA_OK == error) && (NULL != method))
+    {
+        *method = localMethod;
+    }
+    return error;
+}
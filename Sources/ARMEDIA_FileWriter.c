@@ -0,0 +1,837 @@
+/*
+    Copyright (C) 2014 Parrot SA
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the
+      distribution.
+    * Neither the name of Parrot nor the names
+      of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written
+      permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+    "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+    LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+    FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+    COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+    BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+    OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+    AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+    OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+    SUCH DAMAGE.
+*/
+/**
+ * @file ARMEDIA_FileWriter.c
+ * @brief Recording output of the video encapsuler.
+ */
+
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+#endif
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // sync_file_range()
+#endif
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libARSAL/ARSAL_Print.h>
+#include <libARSAL/ARSAL_Sem.h>
+#include <libARSAL/ARSAL_Thread.h>
+#include "ARMEDIA_FileWriter.h"
+#include "ARMEDIA_DirectWriter.h"
+
+#define ARMEDIA_FILEWRITER_TAG "ARMEDIA FileWriter"
+
+#define FILEWRITER_ERROR(...)                                           \
+    do {                                                                \
+        ARSAL_PRINT (ARSAL_PRINT_ERROR, ARMEDIA_FILEWRITER_TAG, "error: " __VA_ARGS__); \
+    } while (0)
+
+// Initial size of the job buffers, they grow to fit the biggest frame
+#define FILEWRITER_JOB_DATA_SIZE (64 * 1024)
+#define FILEWRITER_JOB_META_SIZE (256)
+
+#define ZBUFF_SIZE 1024
+
+// The synchronous writer gathers the writes of a job and submits them with a
+// single pwritev(); the small writes (NALU sizes) are copied to a scratch area
+#define FILEWRITER_IOV_COUNT (64)
+#define FILEWRITER_SCRATCH_SIZE (256)
+#define FILEWRITER_SMALL_WRITE_SIZE (16)
+
+#if defined(__linux__) && !(defined(__ANDROID__) && (__ANDROID_API__ < 24))
+#define FILEWRITER_HAVE_PWRITEV (1)
+#endif
+
+#if defined(__linux__) && !(defined(__ANDROID__) && (__ANDROID_API__ < 21))
+#define FILEWRITER_HAVE_FALLOCATE (1)
+#endif
+
+// The queue indexes are shared between the caller and the writer thread
+#define FILEWRITER_LOAD(PTR) __atomic_load_n (PTR, __ATOMIC_ACQUIRE)
+#define FILEWRITER_STORE(PTR, VAL) __atomic_store_n (PTR, VAL, __ATOMIC_RELEASE)
+
+typedef struct
+{
+    uint8_t *data;
+    size_t dataSize;
+    size_t dataCapacity;
+    uint8_t *meta;
+    size_t metaSize;
+    size_t metaCapacity;
+    int sync;       // flush the files before writing the job
+    int barrier;    // signal the caller once the job is written
+} ARMEDIA_FileWriter_Job_t;
+
+struct ARMEDIA_FileWriter_t
+{
+    FILE *dataFile;
+    FILE *metaFile;
+
+    // The media data is written to the file descriptor, bypassing the stdio buffer
+    int dataFd;
+    off_t dataPosition; // where the next data is written, -1 to get it from dataFile
+    ARMEDIA_DirectWriter_t *direct; // direct I/O staging, NULL to write through the page cache
+
+    // Synchronous writer only: writes of the current job
+    struct iovec iov[FILEWRITER_IOV_COUNT];
+    int iovCount;
+    size_t iovSize;
+    uint8_t scratch[FILEWRITER_SCRATCH_SIZE];
+    size_t scratchSize;
+
+    // Early writeback of the data file, touched only by the thread that writes
+    size_t writebackSize;
+    size_t writebackPending;
+    off_t writebackOffset;
+
+    // Asynchronous writer only
+    uint32_t queueSize;
+    eARMEDIA_ENCAPSULER_OVERFLOW_POLICY overflowPolicy;
+    ARMEDIA_FileWriter_Job_t *jobs;
+    ARMEDIA_FileWriter_Job_t *currentJob; // job being filled by the caller
+    uint32_t head;  // next job to fill, written by the caller only
+    uint32_t tail;  // next job to write, written by the writer thread only
+    uint32_t maxDepth;
+    int error;      // first error met by the writer thread
+    int stop;
+    ARSAL_Sem_t pendingSem; // number of committed jobs
+    ARSAL_Sem_t freeSem;    // number of free jobs
+    ARSAL_Sem_t barrierSem;
+    ARSAL_Thread_t thread;
+    int threadStarted;
+};
+
+static void *ARMEDIA_FileWriter_ThreadRun (void *arg);
+
+static const uint8_t ARMEDIA_FileWriter_Zeros[ZBUFF_SIZE] = {0};
+
+static int ARMEDIA_FileWriter_DataSync (FILE *file)
+{
+    if (0 != fflush (file))
+    {
+        return -1;
+    }
+#if defined(__APPLE__)
+    return fsync (fileno (file));
+#else
+    // The file metadata (except its size) is not needed to read the data back
+    return fdatasync (fileno (file));
+#endif
+}
+
+static int ARMEDIA_FileWriter_FlushMeta (ARMEDIA_FileWriter_t *writer)
+{
+    return (NULL != writer->metaFile) ? fflush (writer->metaFile) : 0;
+}
+
+static eARMEDIA_ERROR ARMEDIA_FileWriter_SyncFiles (ARMEDIA_FileWriter_t *writer)
+{
+    eARMEDIA_ERROR error = ARMEDIA_OK;
+
+    if ((NULL != writer->direct) && (ARMEDIA_OK != ARMEDIA_DirectWriter_Flush (writer->direct)))
+    {
+        error = ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+    }
+
+    if (0 != ARMEDIA_FileWriter_DataSync (writer->dataFile))
+    {
+        error = ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+    }
+    if ((NULL != writer->metaFile) && (0 != ARMEDIA_FileWriter_DataSync (writer->metaFile)))
+    {
+        error = ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+    }
+    return error;
+}
+
+static void ARMEDIA_FileWriter_Writeback (ARMEDIA_FileWriter_t *writer, size_t written)
+{
+#if defined(SYNC_FILE_RANGE_WRITE)
+    off_t offset;
+
+    if ((0 == writer->writebackSize) || (NULL != writer->direct))
+    {
+        return;
+    }
+    writer->writebackPending += written;
+    if (writer->writebackPending < writer->writebackSize)
+    {
+        return;
+    }
+    writer->writebackPending = 0;
+
+    // Start the writeback of the last written range without waiting for it,
+    // so that the next sync only has a small amount of data left to write
+    offset = writer->dataPosition;
+    if (offset > writer->writebackOffset)
+    {
+        sync_file_range (writer->dataFd, writer->writebackOffset, offset - writer->writebackOffset, SYNC_FILE_RANGE_WRITE);
+        writer->writebackOffset = offset;
+    }
+#endif
+}
+
+static eARMEDIA_ERROR ARMEDIA_FileWriter_WriteVector (ARMEDIA_FileWriter_t *writer, struct iovec *iov, int count, size_t size)
+{
+    size_t written = 0;
+
+    if (writer->dataPosition < 0)
+    {
+        // First write since the data file was last accessed through stdio
+        if (0 != fflush (writer->dataFile))
+        {
+            return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+        }
+        writer->dataPosition = ftello (writer->dataFile);
+        if (writer->dataPosition < 0)
+        {
+            return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+        }
+    }
+
+    if (NULL != writer->direct)
+    {
+        eARMEDIA_ERROR error = ARMEDIA_DirectWriter_Write (writer->direct, writer->dataPosition, iov, count);
+        if (ARMEDIA_OK == error)
+        {
+            writer->dataPosition += size;
+        }
+        return error;
+    }
+
+    while (written < size)
+    {
+        ssize_t ret;
+#ifdef FILEWRITER_HAVE_PWRITEV
+        ret = pwritev (writer->dataFd, iov, count, writer->dataPosition + written);
+#else
+        if ((off_t)-1 == lseek (writer->dataFd, writer->dataPosition + written, SEEK_SET))
+        {
+            return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+        }
+        ret = writev (writer->dataFd, iov, count);
+#endif
+        if (ret < 0)
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+            FILEWRITER_ERROR ("Unable to write %zu bytes into data file: %s", size - written, strerror (errno));
+            return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+        }
+        if (0 == ret)
+        {
+            return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+        }
+        written += ret;
+
+        // Partial write: skip what was written
+        while ((count > 0) && ((size_t)ret >= iov->iov_len))
+        {
+            ret -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = (uint8_t *)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+    writer->dataPosition += size;
+    ARMEDIA_FileWriter_Writeback (writer, size);
+
+    return ARMEDIA_OK;
+}
+
+static eARMEDIA_ERROR ARMEDIA_FileWriter_Submit (ARMEDIA_FileWriter_t *writer)
+{
+    eARMEDIA_ERROR error = ARMEDIA_OK;
+
+    if (0 != writer->iovCount)
+    {
+        error = ARMEDIA_FileWriter_WriteVector (writer, writer->iov, writer->iovCount, writer->iovSize);
+    }
+    writer->iovCount = 0;
+    writer->iovSize = 0;
+    writer->scratchSize = 0;
+
+    return error;
+}
+
+static eARMEDIA_ERROR ARMEDIA_FileWriter_Gather (ARMEDIA_FileWriter_t *writer, const void *data, size_t size)
+{
+    eARMEDIA_ERROR error = ARMEDIA_OK;
+    struct iovec *last;
+
+    if (0 == size)
+    {
+        return ARMEDIA_OK;
+    }
+    if ((FILEWRITER_IOV_COUNT == writer->iovCount) ||
+        ((size <= FILEWRITER_SMALL_WRITE_SIZE) && (writer->scratchSize + size > FILEWRITER_SCRATCH_SIZE)))
+    {
+        error = ARMEDIA_FileWriter_Submit (writer);
+    }
+    if (size <= FILEWRITER_SMALL_WRITE_SIZE)
+    {
+        // The caller may reuse its buffer before the job is submitted
+        memcpy (writer->scratch + writer->scratchSize, data, size);
+        data = writer->scratch + writer->scratchSize;
+        writer->scratchSize += size;
+    }
+
+    last = (0 != writer->iovCount) ? &writer->iov[writer->iovCount - 1] : NULL;
+    if ((NULL != last) && ((const uint8_t *)last->iov_base + last->iov_len == (const uint8_t *)data))
+    {
+        last->iov_len += size;
+    }
+    else
+    {
+        writer->iov[writer->iovCount].iov_base = (void *)data;
+        writer->iov[writer->iovCount].iov_len = size;
+        writer->iovCount++;
+    }
+    writer->iovSize += size;
+
+    return error;
+}
+
+/* Leave the stdio position of the data file at the end of the written data */
+static eARMEDIA_ERROR ARMEDIA_FileWriter_ReleaseDataFile (ARMEDIA_FileWriter_t *writer)
+{
+    if ((NULL != writer->direct) && (ARMEDIA_OK != ARMEDIA_DirectWriter_Flush (writer->direct)))
+    {
+        return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+    }
+    if (writer->dataPosition >= 0)
+    {
+        if (0 != fseeko (writer->dataFile, writer->dataPosition, SEEK_SET))
+        {
+            return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+        }
+        writer->dataPosition = -1;
+    }
+    return ARMEDIA_OK;
+}
+
+static eARMEDIA_ERROR ARMEDIA_FileWriter_Append (uint8_t **buffer, size_t *size, size_t *capacity, const void *data, size_t len)
+{
+    if (*size + len > *capacity)
+    {
+        size_t newCapacity = (*capacity) ? *capacity : len;
+        uint8_t *newBuffer;
+        while (newCapacity < *size + len)
+        {
+            newCapacity *= 2;
+        }
+        newBuffer = realloc (*buffer, newCapacity);
+        if (NULL == newBuffer)
+        {
+            FILEWRITER_ERROR ("Unable to grow job buffer to %zu bytes", newCapacity);
+            return ARMEDIA_ERROR_ENCAPSULER;
+        }
+        *buffer = newBuffer;
+        *capacity = newCapacity;
+    }
+    if (NULL != data)
+    {
+        memcpy (*buffer + *size, data, len);
+    }
+    else
+    {
+        memset (*buffer + *size, 0, len);
+    }
+    *size += len;
+    return ARMEDIA_OK;
+}
+
+ARMEDIA_FileWriter_t *ARMEDIA_FileWriter_New (FILE *dataFile, FILE *metaFile, uint32_t queueSize, eARMEDIA_ENCAPSULER_OVERFLOW_POLICY overflowPolicy, eARMEDIA_ERROR *error)
+{
+    ARMEDIA_FileWriter_t *writer = NULL;
+    uint32_t i;
+
+    if (NULL == dataFile)
+    {
+        *error = ARMEDIA_ERROR_BAD_PARAMETER;
+        return NULL;
+    }
+
+    writer = calloc (1, sizeof (ARMEDIA_FileWriter_t));
+    if (NULL == writer)
+    {
+        FILEWRITER_ERROR ("Unable to allocate file writer");
+        *error = ARMEDIA_ERROR_ENCAPSULER;
+        return NULL;
+    }
+    writer->dataFile = dataFile;
+    writer->metaFile = metaFile;
+    writer->dataFd = fileno (dataFile);
+    writer->dataPosition = -1;
+    writer->queueSize = queueSize;
+    writer->overflowPolicy = overflowPolicy;
+    writer->error = ARMEDIA_OK;
+
+    if (0 == queueSize)
+    {
+        // synchronous writer
+        *error = ARMEDIA_OK;
+        return writer;
+    }
+
+    writer->jobs = calloc (queueSize, sizeof (ARMEDIA_FileWriter_Job_t));
+    if (NULL == writer->jobs)
+    {
+        FILEWRITER_ERROR ("Unable to allocate %u jobs", queueSize);
+        free (writer);
+        *error = ARMEDIA_ERROR_ENCAPSULER;
+        return NULL;
+    }
+    ARSAL_Sem_Init (&writer->pendingSem, 0, 0);
+    ARSAL_Sem_Init (&writer->freeSem, 0, queueSize);
+    ARSAL_Sem_Init (&writer->barrierSem, 0, 0);
+
+    for (i = 0; i < queueSize; i++)
+    {
+        writer->jobs[i].dataCapacity = FILEWRITER_JOB_DATA_SIZE;
+        writer->jobs[i].data = malloc (writer->jobs[i].dataCapacity);
+        writer->jobs[i].metaCapacity = FILEWRITER_JOB_META_SIZE;
+        writer->jobs[i].meta = malloc (writer->jobs[i].metaCapacity);
+        if ((NULL == writer->jobs[i].data) || (NULL == writer->jobs[i].meta))
+        {
+            FILEWRITER_ERROR ("Unable to allocate job buffers");
+            *error = ARMEDIA_ERROR_ENCAPSULER;
+            ARMEDIA_FileWriter_Delete (&writer);
+            return NULL;
+        }
+    }
+
+    if (0 != ARSAL_Thread_Create (&writer->thread, ARMEDIA_FileWriter_ThreadRun, writer))
+    {
+        FILEWRITER_ERROR ("Unable to create writer thread");
+        *error = ARMEDIA_ERROR_ENCAPSULER;
+        ARMEDIA_FileWriter_Delete (&writer);
+        return NULL;
+    }
+    writer->threadStarted = 1;
+
+    *error = ARMEDIA_OK;
+    return writer;
+}
+
+eARMEDIA_ERROR ARMEDIA_FileWriter_Delete (ARMEDIA_FileWriter_t **writer)
+{
+    ARMEDIA_FileWriter_t *w;
+    eARMEDIA_ERROR error = ARMEDIA_OK;
+    uint32_t i;
+
+    if ((NULL == writer) || (NULL == *writer))
+    {
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
+    w = *writer;
+
+    if (0 == w->queueSize)
+    {
+        error = ARMEDIA_FileWriter_Submit (w);
+    }
+    if (w->threadStarted)
+    {
+        if (NULL != w->currentJob)
+        {
+            ARMEDIA_FileWriter_CommitJob (w);
+        }
+        // The writer thread stops once all the committed jobs are written
+        FILEWRITER_STORE (&w->stop, 1);
+        ARSAL_Sem_Post (&w->pendingSem);
+        ARSAL_Thread_Join (w->thread, NULL);
+        ARSAL_Thread_Destroy (&w->thread);
+        error = FILEWRITER_LOAD (&w->error);
+    }
+    if (NULL != w->jobs)
+    {
+        ARSAL_Sem_Destroy (&w->pendingSem);
+        ARSAL_Sem_Destroy (&w->freeSem);
+        ARSAL_Sem_Destroy (&w->barrierSem);
+        for (i = 0; i < w->queueSize; i++)
+        {
+            free (w->jobs[i].data);
+            free (w->jobs[i].meta);
+        }
+        free (w->jobs);
+    }
+    if (((ARMEDIA_OK != ARMEDIA_FileWriter_ReleaseDataFile (w)) || (0 != ARMEDIA_FileWriter_FlushMeta (w))) &&
+        (ARMEDIA_OK == error))
+    {
+        error = ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+    }
+    if (NULL != w->direct)
+    {
+        ARMEDIA_DirectWriter_Delete (&w->direct);
+    }
+    free (w);
+    *writer = NULL;
+
+    return error;
+}
+
+void ARMEDIA_FileWriter_SetWriteback (ARMEDIA_FileWriter_t *writer, size_t writebackSize)
+{
+    writer->writebackSize = writebackSize;
+}
+
+void ARMEDIA_FileWriter_SetMetaFile (ARMEDIA_FileWriter_t *writer, FILE *metaFile)
+{
+    writer->metaFile = metaFile;
+}
+
+eARMEDIA_ERROR ARMEDIA_FileWriter_SetDirectIo (ARMEDIA_FileWriter_t *writer, const char *path, size_t bufferSize)
+{
+    eARMEDIA_ERROR error = ARMEDIA_OK;
+    ARMEDIA_DirectWriter_t *direct = NULL;
+
+    if (0 != bufferSize)
+    {
+        direct = ARMEDIA_DirectWriter_New (path, writer->dataFd, bufferSize, &error);
+        if (NULL == direct)
+        {
+            return error;
+        }
+    }
+    if (NULL != writer->direct)
+    {
+        error = ARMEDIA_DirectWriter_Delete (&writer->direct);
+    }
+    writer->direct = direct;
+
+    return error;
+}
+
+eARMEDIA_ERROR ARMEDIA_FileWriter_Allocate (ARMEDIA_FileWriter_t *writer, off_t offset, off_t length)
+{
+    int ret;
+
+#if defined(FILEWRITER_HAVE_FALLOCATE)
+    // Keep the file size so that it still tells how much data was written
+    do
+    {
+        ret = (0 == fallocate (writer->dataFd, FALLOC_FL_KEEP_SIZE, offset, length)) ? 0 : errno;
+    } while (EINTR == ret);
+    if ((EOPNOTSUPP == ret) || (ENOSYS == ret))
+    {
+        ret = posix_fallocate (writer->dataFd, offset, length);
+    }
+#elif defined(__APPLE__)
+    // Allocated from the physical end of file, which is where the previous allocation ended
+    fstore_t store = { F_ALLOCATECONTIG, F_PEOFPOSMODE, 0, length, 0 };
+    (void)offset;
+    ret = (-1 != fcntl (writer->dataFd, F_PREALLOCATE, &store)) ? 0 : errno;
+    if (ENOSPC == ret)
+    {
+        store.fst_flags = F_ALLOCATEALL;
+        ret = (-1 != fcntl (writer->dataFd, F_PREALLOCATE, &store)) ? 0 : errno;
+    }
+#else
+    (void)offset;
+    (void)length;
+    ret = EOPNOTSUPP;
+#endif
+
+    switch (ret)
+    {
+    case 0:
+        return ARMEDIA_OK;
+    case ENOSPC:
+    case EFBIG:
+        return ARMEDIA_ERROR_ENCAPSULER_DISK_FULL;
+    case EOPNOTSUPP:
+    case ENOSYS:
+    case EINVAL:
+        return ARMEDIA_ERROR_NOT_IMPLEMENTED;
+    default:
+        FILEWRITER_ERROR ("Unable to allocate %lld bytes in data file: %s", (long long)length, strerror (ret));
+        return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+    }
+}
+
+eARMEDIA_ERROR ARMEDIA_FileWriter_BeginJob (ARMEDIA_FileWriter_t *writer)
+{
+    eARMEDIA_ERROR error;
+
+    if (0 == writer->queueSize)
+    {
+        return ARMEDIA_OK;
+    }
+
+    error = FILEWRITER_LOAD (&writer->error);
+    if (ARMEDIA_OK != error)
+    {
+        return error;
+    }
+
+    if (0 != ARSAL_Sem_Trywait (&writer->freeSem))
+    {
+        if (ARMEDIA_ENCAPSULER_OVERFLOW_POLICY_DROP == writer->overflowPolicy)
+        {
+            return ARMEDIA_ERROR_ENCAPSULER_QUEUE_FULL;
+        }
+        ARSAL_Sem_Wait (&writer->freeSem);
+    }
+
+    writer->currentJob = &writer->jobs[writer->head % writer->queueSize];
+    writer->currentJob->dataSize = 0;
+    writer->currentJob->metaSize = 0;
+    writer->currentJob->sync = 0;
+    writer->currentJob->barrier = 0;
+
+    return ARMEDIA_OK;
+}
+
+eARMEDIA_ERROR ARMEDIA_FileWriter_CommitJob (ARMEDIA_FileWriter_t *writer)
+{
+    uint32_t depth;
+
+    if (0 == writer->queueSize)
+    {
+        return ARMEDIA_FileWriter_Submit (writer);
+    }
+    if (NULL == writer->currentJob)
+    {
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
+
+    writer->currentJob = NULL;
+    FILEWRITER_STORE (&writer->head, writer->head + 1);
+    ARSAL_Sem_Post (&writer->pendingSem);
+
+    depth = writer->head - FILEWRITER_LOAD (&writer->tail);
+    if (depth > writer->maxDepth)
+    {
+        writer->maxDepth = depth;
+    }
+
+    return ARMEDIA_OK;
+}
+
+eARMEDIA_ERROR ARMEDIA_FileWriter_WriteData (ARMEDIA_FileWriter_t *writer, const void *data, size_t size)
+{
+    ARMEDIA_FileWriter_Job_t *job = writer->currentJob;
+
+    if (0 == writer->queueSize)
+    {
+        return ARMEDIA_FileWriter_Gather (writer, data, size);
+    }
+    if (NULL == job)
+    {
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
+    return ARMEDIA_FileWriter_Append (&job->data, &job->dataSize, &job->dataCapacity, data, size);
+}
+
+eARMEDIA_ERROR ARMEDIA_FileWriter_WriteZeros (ARMEDIA_FileWriter_t *writer, size_t size)
+{
+    ARMEDIA_FileWriter_Job_t *job = writer->currentJob;
+
+    if (0 == writer->queueSize)
+    {
+        while (size > 0)
+        {
+            size_t len = (size > ZBUFF_SIZE) ? ZBUFF_SIZE : size;
+            eARMEDIA_ERROR error = ARMEDIA_FileWriter_Gather (writer, ARMEDIA_FileWriter_Zeros, len);
+            if (ARMEDIA_OK != error)
+            {
+                return error;
+            }
+            size -= len;
+        }
+        return ARMEDIA_OK;
+    }
+    if (NULL == job)
+    {
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
+    return ARMEDIA_FileWriter_Append (&job->data, &job->dataSize, &job->dataCapacity, NULL, size);
+}
+
+eARMEDIA_ERROR ARMEDIA_FileWriter_WriteMeta (ARMEDIA_FileWriter_t *writer, const void *data, size_t size)
+{
+    ARMEDIA_FileWriter_Job_t *job = writer->currentJob;
+
+    if (NULL == writer->metaFile)
+    {
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
+    if (0 == writer->queueSize)
+    {
+        if (size != fwrite (data, 1, size, writer->metaFile))
+        {
+            return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+        }
+        return ARMEDIA_OK;
+    }
+    if (NULL == job)
+    {
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
+    return ARMEDIA_FileWriter_Append (&job->meta, &job->metaSize, &job->metaCapacity, data, size);
+}
+
+eARMEDIA_ERROR ARMEDIA_FileWriter_Sync (ARMEDIA_FileWriter_t *writer)
+{
+    if (0 == writer->queueSize)
+    {
+        eARMEDIA_ERROR error = ARMEDIA_FileWriter_Submit (writer);
+        return (ARMEDIA_OK != error) ? error : ARMEDIA_FileWriter_SyncFiles (writer);
+    }
+    if (NULL == writer->currentJob)
+    {
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
+    writer->currentJob->sync = 1;
+    return ARMEDIA_OK;
+}
+
+eARMEDIA_ERROR ARMEDIA_FileWriter_Flush (ARMEDIA_FileWriter_t *writer)
+{
+    if (0 == writer->queueSize)
+    {
+        if ((ARMEDIA_OK != ARMEDIA_FileWriter_Submit (writer)) ||
+            (ARMEDIA_OK != ARMEDIA_FileWriter_ReleaseDataFile (writer)) ||
+            (0 != ARMEDIA_FileWriter_FlushMeta (writer)))
+        {
+            return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+        }
+        return ARMEDIA_OK;
+    }
+
+    if (NULL == writer->currentJob)
+    {
+        // The barrier must not be dropped
+        ARSAL_Sem_Wait (&writer->freeSem);
+        writer->currentJob = &writer->jobs[writer->head % writer->queueSize];
+        writer->currentJob->dataSize = 0;
+        writer->currentJob->metaSize = 0;
+        writer->currentJob->sync = 0;
+    }
+    writer->currentJob->barrier = 1;
+    ARMEDIA_FileWriter_CommitJob (writer);
+    ARSAL_Sem_Wait (&writer->barrierSem);
+
+    // The writer thread is idle until the next job
+    if (ARMEDIA_OK != ARMEDIA_FileWriter_ReleaseDataFile (writer))
+    {
+        return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+    }
+    return FILEWRITER_LOAD (&writer->error);
+}
+
+void ARMEDIA_FileWriter_GetQueueDepth (ARMEDIA_FileWriter_t *writer, uint32_t *depth, uint32_t *maxDepth)
+{
+    if (NULL != depth)
+    {
+        *depth = (0 != writer->queueSize) ? FILEWRITER_LOAD (&writer->head) - FILEWRITER_LOAD (&writer->tail) : 0;
+    }
+    if (NULL != maxDepth)
+    {
+        *maxDepth = writer->maxDepth;
+    }
+}
+
+static void *ARMEDIA_FileWriter_ThreadRun (void *arg)
+{
+    ARMEDIA_FileWriter_t *writer = (ARMEDIA_FileWriter_t *)arg;
+    ARMEDIA_FileWriter_Job_t *job;
+    eARMEDIA_ERROR error = ARMEDIA_OK;
+    uint32_t tail;
+
+    for (;;)
+    {
+        ARSAL_Sem_Wait (&writer->pendingSem);
+        tail = writer->tail;
+        if (tail == FILEWRITER_LOAD (&writer->head))
+        {
+            // woken up without a job: this is the stop request
+            if (FILEWRITER_LOAD (&writer->stop))
+            {
+                break;
+            }
+            continue;
+        }
+        job = &writer->jobs[tail % writer->queueSize];
+
+        // After an error, jobs are discarded so that the data file never
+        // gets out of sync with the frame infos
+        if (ARMEDIA_OK == error)
+        {
+            if (job->sync)
+            {
+                error = ARMEDIA_FileWriter_SyncFiles (writer);
+            }
+            if ((ARMEDIA_OK == error) && (0 != job->dataSize))
+            {
+                struct iovec iov = { job->data, job->dataSize };
+                error = ARMEDIA_FileWriter_WriteVector (writer, &iov, 1, job->dataSize);
+            }
+            if ((ARMEDIA_OK == error) && (0 != job->metaSize) &&
+                (job->metaSize != fwrite (job->meta, 1, job->metaSize, writer->metaFile)))
+            {
+                FILEWRITER_ERROR ("Unable to write %zu bytes into info file", job->metaSize);
+                error = ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+            }
+            if ((ARMEDIA_OK == error) && job->barrier &&
+                (0 != ARMEDIA_FileWriter_FlushMeta (writer)))
+            {
+                error = ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+            }
+            if (ARMEDIA_OK != error)
+            {
+                FILEWRITER_STORE (&writer->error, error);
+            }
+        }
+
+        if (job->barrier)
+        {
+            job->barrier = 0;
+            ARSAL_Sem_Post (&writer->barrierSem);
+        }
+        FILEWRITER_STORE (&writer->tail, tail + 1);
+        ARSAL_Sem_Post (&writer->freeSem);
+    }
+
+    return NULL;
+}
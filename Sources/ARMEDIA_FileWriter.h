@@ -0,0 +1,184 @@
+/*
+    Copyright (C) 2014 Parrot SA
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the
+      distribution.
+    * Neither the name of Parrot nor the names
+      of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written
+      permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+    "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+    LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+    FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+    COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+    BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+    OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+    AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+    OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+    SUCH DAMAGE.
+*/
+/**
+ * @file ARMEDIA_FileWriter.h
+ * @brief Recording output of the video encapsuler (private).
+ *
+ * All the writes done while recording (media data into the temporary file,
+ * frame infos into the -encaps.dat file) go through a file writer.
+ * A synchronous writer writes directly on the caller thread. An asynchronous
+ * writer copies each frame into a job of a bounded single producer / single
+ * consumer queue, which is drained by a dedicated writer thread.
+ *
+ * The media data bypasses the stdio buffer of the data file: a synchronous
+ * writer gathers the writes of a job and submits them with one pwritev()
+ * when the job is committed, so the data passed to ARMEDIA_FileWriter_WriteData()
+ * must stay valid until then (except for writes of 16 bytes or less).
+ * The stdio position of the data file is only up to date after
+ * ARMEDIA_FileWriter_Flush() or ARMEDIA_FileWriter_Delete().
+ */
+#ifndef _ARMEDIA_FILEWRITER_H_
+#define _ARMEDIA_FILEWRITER_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <libARMedia/ARMEDIA_Error.h>
+#include <libARMedia/ARMEDIA_VideoEncapsuler.h>
+
+typedef struct ARMEDIA_FileWriter_t ARMEDIA_FileWriter_t;
+
+/**
+ * @brief Create a new file writer
+ * @param dataFile media data file
+ * @param metaFile frame infos file, NULL if the frame infos are not recorded
+ * @param queueSize number of jobs of the queue, 0 for a synchronous writer
+ * @param overflowPolicy policy applied when the queue is full
+ * @param[out] error pointer on the error output
+ * @return Pointer on the new file writer, NULL on error
+ */
+ARMEDIA_FileWriter_t *ARMEDIA_FileWriter_New (FILE *dataFile, FILE *metaFile, uint32_t queueSize, eARMEDIA_ENCAPSULER_OVERFLOW_POLICY overflowPolicy, eARMEDIA_ERROR *error);
+
+/**
+ * @brief Write all pending jobs, stop the writer thread and free the writer
+ * @param writer address of the pointer on the file writer
+ * @return The first error met by the writer thread, if any
+ */
+eARMEDIA_ERROR ARMEDIA_FileWriter_Delete (ARMEDIA_FileWriter_t **writer);
+
+/**
+ * @brief Start the writeback of the data file every writebackSize bytes
+ * The data is not synced, this only spreads the writes so that
+ * ARMEDIA_FileWriter_Sync() has less data to wait for (Linux only).
+ * @param writer the file writer
+ * @param writebackSize writeback period in bytes, 0 to disable
+ */
+void ARMEDIA_FileWriter_SetWriteback (ARMEDIA_FileWriter_t *writer, size_t writebackSize);
+
+/**
+ * @brief Change the frame infos file
+ * Must be called before the first job.
+ * @param writer the file writer
+ * @param metaFile frame infos file, NULL to stop recording the frame infos
+ * (ARMEDIA_FileWriter_WriteMeta() then fails)
+ */
+void ARMEDIA_FileWriter_SetMetaFile (ARMEDIA_FileWriter_t *writer, FILE *metaFile);
+
+/**
+ * @brief Write the media data with direct I/O
+ * The data is staged into two buffers of bufferSize bytes, written with
+ * O_DIRECT once full (see ARMEDIA_DirectWriter.h).
+ * Must be called before the first write.
+ * @param writer the file writer
+ * @param path path of the data file
+ * @param bufferSize size of the staging buffers, multiple of 4 KiB, 0 to disable direct I/O
+ * @return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR if the file system does not support direct I/O
+ */
+eARMEDIA_ERROR ARMEDIA_FileWriter_SetDirectIo (ARMEDIA_FileWriter_t *writer, const char *path, size_t bufferSize);
+
+/**
+ * @brief Allocate the storage of a range of the media data file
+ * The data file size is not changed when the system can allocate beyond the end of
+ * file (fallocate() with FALLOC_FL_KEEP_SIZE, F_PREALLOCATE); otherwise the file is
+ * extended with posix_fallocate() and must be truncated to the data size once written.
+ * Can be called from any thread, the writer thread is not involved.
+ * @param writer the file writer
+ * @param offset start of the range
+ * @param length length of the range in bytes
+ * @return ARMEDIA_ERROR_ENCAPSULER_DISK_FULL if there is not enough space on the storage,
+ * ARMEDIA_ERROR_NOT_IMPLEMENTED if the file system does not support preallocation
+ */
+eARMEDIA_ERROR ARMEDIA_FileWriter_Allocate (ARMEDIA_FileWriter_t *writer, off_t offset, off_t length);
+
+/**
+ * @brief Start a new job (one frame or one sample)
+ * All the writes and syncs until ARMEDIA_FileWriter_CommitJob() belong to the job.
+ * @param writer the file writer
+ * @return ARMEDIA_ERROR_ENCAPSULER_QUEUE_FULL if the queue is full and the overflow policy is to drop
+ */
+eARMEDIA_ERROR ARMEDIA_FileWriter_BeginJob (ARMEDIA_FileWriter_t *writer);
+
+/**
+ * @brief Hand the current job over to the writer thread
+ * @param writer the file writer
+ * @return Possible return values are in eARMEDIA_ERROR
+ */
+eARMEDIA_ERROR ARMEDIA_FileWriter_CommitJob (ARMEDIA_FileWriter_t *writer);
+
+/**
+ * @brief Append data to the media data file
+ * @param writer the file writer
+ * @param data data to write
+ * @param size size of the data in bytes
+ * @return Possible return values are in eARMEDIA_ERROR
+ */
+eARMEDIA_ERROR ARMEDIA_FileWriter_WriteData (ARMEDIA_FileWriter_t *writer, const void *data, size_t size);
+
+/**
+ * @brief Append zeros to the media data file
+ * @param writer the file writer
+ * @param size number of zero bytes to write
+ * @return Possible return values are in eARMEDIA_ERROR
+ */
+eARMEDIA_ERROR ARMEDIA_FileWriter_WriteZeros (ARMEDIA_FileWriter_t *writer, size_t size);
+
+/**
+ * @brief Append a record to the frame infos file
+ * @param writer the file writer
+ * @param data record to write
+ * @param size size of the record in bytes
+ * @return Possible return values are in eARMEDIA_ERROR
+ */
+eARMEDIA_ERROR ARMEDIA_FileWriter_WriteMeta (ARMEDIA_FileWriter_t *writer, const void *data, size_t size);
+
+/**
+ * @brief Flush both files to the storage before the writes of the current job
+ * @param writer the file writer
+ * @return Possible return values are in eARMEDIA_ERROR
+ */
+eARMEDIA_ERROR ARMEDIA_FileWriter_Sync (ARMEDIA_FileWriter_t *writer);
+
+/**
+ * @brief Wait until all the committed jobs are written and the files flushed
+ * After this call, the files can be accessed directly until the next job.
+ * @param writer the file writer
+ * @return The first error met by the writer thread, if any
+ */
+eARMEDIA_ERROR ARMEDIA_FileWriter_Flush (ARMEDIA_FileWriter_t *writer);
+
+/**
+ * @brief Get the queue statistics
+ * @param writer the file writer
+ * @param[out] depth number of jobs waiting to be written (may be NULL)
+ * @param[out] maxDepth highest depth reached (may be NULL)
+ */
+void ARMEDIA_FileWriter_GetQueueDepth (ARMEDIA_FileWriter_t *writer, uint32_t *depth, uint32_t *maxDepth);
+
+#endif /* _ARMEDIA_FILEWRITER_H_ */
@@ -0,0 +1,229 @@
+/*
+    Copyright (C) 2014 Parrot SA
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the
+      distribution.
+    * Neither the name of Parrot nor the names
+      of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written
+      permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+    "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+    LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+    FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+    COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+    BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+    OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+    AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+    OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+    SUCH DAMAGE.
+*/
+/**
+ * @file ARMEDIA_NaluScanner.c
+ * @brief H.264 Annex-B start code scanner.
+ *
+ * The vector versions look for the "00 00 01" pattern 16 or 32 positions at
+ * a time by comparing three loads shifted by one byte, then check the byte
+ * before the match to tell a 4-byte start code from a 3-byte one.
+ */
+
+#include <pthread.h>
+#include "ARMEDIA_NaluScanner.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define NALUSCANNER_X86 (1)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define NALUSCANNER_NEON (1)
+#include <arm_neon.h>
+#endif
+
+typedef int (*ARMEDIA_NaluScanner_Find_t) (const uint8_t *buf, size_t size, uint32_t *startCodeSize);
+
+static ARMEDIA_NaluScanner_Find_t ARMEDIA_NaluScanner_FindFunction = ARMEDIA_NaluScanner_FindScalar;
+static const char *ARMEDIA_NaluScanner_Implementation = "scalar";
+static pthread_once_t ARMEDIA_NaluScanner_Once = PTHREAD_ONCE_INIT;
+
+/* Return the start code at pos (a "00 00 01" match at least 'start') */
+static inline int ARMEDIA_NaluScanner_Found (const uint8_t *buf, size_t pos, uint32_t *startCodeSize)
+{
+    uint32_t len = 3;
+    if ((pos > 0) && (0 == buf[pos - 1]))
+    {
+        pos--;
+        len = 4;
+    }
+    if (NULL != startCodeSize)
+    {
+        *startCodeSize = len;
+    }
+    return (int)pos;
+}
+
+static int ARMEDIA_NaluScanner_FindTail (const uint8_t *buf, size_t size, size_t pos, uint32_t *startCodeSize)
+{
+    while (pos + 3 <= size)
+    {
+        if (buf[pos + 2] > 1)
+        {
+            pos += 3;
+        }
+        else if ((1 == buf[pos + 2]) && (0 == buf[pos + 1]) && (0 == buf[pos]))
+        {
+            return ARMEDIA_NaluScanner_Found (buf, pos, startCodeSize);
+        }
+        else
+        {
+            pos++;
+        }
+    }
+    return -1;
+}
+
+int ARMEDIA_NaluScanner_FindScalar (const uint8_t *buf, size_t size, uint32_t *startCodeSize)
+{
+    return ARMEDIA_NaluScanner_FindTail (buf, size, 0, startCodeSize);
+}
+
+#ifdef NALUSCANNER_X86
+
+__attribute__((target("sse2")))
+static int ARMEDIA_NaluScanner_FindSse2 (const uint8_t *buf, size_t size, uint32_t *startCodeSize)
+{
+    const __m128i zero = _mm_setzero_si128 ();
+    const __m128i one = _mm_set1_epi8 (1);
+    size_t pos = 0;
+
+    while (pos + 16 + 2 <= size)
+    {
+        __m128i b0 = _mm_loadu_si128 ((const __m128i *)(buf + pos));
+        __m128i b1 = _mm_loadu_si128 ((const __m128i *)(buf + pos + 1));
+        __m128i b2 = _mm_loadu_si128 ((const __m128i *)(buf + pos + 2));
+        __m128i match = _mm_and_si128 (_mm_and_si128 (_mm_cmpeq_epi8 (b0, zero), _mm_cmpeq_epi8 (b1, zero)),
+                                       _mm_cmpeq_epi8 (b2, one));
+        int mask = _mm_movemask_epi8 (match);
+        if (0 != mask)
+        {
+            return ARMEDIA_NaluScanner_Found (buf, pos + __builtin_ctz (mask), startCodeSize);
+        }
+        pos += 16;
+    }
+    return ARMEDIA_NaluScanner_FindTail (buf, size, pos, startCodeSize);
+}
+
+__attribute__((target("avx2")))
+static int ARMEDIA_NaluScanner_FindAvx2 (const uint8_t *buf, size_t size, uint32_t *startCodeSize)
+{
+    const __m256i zero = _mm256_setzero_si256 ();
+    const __m256i one = _mm256_set1_epi8 (1);
+    size_t pos = 0;
+
+    while (pos + 32 + 2 <= size)
+    {
+        __m256i b0 = _mm256_loadu_si256 ((const __m256i *)(buf + pos));
+        __m256i b1 = _mm256_loadu_si256 ((const __m256i *)(buf + pos + 1));
+        __m256i b2 = _mm256_loadu_si256 ((const __m256i *)(buf + pos + 2));
+        __m256i match = _mm256_and_si256 (_mm256_and_si256 (_mm256_cmpeq_epi8 (b0, zero), _mm256_cmpeq_epi8 (b1, zero)),
+                                          _mm256_cmpeq_epi8 (b2, one));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8 (match);
+        if (0 != mask)
+        {
+            return ARMEDIA_NaluScanner_Found (buf, pos + __builtin_ctz (mask), startCodeSize);
+        }
+        pos += 32;
+    }
+    return ARMEDIA_NaluScanner_FindTail (buf, size, pos, startCodeSize);
+}
+
+#endif /* NALUSCANNER_X86 */
+
+#ifdef NALUSCANNER_NEON
+
+static int ARMEDIA_NaluScanner_FindNeon (const uint8_t *buf, size_t size, uint32_t *startCodeSize)
+{
+    const uint8x16_t zero = vdupq_n_u8 (0);
+    const uint8x16_t one = vdupq_n_u8 (1);
+    size_t pos = 0;
+
+    while (pos + 16 + 2 <= size)
+    {
+        uint8x16_t b0 = vld1q_u8 (buf + pos);
+        uint8x16_t b1 = vld1q_u8 (buf + pos + 1);
+        uint8x16_t b2 = vld1q_u8 (buf + pos + 2);
+        uint8x16_t match = vandq_u8 (vandq_u8 (vceqq_u8 (b0, zero), vceqq_u8 (b1, zero)), vceqq_u8 (b2, one));
+        uint64x2_t halves = vreinterpretq_u64_u8 (match);
+        if (0 != (vgetq_lane_u64 (halves, 0) | vgetq_lane_u64 (halves, 1)))
+        {
+            // A match was found in these 16 bytes, locate it with the scalar loop
+            return ARMEDIA_NaluScanner_FindTail (buf, pos + 16 + 2, pos, startCodeSize);
+        }
+        pos += 16;
+    }
+    return ARMEDIA_NaluScanner_FindTail (buf, size, pos, startCodeSize);
+}
+
+#endif /* NALUSCANNER_NEON */
+
+static void ARMEDIA_NaluScanner_Select (void)
+{
+#ifdef NALUSCANNER_X86
+    __builtin_cpu_init ();
+    if (__builtin_cpu_supports ("avx2"))
+    {
+        ARMEDIA_NaluScanner_FindFunction = ARMEDIA_NaluScanner_FindAvx2;
+        ARMEDIA_NaluScanner_Implementation = "avx2";
+    }
+    else if (__builtin_cpu_supports ("sse2"))
+    {
+        ARMEDIA_NaluScanner_FindFunction = ARMEDIA_NaluScanner_FindSse2;
+        ARMEDIA_NaluScanner_Implementation = "sse2";
+    }
+#elif defined(NALUSCANNER_NEON)
+    ARMEDIA_NaluScanner_FindFunction = ARMEDIA_NaluScanner_FindNeon;
+    ARMEDIA_NaluScanner_Implementation = "neon";
+#endif
+}
+
+int ARMEDIA_NaluScanner_Find (const uint8_t *buf, size_t size, uint32_t *startCodeSize)
+{
+    pthread_once (&ARMEDIA_NaluScanner_Once, ARMEDIA_NaluScanner_Select);
+    return ARMEDIA_NaluScanner_FindFunction (buf, size, startCodeSize);
+}
+
+uint32_t ARMEDIA_NaluScanner_Split (const uint8_t *buf, size_t size, ARMEDIA_Nalu_t *nalus, uint32_t maxNalus)
+{
+    uint32_t count = 0;
+    uint32_t startCodeSize = 0;
+    int next = ARMEDIA_NaluScanner_Find (buf, size, &startCodeSize);
+
+    while (next >= 0)
+    {
+        size_t start = (size_t)next + startCodeSize;
+        int found = ARMEDIA_NaluScanner_Find (buf + start, size - start, &startCodeSize);
+        size_t end = (found >= 0) ? start + found : size;
+        if (count < maxNalus)
+        {
+            nalus[count].data = buf + start;
+            nalus[count].size = (uint32_t)(end - start);
+        }
+        count++;
+        next = (found >= 0) ? (int)end : -1;
+    }
+    return count;
+}
+
+const char *ARMEDIA_NaluScanner_GetImplementation (void)
+{
+    pthread_once (&ARMEDIA_NaluScanner_Once, ARMEDIA_NaluScanner_Select);
+    return ARMEDIA_NaluScanner_Implementation;
+}
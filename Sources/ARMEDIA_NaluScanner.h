@@ -0,0 +1,85 @@
+/*
+    Copyright (C) 2014 Parrot SA
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the
+      distribution.
+    * Neither the name of Parrot nor the names
+      of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written
+      permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+    "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+    LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+    FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+    COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+    BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+    OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+    AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+    OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+    SUCH DAMAGE.
+*/
+/**
+ * @file ARMEDIA_NaluScanner.h
+ * @brief H.264 Annex-B start code scanner (private).
+ *
+ * Finds the "00 00 01" and "00 00 00 01" start codes of a byte stream.
+ * The search uses SSE2 or AVX2 on x86 (selected at runtime), NEON on ARM,
+ * and a scalar loop elsewhere.
+ */
+#ifndef _ARMEDIA_NALUSCANNER_H_
+#define _ARMEDIA_NALUSCANNER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct
+{
+    const uint8_t *data;    // NALU payload, after the start code
+    uint32_t size;          // size of the NALU payload
+} ARMEDIA_Nalu_t;
+
+/**
+ * @brief Find the next start code of a byte stream
+ * @param buf byte stream
+ * @param size size of the byte stream
+ * @param[out] startCodeSize size of the start code found, 3 or 4 (may be NULL)
+ * @return Offset of the start code, or -1 if there is none
+ */
+int ARMEDIA_NaluScanner_Find (const uint8_t *buf, size_t size, uint32_t *startCodeSize);
+
+/**
+ * @brief Split an Annex-B frame into NAL units in a single pass
+ * The bytes before the first start code are ignored.
+ * If the returned count is greater than maxNalus, only the first maxNalus
+ * NAL units are stored.
+ * @param buf frame in Annex-B format
+ * @param size size of the frame
+ * @param[out] nalus NAL units found
+ * @param maxNalus size of the nalus array
+ * @return Number of NAL units of the frame
+ */
+uint32_t ARMEDIA_NaluScanner_Split (const uint8_t *buf, size_t size, ARMEDIA_Nalu_t *nalus, uint32_t maxNalus);
+
+/**
+ * @brief Find the next start code with the scalar implementation
+ * Same as ARMEDIA_NaluScanner_Find(), for the benchmarks.
+ */
+int ARMEDIA_NaluScanner_FindScalar (const uint8_t *buf, size_t size, uint32_t *startCodeSize);
+
+/**
+ * @brief Get the name of the implementation used by ARMEDIA_NaluScanner_Find()
+ * @return "avx2", "sse2", "neon" or "scalar"
+ */
+const char *ARMEDIA_NaluScanner_GetImplementation (void);
+
+#endif /* _ARMEDIA_NALUSCANNER_H_ */
@@ -0,0 +1,271 @@
+/*
+    Copyright (C) 2014 Parrot SA
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the
+      distribution.
+    * Neither the name of Parrot nor the names
+      of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written
+      permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+    "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+    LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+    FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+    COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+    BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+    OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+    AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+    OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+    SUCH DAMAGE.
+*/
+/**
+ * @file ARMEDIA_SampleTable.c
+ * @brief In-memory sample table of one track.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "ARMEDIA_SampleTable.h"
+
+#define SAMPLETABLE_BLOCK_SIZE  (16 * 1024)
+
+// Biggest encoded entry: 64-bit gap, 32-bit size, 33-bit duration delta + flag
+#define SAMPLETABLE_ENTRY_MAX_SIZE (10 + 5 + 5)
+
+static size_t ARMEDIA_SampleTable_PutVarint (uint8_t *buffer, uint64_t value)
+{
+    size_t len = 0;
+    while (value >= 0x80)
+    {
+        buffer[len++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    buffer[len++] = (uint8_t)value;
+    return len;
+}
+
+static uint64_t ARMEDIA_SampleTable_GetVarint (const uint8_t *buffer, size_t *pos)
+{
+    uint64_t value = 0;
+    int shift = 0;
+    uint8_t byte;
+    do
+    {
+        byte = buffer[(*pos)++];
+        value |= (uint64_t)(byte & 0x7F) << shift;
+        shift += 7;
+    }
+    while (byte & 0x80);
+    return value;
+}
+
+void ARMEDIA_SampleTable_Init (ARMEDIA_SampleTable_t *table)
+{
+    memset (table, 0, sizeof (*table));
+}
+
+void ARMEDIA_SampleTable_Clear (ARMEDIA_SampleTable_t *table)
+{
+    uint32_t i;
+    for (i = 0; i < table->usedBlocks; i++)
+    {
+        free (table->blocks[i]);
+    }
+    free (table->blocks);
+    ARMEDIA_SampleTable_Init (table);
+}
+
+static eARMEDIA_ERROR ARMEDIA_SampleTable_AddBlock (ARMEDIA_SampleTable_t *table)
+{
+    if (table->usedBlocks == table->blockCount)
+    {
+        // Only the block pointers are reallocated, never the entries
+        uint32_t blockCount = (0 == table->blockCount) ? 16 : 2 * table->blockCount;
+        uint8_t **blocks = realloc (table->blocks, blockCount * sizeof (*blocks));
+        if (NULL == blocks)
+        {
+            return ARMEDIA_ERROR_ENCAPSULER;
+        }
+        table->blocks = blocks;
+        table->blockCount = blockCount;
+    }
+    table->blocks[table->usedBlocks] = malloc (SAMPLETABLE_BLOCK_SIZE);
+    if (NULL == table->blocks[table->usedBlocks])
+    {
+        return ARMEDIA_ERROR_ENCAPSULER;
+    }
+    if (0 != table->usedBlocks)
+    {
+        // The end of a full block is copied with its entries by ARMEDIA_SampleTable_CopyDelta()
+        memset (table->blocks[table->usedBlocks - 1] + table->blockUsed, 0, SAMPLETABLE_BLOCK_SIZE - table->blockUsed);
+    }
+    table->usedBlocks++;
+    table->blockUsed = 0;
+    return ARMEDIA_OK;
+}
+
+eARMEDIA_ERROR ARMEDIA_SampleTable_Add (ARMEDIA_SampleTable_t *table, const ARMEDIA_SampleTable_Entry_t *entry)
+{
+    uint8_t *ptr;
+    int64_t durationDelta;
+    uint64_t durationCode;
+
+    if (((0 == table->usedBlocks) || (table->blockUsed + SAMPLETABLE_ENTRY_MAX_SIZE > SAMPLETABLE_BLOCK_SIZE)) &&
+        (ARMEDIA_OK != ARMEDIA_SampleTable_AddBlock (table)))
+    {
+        return ARMEDIA_ERROR_ENCAPSULER;
+    }
+
+    ptr = table->blocks[table->usedBlocks - 1] + table->blockUsed;
+    durationDelta = (int64_t)entry->duration - (int64_t)table->lastDuration;
+    durationCode = ((uint64_t)durationDelta << 1) ^ (uint64_t)(durationDelta >> 63); // zigzag
+    table->blockUsed += ARMEDIA_SampleTable_PutVarint (ptr, entry->offset - table->lastEnd);
+    ptr = table->blocks[table->usedBlocks - 1] + table->blockUsed;
+    table->blockUsed += ARMEDIA_SampleTable_PutVarint (ptr, entry->size);
+    ptr = table->blocks[table->usedBlocks - 1] + table->blockUsed;
+    table->blockUsed += ARMEDIA_SampleTable_PutVarint (ptr, (durationCode << 2) | (entry->flags & ARMEDIA_SAMPLETABLE_FLAGS_MASK));
+
+    table->lastEnd = entry->offset + entry->size;
+    table->lastDuration = entry->duration;
+    table->totalSize += entry->size;
+    table->count++;
+
+    return ARMEDIA_OK;
+}
+
+size_t ARMEDIA_SampleTable_GetMemorySize (const ARMEDIA_SampleTable_t *table)
+{
+    return sizeof (*table) + table->blockCount * sizeof (uint8_t *) + (size_t)table->usedBlocks * SAMPLETABLE_BLOCK_SIZE;
+}
+
+void ARMEDIA_SampleTable_Begin (const ARMEDIA_SampleTable_t *table, ARMEDIA_SampleTable_Iterator_t *iterator)
+{
+    memset (iterator, 0, sizeof (*iterator));
+    iterator->table = table;
+}
+
+int ARMEDIA_SampleTable_Next (ARMEDIA_SampleTable_Iterator_t *iterator, ARMEDIA_SampleTable_Entry_t *entry)
+{
+    const ARMEDIA_SampleTable_t *table = iterator->table;
+    const uint8_t *block;
+    uint64_t durationCode;
+
+    if (iterator->index >= table->count)
+    {
+        return 0;
+    }
+    // Same rule as ARMEDIA_SampleTable_Add() to move to the next block
+    if (iterator->pos + SAMPLETABLE_ENTRY_MAX_SIZE > SAMPLETABLE_BLOCK_SIZE)
+    {
+        iterator->block++;
+        iterator->pos = 0;
+    }
+
+    block = table->blocks[iterator->block];
+    entry->offset = iterator->lastEnd + ARMEDIA_SampleTable_GetVarint (block, &iterator->pos);
+    entry->size = (uint32_t)ARMEDIA_SampleTable_GetVarint (block, &iterator->pos);
+    durationCode = ARMEDIA_SampleTable_GetVarint (block, &iterator->pos);
+    entry->flags = (uint8_t)(durationCode & ARMEDIA_SAMPLETABLE_FLAGS_MASK);
+    durationCode >>= 2;
+    entry->duration = (uint32_t)((int64_t)iterator->lastDuration + ((int64_t)(durationCode >> 1) ^ -(int64_t)(durationCode & 1)));
+
+    iterator->lastEnd = entry->offset + entry->size;
+    iterator->lastDuration = entry->duration;
+    iterator->index++;
+
+    return 1;
+}
+
+void ARMEDIA_SampleTable_GetState (const ARMEDIA_SampleTable_t *table, ARMEDIA_SampleTable_State_t *state)
+{
+    state->count = table->count;
+    state->lastEnd = table->lastEnd;
+    state->lastDuration = table->lastDuration;
+    state->usedBlocks = table->usedBlocks;
+    state->blockUsed = (uint32_t)table->blockUsed;
+    state->totalSize = table->totalSize;
+}
+
+size_t ARMEDIA_SampleTable_GetDeltaSize (const ARMEDIA_SampleTable_State_t *from, const ARMEDIA_SampleTable_State_t *to)
+{
+    if ((to->count < from->count) || (to->usedBlocks < from->usedBlocks) ||
+        ((to->usedBlocks == from->usedBlocks) && (to->blockUsed < from->blockUsed)))
+    {
+        return 0;
+    }
+    if (to->usedBlocks == from->usedBlocks)
+    {
+        return to->blockUsed - from->blockUsed;
+    }
+    // The rest of the last block of the earlier end, the full blocks, then the last block
+    return ((0 != from->usedBlocks) ? SAMPLETABLE_BLOCK_SIZE - from->blockUsed : 0) +
+        (size_t)(to->usedBlocks - from->usedBlocks - 1) * SAMPLETABLE_BLOCK_SIZE + to->blockUsed;
+}
+
+void ARMEDIA_SampleTable_CopyDelta (const ARMEDIA_SampleTable_t *table, const ARMEDIA_SampleTable_State_t *from, uint8_t *buffer)
+{
+    uint32_t block = (0 != from->usedBlocks) ? from->usedBlocks - 1 : 0;
+    size_t pos = (0 != from->usedBlocks) ? from->blockUsed : 0;
+    size_t size;
+
+    for (; block < table->usedBlocks; block++, pos = 0)
+    {
+        size = ((block + 1 == table->usedBlocks) ? table->blockUsed : SAMPLETABLE_BLOCK_SIZE) - pos;
+        memcpy (buffer, table->blocks[block] + pos, size);
+        buffer += size;
+    }
+}
+
+eARMEDIA_ERROR ARMEDIA_SampleTable_AppendDelta (ARMEDIA_SampleTable_t *table, const ARMEDIA_SampleTable_State_t *to, const uint8_t *data)
+{
+    ARMEDIA_SampleTable_State_t from;
+    size_t size;
+
+    ARMEDIA_SampleTable_GetState (table, &from);
+    if ((to->count < from.count) || (to->usedBlocks < from.usedBlocks) || (SAMPLETABLE_BLOCK_SIZE < to->blockUsed) ||
+        ((to->usedBlocks == from.usedBlocks) && (to->blockUsed < from.blockUsed)) ||
+        ((0 == to->usedBlocks) && (0 != to->count)))
+    {
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
+
+    if ((0 == table->usedBlocks) && (0 != to->usedBlocks) && (ARMEDIA_OK != ARMEDIA_SampleTable_AddBlock (table)))
+    {
+        return ARMEDIA_ERROR_ENCAPSULER;
+    }
+    while (table->usedBlocks < to->usedBlocks)
+    {
+        // Fill the current block, then move to the next one
+        size = SAMPLETABLE_BLOCK_SIZE - table->blockUsed;
+        memcpy (table->blocks[table->usedBlocks - 1] + table->blockUsed, data, size);
+        data += size;
+        table->blockUsed = SAMPLETABLE_BLOCK_SIZE;
+        if (ARMEDIA_OK != ARMEDIA_SampleTable_AddBlock (table))
+        {
+            return ARMEDIA_ERROR_ENCAPSULER;
+        }
+    }
+    size = to->blockUsed - table->blockUsed;
+    if (0 != size)
+    {
+        memcpy (table->blocks[table->usedBlocks - 1] + table->blockUsed, data, size);
+        table->blockUsed = to->blockUsed;
+    }
+
+    table->count = to->count;
+    table->lastEnd = to->lastEnd;
+    table->lastDuration = to->lastDuration;
+    table->totalSize = to->totalSize;
+
+    return ARMEDIA_OK;
+}
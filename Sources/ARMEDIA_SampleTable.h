@@ -0,0 +1,177 @@
+/*
+    Copyright (C) 2014 Parrot SA
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the
+      distribution.
+    * Neither the name of Parrot nor the names
+      of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written
+      permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+    "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+    LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+    FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+    COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+    BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+    OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+    AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+    OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+    SUCH DAMAGE.
+*/
+/**
+ * @file ARMEDIA_SampleTable.h
+ * @brief In-memory sample table of one track (private).
+ *
+ * The encapsuler appends one entry per frame, audio chunk or metadata block
+ * while recording, so that the moov atom is built without reading the
+ * frame infos back. Entries are delta-encoded with varints, which takes
+ * about 5 bytes per sample instead of 20 for the expanded tables:
+ *  - the gap between the end of the previous sample of the track and the
+ *    sample offset (usually the size of the other tracks samples in between),
+ *  - the sample size,
+ *  - the difference with the previous duration (zigzag), and the flags.
+ * Entries are stored in fixed-size blocks and are read back sequentially.
+ * The entries added after a given end of the table can be copied encoded, so
+ * that the recording index keeps checkpoints of the tables (see ARMEDIA_Sidecar.h).
+ */
+#ifndef _ARMEDIA_SAMPLETABLE_H_
+#define _ARMEDIA_SAMPLETABLE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <libARMedia/ARMEDIA_Error.h>
+
+#define ARMEDIA_SAMPLETABLE_FLAG_SYNC (1 << 0) // sync sample (I-frame or JPEG)
+#define ARMEDIA_SAMPLETABLE_FLAG_CHUNK_CONTINUE (1 << 1) // same chunk as the previous sample of the track
+#define ARMEDIA_SAMPLETABLE_FLAGS_MASK (ARMEDIA_SAMPLETABLE_FLAG_SYNC | ARMEDIA_SAMPLETABLE_FLAG_CHUNK_CONTINUE)
+
+typedef struct
+{
+    uint64_t offset;    // position in the media file
+    uint32_t size;      // size in bytes
+    uint32_t duration;  // time since the previous sample (usec)
+    uint8_t flags;      // ARMEDIA_SAMPLETABLE_FLAG_*
+} ARMEDIA_SampleTable_Entry_t;
+
+typedef struct
+{
+    uint8_t **blocks;
+    uint32_t blockCount;    // number of allocated block pointers
+    uint32_t usedBlocks;    // number of allocated blocks
+    size_t blockUsed;       // bytes used in the last block
+    uint32_t count;         // number of entries
+    uint64_t lastEnd;       // end of the last entry
+    uint32_t lastDuration;  // duration of the last entry
+    uint64_t totalSize;     // sum of the entry sizes
+} ARMEDIA_SampleTable_t;
+
+typedef struct
+{
+    const ARMEDIA_SampleTable_t *table;
+    uint32_t index;
+    uint32_t block;
+    size_t pos;
+    uint64_t lastEnd;
+    uint32_t lastDuration;
+} ARMEDIA_SampleTable_Iterator_t;
+
+/**
+ * @brief End of a table, to copy the encoded entries appended after it
+ */
+typedef struct
+{
+    uint32_t count;
+    uint64_t lastEnd;
+    uint32_t lastDuration;
+    uint32_t usedBlocks;
+    uint32_t blockUsed;
+    uint64_t totalSize;
+} ARMEDIA_SampleTable_State_t;
+
+/**
+ * @brief Initialize an empty table
+ * @param table the table
+ */
+void ARMEDIA_SampleTable_Init (ARMEDIA_SampleTable_t *table);
+
+/**
+ * @brief Free the memory of a table and empty it
+ * @param table the table
+ */
+void ARMEDIA_SampleTable_Clear (ARMEDIA_SampleTable_t *table);
+
+/**
+ * @brief Append an entry
+ * The offset must not be lower than the end of the previous entry.
+ * @param table the table
+ * @param entry entry to append
+ * @return ARMEDIA_ERROR_ENCAPSULER if the memory is exhausted
+ */
+eARMEDIA_ERROR ARMEDIA_SampleTable_Add (ARMEDIA_SampleTable_t *table, const ARMEDIA_SampleTable_Entry_t *entry);
+
+/**
+ * @brief Get the memory used by a table
+ * @param table the table
+ * @return Size in bytes
+ */
+size_t ARMEDIA_SampleTable_GetMemorySize (const ARMEDIA_SampleTable_t *table);
+
+/**
+ * @brief Start reading the entries of a table
+ * @param table the table (must not be modified while it is read)
+ * @param[out] iterator iterator on the first entry
+ */
+void ARMEDIA_SampleTable_Begin (const ARMEDIA_SampleTable_t *table, ARMEDIA_SampleTable_Iterator_t *iterator);
+
+/**
+ * @brief Read the next entry
+ * @param iterator iterator initialized by ARMEDIA_SampleTable_Begin()
+ * @param[out] entry next entry
+ * @return 1 if an entry was read, 0 at the end of the table
+ */
+int ARMEDIA_SampleTable_Next (ARMEDIA_SampleTable_Iterator_t *iterator, ARMEDIA_SampleTable_Entry_t *entry);
+
+/**
+ * @brief Get the end of a table
+ * @param table the table
+ * @param[out] state current end of the table
+ */
+void ARMEDIA_SampleTable_GetState (const ARMEDIA_SampleTable_t *table, ARMEDIA_SampleTable_State_t *state);
+
+/**
+ * @brief Get the size of the encoded entries between two ends of a table
+ * @param from earlier end of the table
+ * @param to later end of the table
+ * @return Size in bytes, 0 if the ends are not in order
+ */
+size_t ARMEDIA_SampleTable_GetDeltaSize (const ARMEDIA_SampleTable_State_t *from, const ARMEDIA_SampleTable_State_t *to);
+
+/**
+ * @brief Copy the encoded entries appended after an earlier end of a table
+ * @param table the table
+ * @param from earlier end of the table
+ * @param[out] buffer output buffer of ARMEDIA_SampleTable_GetDeltaSize() bytes up to the current end
+ */
+void ARMEDIA_SampleTable_CopyDelta (const ARMEDIA_SampleTable_t *table, const ARMEDIA_SampleTable_State_t *from, uint8_t *buffer);
+
+/**
+ * @brief Append encoded entries copied by ARMEDIA_SampleTable_CopyDelta()
+ * The entries are not decoded: the table must end where the copy started.
+ * @param table the table
+ * @param to end of the table after the entries
+ * @param data encoded entries, of ARMEDIA_SampleTable_GetDeltaSize() bytes from the current end
+ * @return ARMEDIA_ERROR_BAD_PARAMETER if the ends do not follow, ARMEDIA_ERROR_ENCAPSULER if the memory is exhausted
+ */
+eARMEDIA_ERROR ARMEDIA_SampleTable_AppendDelta (ARMEDIA_SampleTable_t *table, const ARMEDIA_SampleTable_State_t *to, const uint8_t *data);
+
+#endif /* _ARMEDIA_SAMPLETABLE_H_ */
@@ -0,0 +1,341 @@
+/*
+    Copyright (C) 2014 Parrot SA
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the
+      distribution.
+    * Neither the name of Parrot nor the names
+      of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written
+      permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+    "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+    LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+    FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+    COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+    BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+    OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+    AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+    OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+    SUCH DAMAGE.
+*/
+/**
+ * @file ARMEDIA_Sidecar.c
+ * @brief Binary format of the -encaps.dat recording index.
+ */
+
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+#endif
+
+#include <unistd.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <libARSAL/ARSAL_Print.h>
+#include "ARMEDIA_Sidecar.h"
+
+#define ARMEDIA_SIDECAR_TAG "ARMEDIA Sidecar"
+
+#define SIDECAR_ERROR(...)                                              \
+    do {                                                                \
+        ARSAL_PRINT (ARSAL_PRINT_ERROR, ARMEDIA_SIDECAR_TAG, "error: " __VA_ARGS__); \
+    } while (0)
+
+// Bytes of a record covered by its CRC
+#define SIDECAR_RECORD_CRC_OFFSET (12)
+
+// CRC following the payload of a checkpoint
+#define SIDECAR_CHECKPOINT_CRC_SIZE (4)
+
+static void ARMEDIA_Sidecar_PutLe (uint8_t *buffer, uint64_t value, int size)
+{
+    int i;
+    for (i = 0; i < size; i++)
+    {
+        buffer[i] = (uint8_t)(value >> (8 * i));
+    }
+}
+
+static uint64_t ARMEDIA_Sidecar_GetLe (const uint8_t *buffer, int size)
+{
+    uint64_t value = 0;
+    int i;
+    for (i = size - 1; i >= 0; i--)
+    {
+        value = (value << 8) | buffer[i];
+    }
+    return value;
+}
+
+static uint32_t ARMEDIA_Sidecar_Crc32 (const uint8_t *data, size_t size)
+{
+    uint32_t crc = 0xFFFFFFFF;
+    size_t i;
+    int bit;
+    for (i = 0; i < size; i++)
+    {
+        crc ^= data[i];
+        for (bit = 0; bit < 8; bit++)
+        {
+            crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+        }
+    }
+    return ~crc;
+}
+
+static uint8_t *ARMEDIA_Sidecar_Reserve (ARMEDIA_Sidecar_Stream_t *stream, size_t size)
+{
+    uint8_t *ptr = NULL;
+    if (stream->error)
+    {
+        return NULL;
+    }
+    if (NULL != stream->buffer)
+    {
+        if (stream->pos + size > stream->size)
+        {
+            stream->error = 1;
+            return NULL;
+        }
+        ptr = stream->buffer + stream->pos;
+    }
+    stream->pos += size;
+    return ptr;
+}
+
+static void ARMEDIA_Sidecar_Integer (ARMEDIA_Sidecar_Stream_t *stream, uint64_t *value, int size)
+{
+    uint8_t *ptr = ARMEDIA_Sidecar_Reserve (stream, size);
+    if (NULL == ptr)
+    {
+        return;
+    }
+    if (stream->reading)
+    {
+        *value = ARMEDIA_Sidecar_GetLe (ptr, size);
+    }
+    else
+    {
+        ARMEDIA_Sidecar_PutLe (ptr, *value, size);
+    }
+}
+
+void ARMEDIA_Sidecar_U8 (ARMEDIA_Sidecar_Stream_t *stream, uint8_t *value)
+{
+    uint64_t tmp = *value;
+    ARMEDIA_Sidecar_Integer (stream, &tmp, 1);
+    *value = (uint8_t)tmp;
+}
+
+void ARMEDIA_Sidecar_U16 (ARMEDIA_Sidecar_Stream_t *stream, uint16_t *value)
+{
+    uint64_t tmp = *value;
+    ARMEDIA_Sidecar_Integer (stream, &tmp, 2);
+    *value = (uint16_t)tmp;
+}
+
+void ARMEDIA_Sidecar_U32 (ARMEDIA_Sidecar_Stream_t *stream, uint32_t *value)
+{
+    uint64_t tmp = *value;
+    ARMEDIA_Sidecar_Integer (stream, &tmp, 4);
+    *value = (uint32_t)tmp;
+}
+
+void ARMEDIA_Sidecar_U64 (ARMEDIA_Sidecar_Stream_t *stream, uint64_t *value)
+{
+    ARMEDIA_Sidecar_Integer (stream, value, 8);
+}
+
+void ARMEDIA_Sidecar_Double (ARMEDIA_Sidecar_Stream_t *stream, double *value)
+{
+    uint64_t tmp;
+    memcpy (&tmp, value, sizeof (tmp));
+    ARMEDIA_Sidecar_Integer (stream, &tmp, 8);
+    memcpy (value, &tmp, sizeof (tmp));
+}
+
+void ARMEDIA_Sidecar_Float (ARMEDIA_Sidecar_Stream_t *stream, float *value)
+{
+    uint32_t tmp;
+    memcpy (&tmp, value, sizeof (tmp));
+    ARMEDIA_Sidecar_U32 (stream, &tmp);
+    memcpy (value, &tmp, sizeof (tmp));
+}
+
+void ARMEDIA_Sidecar_Bytes (ARMEDIA_Sidecar_Stream_t *stream, void *data, size_t size)
+{
+    uint8_t *ptr = ARMEDIA_Sidecar_Reserve (stream, size);
+    if (NULL == ptr)
+    {
+        return;
+    }
+    if (stream->reading)
+    {
+        memcpy (data, ptr, size);
+    }
+    else
+    {
+        memcpy (ptr, data, size);
+    }
+}
+
+void ARMEDIA_Sidecar_EncodePrefix (uint8_t *buffer, const ARMEDIA_Sidecar_Prefix_t *prefix)
+{
+    memcpy (buffer, ARMEDIA_SIDECAR_MAGIC, 4);
+    ARMEDIA_Sidecar_PutLe (buffer + 4, prefix->version, 2);
+    ARMEDIA_Sidecar_PutLe (buffer + 6, prefix->flags, 2);
+    ARMEDIA_Sidecar_PutLe (buffer + 8, prefix->headerSize, 4);
+    ARMEDIA_Sidecar_PutLe (buffer + 12, prefix->recordSize, 4);
+}
+
+int ARMEDIA_Sidecar_DecodePrefix (const uint8_t *buffer, ARMEDIA_Sidecar_Prefix_t *prefix)
+{
+    if (0 != memcmp (buffer, ARMEDIA_SIDECAR_MAGIC, 4))
+    {
+        return 0;
+    }
+    prefix->version = (uint16_t)ARMEDIA_Sidecar_GetLe (buffer + 4, 2);
+    prefix->flags = (uint16_t)ARMEDIA_Sidecar_GetLe (buffer + 6, 2);
+    prefix->headerSize = (uint32_t)ARMEDIA_Sidecar_GetLe (buffer + 8, 4);
+    prefix->recordSize = (uint32_t)ARMEDIA_Sidecar_GetLe (buffer + 12, 4);
+    return 1;
+}
+
+void ARMEDIA_Sidecar_EncodeRecord (uint8_t *buffer, const ARMEDIA_Sidecar_Record_t *record, int withCrc)
+{
+    buffer[0] = (uint8_t)record->type;
+    buffer[1] = record->flags;
+    buffer[2] = 0;
+    buffer[3] = 0;
+    ARMEDIA_Sidecar_PutLe (buffer + 4, record->size, 4);
+    ARMEDIA_Sidecar_PutLe (buffer + 8, record->duration, 4);
+    ARMEDIA_Sidecar_PutLe (buffer + SIDECAR_RECORD_CRC_OFFSET,
+                           withCrc ? ARMEDIA_Sidecar_Crc32 (buffer, SIDECAR_RECORD_CRC_OFFSET) : 0, 4);
+}
+
+int ARMEDIA_Sidecar_DecodeRecord (const uint8_t *buffer, ARMEDIA_Sidecar_Record_t *record, int checkCrc)
+{
+    if (checkCrc &&
+        ARMEDIA_Sidecar_GetLe (buffer + SIDECAR_RECORD_CRC_OFFSET, 4) != ARMEDIA_Sidecar_Crc32 (buffer, SIDECAR_RECORD_CRC_OFFSET))
+    {
+        return 0;
+    }
+    record->type = (char)buffer[0];
+    record->flags = buffer[1];
+    record->size = (uint32_t)ARMEDIA_Sidecar_GetLe (buffer + 4, 4);
+    record->duration = (uint32_t)ARMEDIA_Sidecar_GetLe (buffer + 8, 4);
+    return 1;
+}
+
+uint32_t ARMEDIA_Sidecar_GetCheckpointRecords (uint32_t payloadSize)
+{
+    return 1 + (uint32_t)(((uint64_t)payloadSize + SIDECAR_CHECKPOINT_CRC_SIZE + ARMEDIA_SIDECAR_RECORD_SIZE - 1) / ARMEDIA_SIDECAR_RECORD_SIZE);
+}
+
+void ARMEDIA_Sidecar_EncodeCheckpoint (uint8_t *buffer, uint32_t payloadSize, uint32_t previous)
+{
+    ARMEDIA_Sidecar_Record_t record;
+    uint8_t *payload = buffer + ARMEDIA_SIDECAR_RECORD_SIZE;
+    size_t end = (size_t)(ARMEDIA_Sidecar_GetCheckpointRecords (payloadSize) - 1) * ARMEDIA_SIDECAR_RECORD_SIZE;
+
+    record.type = ARMEDIA_SIDECAR_CHECKPOINT_TAG;
+    record.flags = 0;
+    record.size = payloadSize;
+    record.duration = previous;
+    ARMEDIA_Sidecar_EncodeRecord (buffer, &record, 1);
+    ARMEDIA_Sidecar_PutLe (payload + payloadSize, ARMEDIA_Sidecar_Crc32 (payload, payloadSize), SIDECAR_CHECKPOINT_CRC_SIZE);
+    memset (payload + payloadSize + SIDECAR_CHECKPOINT_CRC_SIZE, 0, end - payloadSize - SIDECAR_CHECKPOINT_CRC_SIZE);
+}
+
+uint32_t ARMEDIA_Sidecar_DecodeCheckpoint (const uint8_t *buffer, uint32_t count, const uint8_t **payload, uint32_t *payloadSize, uint32_t *previous)
+{
+    ARMEDIA_Sidecar_Record_t record;
+    uint32_t records;
+
+    if ((0 == count) || (ARMEDIA_SIDECAR_CHECKPOINT_TAG != (char)buffer[0]) || !ARMEDIA_Sidecar_DecodeRecord (buffer, &record, 1))
+    {
+        return 0;
+    }
+    // A torn checkpoint is shorter than announced, or fails the payload CRC
+    records = ARMEDIA_Sidecar_GetCheckpointRecords (record.size);
+    if ((records > count) ||
+        (ARMEDIA_Sidecar_GetLe (buffer + ARMEDIA_SIDECAR_RECORD_SIZE + record.size, SIDECAR_CHECKPOINT_CRC_SIZE) !=
+         ARMEDIA_Sidecar_Crc32 (buffer + ARMEDIA_SIDECAR_RECORD_SIZE, record.size)))
+    {
+        return 0;
+    }
+    *payload = buffer + ARMEDIA_SIDECAR_RECORD_SIZE;
+    *payloadSize = record.size;
+    *previous = record.duration;
+    return records;
+}
+
+eARMEDIA_ERROR ARMEDIA_Sidecar_Map (FILE *file, uint32_t headerSize, ARMEDIA_Sidecar_Map_t *map)
+{
+    struct stat st;
+
+    memset (map, 0, sizeof (*map));
+    if (0 != fstat (fileno (file), &st))
+    {
+        SIDECAR_ERROR ("Unable to get the sidecar size");
+        return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+    }
+    if (st.st_size < (off_t)headerSize + ARMEDIA_SIDECAR_RECORD_SIZE)
+    {
+        return ARMEDIA_OK;
+    }
+
+    map->length = (size_t)st.st_size;
+    map->base = mmap (NULL, map->length, PROT_READ, MAP_SHARED, fileno (file), 0);
+    if (MAP_FAILED == map->base)
+    {
+        SIDECAR_ERROR ("Unable to map the sidecar (%zu bytes)", map->length);
+        map->base = NULL;
+        map->length = 0;
+        return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+    }
+#if defined(MADV_SEQUENTIAL)
+    madvise (map->base, map->length, MADV_SEQUENTIAL);
+#endif
+    map->records = (const uint8_t *)map->base + headerSize;
+    map->count = (uint32_t)((map->length - headerSize) / ARMEDIA_SIDECAR_RECORD_SIZE);
+
+    return ARMEDIA_OK;
+}
+
+void ARMEDIA_Sidecar_Unmap (ARMEDIA_Sidecar_Map_t *map)
+{
+    if (NULL != map->base)
+    {
+        munmap (map->base, map->length);
+    }
+    memset (map, 0, sizeof (*map));
+}
+
+int ARMEDIA_Sidecar_FindLastCheckpoint (const ARMEDIA_Sidecar_Map_t *map, uint32_t *index)
+{
+    const uint8_t *payload;
+    uint32_t payloadSize, previous;
+    uint32_t i;
+
+    for (i = map->count; i > 0; i--)
+    {
+        if (0 != ARMEDIA_Sidecar_DecodeCheckpoint (map->records + (size_t)(i - 1) * ARMEDIA_SIDECAR_RECORD_SIZE, map->count - (i - 1),
+                                                   &payload, &payloadSize, &previous))
+        {
+            *index = i - 1;
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,214 @@
+/*
+    Copyright (C) 2014 Parrot SA
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the
+      distribution.
+    * Neither the name of Parrot nor the names
+      of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written
+      permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+    "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+    LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+    FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+    COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+    BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+    OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+    AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+    OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+    SUCH DAMAGE.
+*/
+/**
+ * @file ARMEDIA_Sidecar.h
+ * @brief Binary format of the -encaps.dat recording index (private).
+ *
+ * The file starts with a header:
+ *  - a fixed prefix (magic, format version, flags, header and record sizes),
+ *  - the audio descriptor, at a fixed offset so that it can be rewritten
+ *    in place when the first audio sample is received,
+ *  - the encapsuler descriptor (variable size).
+ * It is followed by packed fixed-size records, one per frame, sample or
+ * metadata block, so that it can be read back with a linear scan.
+ * With ARMEDIA_SIDECAR_FLAG_CHECKPOINTS, the records are regularly followed by
+ * a checkpoint of the sample tables, so that a recovery only replays the
+ * records after the last checkpoint. A checkpoint takes whole records:
+ *  - a record of type ARMEDIA_SIDECAR_CHECKPOINT_TAG, always with its CRC,
+ *    whose size is the size of the payload and whose duration is the number
+ *    of records since the previous checkpoint (0 for the first one),
+ *  - the payload and its CRC, padded with zeros to a record boundary.
+ * All the values are stored in little endian.
+ */
+#ifndef _ARMEDIA_SIDECAR_H_
+#define _ARMEDIA_SIDECAR_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <libARMedia/ARMEDIA_Error.h>
+
+#define ARMEDIA_SIDECAR_MAGIC           "ARMS"
+#define ARMEDIA_SIDECAR_PREFIX_SIZE     (16)
+#define ARMEDIA_SIDECAR_AUDIO_OFFSET    ARMEDIA_SIDECAR_PREFIX_SIZE
+#define ARMEDIA_SIDECAR_AUDIO_SIZE      (16)
+#define ARMEDIA_SIDECAR_RECORD_SIZE     (16)
+
+#define ARMEDIA_SIDECAR_FLAG_RECORD_CRC (1 << 0) // records carry a CRC of their content
+#define ARMEDIA_SIDECAR_FLAG_CHECKPOINTS (1 << 1) // records include checkpoints of the sample tables
+
+#define ARMEDIA_SIDECAR_CHECKPOINT_TAG 'k'
+
+#define ARMEDIA_SIDECAR_RECORD_FLAG_SYNC (1 << 0) // sync sample (I-frame or JPEG)
+#define ARMEDIA_SIDECAR_RECORD_FLAG_CHUNK_CONTINUE (1 << 1) // same chunk as the previous record of the same type
+
+/**
+ * @brief Header prefix
+ */
+typedef struct
+{
+    uint16_t version;       // ARMEDIA_ENCAPSULER_VERSION_NUMBER of the writer
+    uint16_t flags;         // ARMEDIA_SIDECAR_FLAG_*
+    uint32_t headerSize;    // offset of the first record
+    uint32_t recordSize;    // size of one record
+} ARMEDIA_Sidecar_Prefix_t;
+
+/**
+ * @brief One frame, sample or metadata block of the media data file
+ */
+typedef struct
+{
+    char type;              // ARMEDIA_ENCAPSULER_*_INFO_TAG
+    uint8_t flags;          // ARMEDIA_SIDECAR_RECORD_FLAG_*
+    uint32_t size;          // size in the media data file
+    uint32_t duration;      // time since the previous record of the same type (usec)
+} ARMEDIA_Sidecar_Record_t;
+
+/**
+ * @brief Serialization stream
+ * The same function can describe a structure for both reading and writing:
+ * each ARMEDIA_Sidecar_Xxx() call below writes the value to the buffer or reads
+ * it from the buffer depending on the stream direction. With a NULL buffer,
+ * a writing stream only counts the bytes.
+ */
+typedef struct
+{
+    uint8_t *buffer;
+    size_t size;
+    size_t pos;
+    int reading;
+    int error;              // set when the buffer is too small
+} ARMEDIA_Sidecar_Stream_t;
+
+void ARMEDIA_Sidecar_U8 (ARMEDIA_Sidecar_Stream_t *stream, uint8_t *value);
+void ARMEDIA_Sidecar_U16 (ARMEDIA_Sidecar_Stream_t *stream, uint16_t *value);
+void ARMEDIA_Sidecar_U32 (ARMEDIA_Sidecar_Stream_t *stream, uint32_t *value);
+void ARMEDIA_Sidecar_U64 (ARMEDIA_Sidecar_Stream_t *stream, uint64_t *value);
+void ARMEDIA_Sidecar_Double (ARMEDIA_Sidecar_Stream_t *stream, double *value);
+void ARMEDIA_Sidecar_Float (ARMEDIA_Sidecar_Stream_t *stream, float *value);
+void ARMEDIA_Sidecar_Bytes (ARMEDIA_Sidecar_Stream_t *stream, void *data, size_t size);
+
+/**
+ * @brief Encode the header prefix
+ * @param buffer output buffer of ARMEDIA_SIDECAR_PREFIX_SIZE bytes
+ * @param prefix header prefix
+ */
+void ARMEDIA_Sidecar_EncodePrefix (uint8_t *buffer, const ARMEDIA_Sidecar_Prefix_t *prefix);
+
+/**
+ * @brief Decode the header prefix
+ * @param buffer input buffer of ARMEDIA_SIDECAR_PREFIX_SIZE bytes
+ * @param[out] prefix header prefix
+ * @return 1 if the buffer starts with the binary sidecar magic, 0 otherwise
+ */
+int ARMEDIA_Sidecar_DecodePrefix (const uint8_t *buffer, ARMEDIA_Sidecar_Prefix_t *prefix);
+
+/**
+ * @brief Encode a record
+ * @param buffer output buffer of ARMEDIA_SIDECAR_RECORD_SIZE bytes
+ * @param record record to encode
+ * @param withCrc add the CRC of the record
+ */
+void ARMEDIA_Sidecar_EncodeRecord (uint8_t *buffer, const ARMEDIA_Sidecar_Record_t *record, int withCrc);
+
+/**
+ * @brief Decode a record
+ * @param buffer input buffer of ARMEDIA_SIDECAR_RECORD_SIZE bytes
+ * @param[out] record decoded record
+ * @param checkCrc check the CRC of the record
+ * @return 1 if the record is valid, 0 if it is corrupted (torn write)
+ */
+int ARMEDIA_Sidecar_DecodeRecord (const uint8_t *buffer, ARMEDIA_Sidecar_Record_t *record, int checkCrc);
+
+/**
+ * @brief Get the number of records taken by a checkpoint
+ * @param payloadSize size of the checkpoint payload
+ * @return Number of records, including the checkpoint record
+ */
+uint32_t ARMEDIA_Sidecar_GetCheckpointRecords (uint32_t payloadSize);
+
+/**
+ * @brief Encode a checkpoint around its payload
+ * @param buffer buffer of ARMEDIA_Sidecar_GetCheckpointRecords() records, holding the payload from its second record
+ * @param payloadSize size of the payload
+ * @param previous number of records since the previous checkpoint, 0 if none
+ */
+void ARMEDIA_Sidecar_EncodeCheckpoint (uint8_t *buffer, uint32_t payloadSize, uint32_t previous);
+
+/**
+ * @brief Decode a checkpoint
+ * @param buffer first record of the checkpoint
+ * @param count number of records available from buffer
+ * @param[out] payload payload of the checkpoint
+ * @param[out] payloadSize size of the payload
+ * @param[out] previous number of records since the previous checkpoint, 0 if none
+ * @return Number of records of the checkpoint, 0 if buffer is not a complete and valid checkpoint
+ */
+uint32_t ARMEDIA_Sidecar_DecodeCheckpoint (const uint8_t *buffer, uint32_t count, const uint8_t **payload, uint32_t *payloadSize, uint32_t *previous);
+
+/**
+ * @brief Read-only mapping of the records of a sidecar file
+ */
+typedef struct
+{
+    void *base;
+    size_t length;
+    const uint8_t *records; // first record
+    uint32_t count;         // number of complete records
+} ARMEDIA_Sidecar_Map_t;
+
+/**
+ * @brief Map the records of a sidecar file
+ * Pending stdio writes must be flushed before.
+ * @param file sidecar file
+ * @param headerSize offset of the first record
+ * @param[out] map mapping (count is 0 and nothing is mapped if the file has no record)
+ * @return Possible return values are in eARMEDIA_ERROR
+ */
+eARMEDIA_ERROR ARMEDIA_Sidecar_Map (FILE *file, uint32_t headerSize, ARMEDIA_Sidecar_Map_t *map);
+
+/**
+ * @brief Unmap the records of a sidecar file
+ * @param map mapping created by ARMEDIA_Sidecar_Map()
+ */
+void ARMEDIA_Sidecar_Unmap (ARMEDIA_Sidecar_Map_t *map);
+
+/**
+ * @brief Find the last valid checkpoint of a sidecar file
+ * The records are scanned backward from the end, so the cost only depends on
+ * the records written after the checkpoint.
+ * @param map mapping created by ARMEDIA_Sidecar_Map()
+ * @param[out] index index of the checkpoint record
+ * @return 1 if a checkpoint is found, 0 otherwise
+ */
+int ARMEDIA_Sidecar_FindLastCheckpoint (const ARMEDIA_Sidecar_Map_t *map, uint32_t *index);
+
+#endif /* _ARMEDIA_SIDECAR_H_ */
@@ -0,0 +1,150 @@
+/*
+    Copyright (C) 2014 Parrot SA
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the
+      distribution.
+    * Neither the name of Parrot nor the names
+      of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written
+      permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+    "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+    LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+    FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+    COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+    BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+    OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+    AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+    OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+    SUCH DAMAGE.
+*/
+/**
+ * @file ARMEDIA_TaskPool.c
+ * @brief Run independent tasks on a few threads.
+ */
+
+#include <unistd.h>
+#include <libARSAL/ARSAL_Mutex.h>
+#include <libARSAL/ARSAL_Thread.h>
+#include "ARMEDIA_TaskPool.h"
+
+typedef struct
+{
+    ARMEDIA_TaskPool_Function_t function;
+    uint8_t *contexts;
+    size_t contextSize;
+    uint32_t count;
+    uint32_t next; // next task to run
+    ARSAL_Mutex_t mutex;
+} ARMEDIA_TaskPool_Batch_t;
+
+uint32_t ARMEDIA_TaskPool_GetDefaultThreadCount (void)
+{
+    long count = sysconf (_SC_NPROCESSORS_ONLN);
+
+    if (1 > count)
+    {
+        return 1;
+    }
+    return (ARMEDIA_TASKPOOL_DEFAULT_MAX_THREADS < count) ? ARMEDIA_TASKPOOL_DEFAULT_MAX_THREADS : (uint32_t)count;
+}
+
+static void *ARMEDIA_TaskPool_ThreadRun (void *arg)
+{
+    ARMEDIA_TaskPool_Batch_t *batch = (ARMEDIA_TaskPool_Batch_t *)arg;
+    uint32_t index;
+
+    for (;;)
+    {
+        ARSAL_Mutex_Lock (&batch->mutex);
+        index = batch->next;
+        if (index < batch->count)
+        {
+            batch->next++;
+        }
+        ARSAL_Mutex_Unlock (&batch->mutex);
+        if (index >= batch->count)
+        {
+            break;
+        }
+        batch->function (batch->contexts + (size_t)index * batch->contextSize);
+    }
+    return NULL;
+}
+
+eARMEDIA_ERROR ARMEDIA_TaskPool_Run (ARMEDIA_TaskPool_Function_t function, void *contexts, size_t contextSize, uint32_t count, uint32_t threadCount)
+{
+    ARMEDIA_TaskPool_Batch_t batch;
+    ARSAL_Thread_t threads[ARMEDIA_TASKPOOL_MAX_THREADS - 1];
+    uint32_t started = 0;
+    uint32_t i;
+
+    if ((NULL == function) || ((NULL == contexts) && (0 != count)))
+    {
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
+    if (0 == threadCount)
+    {
+        threadCount = ARMEDIA_TaskPool_GetDefaultThreadCount ();
+    }
+    if (ARMEDIA_TASKPOOL_MAX_THREADS < threadCount)
+    {
+        threadCount = ARMEDIA_TASKPOOL_MAX_THREADS;
+    }
+    if (count < threadCount)
+    {
+        threadCount = count;
+    }
+
+    batch.function = function;
+    batch.contexts = (uint8_t *)contexts;
+    batch.contextSize = contextSize;
+    batch.count = count;
+    batch.next = 0;
+    if ((1 < threadCount) && (0 != ARSAL_Mutex_Init (&batch.mutex)))
+    {
+        threadCount = 1;
+    }
+    for (i = 1; i < threadCount; i++)
+    {
+        if (0 != ARSAL_Thread_Create (&threads[started], ARMEDIA_TaskPool_ThreadRun, &batch))
+        {
+            break;
+        }
+        started++;
+    }
+
+    if (0 == started)
+    {
+        // Serial run, without locking
+        for (i = 0; i < count; i++)
+        {
+            function (batch.contexts + (size_t)i * contextSize);
+        }
+    }
+    else
+    {
+        ARMEDIA_TaskPool_ThreadRun (&batch);
+    }
+
+    for (i = 0; i < started; i++)
+    {
+        ARSAL_Thread_Join (threads[i], NULL);
+        ARSAL_Thread_Destroy (&threads[i]);
+    }
+    if (1 < threadCount)
+    {
+        ARSAL_Mutex_Destroy (&batch.mutex);
+    }
+    return ARMEDIA_OK;
+}
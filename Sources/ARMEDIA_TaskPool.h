@@ -0,0 +1,75 @@
+/*
+    Copyright (C) 2014 Parrot SA
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the
+      distribution.
+    * Neither the name of Parrot nor the names
+      of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written
+      permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+    "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+    LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+    FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+    COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+    BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+    OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+    AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+    OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+    SUCH DAMAGE.
+*/
+/**
+ * @file ARMEDIA_TaskPool.h
+ * @brief Run independent tasks on a few threads (private).
+ *
+ * The threads are created for one batch of tasks and joined before
+ * ARMEDIA_TaskPool_Run() returns: the pool only exists while the batch is
+ * running. The calling thread runs tasks too, so a batch run with one
+ * thread does not create any.
+ */
+#ifndef _ARMEDIA_TASKPOOL_H_
+#define _ARMEDIA_TASKPOOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <libARMedia/ARMEDIA_Error.h>
+
+#define ARMEDIA_TASKPOOL_MAX_THREADS (16)
+#define ARMEDIA_TASKPOOL_DEFAULT_MAX_THREADS (4)
+
+/**
+ * @brief Run one task
+ * @param context context of the task
+ */
+typedef void (*ARMEDIA_TaskPool_Function_t) (void *context);
+
+/**
+ * @brief Get the number of threads used when none is requested
+ * @return Number of online processors, at most ARMEDIA_TASKPOOL_DEFAULT_MAX_THREADS
+ */
+uint32_t ARMEDIA_TaskPool_GetDefaultThreadCount (void);
+
+/**
+ * @brief Run a batch of tasks and wait for their end
+ * The tasks are started in the order of the contexts. If a thread can not
+ * be created, the tasks are run by the threads already running.
+ * @param function function run for each task
+ * @param contexts array of task contexts
+ * @param contextSize size of one context in bytes
+ * @param count number of tasks
+ * @param threadCount maximum number of threads, the calling thread included (0 for the default)
+ * @return ARMEDIA_OK, or ARMEDIA_ERROR_BAD_PARAMETER
+ */
+eARMEDIA_ERROR ARMEDIA_TaskPool_Run (ARMEDIA_TaskPool_Function_t function, void *contexts, size_t contextSize, uint32_t count, uint32_t threadCount);
+
+#endif /* _ARMEDIA_TASKPOOL_H_ */
@@ -0,0 +1,565 @@
+/*
+    Copyright (C) 2014 Parrot SA
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the
+      distribution.
+    * Neither the name of Parrot nor the names
+      of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written
+      permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+    "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+    LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+    FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+    COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+    BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+    OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+    AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+    OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+    SUCH DAMAGE.
+*/
+/**
+ * @file ARMEDIA_TsMuxer.c
+ * @brief MPEG-2 transport stream packetizer of the media data.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <libARSAL/ARSAL_Print.h>
+#include "ARMEDIA_TsMuxer.h"
+
+#define ARMEDIA_TSMUXER_TAG "ARMEDIA TsMuxer"
+
+#define TSMUXER_ERROR(...)                                              \
+    do {                                                                \
+        ARSAL_PRINT (ARSAL_PRINT_ERROR, ARMEDIA_TSMUXER_TAG, "error: " __VA_ARGS__); \
+    } while (0)
+
+#define TSMUXER_SYNC_BYTE           (0x47)
+#define TSMUXER_PAYLOAD_SIZE        (ARMEDIA_TSMUXER_PACKET_SIZE - 4)
+#define TSMUXER_PAT_PID             (0x0000)
+#define TSMUXER_PMT_PID             (0x1000)
+#define TSMUXER_PROGRAM_NUMBER      (1)
+#define TSMUXER_TRANSPORT_STREAM_ID (1)
+
+// The decoder gets this much of the stream ahead of the presentation time of a frame
+#define TSMUXER_PTS_DELAY           (ARMEDIA_TSMUXER_CLOCK_RATE * 7 / 10)
+#define TSMUXER_TIMESTAMP_MASK      ((1ULL << 33) - 1)
+
+#define TSMUXER_PES_HEADER_SIZE     (14) // with a PTS
+// Largest payload of a bounded PES packet (the length field counts the bytes after it)
+#define TSMUXER_PES_MAX_PAYLOAD     (UINT16_MAX - (TSMUXER_PES_HEADER_SIZE - 6))
+#define TSMUXER_PCR_FIELD_SIZE      (8) // adaptation field with the flags and the PCR
+
+#define TSMUXER_AF_RANDOM_ACCESS    (0x40)
+#define TSMUXER_AF_PCR              (0x10)
+
+typedef struct
+{
+    uint16_t pid;
+    uint8_t streamId;
+    uint8_t streamType;
+    uint8_t continuityCounter;
+    uint8_t added;
+    uint8_t descriptors[ARMEDIA_TSMUXER_MAX_DESCRIPTORS_SIZE];
+    uint32_t descriptorsSize;
+} ARMEDIA_TsMuxer_Stream_t;
+
+struct ARMEDIA_TsMuxer_t
+{
+    uint8_t *buffer;
+    size_t capacity; // whole packets
+    size_t fill;
+    off_t flushedSize;
+    ARMEDIA_TsMuxer_Output_t output;
+    void *userData;
+
+    ARMEDIA_TsMuxer_Stream_t streams[ARMEDIA_TSMUXER_STREAM_MAX];
+    uint8_t patCounter;
+    uint8_t pmtCounter;
+    uint8_t pmtVersion;
+    uint8_t psiPending; // the PAT and PMT are written before the next PES packet
+    uint8_t psiWritten;
+};
+
+// Read position in the payload of a PES packet
+typedef struct
+{
+    const struct iovec *iov;
+    uint32_t count;
+    uint32_t index;
+    size_t offset;
+} ARMEDIA_TsMuxer_Cursor_t;
+
+static const uint16_t ARMEDIA_TsMuxer_Pid[ARMEDIA_TSMUXER_STREAM_MAX] = { 0x0100, 0x0101, 0x0102 };
+static const uint8_t ARMEDIA_TsMuxer_StreamId[ARMEDIA_TSMUXER_STREAM_MAX] = { 0xe0, 0xbd, 0xbd }; // video, private_stream_1
+
+// CRC of the PSI sections (CRC-32/MPEG-2, not reflected)
+static uint32_t ARMEDIA_TsMuxer_Crc32 (const uint8_t *data, size_t size)
+{
+    uint32_t crc = 0xffffffff;
+    size_t i;
+    int bit;
+
+    for (i = 0; i < size; i++)
+    {
+        crc ^= (uint32_t)data[i] << 24;
+        for (bit = 0; bit < 8; bit++)
+        {
+            crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04c11db7 : (crc << 1);
+        }
+    }
+    return crc;
+}
+
+ARMEDIA_TsMuxer_t *ARMEDIA_TsMuxer_New (uint32_t packetCount, ARMEDIA_TsMuxer_Output_t output, void *userData, eARMEDIA_ERROR *error)
+{
+    ARMEDIA_TsMuxer_t *muxer = NULL;
+    int i;
+
+    if ((0 == packetCount) || (NULL == output))
+    {
+        TSMUXER_ERROR ("Bad parameters");
+        if (NULL != error)
+        {
+            *error = ARMEDIA_ERROR_BAD_PARAMETER;
+        }
+        return NULL;
+    }
+
+    muxer = calloc (1, sizeof (*muxer));
+    if (NULL != muxer)
+    {
+        muxer->capacity = (size_t)packetCount * ARMEDIA_TSMUXER_PACKET_SIZE;
+        muxer->buffer = malloc (muxer->capacity);
+    }
+    if ((NULL == muxer) || (NULL == muxer->buffer))
+    {
+        TSMUXER_ERROR ("Unable to allocate a muxer of %u packets", packetCount);
+        if (NULL != muxer)
+        {
+            free (muxer);
+        }
+        if (NULL != error)
+        {
+            *error = ARMEDIA_ERROR_ENCAPSULER;
+        }
+        return NULL;
+    }
+    muxer->output = output;
+    muxer->userData = userData;
+    for (i = 0; i < ARMEDIA_TSMUXER_STREAM_MAX; i++)
+    {
+        muxer->streams[i].pid = ARMEDIA_TsMuxer_Pid[i];
+        muxer->streams[i].streamId = ARMEDIA_TsMuxer_StreamId[i];
+    }
+    muxer->psiPending = 1;
+
+    if (NULL != error)
+    {
+        *error = ARMEDIA_OK;
+    }
+    return muxer;
+}
+
+void ARMEDIA_TsMuxer_Delete (ARMEDIA_TsMuxer_t **muxer)
+{
+    if ((NULL != muxer) && (NULL != *muxer))
+    {
+        free ((*muxer)->buffer);
+        free (*muxer);
+        *muxer = NULL;
+    }
+}
+
+void ARMEDIA_TsMuxer_SetUserData (ARMEDIA_TsMuxer_t *muxer, void *userData)
+{
+    muxer->userData = userData;
+}
+
+eARMEDIA_ERROR ARMEDIA_TsMuxer_AddStream (ARMEDIA_TsMuxer_t *muxer, eARMEDIA_TSMUXER_STREAM stream, uint8_t streamType,
+                                          const uint8_t *descriptors, uint32_t descriptorsSize)
+{
+    ARMEDIA_TsMuxer_Stream_t *newStream;
+    uint32_t pmtSize = 12 + 4 + 5 + descriptorsSize; // header, CRC and the new stream
+    int i;
+
+    if ((NULL == muxer) || (ARMEDIA_TSMUXER_STREAM_MAX <= (unsigned)stream) ||
+        (ARMEDIA_TSMUXER_MAX_DESCRIPTORS_SIZE < descriptorsSize) || ((NULL == descriptors) && (0 != descriptorsSize)))
+    {
+        TSMUXER_ERROR ("Bad parameters");
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
+    newStream = &muxer->streams[stream];
+    if (newStream->added)
+    {
+        TSMUXER_ERROR ("Stream %d already added", stream);
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
+
+    // The PMT is written in a single packet
+    for (i = 0; i < ARMEDIA_TSMUXER_STREAM_MAX; i++)
+    {
+        if (muxer->streams[i].added)
+        {
+            pmtSize += 5 + muxer->streams[i].descriptorsSize;
+        }
+    }
+    if (TSMUXER_PAYLOAD_SIZE - 1 < pmtSize)
+    {
+        TSMUXER_ERROR ("The descriptors of stream %d do not fit in the PMT", stream);
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
+
+    newStream->streamType = streamType;
+    if (0 != descriptorsSize)
+    {
+        memcpy (newStream->descriptors, descriptors, descriptorsSize);
+    }
+    newStream->descriptorsSize = descriptorsSize;
+    newStream->added = 1;
+    if (muxer->psiWritten)
+    {
+        muxer->pmtVersion = (muxer->pmtVersion + 1) & 0x1f;
+    }
+    muxer->psiPending = 1;
+
+    return ARMEDIA_OK;
+}
+
+eARMEDIA_ERROR ARMEDIA_TsMuxer_Flush (ARMEDIA_TsMuxer_t *muxer)
+{
+    eARMEDIA_ERROR error;
+
+    if (NULL == muxer)
+    {
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
+    if (0 == muxer->fill)
+    {
+        return ARMEDIA_OK;
+    }
+    // The packets are handed over once, even if the output fails, unless it is only busy
+    error = muxer->output (muxer->buffer, muxer->fill, muxer->userData);
+    if (ARMEDIA_ERROR_ENCAPSULER_QUEUE_FULL != error)
+    {
+        muxer->flushedSize += muxer->fill;
+        muxer->fill = 0;
+    }
+    return error;
+}
+
+off_t ARMEDIA_TsMuxer_GetSize (ARMEDIA_TsMuxer_t *muxer)
+{
+    return (NULL != muxer) ? muxer->flushedSize + (off_t)muxer->fill : 0;
+}
+
+size_t ARMEDIA_TsMuxer_GetFreeSize (ARMEDIA_TsMuxer_t *muxer)
+{
+    return (NULL != muxer) ? muxer->capacity - muxer->fill : 0;
+}
+
+size_t ARMEDIA_TsMuxer_GetMaxPesSize (size_t payloadSize)
+{
+    size_t pesCount = payloadSize / TSMUXER_PES_MAX_PAYLOAD + 1;
+    size_t size = payloadSize + pesCount * TSMUXER_PES_HEADER_SIZE + TSMUXER_PCR_FIELD_SIZE;
+
+    // The last packet of each PES packet is padded, and the PAT and PMT come first
+    return ((size + TSMUXER_PAYLOAD_SIZE - 1) / TSMUXER_PAYLOAD_SIZE + pesCount + 2) * ARMEDIA_TSMUXER_PACKET_SIZE;
+}
+
+// Next free packet of the buffer, flushed first if full
+static eARMEDIA_ERROR ARMEDIA_TsMuxer_NextPacket (ARMEDIA_TsMuxer_t *muxer, uint8_t **packet)
+{
+    eARMEDIA_ERROR error = ARMEDIA_OK;
+
+    if (muxer->fill == muxer->capacity)
+    {
+        error = ARMEDIA_TsMuxer_Flush (muxer);
+        if (ARMEDIA_OK != error)
+        {
+            return error;
+        }
+    }
+    *packet = &muxer->buffer[muxer->fill];
+    muxer->fill += ARMEDIA_TSMUXER_PACKET_SIZE;
+    return error;
+}
+
+static eARMEDIA_ERROR ARMEDIA_TsMuxer_WriteSection (ARMEDIA_TsMuxer_t *muxer, uint16_t pid, uint8_t *counter, uint8_t *section, size_t size)
+{
+    eARMEDIA_ERROR error;
+    uint8_t *packet;
+    uint32_t crc = ARMEDIA_TsMuxer_Crc32 (section, size);
+
+    error = ARMEDIA_TsMuxer_NextPacket (muxer, &packet);
+    if (ARMEDIA_OK != error)
+    {
+        return error;
+    }
+    section[size++] = (uint8_t)(crc >> 24);
+    section[size++] = (uint8_t)(crc >> 16);
+    section[size++] = (uint8_t)(crc >> 8);
+    section[size++] = (uint8_t)crc;
+
+    packet[0] = TSMUXER_SYNC_BYTE;
+    packet[1] = 0x40 | (uint8_t)(pid >> 8); // payload_unit_start_indicator
+    packet[2] = (uint8_t)pid;
+    packet[3] = 0x10 | *counter; // payload only
+    *counter = (*counter + 1) & 0x0f;
+    packet[4] = 0; // pointer_field
+    memcpy (&packet[5], section, size);
+    memset (&packet[5 + size], 0xff, ARMEDIA_TSMUXER_PACKET_SIZE - 5 - size);
+    return ARMEDIA_OK;
+}
+
+static eARMEDIA_ERROR ARMEDIA_TsMuxer_WritePsi (ARMEDIA_TsMuxer_t *muxer)
+{
+    eARMEDIA_ERROR error;
+    uint8_t section[TSMUXER_PAYLOAD_SIZE];
+    size_t size;
+    int i;
+
+    // PAT: a single program
+    section[0] = 0x00; // table_id
+    section[1] = 0xb0;
+    section[2] = 13; // section_length
+    section[3] = (uint8_t)(TSMUXER_TRANSPORT_STREAM_ID >> 8);
+    section[4] = (uint8_t)TSMUXER_TRANSPORT_STREAM_ID;
+    section[5] = 0xc1; // version 0, current
+    section[6] = 0; // section_number
+    section[7] = 0; // last_section_number
+    section[8] = (uint8_t)(TSMUXER_PROGRAM_NUMBER >> 8);
+    section[9] = (uint8_t)TSMUXER_PROGRAM_NUMBER;
+    section[10] = 0xe0 | (uint8_t)(TSMUXER_PMT_PID >> 8);
+    section[11] = (uint8_t)TSMUXER_PMT_PID;
+    error = ARMEDIA_TsMuxer_WriteSection (muxer, TSMUXER_PAT_PID, &muxer->patCounter, section, 12);
+    if (ARMEDIA_OK != error)
+    {
+        return error;
+    }
+
+    // PMT: the streams added, the PCR is carried by the video
+    section[0] = 0x02; // table_id
+    section[3] = (uint8_t)(TSMUXER_PROGRAM_NUMBER >> 8);
+    section[4] = (uint8_t)TSMUXER_PROGRAM_NUMBER;
+    section[5] = 0xc1 | (uint8_t)(muxer->pmtVersion << 1);
+    section[6] = 0;
+    section[7] = 0;
+    section[8] = 0xe0 | (uint8_t)(muxer->streams[ARMEDIA_TSMUXER_STREAM_VIDEO].pid >> 8);
+    section[9] = (uint8_t)muxer->streams[ARMEDIA_TSMUXER_STREAM_VIDEO].pid;
+    section[10] = 0xf0; // program_info_length
+    section[11] = 0;
+    size = 12;
+    for (i = 0; i < ARMEDIA_TSMUXER_STREAM_MAX; i++)
+    {
+        const ARMEDIA_TsMuxer_Stream_t *stream = &muxer->streams[i];
+        if (!stream->added)
+        {
+            continue;
+        }
+        section[size++] = stream->streamType;
+        section[size++] = 0xe0 | (uint8_t)(stream->pid >> 8);
+        section[size++] = (uint8_t)stream->pid;
+        section[size++] = 0xf0 | (uint8_t)(stream->descriptorsSize >> 8);
+        section[size++] = (uint8_t)stream->descriptorsSize;
+        memcpy (&section[size], stream->descriptors, stream->descriptorsSize);
+        size += stream->descriptorsSize;
+    }
+    section[1] = 0xb0 | (uint8_t)((size + 4 - 3) >> 8);
+    section[2] = (uint8_t)(size + 4 - 3);
+    error = ARMEDIA_TsMuxer_WriteSection (muxer, TSMUXER_PMT_PID, &muxer->pmtCounter, section, size);
+    if (ARMEDIA_OK != error)
+    {
+        return error;
+    }
+
+    muxer->psiPending = 0;
+    muxer->psiWritten = 1;
+    return ARMEDIA_OK;
+}
+
+static void ARMEDIA_TsMuxer_CopyPayload (ARMEDIA_TsMuxer_Cursor_t *cursor, uint8_t *data, size_t size)
+{
+    while (size > 0)
+    {
+        const struct iovec *part = &cursor->iov[cursor->index];
+        size_t length = part->iov_len - cursor->offset;
+        if (length > size)
+        {
+            length = size;
+        }
+        memcpy (data, (const uint8_t *)part->iov_base + cursor->offset, length);
+        data += length;
+        size -= length;
+        cursor->offset += length;
+        if (cursor->offset == part->iov_len)
+        {
+            cursor->index++;
+            cursor->offset = 0;
+        }
+    }
+}
+
+// Cut a PES packet into transport packets
+static eARMEDIA_ERROR ARMEDIA_TsMuxer_WritePesPacket (ARMEDIA_TsMuxer_t *muxer, ARMEDIA_TsMuxer_Stream_t *stream, const uint8_t *header, size_t headerSize,
+                                                      ARMEDIA_TsMuxer_Cursor_t *cursor, size_t payloadSize, uint8_t flags, uint64_t pcrBase)
+{
+    eARMEDIA_ERROR error;
+    size_t remaining = headerSize + payloadSize;
+    int first = 1;
+
+    while (remaining > 0)
+    {
+        uint8_t *packet;
+        size_t fieldSize = 0; // adaptation field, with its length byte
+        size_t size, headerPart;
+
+        error = ARMEDIA_TsMuxer_NextPacket (muxer, &packet);
+        if (ARMEDIA_OK != error)
+        {
+            return error;
+        }
+        if (first && (0 != flags))
+        {
+            fieldSize = (flags & TSMUXER_AF_PCR) ? TSMUXER_PCR_FIELD_SIZE : 2;
+        }
+        // The last packet is padded with stuffing bytes in its adaptation field
+        if (remaining < TSMUXER_PAYLOAD_SIZE - fieldSize)
+        {
+            fieldSize = TSMUXER_PAYLOAD_SIZE - remaining;
+        }
+        size = TSMUXER_PAYLOAD_SIZE - fieldSize;
+
+        packet[0] = TSMUXER_SYNC_BYTE;
+        packet[1] = (first ? 0x40 : 0) | (uint8_t)(stream->pid >> 8);
+        packet[2] = (uint8_t)stream->pid;
+        packet[3] = ((0 != fieldSize) ? 0x30 : 0x10) | stream->continuityCounter;
+        stream->continuityCounter = (stream->continuityCounter + 1) & 0x0f;
+        if (0 != fieldSize)
+        {
+            uint8_t *field = &packet[4];
+            size_t used = 1;
+            field[0] = (uint8_t)(fieldSize - 1);
+            if (fieldSize > 1)
+            {
+                field[1] = first ? flags : 0;
+                used = 2;
+                if (first && (flags & TSMUXER_AF_PCR))
+                {
+                    // 33-bit base at 90 kHz, 6 reserved bits, 9-bit extension at 27 MHz
+                    field[2] = (uint8_t)(pcrBase >> 25);
+                    field[3] = (uint8_t)(pcrBase >> 17);
+                    field[4] = (uint8_t)(pcrBase >> 9);
+                    field[5] = (uint8_t)(pcrBase >> 1);
+                    field[6] = (uint8_t)((pcrBase & 1) << 7) | 0x7e;
+                    field[7] = 0;
+                    used = TSMUXER_PCR_FIELD_SIZE;
+                }
+            }
+            memset (&field[used], 0xff, fieldSize - used);
+        }
+
+        packet += 4 + fieldSize;
+        headerPart = (headerSize < size) ? headerSize : size;
+        memcpy (packet, header, headerPart);
+        header += headerPart;
+        headerSize -= headerPart;
+        ARMEDIA_TsMuxer_CopyPayload (cursor, packet + headerPart, size - headerPart);
+        remaining -= size;
+        first = 0;
+    }
+    return ARMEDIA_OK;
+}
+
+eARMEDIA_ERROR ARMEDIA_TsMuxer_WritePes (ARMEDIA_TsMuxer_t *muxer, eARMEDIA_TSMUXER_STREAM stream, uint64_t timestamp,
+                                         const struct iovec *iov, uint32_t iovCount, int randomAccess)
+{
+    eARMEDIA_ERROR error = ARMEDIA_OK;
+    ARMEDIA_TsMuxer_Stream_t *pesStream;
+    ARMEDIA_TsMuxer_Cursor_t cursor = { iov, iovCount, 0, 0 };
+    uint8_t header[TSMUXER_PES_HEADER_SIZE];
+    uint64_t pts = (timestamp + TSMUXER_PTS_DELAY) & TSMUXER_TIMESTAMP_MASK;
+    size_t payloadSize = 0;
+    uint32_t i;
+    int first = 1;
+
+    if ((NULL == muxer) || (ARMEDIA_TSMUXER_STREAM_MAX <= (unsigned)stream) || ((NULL == iov) && (0 != iovCount)))
+    {
+        TSMUXER_ERROR ("Bad parameters");
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
+    pesStream = &muxer->streams[stream];
+    if (!pesStream->added)
+    {
+        TSMUXER_ERROR ("Stream %d not added", stream);
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
+    for (i = 0; i < iovCount; i++)
+    {
+        payloadSize += iov[i].iov_len;
+    }
+
+    if ((muxer->psiPending) || (randomAccess && (ARMEDIA_TSMUXER_STREAM_VIDEO == stream)))
+    {
+        error = ARMEDIA_TsMuxer_WritePsi (muxer);
+    }
+
+    while ((ARMEDIA_OK == error) && (first || (0 != payloadSize)))
+    {
+        // The video PES packets are unbounded when too large, the others are split
+        size_t size = payloadSize;
+        size_t headerSize = first ? TSMUXER_PES_HEADER_SIZE : TSMUXER_PES_HEADER_SIZE - 5;
+        size_t length;
+        uint8_t flags = 0;
+
+        if ((ARMEDIA_TSMUXER_STREAM_VIDEO != stream) && (TSMUXER_PES_MAX_PAYLOAD < size))
+        {
+            size = TSMUXER_PES_MAX_PAYLOAD;
+        }
+        length = headerSize - 6 + size;
+
+        header[0] = 0;
+        header[1] = 0;
+        header[2] = 1;
+        header[3] = pesStream->streamId;
+        header[4] = (UINT16_MAX < length) ? 0 : (uint8_t)(length >> 8);
+        header[5] = (UINT16_MAX < length) ? 0 : (uint8_t)length;
+        header[6] = first ? 0x84 : 0x80; // data_alignment_indicator on the first one
+        header[7] = first ? 0x80 : 0; // PTS only
+        header[8] = first ? 5 : 0;
+        if (first)
+        {
+            header[9] = 0x21 | (uint8_t)((pts >> 29) & 0x0e);
+            header[10] = (uint8_t)(pts >> 22);
+            header[11] = 0x01 | (uint8_t)((pts >> 14) & 0xfe);
+            header[12] = (uint8_t)(pts >> 7);
+            header[13] = 0x01 | (uint8_t)((pts << 1) & 0xfe);
+
+            if (randomAccess)
+            {
+                flags |= TSMUXER_AF_RANDOM_ACCESS;
+            }
+            if (ARMEDIA_TSMUXER_STREAM_VIDEO == stream)
+            {
+                flags |= TSMUXER_AF_PCR;
+            }
+        }
+
+        error = ARMEDIA_TsMuxer_WritePesPacket (muxer, pesStream, header, headerSize, &cursor, size, flags, timestamp & TSMUXER_TIMESTAMP_MASK);
+        payloadSize -= size;
+        first = 0;
+    }
+
+    return error;
+}
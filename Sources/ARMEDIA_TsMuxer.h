@@ -0,0 +1,162 @@
+/*
+    Copyright (C) 2014 Parrot SA
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the
+      distribution.
+    * Neither the name of Parrot nor the names
+      of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written
+      permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+    "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+    LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+    FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+    COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+    BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+    OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+    AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+    OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+    SUCH DAMAGE.
+*/
+/**
+ * @file ARMEDIA_TsMuxer.h
+ * @brief MPEG-2 transport stream packetizer of the media data (private).
+ *
+ * The PES packets of the streams are cut into 188-byte transport packets,
+ * written into a preallocated buffer which is handed to the output function
+ * once full (or on flush), so that the file is written in large batches.
+ * The PAT and PMT are written before the first packet, before each random
+ * access point of the video and whenever a stream is added.
+ * A stream never needs to be finalized: it is valid up to its last packet.
+ */
+#ifndef _ARMEDIA_TSMUXER_H_
+#define _ARMEDIA_TSMUXER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <libARMedia/ARMEDIA_Error.h>
+
+#define ARMEDIA_TSMUXER_PACKET_SIZE (188)
+
+// Clock of the timestamps given to the muxer
+#define ARMEDIA_TSMUXER_CLOCK_RATE (90000)
+
+// Maximum size of the descriptors of a stream in the PMT
+#define ARMEDIA_TSMUXER_MAX_DESCRIPTORS_SIZE (120)
+
+typedef enum
+{
+    ARMEDIA_TSMUXER_STREAM_VIDEO = 0,   /* H.264 Annex-B access units, carries the PCR */
+    ARMEDIA_TSMUXER_STREAM_AUDIO,       /* private PES */
+    ARMEDIA_TSMUXER_STREAM_METADATA,    /* private PES */
+    ARMEDIA_TSMUXER_STREAM_MAX
+} eARMEDIA_TSMUXER_STREAM;
+
+typedef struct ARMEDIA_TsMuxer_t ARMEDIA_TsMuxer_t;
+
+/**
+ * @brief Function receiving the transport packets
+ * @param packets whole transport packets, only valid during the call
+ * @param size size of the packets, multiple of ARMEDIA_TSMUXER_PACKET_SIZE
+ * @param userData pointer given to ARMEDIA_TsMuxer_New()
+ * @return Possible return values are in eARMEDIA_ERROR
+ */
+typedef eARMEDIA_ERROR (*ARMEDIA_TsMuxer_Output_t) (const uint8_t *packets, size_t size, void *userData);
+
+/**
+ * @brief Create a new transport stream muxer, without streams
+ * @param packetCount number of packets of the buffer
+ * @param output function receiving the packets
+ * @param userData pointer given to the output function
+ * @param[out] error pointer on the error output
+ * @return Pointer on the new muxer, NULL on error
+ */
+ARMEDIA_TsMuxer_t *ARMEDIA_TsMuxer_New (uint32_t packetCount, ARMEDIA_TsMuxer_Output_t output, void *userData, eARMEDIA_ERROR *error);
+
+/**
+ * @brief Free a muxer
+ * The packets not flushed yet are lost.
+ * @param muxer address of the pointer on the muxer
+ */
+void ARMEDIA_TsMuxer_Delete (ARMEDIA_TsMuxer_t **muxer);
+
+/**
+ * @brief Change the pointer given to the output function
+ * @param muxer the muxer
+ * @param userData new pointer given to the output function
+ */
+void ARMEDIA_TsMuxer_SetUserData (ARMEDIA_TsMuxer_t *muxer, void *userData);
+
+/**
+ * @brief Add a stream to the program
+ * The PMT is updated (with a new version once packets were written) and
+ * written again before the next PES packet.
+ * @param muxer the muxer
+ * @param stream stream to add
+ * @param streamType stream_type of the stream in the PMT
+ * @param descriptors descriptors of the stream in the PMT, NULL if none
+ * @param descriptorsSize size of the descriptors, at most ARMEDIA_TSMUXER_MAX_DESCRIPTORS_SIZE
+ * @return Possible return values are in eARMEDIA_ERROR
+ */
+eARMEDIA_ERROR ARMEDIA_TsMuxer_AddStream (ARMEDIA_TsMuxer_t *muxer, eARMEDIA_TSMUXER_STREAM stream, uint8_t streamType,
+                                          const uint8_t *descriptors, uint32_t descriptorsSize);
+
+/**
+ * @brief Write a PES packet of a stream
+ * The payload is copied into the packets. The PES packets of the audio and
+ * metadata streams are bounded: a larger payload is split into several ones,
+ * the first one carrying the timestamp.
+ * @param muxer the muxer
+ * @param stream stream of the payload, added by ARMEDIA_TsMuxer_AddStream()
+ * @param timestamp presentation time in ARMEDIA_TSMUXER_CLOCK_RATE units, from the start of the recording
+ * @param iov payload, in one or more parts
+ * @param iovCount number of iov entries
+ * @param randomAccess the payload is a random access point (the PAT and PMT are written first)
+ * @return Possible return values are in eARMEDIA_ERROR, including the errors of the output function
+ */
+eARMEDIA_ERROR ARMEDIA_TsMuxer_WritePes (ARMEDIA_TsMuxer_t *muxer, eARMEDIA_TSMUXER_STREAM stream, uint64_t timestamp,
+                                         const struct iovec *iov, uint32_t iovCount, int randomAccess);
+
+/**
+ * @brief Hand the packets of the buffer to the output function
+ * The packets are kept in the buffer when the output function returns
+ * ARMEDIA_ERROR_ENCAPSULER_QUEUE_FULL, and are lost on other errors.
+ * @param muxer the muxer
+ * @return Possible return values are in eARMEDIA_ERROR, ARMEDIA_OK if the buffer is empty
+ */
+eARMEDIA_ERROR ARMEDIA_TsMuxer_Flush (ARMEDIA_TsMuxer_t *muxer);
+
+/**
+ * @brief Get the size of the packets written, flushed or not
+ * @param muxer the muxer
+ * @return Size of the stream in bytes
+ */
+off_t ARMEDIA_TsMuxer_GetSize (ARMEDIA_TsMuxer_t *muxer);
+
+/**
+ * @brief Get the space left in the buffer before it is flushed
+ * @param muxer the muxer
+ * @return Free space of the buffer in bytes
+ */
+size_t ARMEDIA_TsMuxer_GetFreeSize (ARMEDIA_TsMuxer_t *muxer);
+
+/**
+ * @brief Get the largest size of the packets of a payload, with the PAT and PMT
+ * @param payloadSize size of the payload given to ARMEDIA_TsMuxer_WritePes()
+ * @return Size of the packets in bytes
+ */
+size_t ARMEDIA_TsMuxer_GetMaxPesSize (size_t payloadSize);
+
+#endif /* _ARMEDIA_TSMUXER_H_ */
@@ -99,6 +99,17 @@
         data[currentIndex++] = (uint8_t)((VAL>>8)&0xff);    \
         data[currentIndex++] = (uint8_t)((VAL)&0xff);       \
     } while (0)
+// Write a date or a duration into atom data: 64 bit in the version 1 atoms, else 32 bit
+#define ATOM_WRITE_TIME(VERSION, VAL)                       \
+    do                                                      \
+    {                                                       \
+        uint64_t TIME = (VAL);                              \
+        if (1 == (VERSION))                                 \
+        {                                                   \
+            ATOM_WRITE_U32 ((uint32_t)(TIME >> 32));        \
+        }                                                   \
+        ATOM_WRITE_U32 ((uint32_t)TIME);                    \
+    } while (0)
 // Write an defined number of bytes into atom data
 //  Usage : ATOM_WRITE_BYTES (pointerToData, sizeToCopy)
 #define ATOM_WRITE_BYTES(POINTER, SIZE)                     \
@@ -364,10 +375,11 @@ movie_atom_t *mdatAtomForFormatWithVideoSize (uint64_t videoSize)
     return retAtom;
 }
 
-movie_atom_t *mvhdAtomFromFpsNumFramesAndDate (uint32_t timescale, uint32_t duration, time_t date)
+movie_atom_t *mvhdAtomFromFpsNumFramesAndDate (uint32_t timescale, uint64_t duration, time_t date)
 {
     uint32_t date_1904 = (uint32_t)date + TIMESTAMP_FROM_1970_TO_1904;
-    uint32_t dataSize = 100;
+    uint8_t version = (UINT32_MAX < duration) ? 1 : 0; // version 1: 64-bit dates and duration
+    uint32_t dataSize = version ? 112 : 100;
     uint8_t *data = (uint8_t*) ATOM_MALLOC (dataSize);
     uint32_t currentIndex = 0;
     movie_atom_t *retAtom;
@@ -378,11 +390,11 @@ movie_atom_t *mvhdAtomFromFpsNumFramesAndDate (uint32_t timescale, uint32_t dura
     }
 
 
-    ATOM_WRITE_U32 (0); /* Version (8) + Flags (24) */
-    ATOM_WRITE_U32 (date_1904); /* Creation time */
-    ATOM_WRITE_U32 (date_1904); /* Modification time */
+    ATOM_WRITE_U32 ((uint32_t)(version << 24)); /* Version (8) + Flags (24) */
+    ATOM_WRITE_TIME (version, date_1904); /* Creation time */
+    ATOM_WRITE_TIME (version, date_1904); /* Modification time */
     ATOM_WRITE_U32 (timescale); /* Timescale */
-    ATOM_WRITE_U32 (duration); /* Duration (in timescale units) */
+    ATOM_WRITE_TIME (version, duration); /* Duration (in timescale units) */
 
     ATOM_WRITE_U32 (0x00010000); /* Rate */
     ATOM_WRITE_U16 (0x0100); /* Volume */
@@ -413,10 +425,11 @@ movie_atom_t *mvhdAtomFromFpsNumFramesAndDate (uint32_t timescale, uint32_t dura
     return retAtom;
 }
 
-movie_atom_t *tkhdAtomWithResolutionNumFramesFpsAndDate (uint32_t w, uint32_t h, uint32_t timescale, uint32_t duration, time_t date, eARMEDIA_VIDEOATOM_MEDIATYPE type)
+movie_atom_t *tkhdAtomWithResolutionNumFramesFpsAndDate (uint32_t w, uint32_t h, uint32_t timescale, uint64_t duration, time_t date, eARMEDIA_VIDEOATOM_MEDIATYPE type)
 {
     uint32_t date_1904 = (uint32_t)date + TIMESTAMP_FROM_1970_TO_1904;
-    uint32_t dataSize = 84;
+    uint8_t version = (UINT32_MAX < duration) ? 1 : 0; // version 1: 64-bit dates and duration
+    uint32_t dataSize = version ? 96 : 84;
     uint8_t *data = (uint8_t*) ATOM_MALLOC (dataSize);
     uint32_t currentIndex = 0;
     movie_atom_t *retAtom;
@@ -426,12 +439,12 @@ movie_atom_t *tkhdAtomWithResolutionNumFramesFpsAndDate (uint32_t w, uint32_t h,
         return NULL;
     }
 
-    ATOM_WRITE_U32 (0x0000000f); /* Version (8) + Flags (24) */
-    ATOM_WRITE_U32 (date_1904); /* Creation time */
-    ATOM_WRITE_U32 (date_1904); /* Modification time */
+    ATOM_WRITE_U32 ((uint32_t)((version << 24) | 0x0000000f)); /* Version (8) + Flags (24) */
+    ATOM_WRITE_TIME (version, date_1904); /* Creation time */
+    ATOM_WRITE_TIME (version, date_1904); /* Modification time */
     ATOM_WRITE_U32 ((type+1)); /* Track ID */
     ATOM_WRITE_U32 (0); /* Reserved */
-    ATOM_WRITE_U32 (duration); /* Duration (in timescale units) */
+    ATOM_WRITE_TIME (version, duration); /* Duration (in timescale units) */
     ATOM_WRITE_U32 (0); /* Reserved */
     ATOM_WRITE_U32 (0); /* Reserved */
     if (type == ARMEDIA_VIDEOATOM_MEDIATYPE_SOUND)
@@ -495,10 +508,11 @@ movie_atom_t *cdscAtomGen (uint32_t *target_track_id, uint32_t target_track_id_c
     return retAtom;
 }
 
-movie_atom_t *mdhdAtomFromFpsNumFramesAndDate (uint32_t timescale, uint32_t duration, time_t date)
+movie_atom_t *mdhdAtomFromFpsNumFramesAndDate (uint32_t timescale, uint64_t duration, time_t date)
 {
     uint32_t date_1904 = (uint32_t)date + TIMESTAMP_FROM_1970_TO_1904;
-    uint32_t dataSize = 24;
+    uint8_t version = (UINT32_MAX < duration) ? 1 : 0; // version 1: 64-bit dates and duration
+    uint32_t dataSize = version ? 36 : 24;
     uint32_t currentIndex = 0;
     uint8_t *data = (uint8_t*) ATOM_MALLOC (dataSize);
     movie_atom_t *retAtom;
@@ -508,11 +522,11 @@ movie_atom_t *mdhdAtomFromFpsNumFramesAndDate (uint32_t timescale, uint32_t dura
         return NULL;
     }
 
-    ATOM_WRITE_U32 (0); /* Version (8) + Flags (24) */
-    ATOM_WRITE_U32 (date_1904); /* Creation time */
-    ATOM_WRITE_U32 (date_1904); /* Modification time */
+    ATOM_WRITE_U32 ((uint32_t)(version << 24)); /* Version (8) + Flags (24) */
+    ATOM_WRITE_TIME (version, date_1904); /* Creation time */
+    ATOM_WRITE_TIME (version, date_1904); /* Modification time */
     ATOM_WRITE_U32 (timescale); /* Timescale */
-    ATOM_WRITE_U32 (duration); /* Duration (in timescale units) */
+    ATOM_WRITE_TIME (version, duration); /* Duration (in timescale units) */
     ATOM_WRITE_U32 (0x55c40000); /* Language code (16) + Quality (16) */
 
     retAtom = atomFromData (dataSize, "mdhd", data);
@@ -1497,6 +1511,11 @@ uint32_t getVideoFpsFromAtom (uint8_t *mdhdAtom, const int atomSize)
     if (1 == valid)
     {
         ATOM_READ_U32 (vflags);
+        if ((1 == (vflags >> 24)) && (24 <= atomSize))
+        {
+            // Version 1: 64-bit dates, the timescale is 8 bytes further
+            pBuffer += 8;
+        }
         ATOM_READ_U32 (cdate);
         ATOM_READ_U32 (mdate);
         ATOM_READ_U32 (fps);
@@ -43,6 +43,7 @@
 
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <utime.h>
 #include <string.h>
@@ -52,15 +53,73 @@
 #include <arpa/inet.h>
 #include <json-c/json.h>
 #include <locale.h>
+#include <pthread.h>
 #include <libARDiscovery/ARDiscovery.h>
 #include <libARMedia/ARMedia.h>
 #include <libARSAL/ARSAL_Print.h>
+#include <libARSAL/ARSAL_Mutex.h>
+#include <libARSAL/ARSAL_Thread.h>
 #include <libARMedia/ARMEDIA_VideoEncapsuler.h>
+#include "ARMEDIA_FileWriter.h"
+#include "ARMEDIA_Sidecar.h"
+#include "ARMEDIA_SampleTable.h"
+#include "ARMEDIA_NaluScanner.h"
+#include "ARMEDIA_AtomTree.h"
+#include "ARMEDIA_TaskPool.h"
+#include "ARMEDIA_TsMuxer.h"
 
 #define ENCAPSULER_SMALL_STRING_SIZE    (30)
 #define ENCAPSULER_INFODATA_MAX_SIZE    (256)
 #define ARMEDIA_ENCAPSULER_TAG          "ARMEDIA Encapsuler"
 
+#define ENCAPSULER_RESERVE_STEP         (64 * 1024)
+
+// Chunk buffers grow by doubling from these sizes
+#define ENCAPSULER_CHUNK_MIN_CAPACITY   (64 * 1024)
+#define ENCAPSULER_CHUNK_MIN_RECORDS    (64)
+// Records of a chunk encoded at once
+#define ENCAPSULER_CHUNK_RECORD_BATCH   (32)
+#define ENCAPSULER_RESERVE_ALIGNMENT    (4096)
+
+// Size of the mdat atom header (free or wide atom + mdat atom, or 64 bits mdat atom)
+#define ENCAPSULER_MDAT_HEADER_SIZE     (16)
+
+// Largest end of data with 32 bits chunk offsets (stco atoms), leaving room
+// to move the moov atom before the mdat atom afterwards
+#define ENCAPSULER_STCO_MAX_DATA_END    (UINT32_MAX - 64 * 1024 * 1024)
+
+// Moov size estimate: atoms other than the sample tables (untimed metadata included),
+// then worst case table entries per sample
+#define ENCAPSULER_MOOV_FIXED_SIZE      (16 * 1024)
+#define ENCAPSULER_MOOV_VIDEO_SAMPLE_SIZE       (24) // stts, stss, stsz, co64
+#define ENCAPSULER_MOOV_METADATA_SAMPLE_SIZE    (16) // stts, co64
+#define ENCAPSULER_MOOV_AUDIO_CHUNK_SIZE        (20) // stsc, co64
+
+// Fragmented MP4: sample flags of a sync sample and of a sample depending on others
+#define ENCAPSULER_SAMPLE_FLAGS_SYNC        (0x02000000)
+#define ENCAPSULER_SAMPLE_FLAGS_NON_SYNC    (0x01010000)
+// tfhd flags: offsets from the moof atom, default sample duration, size and flags
+#define ENCAPSULER_TFHD_FLAGS               (0x020038)
+// trun flags: fields of the run and of each sample
+#define ENCAPSULER_TRUN_DATA_OFFSET         (0x001)
+#define ENCAPSULER_TRUN_FIRST_FLAGS         (0x004)
+#define ENCAPSULER_TRUN_DURATION            (0x100)
+#define ENCAPSULER_TRUN_SIZE                (0x200)
+#define ENCAPSULER_TRUN_FLAGS               (0x400)
+// Sizes of the moof atom header with the mfhd atom, of the traf atom header with
+// the tfhd and tfdt atoms, and of the trun atom without the optional fields
+#define ENCAPSULER_MOOF_HEADER_SIZE         (8 + 16)
+#define ENCAPSULER_TRAF_HEADER_SIZE         (8 + 28 + 20)
+#define ENCAPSULER_TRUN_HEADER_SIZE         (8 + 12)
+
+// Transport stream program (ISO/IEC 13818-1)
+#define ENCAPSULER_TS_STREAM_TYPE_AVC           (0x1b)
+#define ENCAPSULER_TS_STREAM_TYPE_PRIVATE       (0x06) // PES packets with private data
+#define ENCAPSULER_TS_REGISTRATION_DESCRIPTOR   (0x05)
+#define ENCAPSULER_TS_FORMAT_DESCRIPTOR         (0x80) // user private descriptor tag
+#define ENCAPSULER_TS_AUDIO_FLAG_LITTLE_ENDIAN  (0x01)
+#define ENCAPSULER_AVC_NALU_TYPE_AUD            (9)
+
 #define ENCAPSULER_DEBUG_ENABLE (1)
 #define ENCAPSULER_LOG_TIMESTAMPS (0)
 
@@ -127,6 +186,64 @@ typedef struct ARMEDIA_Video_t ARMEDIA_Video_t;
 typedef struct ARMEDIA_Audio_t ARMEDIA_Audio_t;
 typedef struct ARMEDIA_Metadata_t ARMEDIA_Metadata_t;
 
+/* Atoms of a track which do not depend on the recorded samples, built as soon
+   as the track is configured: Finish adds the tkhd and mdhd atoms, which hold
+   the duration, and the sample tables */
+typedef struct
+{
+    ARMEDIA_AtomTree_Node_t *trak; // trak > (tref) > mdia > hdlr, minf > (media header, dinf, stbl > stsd)
+    ARMEDIA_AtomTree_Node_t *mdia; // in trak
+    ARMEDIA_AtomTree_Node_t *stbl; // in trak
+} ARMEDIA_VideoEncapsuler_Track_t;
+
+typedef enum
+{
+    ENCAPSULER_CHUNK_VIDEO = 0,
+    ENCAPSULER_CHUNK_METADATA,
+    ENCAPSULER_CHUNK_AUDIO,
+    ENCAPSULER_CHUNK_MAX,
+} eENCAPSULER_CHUNK;
+
+#define ENCAPSULER_CHUNK_ALL ((1 << ENCAPSULER_CHUNK_MAX) - 1)
+
+/* Samples of one track kept in memory until they are written as one chunk,
+   with their frame infos (the offsets are only known then) */
+typedef struct
+{
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+    ARMEDIA_Sidecar_Record_t *records;
+    uint32_t count;
+    uint32_t recordCapacity;
+    uint64_t firstTimestamp; // timestamp of the first sample
+} ARMEDIA_VideoEncapsuler_Chunk_t;
+
+/* Converts the captured durations of a track (usec) to durations in timescale units */
+typedef struct
+{
+    uint32_t timescale;
+    uint32_t lastDelta;     // duration of the last sample, in timescale units
+    uint32_t tolerance;     // durations are snapped to lastDelta within this error, 0 to keep them
+    uint64_t exactTime;     // sum of the captured durations, in usec
+    uint64_t quantizedTime; // sum of the converted durations, in timescale units
+} ARMEDIA_VideoEncapsuler_Clock_t;
+
+/* Segmentation, see ARMEDIA_VideoEncapsuler_SetSegmentation(). It belongs to the
+   encapsuler handle: it stays with the handle when the recording moves to the next segment */
+typedef struct
+{
+    uint64_t maxSize; // in bytes, 0 for no limit
+    uint64_t maxDuration; // in usec, 0 for no limit
+    ARMEDIA_VideoEncapsuler_FinishCallback_t finishCallback;
+    void *userData;
+    char mediaPath[ARMEDIA_ENCAPSULER_VIDEO_PATH_SIZE]; // path of the first segment
+    uint32_t index; // index of the current segment, 0 for the first one
+    ARMEDIA_VideoEncapsuler_t *next; // opened and set up before the cut, NULL if not yet
+    ARMEDIA_VideoEncapsuler_t *previous; // ended by the last cut, waiting for the audio captured before it
+    uint8_t openFailed; // the next segment is only opened again on a sync frame
+} ARMEDIA_VideoEncapsuler_Segmentation_t;
+
 struct ARMEDIA_VideoEncapsuler_t
 {
     // Encapsuler local data
@@ -158,11 +275,134 @@ struct ARMEDIA_VideoEncapsuler_t
     char tempFilePath [ARMEDIA_ENCAPSULER_VIDEO_PATH_SIZE]; // Keep this so we can rename the output file
     FILE *metaFile;
     FILE *dataFile;
+    ARMEDIA_FileWriter_t *writer;
+    uint32_t sidecarHeaderSize; // offset of the first record in the metadata file
+    uint16_t sidecarFlags;
+    uint32_t queueSize;
+    eARMEDIA_ENCAPSULER_OVERFLOW_POLICY overflowPolicy;
+    uint8_t dropUntilIFrame;
+    uint32_t droppedCount;
+    uint32_t directIoBufferSize; // 0 when writing through the page cache
+    uint32_t preallocationSize; // 0 when the data file is not preallocated
+    uint32_t finishMemoryLimit; // size of the window used to write the moov tables
+    uint32_t finishThreadCount; // threads building the moov tables, 0 for the default
+    off_t preallocatedEnd; // end of the allocated space of the data file
+    uint32_t fastStartSize; // space reserved for the moov atom before the mdat atom, 0 if none
+    ARMEDIA_VideoEncapsuler_FastStartCallback_t fastStartCallback;
+    void *fastStartUserData;
+
+    // Finish progress, reported when finished by ARMEDIA_VideoEncapsuler_FinishAsync()
+    ARMEDIA_VideoEncapsuler_FinishProgressCallback_t finishProgressCallback;
+    void *finishUserData;
+    uint8_t finishProgress; // last reported percentage
+    uint64_t finishTotalSize; // size of the moov atom
+    uint64_t finishDoneSize; // size of the generated tables written
+    ARSAL_Mutex_t finishMutex; // protects the progress while the tables are written
+    int finishLocked; // finishMutex is initialized
+
+    // Atoms built before Finish
+    ARMEDIA_AtomTree_Node_t *udtaAtom;
+    ARMEDIA_AtomTree_Node_t *metaAtom;
+    off_t thumbnailSize; // thumbnail read in the atoms above, -1 if none
+    time_t thumbnailTime;
+    ARMEDIA_VideoEncapsuler_Track_t videoTrack;
+    ARMEDIA_VideoEncapsuler_Track_t metadataTrack;
+    ARMEDIA_VideoEncapsuler_Track_t audioTrack;
+
+    // Durability
+    eARMEDIA_ENCAPSULER_DURABILITY durabilityPolicy;
+    uint32_t durabilityValue;
+    uint64_t lastSyncTimestamp;
+    uint64_t maxSyncInterval; // in usec
+    off_t lastSyncSize; // media data size at the last sync
+
+    // Checkpoints of the sample tables, see ARMEDIA_VideoEncapsuler_SetCheckpointInterval()
+    uint32_t checkpointInterval; // 0 when the infos file has no checkpoint
+    ARMEDIA_SampleTable_State_t checkpointStates[ENCAPSULER_CHUNK_MAX]; // ends of the tables at the last checkpoint
+    uint32_t checkpointIndex; // index of the last checkpoint in the infos file
+    uint32_t checkpointRecords; // infos file records taken by the checkpoints, 0 if none was written
+    uint8_t *checkpointBuffer;
+    size_t checkpointCapacity;
+
+    // Chunking, see ARMEDIA_VideoEncapsuler_SetChunking()
+    uint32_t chunkDuration; // in usec, 0 when each frame, metadata block and audio sample is a chunk
+    uint32_t chunkMaxSize;
+    ARMEDIA_VideoEncapsuler_Chunk_t chunks[ENCAPSULER_CHUNK_MAX];
+    off_t chunkPendingSize; // data kept in the chunks, included in the tracks total sizes
+
+    uint32_t timestampTolerance; // in usec, see ARMEDIA_VideoEncapsuler_SetTimestampTolerance()
+
+    // Fragmented MP4, see ARMEDIA_VideoEncapsuler_SetFragmentation()
+    uint8_t fragmented;
+    uint32_t fragmentDuration; // in usec, 0 for a fragment per GOP
+    uint32_t fragmentCount; // sequence number of the last fragment, 0 until the init segment is written
+    uint32_t fragmentTracks; // tracks declared by the init segment, mask of 1 << eENCAPSULER_CHUNK
+    off_t fragmentEnd; // end of the last fragment in the data file
+    ARMEDIA_VideoEncapsuler_Clock_t fragmentClocks[ENCAPSULER_CHUNK_MAX];
+    uint64_t fragmentTimes[ENCAPSULER_CHUNK_MAX]; // decode time of the next fragment of each track
+    uint8_t *fragmentBuffer; // moof atom and mdat atom header, kept until the writer job is committed
+    size_t fragmentCapacity;
+
+    // MPEG-2 transport stream, see ARMEDIA_VideoEncapsuler_SetTransportStream()
+    ARMEDIA_TsMuxer_t *tsMuxer; // NULL when recording an MP4 media
+    uint32_t tsBatchSize;
+    struct iovec *tsIov; // parts of the access unit being written
+    uint32_t tsIovCapacity;
+    uint8_t tsMayDrop; // a full writer queue keeps the batch instead of blocking
+    uint8_t tsSyncPending; // the next batch written is synced
+    uint64_t tsSyncTimestamp;
+
+    // Sample tables, filled while recording
+    ARMEDIA_SampleTable_t videoTable;
+    ARMEDIA_SampleTable_t audioTable;
+    ARMEDIA_SampleTable_t metadataTable;
+
+    // NAL units of the current Annex-B frame
+    ARMEDIA_Nalu_t *nalus;
+    uint32_t naluCapacity;
+    uint32_t naluCount;
+    uint8_t nalusInPlace; // the NALU sizes replace the start codes in the frame buffer
+
+    // Frame buffer handed out by ARMEDIA_VideoEncapsuler_ReserveFrame()
+    uint8_t *reserveBuffer;
+    uint32_t reserveCapacity;
+    uint32_t reserveSize; // 0 when no frame is reserved
+
+    ARMEDIA_VideoEncapsuler_Segmentation_t *segmentation; // NULL when recording a single media
 
     // additionnal data
     ARMEDIA_videoGpsInfos_t videoGpsInfos;
 };
 
+// Raw descriptor of the version 5 encapsuler, which wrote ASCII frame infos
+#define ARMEDIA_ENCAPSULER_LEGACY_VERSION_NUMBER (5)
+typedef struct
+{
+    uint8_t version;
+    uint32_t timescale;
+    uint8_t got_iframe;
+    uint8_t got_audio;
+    uint8_t got_metadata;
+    ARMEDIA_Video_t* video;
+    ARMEDIA_Audio_t* audio;
+    ARMEDIA_Metadata_t* metadata;
+    time_t creationTime;
+    ARMEDIA_Untimed_Metadata_t untimed_metadata;
+    uint8_t got_untimed_metadata;
+    char thumbnailFilePath[ARMEDIA_ENCAPSULER_VIDEO_PATH_SIZE];
+    off_t mdatAtomOffset;
+    off_t dataOffset;
+    char uuid[UUID_MAXLENGTH];
+    char runDate[DATETIME_MAXLENGTH];
+    eARDISCOVERY_PRODUCT product;
+    char metaFilePath [ARMEDIA_ENCAPSULER_VIDEO_PATH_SIZE];
+    char dataFilePath [ARMEDIA_ENCAPSULER_VIDEO_PATH_SIZE];
+    char tempFilePath [ARMEDIA_ENCAPSULER_VIDEO_PATH_SIZE];
+    FILE *metaFile;
+    FILE *dataFile;
+    ARMEDIA_videoGpsInfos_t videoGpsInfos;
+} ARMEDIA_VideoEncapsuler_v5_t;
+
 struct ARMEDIA_Metadata_t
 {
     uint32_t block_size;
@@ -219,6 +459,12 @@ struct ARMEDIA_Video_t
 // Limit for audio drift. If more, then add encapsuler adds blank.
 #define ADRIFT_LIMIT 10000 // usec
 
+// Data file writeback period when the data is synced regularly
+#define WRITEBACK_SIZE (1024 * 1024)
+
+// Default delay before the system writes back dirty pages (dirty_expire + dirty_writeback)
+#define SYSTEM_WRITEBACK_DELAY 35000 // msec
+
 #define ENCAPSULER_ERROR(...)                                           \
     do {                                                                \
         ARSAL_PRINT (ARSAL_PRINT_ERROR, ARMEDIA_ENCAPSULER_TAG, "error: " __VA_ARGS__); \
@@ -244,7 +490,12 @@ struct ARMEDIA_Video_t
 } while (0)
 
 static eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_Cleanup (ARMEDIA_VideoEncapsuler_t **encapsuler, bool rename_tempFile);
-static eARMEDIA_ERROR ARMEDIA_FillZeros(FILE* file, uint32_t nBytes);
+static void ARMEDIA_VideoEncapsuler_BuildUntimedMetadataAtoms (ARMEDIA_VideoEncapsuler_t *encapsuler);
+static void ARMEDIA_VideoEncapsuler_BuildVideoTrack (ARMEDIA_VideoEncapsuler_t *encapsuler);
+static void ARMEDIA_VideoEncapsuler_BuildMetadataTrack (ARMEDIA_VideoEncapsuler_t *encapsuler);
+static void ARMEDIA_VideoEncapsuler_BuildAudioTrack (ARMEDIA_VideoEncapsuler_t *encapsuler);
+static eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_WritePendingChunks (ARMEDIA_VideoEncapsuler_t *encapsuler);
+static eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_WriteInitSegment (ARMEDIA_VideoEncapsuler_t *encapsuler);
 
 ARMEDIA_VideoEncapsuler_t *ARMEDIA_VideoEncapsuler_New (const char *mediaPath, int fps, char* uuid, char* runDate, eARDISCOVERY_PRODUCT product, eARMEDIA_ERROR *error)
 {
@@ -328,6 +579,90 @@ ARMEDIA_VideoEncapsuler_t *ARMEDIA_VideoEncapsuler_New (const char *mediaPath, i
         return NULL;
     }
 
+    // frames are written synchronously unless ARMEDIA_VideoEncapsuler_SetAsyncWriter() is called
+    retVideo->sidecarHeaderSize = 0;
+    retVideo->directIoBufferSize = 0;
+    retVideo->preallocationSize = 0;
+    retVideo->preallocatedEnd = 0;
+    retVideo->finishMemoryLimit = ARMEDIA_ENCAPSULER_DEFAULT_FINISH_MEMORY_LIMIT;
+    retVideo->finishThreadCount = 0;
+    retVideo->fastStartSize = 0;
+    retVideo->fastStartCallback = NULL;
+    retVideo->fastStartUserData = NULL;
+    retVideo->finishProgressCallback = NULL;
+    retVideo->finishUserData = NULL;
+    retVideo->finishProgress = 0;
+    retVideo->finishTotalSize = 0;
+    retVideo->finishDoneSize = 0;
+    retVideo->udtaAtom = NULL;
+    retVideo->metaAtom = NULL;
+    retVideo->thumbnailSize = -1;
+    retVideo->thumbnailTime = 0;
+    memset (&retVideo->videoTrack, 0, sizeof (retVideo->videoTrack));
+    memset (&retVideo->metadataTrack, 0, sizeof (retVideo->metadataTrack));
+    memset (&retVideo->audioTrack, 0, sizeof (retVideo->audioTrack));
+    ARMEDIA_SampleTable_Init (&retVideo->videoTable);
+    ARMEDIA_SampleTable_Init (&retVideo->audioTable);
+    ARMEDIA_SampleTable_Init (&retVideo->metadataTable);
+    retVideo->nalus = NULL;
+    retVideo->naluCapacity = 0;
+    retVideo->naluCount = 0;
+    retVideo->nalusInPlace = 0;
+    retVideo->reserveBuffer = NULL;
+    retVideo->reserveCapacity = 0;
+    retVideo->reserveSize = 0;
+    retVideo->segmentation = NULL;
+    retVideo->chunkDuration = 0;
+    retVideo->chunkMaxSize = 0;
+    memset (retVideo->chunks, 0, sizeof (retVideo->chunks));
+    retVideo->chunkPendingSize = 0;
+    retVideo->timestampTolerance = 0;
+    retVideo->fragmented = 0;
+    retVideo->fragmentDuration = 0;
+    retVideo->fragmentCount = 0;
+    retVideo->fragmentTracks = 0;
+    retVideo->fragmentEnd = 0;
+    memset (retVideo->fragmentClocks, 0, sizeof (retVideo->fragmentClocks));
+    memset (retVideo->fragmentTimes, 0, sizeof (retVideo->fragmentTimes));
+    retVideo->fragmentBuffer = NULL;
+    retVideo->fragmentCapacity = 0;
+    retVideo->tsMuxer = NULL;
+    retVideo->tsBatchSize = 0;
+    retVideo->tsIov = NULL;
+    retVideo->tsIovCapacity = 0;
+    retVideo->tsMayDrop = 0;
+    retVideo->tsSyncPending = 0;
+    retVideo->tsSyncTimestamp = 0;
+    retVideo->sidecarFlags = ARMEDIA_SIDECAR_FLAG_RECORD_CRC | ARMEDIA_SIDECAR_FLAG_CHECKPOINTS;
+    retVideo->writer = ARMEDIA_FileWriter_New (retVideo->dataFile, retVideo->metaFile, 0, ARMEDIA_ENCAPSULER_OVERFLOW_POLICY_BLOCK, error);
+    if (NULL == retVideo->writer)
+    {
+        ENCAPSULER_ERROR ("Unable to create file writer");
+        fclose (retVideo->dataFile);
+        fclose (retVideo->metaFile);
+        free (retVideo);
+        retVideo = NULL;
+        return NULL;
+    }
+    ARMEDIA_FileWriter_SetWriteback (retVideo->writer, WRITEBACK_SIZE);
+    retVideo->queueSize = 0;
+    retVideo->overflowPolicy = ARMEDIA_ENCAPSULER_OVERFLOW_POLICY_BLOCK;
+    retVideo->dropUntilIFrame = 0;
+    retVideo->droppedCount = 0;
+
+    retVideo->durabilityPolicy = ARMEDIA_ENCAPSULER_DURABILITY_GOP;
+    retVideo->durabilityValue = 0;
+    retVideo->lastSyncTimestamp = 0;
+    retVideo->maxSyncInterval = 0;
+    retVideo->lastSyncSize = 0;
+
+    retVideo->checkpointInterval = ARMEDIA_ENCAPSULER_DEFAULT_CHECKPOINT_INTERVAL;
+    memset (retVideo->checkpointStates, 0, sizeof (retVideo->checkpointStates));
+    retVideo->checkpointIndex = 0;
+    retVideo->checkpointRecords = 0;
+    retVideo->checkpointBuffer = NULL;
+    retVideo->checkpointCapacity = 0;
+
     // gps data initialization
     retVideo->videoGpsInfos.latitude = 500.0;
     retVideo->videoGpsInfos.longitude = 500.0;
@@ -353,39 +688,6 @@ ARMEDIA_VideoEncapsuler_t *ARMEDIA_VideoEncapsuler_New (const char *mediaPath, i
     return retVideo;
 }
 
-#define BYTE_STREAM_NALU_START_CODE 0x00000001
-
-static int ARMEDIA_H264StartcodeMatch(const uint8_t* pBuf, unsigned int bufSize)
-{
-    int ret, pos, end;
-    uint32_t shiftVal = 0;
-    const uint8_t* ptr = pBuf;
-
-    if (bufSize < 4) return -2;
-
-    pos = 0;
-    end = bufSize;
-
-    do
-    {
-        shiftVal <<= 8;
-        shiftVal |= (*ptr++) & 0xFF;
-        pos++;
-    }
-    while (((shiftVal != BYTE_STREAM_NALU_START_CODE) && (pos < end)) || (pos < 4));
-
-    if (shiftVal == BYTE_STREAM_NALU_START_CODE)
-    {
-        ret = pos - 4;
-    }
-    else
-    {
-        ret = -2;
-    }
-
-    return ret;
-}
-
 eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_SetAvcParameterSets (ARMEDIA_VideoEncapsuler_t *encapsuler, const uint8_t *sps, uint32_t spsSize, const uint8_t *pps, uint32_t ppsSize)
 {
     if (NULL == encapsuler)
@@ -467,6 +769,7 @@ eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_SetMetadataInfo (ARMEDIA_VideoEncapsuler_
             sizeof(encapsuler->metadata->mime_format), "%s", mime_format);
 
     encapsuler->metadata->block_size = metadata_block_size;
+    ARMEDIA_VideoEncapsuler_BuildMetadataTrack (encapsuler);
 
     return ARMEDIA_OK;
 }
@@ -580,6 +883,7 @@ eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_SetUntimedMetadata (ARMEDIA_VideoEncapsul
         }
     }
     encapsuler->got_untimed_metadata = 1;
+    ARMEDIA_VideoEncapsuler_BuildUntimedMetadataAtoms (encapsuler);
 
     return ARMEDIA_OK;
 }
@@ -598,1629 +902,4582 @@ eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_SetVideoThumbnail (ARMEDIA_VideoEncapsule
     snprintf(encapsuler->thumbnailFilePath,
              ARMEDIA_ENCAPSULER_VIDEO_PATH_SIZE, "%s",
              file);
+    ARMEDIA_VideoEncapsuler_BuildUntimedMetadataAtoms (encapsuler);
 
     return ARMEDIA_OK;
 }
 
-eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_AddFrame (ARMEDIA_VideoEncapsuler_t *encapsuler, ARMEDIA_Frame_Header_t *frameHeader, const void *metadataBuffer)
+eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_SetAsyncWriter (ARMEDIA_VideoEncapsuler_t *encapsuler, uint32_t queueSize, eARMEDIA_ENCAPSULER_OVERFLOW_POLICY overflowPolicy)
 {
-    uint8_t searchIndex;
-    uint32_t descriptorSize;
-    movie_atom_t *ftypAtom;
+    ARMEDIA_FileWriter_t *writer;
+    eARMEDIA_ERROR error = ARMEDIA_OK;
 
     if (NULL == encapsuler)
     {
         ENCAPSULER_ERROR ("encapsuler pointer must not be null");
         return ARMEDIA_ERROR_BAD_PARAMETER;
     }
-
-    ARMEDIA_Video_t* video = encapsuler->video;
-    if (NULL == video)
+    if ((ARMEDIA_ENCAPSULER_OVERFLOW_POLICY_BLOCK > overflowPolicy) || (ARMEDIA_ENCAPSULER_OVERFLOW_POLICY_MAX <= overflowPolicy))
     {
-        ENCAPSULER_ERROR ("video pointer must not be null");
+        ENCAPSULER_ERROR ("Bad overflow policy (%d)", overflowPolicy);
         return ARMEDIA_ERROR_BAD_PARAMETER;
     }
-    if (NULL == frameHeader)
+    if (encapsuler->got_iframe)
     {
-        ENCAPSULER_ERROR ("frame pointer must not be null");
+        ENCAPSULER_ERROR ("The writer can not be changed once the recording has started");
         return ARMEDIA_ERROR_BAD_PARAMETER;
     }
 
-    // get frame data
-    if ((NULL == frameHeader->frame) && (0 == frameHeader->avc_nalu_count))
+    writer = ARMEDIA_FileWriter_New (encapsuler->dataFile, encapsuler->metaFile, queueSize, overflowPolicy, &error);
+    if (NULL == writer)
     {
-        ENCAPSULER_ERROR ("Unable to get frame data (%d bytes) ", frameHeader->frame_size);
-        return ARMEDIA_ERROR_ENCAPSULER;
+        ENCAPSULER_ERROR ("Unable to create file writer with %u slots", queueSize);
+        return error;
     }
-
-    if ((NULL != frameHeader->frame) && (!frameHeader->frame_size))
+    if ((0 != encapsuler->directIoBufferSize) &&
+        (ARMEDIA_OK != (error = ARMEDIA_FileWriter_SetDirectIo (writer, encapsuler->tempFilePath, encapsuler->directIoBufferSize))))
     {
-        // Do nothing
-        ENCAPSULER_DEBUG ("Empty frame\n");
-        return ARMEDIA_OK;
+        ARMEDIA_FileWriter_Delete (&writer);
+        return error;
     }
+    ARMEDIA_FileWriter_Delete (&encapsuler->writer);
+    encapsuler->writer = writer;
+    encapsuler->queueSize = queueSize;
+    encapsuler->overflowPolicy = overflowPolicy;
+    ARMEDIA_FileWriter_SetWriteback (writer, (ARMEDIA_ENCAPSULER_DURABILITY_NEVER != encapsuler->durabilityPolicy) ? WRITEBACK_SIZE : 0);
+
+    return ARMEDIA_OK;
+}
 
-    if (ARMEDIA_ENCAPSULER_FRAMES_COUNT_LIMIT <= video->framesCount)
+eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_SetDirectIo (ARMEDIA_VideoEncapsuler_t *encapsuler, uint32_t bufferSize)
+{
+    eARMEDIA_ERROR error;
+
+    if (NULL == encapsuler)
     {
-        ENCAPSULER_ERROR ("Video contains already %d frames, which is the maximum", ARMEDIA_ENCAPSULER_FRAMES_COUNT_LIMIT);
-        return ARMEDIA_ERROR_ENCAPSULER;
+        ENCAPSULER_ERROR ("encapsuler pointer must not be null");
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
+    if (0 != bufferSize % ARMEDIA_ENCAPSULER_DIRECT_IO_ALIGNMENT)
+    {
+        ENCAPSULER_ERROR ("Direct I/O buffer size must be a multiple of %d (%u)", ARMEDIA_ENCAPSULER_DIRECT_IO_ALIGNMENT, bufferSize);
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
+    if (encapsuler->got_iframe)
+    {
+        ENCAPSULER_ERROR ("Direct I/O can not be changed once the recording has started");
+        return ARMEDIA_ERROR_BAD_PARAMETER;
     }
 
-    // First frame
-    if (!video->width)
+    error = ARMEDIA_FileWriter_SetDirectIo (encapsuler->writer, encapsuler->tempFilePath, bufferSize);
+    if (ARMEDIA_OK != error)
     {
-        // Ensure that the codec is h.264 or mjpeg (mp4 not supported)
-        if ((CODEC_MPEG4_AVC != frameHeader->codec) && (CODEC_MOTION_JPEG != frameHeader->codec))
-        {
-            ENCAPSULER_ERROR ("Only h.264 or mjpeg codec are supported");
-            return ARMEDIA_ERROR_ENCAPSULER_BAD_CODEC;
-        }
+        ENCAPSULER_ERROR ("Unable to use direct I/O on %s", encapsuler->tempFilePath);
+        return error;
+    }
+    encapsuler->directIoBufferSize = bufferSize;
 
-        // Init video structure
-        video->width = frameHeader->width;
-        video->height = frameHeader->height;
-        video->codec = frameHeader->codec;
+    return ARMEDIA_OK;
+}
 
-        // If codec is H.264, save SPS/PPS
-        if (CODEC_MPEG4_AVC == video->codec)
-        {
-            if (ARMEDIA_ENCAPSULER_FRAME_TYPE_I_FRAME != frameHeader->frame_type)
-            {
-                // Wait until we get an IFrame 1 to start the actual recording
-                video->width = video->height = frameHeader->codec = 0;
-                return ARMEDIA_ERROR_ENCAPSULER_WAITING_FOR_IFRAME;
-            }
+eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_SetPreallocation (ARMEDIA_VideoEncapsuler_t *encapsuler, uint32_t preallocationSize)
+{
+    if (NULL == encapsuler)
+    {
+        ENCAPSULER_ERROR ("encapsuler pointer must not be null");
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
+    if (encapsuler->got_iframe)
+    {
+        ENCAPSULER_ERROR ("The preallocation can not be changed once the recording has started");
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
 
-            if ((NULL == video->sps) && (NULL == video->pps))
-            {
-                const uint8_t *pSps = NULL, *pPps = NULL;
-                if (frameHeader->avc_nalu_count)
-                {
-                    // We consider that on a I-Frame the first NALU is an SPS and the second NALU is a PPS
-                    video->spsSize = frameHeader->avc_nalu_size[0];
-                    video->ppsSize = frameHeader->avc_nalu_size[1];
-                    if (frameHeader->frame)
-                    {
-                        pSps = frameHeader->frame;
-                        pPps = frameHeader->frame + video->spsSize;
-                    }
-                    else
-                    {
-                        pSps = frameHeader->avc_nalu_data[0];
-                        pPps = frameHeader->avc_nalu_data[1];
-                    }
-                }
-                else
-                {
-                    // we'll need to search the "00 00 00 01" pattern to find each header size
-                    // Search start at index 4 to avoid finding the SPS "00 00 00 01" tag
-                    for (searchIndex = 4; searchIndex <= frameHeader->frame_size - 4; searchIndex ++)
-                    {
-                        if (0 == frameHeader->frame[searchIndex  ] &&
-                                0 == frameHeader->frame[searchIndex+1] &&
-                                0 == frameHeader->frame[searchIndex+2] &&
-                                1 == frameHeader->frame[searchIndex+3])
-                        {
-                            break;  // PPS header found
-                        }
-                    }
-                    video->spsSize = searchIndex;
-                    pSps = frameHeader->frame;
-
-                    // Search start at index 4 to avoid finding the SPS "00 00 00 01" tag
-                    for (searchIndex = video->spsSize+4; searchIndex <= frameHeader->frame_size - 4; searchIndex ++)
-                    {
-                        if (0 == frameHeader->frame[searchIndex  ] &&
-                                0 == frameHeader->frame[searchIndex+1] &&
-                                0 == frameHeader->frame[searchIndex+2] &&
-                                1 == frameHeader->frame[searchIndex+3])
-                        {
-                            break;  // frame header found
-                        }
-                    }
-                    video->ppsSize = searchIndex - video->spsSize;
-                    pPps = frameHeader->frame + video->spsSize;
-                }
+    encapsuler->preallocationSize = preallocationSize;
 
-                video->sps = malloc (video->spsSize);
-                video->pps = malloc (video->ppsSize);
+    return ARMEDIA_OK;
+}
 
-                if (NULL == video->sps || NULL == video->pps)
-                {
-                    ENCAPSULER_ERROR ("Unable to allocate SPS/PPS buffers");
-                    if (NULL != video->sps)
-                    {
-                        free (video->sps);
-                        video->sps = NULL;
-                    }
-
-                    if (NULL != video->pps)
-                    {
-                        free (video->pps);
-                        video->pps = NULL;
-                    }
-                    return ARMEDIA_ERROR_ENCAPSULER;
-                }
-                memcpy (video->sps, pSps, video->spsSize);
-                memcpy (video->pps, pPps, video->ppsSize);
-            }
-        }
+eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_SetFinishMemoryLimit (ARMEDIA_VideoEncapsuler_t *encapsuler, uint32_t memoryLimit)
+{
+    if (NULL == encapsuler)
+    {
+        ENCAPSULER_ERROR ("encapsuler pointer must not be null");
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
+    if ((0 != memoryLimit) && (ARMEDIA_ENCAPSULER_MIN_FINISH_MEMORY_LIMIT > memoryLimit))
+    {
+        ENCAPSULER_ERROR ("Finish memory limit must be at least %d bytes (%u)", ARMEDIA_ENCAPSULER_MIN_FINISH_MEMORY_LIMIT, memoryLimit);
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
 
-        // Start to write file
-        rewind(encapsuler->dataFile);
-        ftypAtom = ftypAtomForFormatAndCodecWithOffset (video->codec, &(encapsuler->dataOffset));
-        if (NULL == ftypAtom)
-        {
-            ENCAPSULER_ERROR ("Unable to create ftyp atom");
-            return ARMEDIA_ERROR_ENCAPSULER;
-        }
+    encapsuler->finishMemoryLimit = (0 != memoryLimit) ? memoryLimit : ARMEDIA_ENCAPSULER_DEFAULT_FINISH_MEMORY_LIMIT;
 
-        if (-1 == writeAtomToFile (&ftypAtom, encapsuler->dataFile))
-        {
-            ENCAPSULER_ERROR ("Unable to write ftyp atom");
-            return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
-        }
+    return ARMEDIA_OK;
+}
 
-        // Add an offset for PVAT at beginning
-        encapsuler->dataOffset += ARMEDIA_JSON_DESCRIPTION_MAXLENGTH+8;
+eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_SetFinishThreadCount (ARMEDIA_VideoEncapsuler_t *encapsuler, uint32_t threadCount)
+{
+    if (NULL == encapsuler)
+    {
+        ENCAPSULER_ERROR ("encapsuler pointer must not be null");
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
+    if (ARMEDIA_ENCAPSULER_MAX_FINISH_THREAD_COUNT < threadCount)
+    {
+        ENCAPSULER_ERROR ("Finish thread count must be at most %d (%u)", ARMEDIA_ENCAPSULER_MAX_FINISH_THREAD_COUNT, threadCount);
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
 
-        if (-1 == fseeko(encapsuler->dataFile, encapsuler->dataOffset, SEEK_SET))
-        {
-            ENCAPSULER_ERROR ("Unable to set file write pointer to %zu", (size_t)encapsuler->dataOffset);
-            return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
-        }
-        encapsuler->mdatAtomOffset = encapsuler->dataOffset - 16;
+    encapsuler->finishThreadCount = threadCount;
 
-        // Write video infos to info file header
-        descriptorSize = sizeof(ARMEDIA_VideoEncapsuler_t) +
-            sizeof(ARMEDIA_Video_t) + sizeof(ARMEDIA_Audio_t) + sizeof(ARMEDIA_Metadata_t);
-        if (video->codec == CODEC_MPEG4_AVC) descriptorSize += video->spsSize + video->ppsSize;
+    return ARMEDIA_OK;
+}
 
-        // Write total length
-        if (1 != fwrite (&descriptorSize, sizeof (uint32_t), 1, encapsuler->metaFile))
-        {
-            ENCAPSULER_ERROR ("Unable to write size of video descriptor");
-            return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
-        }
-        // Write VideoEncapsuler info
-        if (1 != fwrite (encapsuler, sizeof (ARMEDIA_VideoEncapsuler_t), 1, encapsuler->metaFile))
-        {
-            ENCAPSULER_ERROR ("Unable to write encapsuler descriptor");
-            return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
-        }
-        // Write Video info
-        if (1 != fwrite (video, sizeof (ARMEDIA_Video_t), 1, encapsuler->metaFile))
-        {
-            ENCAPSULER_ERROR ("Unable to write video descriptor");
-            return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
-        }
+eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_SetFastStart (ARMEDIA_VideoEncapsuler_t *encapsuler, uint32_t reservedSize, ARMEDIA_VideoEncapsuler_FastStartCallback_t callback, void *userData)
+{
+    if (NULL == encapsuler)
+    {
+        ENCAPSULER_ERROR ("encapsuler pointer must not be null");
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
+    if ((0 != reservedSize) && (8 > reservedSize))
+    {
+        ENCAPSULER_ERROR ("Fast start reserved size must hold a free atom (%u)", reservedSize);
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
+    if (encapsuler->got_iframe)
+    {
+        ENCAPSULER_ERROR ("The fast start space can not be changed once the recording has started");
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
+    if ((0 != reservedSize) && (encapsuler->fragmented || (NULL != encapsuler->tsMuxer)))
+    {
+        ENCAPSULER_ERROR ("A fragmented media or a transport stream has no fast start layout");
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
 
-        if (video->codec == CODEC_MPEG4_AVC)
-        {
-            // Write SPS
-            if (video->spsSize != fwrite (video->sps, sizeof (uint8_t), video->spsSize, encapsuler->metaFile))
-            {
-                ENCAPSULER_ERROR ("Unable to write sps header");
-                return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
-            }
-            // Write PPS
-            if (video->ppsSize != fwrite (video->pps, sizeof (uint8_t), video->ppsSize, encapsuler->metaFile))
-            {
-                ENCAPSULER_ERROR ("Unable to write pps header");
-                return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
-            }
-        }
+    encapsuler->fastStartSize = reservedSize;
+    encapsuler->fastStartCallback = callback;
+    encapsuler->fastStartUserData = userData;
 
-        if (metadataBuffer != NULL && encapsuler->metadata != NULL && encapsuler->metadata->block_size > 0)
-        {
-            // Write Metadata info
-            if (1 != fwrite (encapsuler->metadata, sizeof (ARMEDIA_Metadata_t), 1, encapsuler->metaFile))
-            {
-                ENCAPSULER_ERROR ("Unable to write video descriptor");
-                return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
-            }
-        }
-        else
-        {
-            fseeko(encapsuler->metaFile, (off_t)sizeof(ARMEDIA_Metadata_t), SEEK_CUR);
-        }
+    return ARMEDIA_OK;
+}
 
-        fseeko(encapsuler->metaFile, (off_t)sizeof(ARMEDIA_Audio_t), SEEK_CUR);
-        encapsuler->got_iframe = 1;
-        video->firstFrameTimestamp = frameHeader->timestamp;
-    } // end first frame
+uint32_t ARMEDIA_VideoEncapsuler_EstimateMoovSize (uint32_t frameRate, uint32_t duration, uint8_t hasMetadata, uint32_t audioChunkRate)
+{
+    uint64_t frames = (uint64_t)frameRate * duration;
+    uint64_t size = ENCAPSULER_MOOV_FIXED_SIZE + frames * ENCAPSULER_MOOV_VIDEO_SAMPLE_SIZE;
 
-    // Normal operation : file pointer is at end of file
-    if (video->codec != frameHeader->codec ||
-        video->width != frameHeader->width ||
-        video->height != frameHeader->height)
+    if (hasMetadata)
     {
-        ENCAPSULER_ERROR ("New frame don't match the video size/codec");
-        return ARMEDIA_ERROR_ENCAPSULER_BAD_VIDEO_FRAME;
+        size += frames * ENCAPSULER_MOOV_METADATA_SAMPLE_SIZE;
     }
+    size += (uint64_t)audioChunkRate * duration * ENCAPSULER_MOOV_AUDIO_CHUNK_SIZE;
+    return (UINT32_MAX < size) ? UINT32_MAX : (uint32_t)size;
+}
 
-    // New frame, write all infos about last one
-    // if frame TS is null, set it as last TS + default duration (from fps)
-    if (frameHeader->timestamp == 0) {
-        frameHeader->timestamp = video->lastFrameTimestamp + video->defaultFrameDuration;
+eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_SetChunking (ARMEDIA_VideoEncapsuler_t *encapsuler, uint32_t durationMs, uint32_t maxSize)
+{
+    if (NULL == encapsuler)
+    {
+        ENCAPSULER_ERROR ("encapsuler pointer must not be null");
+        return ARMEDIA_ERROR_BAD_PARAMETER;
     }
-    // For first frame, no previous timestamp => dt = 0
-    if (video->lastFrameTimestamp == 0) {
-        video->lastFrameTimestamp = frameHeader->timestamp;
+    if (UINT32_MAX / 1000 < durationMs)
+    {
+        ENCAPSULER_ERROR ("Chunk duration too long (%u ms)", durationMs);
+        return ARMEDIA_ERROR_BAD_PARAMETER;
     }
-
-    ARMEDIA_Metadata_t *metadata = NULL;
-    if (encapsuler->metadata != NULL && encapsuler->metadata->block_size > 0)
+    if (encapsuler->got_iframe)
     {
-        metadata = encapsuler->metadata;
-
-        // Same as for video, no previous timestamp => dt = 0
-        if (metadataBuffer != NULL && metadata->lastFrameTimestamp == 0) {
-            metadata->lastFrameTimestamp = frameHeader->timestamp;
-        }
+        ENCAPSULER_ERROR ("The chunking can not be changed once the recording has started");
+        return ARMEDIA_ERROR_BAD_PARAMETER;
     }
-
-    // Use frameHeader->frame_type to check that we don't write infos about a null frame
-
-    // synchronisation every 10 frames in MJPEG or else before new I-Frames
-    if ((video->codec == CODEC_MOTION_JPEG && (video->framesCount % 10) == 0) ||
-	frameHeader->frame_type == ARMEDIA_ENCAPSULER_FRAME_TYPE_I_FRAME)
+    if ((0 != durationMs) && (NULL != encapsuler->tsMuxer))
     {
-        fflush (encapsuler->dataFile);
-        fsync(fileno(encapsuler->dataFile));
-        fflush (encapsuler->metaFile);
-        fsync(fileno(encapsuler->metaFile));
+        ENCAPSULER_ERROR ("A transport stream has no chunks");
+        return ARMEDIA_ERROR_BAD_PARAMETER;
     }
 
-    if (ARMEDIA_ENCAPSULER_FRAME_TYPE_UNKNNOWN != frameHeader->frame_type)
-    {
-        uint32_t infoLen;
-        off_t totalFrameSize = 0;
-        if (frameHeader->frame)
-        {
-            totalFrameSize += frameHeader->frame_size;
-        }
-        else
-        {
-            uint32_t i;
-            for (i = 0; i < frameHeader->avc_nalu_count; i++)
-            {
-                totalFrameSize += frameHeader->avc_nalu_size[i];
-            }
-        }
-        if (frameHeader->avc_insert_ps)
-        {
-            if (video->spsSize > 4)
-                totalFrameSize += video->spsSize;
-            if (video->ppsSize > 4)
-                totalFrameSize += video->ppsSize;
-        }
+    encapsuler->chunkDuration = durationMs * 1000;
+    encapsuler->chunkMaxSize = (0 != maxSize) ? maxSize : ARMEDIA_ENCAPSULER_DEFAULT_CHUNK_MAX_SIZE;
 
-        char infoData [ENCAPSULER_INFODATA_MAX_SIZE] = {0};
-        char fTypeChar = 'p';
-        if (ARMEDIA_ENCAPSULER_FRAME_TYPE_I_FRAME == frameHeader->frame_type ||
-                ARMEDIA_ENCAPSULER_FRAME_TYPE_JPEG == frameHeader->frame_type)
-        {
-            fTypeChar = 'i';
-        }
-        snprintf (infoData, ENCAPSULER_INFODATA_MAX_SIZE,
-                ARMEDIA_ENCAPSULER_INFO_PATTERN,
-                ARMEDIA_ENCAPSULER_VIDEO_INFO_TAG,
-                (long long)totalFrameSize,
-                fTypeChar,
-                (uint32_t)(frameHeader->timestamp - video->lastFrameTimestamp)); // frame duration
-        infoLen = strlen(infoData);
+    return ARMEDIA_OK;
+}
 
-        if (infoLen != fwrite (infoData, 1, infoLen, encapsuler->metaFile))
-        {
-            ENCAPSULER_ERROR ("Unable to write frameInfo into info file");
-            return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
-        }
+eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_SetTimestampTolerance (ARMEDIA_VideoEncapsuler_t *encapsuler, uint32_t toleranceUs)
+{
+    if (NULL == encapsuler)
+    {
+        ENCAPSULER_ERROR ("encapsuler pointer must not be null");
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
+    if (2 * (uint64_t)toleranceUs >= encapsuler->video->defaultFrameDuration)
+    {
+        ENCAPSULER_ERROR ("Timestamp tolerance (%u usec) must be less than half a frame duration", toleranceUs);
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
+    if (encapsuler->got_iframe)
+    {
+        ENCAPSULER_ERROR ("The timestamp tolerance can not be changed once the recording has started");
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
 
-        if (metadataBuffer != NULL && metadata != NULL && metadata->block_size > 0)
-        {
-            snprintf (infoData, ENCAPSULER_INFODATA_MAX_SIZE,
-                    ARMEDIA_ENCAPSULER_INFO_PATTERN,
-                    ARMEDIA_ENCAPSULER_METADATA_INFO_TAG,
-                    (long long)metadata->block_size,
-                    fTypeChar, // or always 'p'?
-                    (uint32_t)(frameHeader->timestamp - metadata->lastFrameTimestamp));
-            infoLen = strlen(infoData);
+    encapsuler->timestampTolerance = toleranceUs;
 
-            if (infoLen != fwrite (infoData, 1, infoLen, encapsuler->metaFile))
-            {
-                ENCAPSULER_ERROR ("Unable to write metadataInfo into info file");
-                return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
-            }
+    return ARMEDIA_OK;
+}
 
-            metadata->lastFrameTimestamp = frameHeader->timestamp;
-            metadata->framesCount++;
-        }
+/* For the medias which are valid while recorded: write the media under its
+   final name and stop recording the frame infos */
+static eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_DropInfosFile (ARMEDIA_VideoEncapsuler_t *encapsuler)
+{
+    if (0 != rename (encapsuler->tempFilePath, encapsuler->dataFilePath))
+    {
+        ENCAPSULER_ERROR ("Unable to rename %s to %s", encapsuler->tempFilePath, encapsuler->dataFilePath);
+        return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
     }
+    snprintf (encapsuler->tempFilePath, sizeof (encapsuler->tempFilePath), "%s", encapsuler->dataFilePath);
+    ARMEDIA_FileWriter_SetMetaFile (encapsuler->writer, NULL);
+    ENCAPSULER_CLEANUP (fclose, encapsuler->metaFile);
+    remove (encapsuler->metaFilePath);
+    return ARMEDIA_OK;
+}
 
-    video->lastFrameTimestamp = frameHeader->timestamp;
-    video->framesCount++;
+eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_SetFragmentation (ARMEDIA_VideoEncapsuler_t *encapsuler, uint32_t durationMs)
+{
+    if (NULL == encapsuler)
+    {
+        ENCAPSULER_ERROR ("encapsuler pointer must not be null");
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
+    if (UINT32_MAX / 1000 < durationMs)
+    {
+        ENCAPSULER_ERROR ("Fragment duration too long (%u ms)", durationMs);
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
+    if (encapsuler->got_iframe)
+    {
+        ENCAPSULER_ERROR ("The fragmentation can not be changed once the recording has started");
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
+    if (0 != encapsuler->fastStartSize)
+    {
+        ENCAPSULER_ERROR ("A fragmented media has no fast start layout");
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
+    if (NULL != encapsuler->tsMuxer)
+    {
+        ENCAPSULER_ERROR ("A transport stream can not be fragmented");
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
 
-    if (frameHeader->avc_insert_ps)
+    if (!encapsuler->fragmented)
     {
-        // Force insertion of SPS and PPS before this frame
-        uint32_t naluSize, naluSizeNe;
-        if (video->spsSize > 4)
-        {
-            naluSize = video->spsSize - 4;
-            naluSizeNe = htonl(naluSize);
-            if (4 != fwrite (&naluSizeNe, 1, 4, encapsuler->dataFile))
-            {
-                ENCAPSULER_ERROR ("Unable to write SPS into data file");
-                return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
-            }
-            if (naluSize != fwrite (video->sps + 4, 1, naluSize, encapsuler->dataFile))
-            {
-                ENCAPSULER_ERROR ("Unable to write SPS into data file");
-                return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
-            }
-            video->totalsize += video->spsSize;
-        }
-        if (video->ppsSize > 4)
+        // The media is valid after each fragment
+        eARMEDIA_ERROR error = ARMEDIA_VideoEncapsuler_DropInfosFile (encapsuler);
+        if (ARMEDIA_OK != error)
         {
-            naluSize = video->ppsSize - 4;
-            naluSizeNe = htonl(naluSize);
-            if (4 != fwrite (&naluSizeNe, 1, 4, encapsuler->dataFile))
-            {
-                ENCAPSULER_ERROR ("Unable to write PPS into data file");
-                return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
-            }
-            if (naluSize != fwrite (video->pps + 4, 1, naluSize, encapsuler->dataFile))
-            {
-                ENCAPSULER_ERROR ("Unable to write PPS into data file");
-                return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
-            }
-            video->totalsize += video->ppsSize;
+            return error;
         }
+        encapsuler->fragmented = 1;
     }
+    encapsuler->fragmentDuration = durationMs * 1000;
 
-    // Write the frame to the data file (and replace the NAL units start code by the NALU size in case of H.264)
-    if ((video->codec == CODEC_MPEG4_AVC) && (frameHeader->avc_nalu_count > 0))
+    return ARMEDIA_OK;
+}
+
+static eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_OutputTsPackets (const uint8_t *packets, size_t size, void *userData);
+
+eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_SetTransportStream (ARMEDIA_VideoEncapsuler_t *encapsuler, uint32_t batchSize)
+{
+    eARMEDIA_ERROR error = ARMEDIA_OK;
+    uint32_t packetCount;
+
+    if (NULL == encapsuler)
     {
-        uint32_t i, offset, naluSize, naluSizeNE;
-        for (i = 0, offset = 0; i < frameHeader->avc_nalu_count; i++)
-        {
-            naluSize = (frameHeader->avc_nalu_size[i] > 4) ? frameHeader->avc_nalu_size[i] - 4 : 0;
-            naluSizeNE = htonl(naluSize);
-            if (fwrite(&naluSizeNE, 4, 1, encapsuler->dataFile) != 1)
-            {
-                ENCAPSULER_ERROR ("Unable to write frame into data file");
-                return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
-            }
-            if (frameHeader->frame)
-            {
-                if (fwrite(frameHeader->frame + offset + 4, naluSize, 1, encapsuler->dataFile) != 1)
-                {
-                    ENCAPSULER_ERROR ("Unable to write frame into data file");
-                    return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
-                }
-            }
-            else if (frameHeader->avc_nalu_data[i])
-            {
-                if (fwrite(frameHeader->avc_nalu_data[i] + 4, naluSize, 1, encapsuler->dataFile) != 1)
-                {
-                    ENCAPSULER_ERROR ("Unable to write frame into data file");
-                    return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
-                }
-            }
-            else
-            {
-                ENCAPSULER_ERROR ("No valid pointer for NALU");
-            }
-            offset += frameHeader->avc_nalu_size[i];
-            video->totalsize += frameHeader->avc_nalu_size[i];
-        }
+        ENCAPSULER_ERROR ("encapsuler pointer must not be null");
+        return ARMEDIA_ERROR_BAD_PARAMETER;
     }
-    else
+    packetCount = ((0 != batchSize) ? batchSize : ARMEDIA_ENCAPSULER_DEFAULT_TS_BATCH_SIZE) / ARMEDIA_TSMUXER_PACKET_SIZE;
+    if (0 == packetCount)
     {
-        if (video->codec == CODEC_MPEG4_AVC)
-        {
-            int startCodePos = 0, naluStart = 0, naluEnd = 0, sizeLeft = frameHeader->frame_size;
-            uint32_t naluSize, naluSizeNE;
-            startCodePos = ARMEDIA_H264StartcodeMatch(frameHeader->frame, sizeLeft);
-            naluStart = startCodePos;
-            while (startCodePos >= 0)
-            {
-                sizeLeft = frameHeader->frame_size - naluStart - 4;
-                startCodePos = ARMEDIA_H264StartcodeMatch(frameHeader->frame + naluStart + 4, sizeLeft);
-                if (startCodePos >= 0)
-                {
-                    naluEnd = naluStart + 4 + startCodePos;
-                }
-                else
-                {
-                    naluEnd = frameHeader->frame_size;
-                }
-                naluSize = naluEnd - naluStart - 4;
-                naluSizeNE = htonl(naluSize);
-                if (fwrite(&naluSizeNE, 4, 1, encapsuler->dataFile) != 1)
-                {
-                    ENCAPSULER_ERROR ("Unable to write frame into data file");
-                    return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
-                }
-                if (fwrite(frameHeader->frame + naluStart + 4, naluSize, 1, encapsuler->dataFile) != 1)
-                {
-                    ENCAPSULER_ERROR ("Unable to write frame into data file");
-                    return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
-                }
-                naluStart = naluEnd;
-            }
-        }
-        else
-        {
-            if (frameHeader->frame_size != fwrite(frameHeader->frame, 1, frameHeader->frame_size, encapsuler->dataFile))
-            {
-                ENCAPSULER_ERROR ("Unable to write frame into data file");
-                return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
-            }
-        }
-        video->totalsize += frameHeader->frame_size;
+        ENCAPSULER_ERROR ("The batch must hold a transport packet (%u bytes)", batchSize);
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
+    if (encapsuler->got_iframe)
+    {
+        ENCAPSULER_ERROR ("The container can not be changed once the recording has started");
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
+    if (encapsuler->fragmented || (0 != encapsuler->fastStartSize) || (0 != encapsuler->chunkDuration))
+    {
+        ENCAPSULER_ERROR ("A transport stream has no fragments, fast start layout or chunks");
+        return ARMEDIA_ERROR_BAD_PARAMETER;
     }
 
-    if (metadataBuffer != NULL && metadata != NULL && metadata->block_size > 0)
+    if (NULL == encapsuler->tsMuxer)
     {
-        if (metadata->block_size != fwrite (metadataBuffer, 1, metadata->block_size, encapsuler->dataFile))
+        // The stream is valid up to its last packet
+        error = ARMEDIA_VideoEncapsuler_DropInfosFile (encapsuler);
+        if (ARMEDIA_OK != error)
         {
-            ENCAPSULER_ERROR ("Unable to write metadata into file");
-            return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+            return error;
         }
-        metadata->totalsize += metadata->block_size;
     }
+    ARMEDIA_TsMuxer_Delete (&encapsuler->tsMuxer);
+    encapsuler->tsMuxer = ARMEDIA_TsMuxer_New (packetCount, ARMEDIA_VideoEncapsuler_OutputTsPackets, encapsuler, &error);
+    encapsuler->tsBatchSize = packetCount * ARMEDIA_TSMUXER_PACKET_SIZE;
 
-#if ENCAPSULER_LOG_TIMESTAMPS
-    fprintf(tslogger, "V;%"PRIu64"\n", frameHeader->timestamp);
-#endif
-
-    return ARMEDIA_OK;
+    return error;
 }
 
-#define ZBUFF_SIZE 1024 // <=> 32 ms of sound
-static eARMEDIA_ERROR ARMEDIA_FillZeros(FILE* file, uint32_t nBytes)
+eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_SetSegmentation (ARMEDIA_VideoEncapsuler_t *encapsuler, uint64_t maxSize, uint32_t maxDurationMs,
+                                                        ARMEDIA_VideoEncapsuler_FinishCallback_t finishCallback, void *userData)
 {
-    uint8_t zbuff[ZBUFF_SIZE] = {0};
+    ARMEDIA_VideoEncapsuler_Segmentation_t *segmentation;
 
-    uint32_t rest = nBytes % ZBUFF_SIZE;
-    uint32_t quotient = (nBytes - rest) / ZBUFF_SIZE;
-    uint32_t i;
+    if (NULL == encapsuler)
+    {
+        ENCAPSULER_ERROR ("encapsuler pointer must not be null");
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
+    if (encapsuler->got_iframe)
+    {
+        ENCAPSULER_ERROR ("The segmentation can not be changed once the recording has started");
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
 
-    for (i=0 ; i<quotient ; i++) {
-        if (ZBUFF_SIZE != fwrite(zbuff, sizeof(uint8_t), ZBUFF_SIZE, file)) {
-            goto fillzeros_error;
-        }
+    if ((0 == maxSize) && (0 == maxDurationMs))
+    {
+        ENCAPSULER_CLEANUP (free, encapsuler->segmentation);
+        return ARMEDIA_OK;
     }
 
-    // write rest
-    if (rest) {
-        if (rest != fwrite(zbuff, sizeof(uint8_t), rest, file)) {
-            goto fillzeros_error;
+    segmentation = encapsuler->segmentation;
+    if (NULL == segmentation)
+    {
+        segmentation = (ARMEDIA_VideoEncapsuler_Segmentation_t*) calloc (1, sizeof (ARMEDIA_VideoEncapsuler_Segmentation_t));
+        if (NULL == segmentation)
+        {
+            ENCAPSULER_ERROR ("Unable to allocate the segmentation");
+            return ARMEDIA_ERROR_ENCAPSULER;
         }
+        snprintf (segmentation->mediaPath, sizeof (segmentation->mediaPath), "%s", encapsuler->dataFilePath);
+        encapsuler->segmentation = segmentation;
     }
+    segmentation->maxSize = maxSize;
+    segmentation->maxDuration = (uint64_t)maxDurationMs * 1000;
+    segmentation->finishCallback = finishCallback;
+    segmentation->userData = userData;
 
     return ARMEDIA_OK;
-fillzeros_error:
-    return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
 }
 
-eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_AddSample (ARMEDIA_VideoEncapsuler_t *encapsuler, ARMEDIA_Sample_Header_t *sampleHeader)
+eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_SetDurabilityPolicy (ARMEDIA_VideoEncapsuler_t *encapsuler, eARMEDIA_ENCAPSULER_DURABILITY policy, uint32_t value)
 {
-    uint8_t *data;
     if (NULL == encapsuler)
     {
         ENCAPSULER_ERROR ("encapsuler pointer must not be null");
         return ARMEDIA_ERROR_BAD_PARAMETER;
     }
-
-    if (encapsuler->got_iframe == 0)
+    if ((ARMEDIA_ENCAPSULER_DURABILITY_GOP > policy) || (ARMEDIA_ENCAPSULER_DURABILITY_MAX <= policy))
     {
-        ENCAPSULER_DEBUG("Waiting for Iframe");
-        return ARMEDIA_ERROR_ENCAPSULER_WAITING_FOR_IFRAME;
+        ENCAPSULER_ERROR ("Bad durability policy (%d)", policy);
+        return ARMEDIA_ERROR_BAD_PARAMETER;
     }
-
-    ARMEDIA_Audio_t* audio;
-    if (NULL == sampleHeader)
+    if (((ARMEDIA_ENCAPSULER_DURABILITY_PERIOD == policy) || (ARMEDIA_ENCAPSULER_DURABILITY_SIZE == policy)) && (0 == value))
     {
-        ENCAPSULER_ERROR ("sample pointer must not be null");
+        ENCAPSULER_ERROR ("Durability period/size must not be null");
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
+    if (encapsuler->got_iframe)
+    {
+        ENCAPSULER_ERROR ("The durability policy can not be changed once the recording has started");
         return ARMEDIA_ERROR_BAD_PARAMETER;
     }
 
-    if (!sampleHeader->sample_size)
+    encapsuler->durabilityPolicy = policy;
+    encapsuler->durabilityValue = value;
+    ARMEDIA_FileWriter_SetWriteback (encapsuler->writer, (ARMEDIA_ENCAPSULER_DURABILITY_NEVER != policy) ? WRITEBACK_SIZE : 0);
+
+    return ARMEDIA_OK;
+}
+
+eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_SetCheckpointInterval (ARMEDIA_VideoEncapsuler_t *encapsuler, uint32_t interval)
+{
+    if (NULL == encapsuler)
     {
-        // Do nothing
-        ENCAPSULER_DEBUG ("Empty sample\n");
-        return ARMEDIA_OK;
+        ENCAPSULER_ERROR ("encapsuler pointer must not be null");
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
+    if (encapsuler->got_iframe)
+    {
+        ENCAPSULER_ERROR ("The checkpoint interval can not be changed once the recording has started");
+        return ARMEDIA_ERROR_BAD_PARAMETER;
     }
 
-    // check sample data
-    if (NULL == sampleHeader->sample)
+    encapsuler->checkpointInterval = interval;
+    if (0 != interval)
     {
-        ENCAPSULER_ERROR ("Unable to get sample data (%d bytes)", sampleHeader->sample_size);
-        return ARMEDIA_ERROR_ENCAPSULER;
+        encapsuler->sidecarFlags |= ARMEDIA_SIDECAR_FLAG_CHECKPOINTS;
+    }
+    else
+    {
+        encapsuler->sidecarFlags &= ~ARMEDIA_SIDECAR_FLAG_CHECKPOINTS;
     }
 
-    data = sampleHeader->sample;
+    return ARMEDIA_OK;
+}
 
-    // First sample
-    if ((encapsuler->got_audio == 0) && (encapsuler->audio == NULL))
+static uint64_t ARMEDIA_VideoEncapsuler_GetSystemWritebackDelay (void)
+{
+    uint64_t delay = SYSTEM_WRITEBACK_DELAY;
+#if defined(__linux__)
+    FILE *expireFile = fopen ("/proc/sys/vm/dirty_expire_centisecs", "r");
+    FILE *writebackFile = fopen ("/proc/sys/vm/dirty_writeback_centisecs", "r");
+    unsigned int expire = 0, writeback = 0;
+    if ((NULL != expireFile) && (NULL != writebackFile) &&
+        (1 == fscanf (expireFile, "%u", &expire)) &&
+        (1 == fscanf (writebackFile, "%u", &writeback)))
     {
-        // Init audio data
-        encapsuler->audio = (ARMEDIA_Audio_t*) malloc (sizeof(ARMEDIA_Audio_t));
-        if (encapsuler->audio != NULL) {
-            encapsuler->got_audio = 1;
-        } else {
-            ENCAPSULER_ERROR ("Unable to allocate audio structure");
-            return ARMEDIA_ERROR_ENCAPSULER;
-        }
-        encapsuler->audio->format = sampleHeader->format;
-        encapsuler->audio->codec = sampleHeader->codec;
-        encapsuler->audio->nchannel = sampleHeader->nchannel;
-        encapsuler->audio->freq = sampleHeader->frequency;
-        encapsuler->audio->defaultSampleDuration = ((uint64_t)sampleHeader->sample_size*8000000 / (sampleHeader->nchannel*sampleHeader->format)) / sampleHeader->frequency;
-        encapsuler->audio->sampleCount = 0;
-        encapsuler->audio->totalsize = 0;
-        encapsuler->audio->lastSampleTimestamp = 0;
-        encapsuler->audio->theoreticalts = encapsuler->video->firstFrameTimestamp;
-        encapsuler->audio->stscEntries = 0;
-        encapsuler->audio->lastChunkSize = 0;
-
-        // Rewrite encapsuler info
-        fseeko(encapsuler->metaFile, (off_t)sizeof(uint32_t), SEEK_SET);
-        if (1 != fwrite (encapsuler, sizeof(ARMEDIA_VideoEncapsuler_t), 1, encapsuler->metaFile))
-        {
-            ENCAPSULER_ERROR ("Unable to rewrite encapsuler descriptor");
-            return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
-        }
-        // Write Audio info
-        off_t offset = sizeof(uint32_t) /*descriptor*/ + sizeof(ARMEDIA_VideoEncapsuler_t) + sizeof(ARMEDIA_Video_t) + sizeof(ARMEDIA_Metadata_t);
-        offset += encapsuler->video->spsSize + encapsuler->video->ppsSize;
-        fseeko(encapsuler->metaFile, offset, SEEK_SET);
-        if (1 != fwrite (encapsuler->audio, sizeof (ARMEDIA_Audio_t), 1, encapsuler->metaFile))
-        {
-            ENCAPSULER_ERROR ("Unable to write audio descriptor");
-            return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
-        }
-        fseeko(encapsuler->metaFile, 0, SEEK_END); // return to the end of file
+        delay = ((uint64_t)expire + writeback) * 10;
     }
-
-    audio = encapsuler->audio;
-    if ((encapsuler->got_audio != 0) && (audio != NULL))
+    if (NULL != expireFile)
     {
-        // Write audio data
-
-        // if frame TS is null, set it as last TS + default duration (from fps)
-        if (sampleHeader->timestamp == 0) {
-            sampleHeader->timestamp = audio->lastSampleTimestamp + audio->defaultSampleDuration;
-        }
-        // For first frame, no previous timestamp => dt = 0
-        if (audio->lastSampleTimestamp == 0) {
-            audio->lastSampleTimestamp = sampleHeader->timestamp;
-        }
-
-#if ENCAPSULER_LOG_TIMESTAMPS
-        fprintf(tslogger, "A;%"PRIu64"\n", sampleHeader->timestamp);
+        fclose (expireFile);
+    }
+    if (NULL != writebackFile)
+    {
+        fclose (writebackFile);
+    }
 #endif
-        uint32_t newSize = sampleHeader->sample_size;
-        uint8_t* newData = data;
+    return delay;
+}
 
-        // synchronisation
-        int64_t tsdiff = sampleHeader->timestamp - audio->theoreticalts;
-        int32_t zlen = 0;
-        if (tsdiff > ADRIFT_LIMIT) {
-            ENCAPSULER_DEBUG("Audio drift too high (%"PRId64"µs) on %uth sample\n", tsdiff, audio->sampleCount);
-            audio->theoreticalts += tsdiff;
-            zlen = (tsdiff * audio->freq / 1000000) * (audio->nchannel * audio->format / 8);
-            eARMEDIA_ERROR error = ARMEDIA_FillZeros(encapsuler->dataFile, zlen);
-            if (error != ARMEDIA_OK) {
-                ENCAPSULER_ERROR ("Unable to write zeros into data file");
-                return error;
-            }
-        }
-        else if (tsdiff < -ADRIFT_LIMIT)
-        {
-            ENCAPSULER_DEBUG("Audio drift too low (%"PRId64"µs) on %uth sample\n", tsdiff, audio->sampleCount);
-            audio->theoreticalts += tsdiff;
-            zlen = (tsdiff * audio->freq / 1000000) * (audio->nchannel * audio->format / 8);
-            if (((uint32_t)-zlen) >= sampleHeader->sample_size) {
-                ENCAPSULER_ERROR ("Timestamp anterior to previous sample");
-                return ARMEDIA_ERROR_ENCAPSULER_BAD_TIMESTAMP;
-            }
-            newSize += zlen;
-            newData -= zlen;
-        }
-        uint32_t newChunkSize = sampleHeader->sample_size + zlen;
+eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_GetDataLossWindow (ARMEDIA_VideoEncapsuler_t *encapsuler, uint32_t *windowMs)
+{
+    ARMEDIA_Video_t *video;
+    uint64_t window = 0; // in usec
 
-        if (audio->lastChunkSize != newChunkSize) {
-            audio->lastChunkSize = newChunkSize;
-            audio->stscEntries++;
-        }
+    if ((NULL == encapsuler) || (NULL == windowMs))
+    {
+        ENCAPSULER_ERROR ("encapsuler and windowMs pointers must not be null");
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
+    video = encapsuler->video;
 
-        uint32_t infoLen;
-        char infoData [ENCAPSULER_INFODATA_MAX_SIZE] = {0};
-        snprintf (infoData, ENCAPSULER_INFODATA_MAX_SIZE, ARMEDIA_ENCAPSULER_INFO_PATTERN,
-                ARMEDIA_ENCAPSULER_AUDIO_INFO_TAG,
-                (long long)newChunkSize,
-                'm',
-                (uint32_t)(sampleHeader->timestamp - audio->lastSampleTimestamp)); // Chunk duration (in usec)
-        infoLen = strlen (infoData);
-        if (infoLen != fwrite (infoData, 1, infoLen, encapsuler->metaFile))
+    switch (encapsuler->durabilityPolicy)
+    {
+    case ARMEDIA_ENCAPSULER_DURABILITY_NEVER:
+        window = ARMEDIA_VideoEncapsuler_GetSystemWritebackDelay () * 1000;
+        break;
+    case ARMEDIA_ENCAPSULER_DURABILITY_PERIOD:
+        // the sync happens on the first frame after the period
+        window = (uint64_t)encapsuler->durabilityValue * 1000 + video->defaultFrameDuration;
+        // fall through
+    default:
+        if (window < encapsuler->maxSyncInterval)
         {
-            ENCAPSULER_ERROR ("Unable to write sampleInfo into info file");
-            return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+            window = encapsuler->maxSyncInterval;
         }
-
-        audio->theoreticalts += audio->defaultSampleDuration;
-        audio->lastSampleTimestamp = sampleHeader->timestamp;
-        audio->sampleCount++;
-
-        if (newSize != fwrite (newData, 1, newSize, encapsuler->dataFile))
+        if ((0 != encapsuler->lastSyncTimestamp) &&
+            (window < video->lastFrameTimestamp - encapsuler->lastSyncTimestamp))
         {
-            ENCAPSULER_ERROR ("Unable to write sample into data file");
-            return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+            window = video->lastFrameTimestamp - encapsuler->lastSyncTimestamp;
         }
-
-        audio->totalsize += sampleHeader->sample_size + zlen;
+        break;
     }
-    else
+
+    // Frames waiting in the writer queue or in a chunk are not written yet
+    if (0 != window)
     {
-        // issue
-        ENCAPSULER_ERROR ("Issue while getting audio sample (%u - %p)\n", encapsuler->got_audio, encapsuler->audio);
-        return ARMEDIA_ERROR_ENCAPSULER;
+        window += (uint64_t)encapsuler->queueSize * video->defaultFrameDuration + encapsuler->chunkDuration;
     }
+    *windowMs = (uint32_t)(window / 1000);
 
     return ARMEDIA_OK;
 }
 
-eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_Finish (ARMEDIA_VideoEncapsuler_t **encapsuler)
+eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_GetQueueDepth (ARMEDIA_VideoEncapsuler_t *encapsuler, uint32_t *depth, uint32_t *maxDepth, uint32_t *droppedCount)
 {
-    eARMEDIA_ERROR localError = ARMEDIA_OK;
-    ARMEDIA_VideoEncapsuler_t* encaps = NULL;
-    ARMEDIA_Video_t *video = NULL;
-    ARMEDIA_Audio_t *audio = NULL;
-    ARMEDIA_Metadata_t *metadata = NULL;
+    if (NULL == encapsuler)
+    {
+        ENCAPSULER_ERROR ("encapsuler pointer must not be null");
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
 
-    // Create internal buffers
-    // video
-    uint32_t *frameSizeBufferNE   = NULL;
-    uint64_t *videoOffsetBuffer   = NULL;
-    uint32_t *frameTimeSyncBuffer = NULL;
-    uint32_t *metadataTimeSyncBuffer = NULL;
-    uint32_t *iFrameIndexBuffer   = NULL;
-    // metadata
-    uint64_t *metadataOffsetBuffer = NULL;
-    // audio
-    uint64_t *audioOffsetBuffer = NULL;
-    uint32_t *audioStscBuffer   = NULL;
-
-    struct tm *nowTm;
-    uint32_t nbFrames = 0;
-    uint32_t nbaChunks = 0;
-    uint32_t nbtFrames = 0;
+    ARMEDIA_FileWriter_GetQueueDepth (encapsuler->writer, depth, maxDepth);
+    if (NULL != droppedCount)
+    {
+        *droppedCount = encapsuler->droppedCount;
+    }
 
-#if ENCAPSULER_LOG_TIMESTAMPS
-    fclose(tslogger);
-#endif
+    return ARMEDIA_OK;
+}
+
+eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_Flush (ARMEDIA_VideoEncapsuler_t *encapsuler)
+{
+    eARMEDIA_ERROR error;
 
     if (NULL == encapsuler)
     {
-        ENCAPSULER_ERROR ("encapsuler double pointer must not be null");
-        localError = ARMEDIA_ERROR_BAD_PARAMETER;
+        ENCAPSULER_ERROR ("encapsuler pointer must not be null");
+        return ARMEDIA_ERROR_BAD_PARAMETER;
     }
 
-    if (encapsuler && (NULL == *encapsuler))
+    error = ARMEDIA_VideoEncapsuler_WritePendingChunks (encapsuler);
+    if (ARMEDIA_OK != error)
     {
-        ENCAPSULER_ERROR ("encapsuler pointer must not be null");
-        localError = ARMEDIA_ERROR_BAD_PARAMETER;
+        return error;
+    }
+    return ARMEDIA_FileWriter_Flush (encapsuler->writer);
+}
+
+static void ARMEDIA_VideoEncapsuler_TransferAudioDescriptor (ARMEDIA_VideoEncapsuler_t *encapsuler, ARMEDIA_Sidecar_Stream_t *stream)
+{
+    ARMEDIA_Audio_t *audio = encapsuler->audio;
+    uint8_t codec = 0;
+    uint16_t format = 0;
+    uint32_t reserved = 0;
+
+    ARMEDIA_Sidecar_U8 (stream, &encapsuler->got_audio);
+    if (encapsuler->got_audio && (NULL != audio))
+    {
+        codec = (uint8_t)audio->codec;
+        format = (uint16_t)audio->format;
+        ARMEDIA_Sidecar_U8 (stream, &codec);
+        ARMEDIA_Sidecar_U16 (stream, &format);
+        ARMEDIA_Sidecar_U16 (stream, &audio->nchannel);
+        ARMEDIA_Sidecar_U16 (stream, &audio->freq);
+        ARMEDIA_Sidecar_U32 (stream, &audio->defaultSampleDuration);
+        ARMEDIA_Sidecar_U32 (stream, &reserved);
+        audio->codec = (eARMEDIA_ENCAPSULER_AUDIO_CODEC)codec;
+        audio->format = (eARMEDIA_ENCAPSULER_AUDIO_FORMAT)format;
     }
     else
     {
-        encaps = *encapsuler;
-        if (NULL == encaps->video)
-        {
-            ENCAPSULER_ERROR ("video pointer must not be null");
-            localError = ARMEDIA_ERROR_BAD_PARAMETER;
-        }
+        encapsuler->got_audio = 0;
     }
+}
 
-    if (ARMEDIA_OK == localError)
+static void ARMEDIA_VideoEncapsuler_TransferUntimedMetadata (ARMEDIA_Untimed_Metadata_t *metadata, ARMEDIA_Sidecar_Stream_t *stream)
+{
+    int k;
+
+    ARMEDIA_Sidecar_Bytes (stream, metadata->maker, sizeof (metadata->maker));
+    ARMEDIA_Sidecar_Bytes (stream, metadata->model, sizeof (metadata->model));
+    ARMEDIA_Sidecar_Bytes (stream, metadata->modelId, sizeof (metadata->modelId));
+    ARMEDIA_Sidecar_Bytes (stream, metadata->serialNumber, sizeof (metadata->serialNumber));
+    ARMEDIA_Sidecar_Bytes (stream, metadata->softwareVersion, sizeof (metadata->softwareVersion));
+    ARMEDIA_Sidecar_Bytes (stream, metadata->buildId, sizeof (metadata->buildId));
+    ARMEDIA_Sidecar_Bytes (stream, metadata->artist, sizeof (metadata->artist));
+    ARMEDIA_Sidecar_Bytes (stream, metadata->title, sizeof (metadata->title));
+    ARMEDIA_Sidecar_Bytes (stream, metadata->comment, sizeof (metadata->comment));
+    ARMEDIA_Sidecar_Bytes (stream, metadata->copyright, sizeof (metadata->copyright));
+    ARMEDIA_Sidecar_Bytes (stream, metadata->mediaDate, sizeof (metadata->mediaDate));
+    ARMEDIA_Sidecar_Bytes (stream, metadata->runDate, sizeof (metadata->runDate));
+    ARMEDIA_Sidecar_Bytes (stream, metadata->runUuid, sizeof (metadata->runUuid));
+    ARMEDIA_Sidecar_Double (stream, &metadata->takeoffLatitude);
+    ARMEDIA_Sidecar_Double (stream, &metadata->takeoffLongitude);
+    ARMEDIA_Sidecar_Float (stream, &metadata->takeoffAltitude);
+    ARMEDIA_Sidecar_Float (stream, &metadata->pictureHFov);
+    ARMEDIA_Sidecar_Float (stream, &metadata->pictureVFov);
+    for (k = 0; k < ARMEDIA_ENCAPSULER_UNTIMED_METADATA_CUSTOM_MAX_COUNT; k++)
     {
-        video = encaps->video; // ease of reading
-        audio = encaps->audio; // ease of reading
-        metadata = encaps->metadata; // ease of reading
-        if (!video->width)
-        {
-            // Video was not initialized
-            ENCAPSULER_ERROR ("video was not initialized");
-            localError =  ARMEDIA_ERROR_BAD_PARAMETER;
-        } // No else
+        ARMEDIA_Sidecar_Bytes (stream, metadata->custom[k].key, sizeof (metadata->custom[k].key));
+        ARMEDIA_Sidecar_Bytes (stream, metadata->custom[k].value, sizeof (metadata->custom[k].value));
     }
+}
 
-    // alloc all buffers for metadata writings
-    if (ARMEDIA_OK == localError)
+/* Describe everything ARMEDIA_VideoEncapsuler_Finish() needs to rebuild the
+ * media from the data file and the records. When reading, the video and
+ * metadata structures must be allocated, the SPS/PPS are allocated here. */
+static eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_TransferDescriptor (ARMEDIA_VideoEncapsuler_t *encapsuler, ARMEDIA_Sidecar_Stream_t *stream)
+{
+    ARMEDIA_Video_t *video = encapsuler->video;
+    uint64_t tmp64;
+    uint32_t tmp32;
+
+    ARMEDIA_Sidecar_U32 (stream, &encapsuler->timescale);
+    tmp64 = (uint64_t)encapsuler->creationTime;
+    ARMEDIA_Sidecar_U64 (stream, &tmp64);
+    encapsuler->creationTime = (time_t)tmp64;
+    tmp64 = (uint64_t)encapsuler->mdatAtomOffset;
+    ARMEDIA_Sidecar_U64 (stream, &tmp64);
+    encapsuler->mdatAtomOffset = (off_t)tmp64;
+    tmp64 = (uint64_t)encapsuler->dataOffset;
+    ARMEDIA_Sidecar_U64 (stream, &tmp64);
+    encapsuler->dataOffset = (off_t)tmp64;
+    ARMEDIA_Sidecar_Bytes (stream, encapsuler->uuid, sizeof (encapsuler->uuid));
+    ARMEDIA_Sidecar_Bytes (stream, encapsuler->runDate, sizeof (encapsuler->runDate));
+    tmp32 = (uint32_t)encapsuler->product;
+    ARMEDIA_Sidecar_U32 (stream, &tmp32);
+    encapsuler->product = (eARDISCOVERY_PRODUCT)tmp32;
+    ARMEDIA_Sidecar_Bytes (stream, encapsuler->dataFilePath, sizeof (encapsuler->dataFilePath));
+    ARMEDIA_Sidecar_Bytes (stream, encapsuler->tempFilePath, sizeof (encapsuler->tempFilePath));
+    ARMEDIA_Sidecar_Bytes (stream, encapsuler->thumbnailFilePath, sizeof (encapsuler->thumbnailFilePath));
+    ARMEDIA_Sidecar_U8 (stream, &encapsuler->got_untimed_metadata);
+    ARMEDIA_VideoEncapsuler_TransferUntimedMetadata (&encapsuler->untimed_metadata, stream);
+
+    // Video
+    ARMEDIA_Sidecar_U32 (stream, &video->fps);
+    ARMEDIA_Sidecar_U32 (stream, &video->defaultFrameDuration);
+    tmp32 = (uint32_t)video->codec;
+    ARMEDIA_Sidecar_U32 (stream, &tmp32);
+    video->codec = (eARMEDIA_ENCAPSULER_VIDEO_CODEC)tmp32;
+    ARMEDIA_Sidecar_U16 (stream, &video->width);
+    ARMEDIA_Sidecar_U16 (stream, &video->height);
+    ARMEDIA_Sidecar_U16 (stream, &video->spsSize);
+    ARMEDIA_Sidecar_U16 (stream, &video->ppsSize);
+    if (stream->reading && !stream->error)
     {
-        // Init internal buffers
-        frameSizeBufferNE   = calloc (video->framesCount, sizeof (uint32_t));
-        videoOffsetBuffer   = calloc (video->framesCount, sizeof (uint64_t));
-        frameTimeSyncBuffer = calloc (2*video->framesCount, sizeof (uint32_t));
-        metadataTimeSyncBuffer = calloc (2*video->framesCount, sizeof (uint32_t));
-        if (encaps->got_metadata && metadata != NULL && metadata->block_size > 0)
+        video->sps = (video->spsSize > 0) ? (uint8_t*) malloc (video->spsSize) : NULL;
+        video->pps = (video->ppsSize > 0) ? (uint8_t*) malloc (video->ppsSize) : NULL;
+        if (((video->spsSize > 0) && (NULL == video->sps)) ||
+            ((video->ppsSize > 0) && (NULL == video->pps)))
         {
-            metadataOffsetBuffer = calloc (metadata->framesCount, sizeof (uint64_t));
-        }
-        if (video->codec == CODEC_MPEG4_AVC) {
-            iFrameIndexBuffer = calloc (video->framesCount, sizeof (uint32_t));
-        }
-        if (encaps->got_audio) {
-            audioOffsetBuffer = calloc (audio->sampleCount, sizeof (uint64_t));
-            audioStscBuffer = calloc(audio->stscEntries*3, sizeof (uint32_t));
+            ENCAPSULER_ERROR ("Unable to allocate video sps/pps");
+            return ARMEDIA_ERROR_ENCAPSULER;
         }
+    }
+    if (video->spsSize > 0)
+    {
+        ARMEDIA_Sidecar_Bytes (stream, video->sps, video->spsSize);
+    }
+    if (video->ppsSize > 0)
+    {
+        ARMEDIA_Sidecar_Bytes (stream, video->pps, video->ppsSize);
+    }
 
-        if (NULL == frameSizeBufferNE   ||
-                NULL == videoOffsetBuffer   ||
-                NULL == frameTimeSyncBuffer ||
-                NULL == metadataTimeSyncBuffer ||
-                (encaps->got_metadata && metadata != NULL && metadata->block_size > 0
-                 && NULL == metadataOffsetBuffer) ||
-                (NULL == iFrameIndexBuffer && video->codec == CODEC_MPEG4_AVC) ||
-                (encaps->got_audio && (NULL == audioOffsetBuffer ||
-                                       NULL == audioStscBuffer)))
-        {
-            ENCAPSULER_ERROR ("Unable to allocate buffers for video finish");
+    // Timed metadata
+    ARMEDIA_Sidecar_U8 (stream, &encapsuler->got_metadata);
+    if (encapsuler->got_metadata && (NULL != encapsuler->metadata))
+    {
+        ARMEDIA_Metadata_t *metadata = encapsuler->metadata;
+        ARMEDIA_Sidecar_U32 (stream, &metadata->block_size);
+        ARMEDIA_Sidecar_Bytes (stream, metadata->content_encoding, sizeof (metadata->content_encoding));
+        ARMEDIA_Sidecar_Bytes (stream, metadata->mime_format, sizeof (metadata->mime_format));
+    }
+    else
+    {
+        encapsuler->got_metadata = 0;
+    }
+
+    // Optional fields, absent from the descriptors of the older writers
+    if (!stream->reading || (stream->pos < stream->size))
+    {
+        ARMEDIA_Sidecar_U32 (stream, &encapsuler->timestampTolerance);
+    }
 
-            ENCAPSULER_CLEANUP(free, frameSizeBufferNE);
-            ENCAPSULER_CLEANUP(free, videoOffsetBuffer);
-            ENCAPSULER_CLEANUP(free, frameTimeSyncBuffer);
-            ENCAPSULER_CLEANUP(free, metadataTimeSyncBuffer);
-            ENCAPSULER_CLEANUP(free, metadataOffsetBuffer);
-            ENCAPSULER_CLEANUP(free, iFrameIndexBuffer);
-            ENCAPSULER_CLEANUP(free, audioOffsetBuffer);
-            ENCAPSULER_CLEANUP(free, audioStscBuffer);
+    return stream->error ? ARMEDIA_ERROR_ENCAPSULER : ARMEDIA_OK;
+}
 
-            localError = ARMEDIA_ERROR_ENCAPSULER;
-        }
+static eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_WriteSidecarHeader (ARMEDIA_VideoEncapsuler_t *encapsuler)
+{
+    ARMEDIA_Sidecar_Stream_t stream;
+    ARMEDIA_Sidecar_Prefix_t prefix;
+    uint8_t *header;
+    eARMEDIA_ERROR error;
+
+    // Get the descriptor size
+    memset (&stream, 0, sizeof (stream));
+    ARMEDIA_VideoEncapsuler_TransferDescriptor (encapsuler, &stream);
+
+    prefix.version = ARMEDIA_ENCAPSULER_VERSION_NUMBER;
+    prefix.flags = encapsuler->sidecarFlags;
+    prefix.headerSize = (uint32_t)(ARMEDIA_SIDECAR_PREFIX_SIZE + ARMEDIA_SIDECAR_AUDIO_SIZE + stream.pos);
+    prefix.recordSize = ARMEDIA_SIDECAR_RECORD_SIZE;
+
+    header = (uint8_t*) calloc (1, prefix.headerSize);
+    if (NULL == header)
+    {
+        ENCAPSULER_ERROR ("Unable to allocate the descriptor (%u bytes)", prefix.headerSize);
+        return ARMEDIA_ERROR_ENCAPSULER;
     }
+    ARMEDIA_Sidecar_EncodePrefix (header, &prefix);
 
+    memset (&stream, 0, sizeof (stream));
+    stream.buffer = header + ARMEDIA_SIDECAR_AUDIO_OFFSET;
+    stream.size = ARMEDIA_SIDECAR_AUDIO_SIZE;
+    ARMEDIA_VideoEncapsuler_TransferAudioDescriptor (encapsuler, &stream);
 
-    if (ARMEDIA_OK == localError)
+    memset (&stream, 0, sizeof (stream));
+    stream.buffer = header + ARMEDIA_SIDECAR_PREFIX_SIZE + ARMEDIA_SIDECAR_AUDIO_SIZE;
+    stream.size = prefix.headerSize - ARMEDIA_SIDECAR_PREFIX_SIZE - ARMEDIA_SIDECAR_AUDIO_SIZE;
+    error = ARMEDIA_VideoEncapsuler_TransferDescriptor (encapsuler, &stream);
+
+    if ((ARMEDIA_OK == error) && (1 != fwrite (header, prefix.headerSize, 1, encapsuler->metaFile)))
     {
-        // Init internal counters
-        uint32_t nbIFrames = 0;
-        uint64_t chunkOffset = encaps->dataOffset;
-        off_t descriptorSize = 0;
+        ENCAPSULER_ERROR ("Unable to write encapsuler descriptor");
+        error = ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+    }
+    encapsuler->sidecarHeaderSize = prefix.headerSize;
+    free (header);
 
-        uint32_t vtimescale = encaps->timescale;
-        // Video time management
-        uint32_t videosttsNentries = 0;
-        uint32_t metadatasttsNentries = 0;
-        uint32_t groupInterFrameDT = 0;
-        uint32_t groupNframes = 0;
-        uint32_t metadataGroupInterFrameDT = 0;
-        uint32_t metadataGroupNframes = 0;
-        uint32_t videoDuration = 0;
-        off_t videoUniqueSize = 0;
+    return error;
+}
 
-        movie_atom_t* moovAtom;         // root
-        movie_atom_t* mvhdAtom;         // > mvhd
-        movie_atom_t* trakAtom;         // > trak
-        movie_atom_t* tkhdAtom;         // | > tkhd
-        movie_atom_t* trefAtom;         // | > tref
-        movie_atom_t* cdscAtom;         // |   > cdsc
-        movie_atom_t* mdiaAtom;         // | > mdia
-        movie_atom_t* mdhdAtom;         // |   > mdhd
-        movie_atom_t* hdlrmdiaAtom;     // |   > hdlr
-        movie_atom_t* minfAtom;         // |   > minf
-        movie_atom_t* hdlrminfAtom;     // |     > hdlr (used only with H264)
-        movie_atom_t* vmhdAtom;         // |     > vmhd
-        movie_atom_t* dinfAtom;         // |     > dinf
-        movie_atom_t* drefAtom;         // |     | > dref
-        movie_atom_t* stblAtom;         // |     > stbl
-        movie_atom_t* stsdAtom;         // |       > stsd
-        movie_atom_t* sttsAtom;         // |       > stts
-        movie_atom_t* stssAtom;         // |       > stss (used only with H264)
-        movie_atom_t* stscAtom;         // |       > stsc
-        movie_atom_t* stszAtom;         // |       > stsz
-        movie_atom_t* stcoAtom;         // |       > stco
-        movie_atom_t* udtaAtom;         // > udta
-        movie_atom_t* xyzUdtaAtom;      // | > xyz
-        movie_atom_t* metaUdtaAtom;     // | > meta
-        movie_atom_t* hdlrMetaUdtaAtom; // |   > hdlr
-        movie_atom_t* ilstMetaUdtaAtom; // |   > ilst
-        movie_atom_t* artistMetaUdtaAtom;   // |     > ART
-        movie_atom_t* titleMetaUdtaAtom;    // |     > nam
-        movie_atom_t* dateMetaUdtaAtom;     // |     > day
-        movie_atom_t* commentMetaUdtaAtom;  // |     > cmt
-        movie_atom_t* copyrightMetaUdtaAtom;// |     > cpy
-        movie_atom_t* makerMetaUdtaAtom;    // |     > mak
-        movie_atom_t* modelMetaUdtaAtom;    // |     > mod
-        movie_atom_t* versionMetaUdtaAtom;  // |     > swr
-        movie_atom_t* encoderMetaUdtaAtom;  // |     > too
-        movie_atom_t* coverMetaUdtaAtom;    // |     > covr
-        movie_atom_t* freeUdtaAtom;         // | > free
-        movie_atom_t* metaAtom;         // > meta
-        movie_atom_t* hdlrMetaAtom;     // | > hdlr
-        movie_atom_t* keysMetaAtom;     // | > keys
-        movie_atom_t* ilstMetaAtom;     // | > ilst
-        movie_atom_t* locationMetaAtom; // |   > com.apple.quicktime.location.ISO6709
-        movie_atom_t* artistMetaAtom;   // |   > com.apple.quicktime.artist
-        movie_atom_t* titleMetaAtom;    // |   > com.apple.quicktime.title
-        movie_atom_t* dateMetaAtom;     // |   > com.apple.quicktime.creationdate
-        movie_atom_t* commentMetaAtom;  // |   > com.apple.quicktime.comment
-        movie_atom_t* copyrightMetaAtom;// |   > com.apple.quicktime.copyright
-        movie_atom_t* makerMetaAtom;    // |   > com.apple.quicktime.make
-        movie_atom_t* modelMetaAtom;    // |   > com.apple.quicktime.model
-        movie_atom_t* versionMetaAtom;  // |   > com.apple.quicktime.software
-        movie_atom_t* coverMetaAtom;    // |   > com.apple.quicktime.artwork
-        movie_atom_t* serialMetaAtom;   // |   > com.parrot.serial
-        movie_atom_t* modelidMetaAtom;  // |   > com.parrot.model.id
-        movie_atom_t* buildidMetaAtom;  // |   > com.parrot.build.id
-        movie_atom_t* runidMetaAtom;    // |   > com.parrot.run.id
-        movie_atom_t* rundateMetaAtom;  // |   > com.parrot.run.date
-        movie_atom_t* customMetaAtom;   // |   > user-defined
-        movie_atom_t* picturehfovMetaAtom;  // |   > com.parrot.picture.hfov
-        movie_atom_t* picturevfovMetaAtom;  // |   > com.parrot.picture.vfov
-        movie_atom_t* freeMetaAtom;         // | > free
-
-        uint32_t stssDataLen;
-        uint8_t *stssBuffer;
-        uint32_t nenbIFrames;
-
-        // Generate stts atom from frameTimeSyncBuffer
-        uint32_t sttsDataLen;
-        uint8_t *sttsBuffer;
-        uint32_t sttsNentriesNE;
-
-        // Generate stsz atom from frameSizeBufferNE and nbFrames
-        uint32_t nbFramesNE;
-
-        // Generate stco atom from videoOffsetBuffer and nbFrames
-        uint32_t stcoDataLen;
-        uint8_t *stcoBuffer;
-
-        // Read info file
-        rewind (encaps->metaFile);
-
-        // Skip video descriptor
-        if (1 != fread(&descriptorSize, sizeof (uint32_t), 1, encaps->metaFile))
-        {
-            ENCAPSULER_ERROR ("Unable to read descriptor size (probably an old .infovid file)");
-            rewind (encaps->metaFile);
-        }
-        else
+static eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_WriteFrame (ARMEDIA_VideoEncapsuler_t *encapsuler, ARMEDIA_Frame_Header_t *frameHeader, const void *metadataBuffer);
+static off_t ARMEDIA_VideoEncapsuler_GetFrameSize (ARMEDIA_VideoEncapsuler_t *encapsuler, const ARMEDIA_Frame_Header_t *frameHeader);
+static off_t ARMEDIA_VideoEncapsuler_GetDataSize (ARMEDIA_VideoEncapsuler_t *encapsuler);
+static eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_Preallocate (ARMEDIA_VideoEncapsuler_t *encapsuler, off_t size);
+static eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_WriteFullChunks (ARMEDIA_VideoEncapsuler_t *encapsuler, uint64_t timestamp);
+static eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_WriteFullFragment (ARMEDIA_VideoEncapsuler_t *encapsuler, const ARMEDIA_Frame_Header_t *frameHeader);
+static eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_AddTsStreams (ARMEDIA_VideoEncapsuler_t *encapsuler);
+static off_t ARMEDIA_VideoEncapsuler_GetTsFrameSize (ARMEDIA_VideoEncapsuler_t *encapsuler, const ARMEDIA_Frame_Header_t *frameHeader, const void *metadataBuffer);
+static eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_WriteTsFrame (ARMEDIA_VideoEncapsuler_t *encapsuler, ARMEDIA_Frame_Header_t *frameHeader, const void *metadataBuffer);
+
+static eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_ReserveNalus (ARMEDIA_VideoEncapsuler_t *encapsuler, uint32_t count)
+{
+    if (count > encapsuler->naluCapacity)
+    {
+        uint32_t capacity = (count < 16) ? 16 : count;
+        ARMEDIA_Nalu_t *nalus = realloc (encapsuler->nalus, capacity * sizeof (*nalus));
+        if (NULL == nalus)
         {
-            fseeko(encaps->metaFile, descriptorSize, SEEK_CUR);
-        }
-
-        uint32_t interframeDT;
-        uint64_t tmpinterframeDT;
-        off_t lastChunkSize = 0;
-        uint32_t cptAudioStsc = 0;
-        while (!feof(encaps->metaFile))
-        {
-            long long fSize_tmp;
-            off_t fSize = 0;
-            char fType = '\0';
-            char dataType = '\0';
-            int readPatterns;
-            // video
-            interframeDT = 0;
-            tmpinterframeDT = 0;
-            readPatterns = fscanf (encaps->metaFile, ARMEDIA_ENCAPSULER_INFO_PATTERN,
-                    &dataType, &fSize_tmp,
-                    &fType, &interframeDT);
-            if (ARMEDIA_ENCAPSULER_NUM_MATCH_PATTERN == readPatterns)
-            {
-                fSize = fSize_tmp;
-                if (dataType == ARMEDIA_ENCAPSULER_VIDEO_INFO_TAG) // video
-                {
-                    frameSizeBufferNE[nbFrames] = htonl (fSize);
-                    uint64_t n_co_l = htonl(chunkOffset & 0xffffffff);
-                    uint64_t n_co_h = htonl(chunkOffset >> 32);
-                    videoOffsetBuffer[nbFrames] = (n_co_l << 32) + n_co_h;
-
-                    // from microseconds to time units
-                    tmpinterframeDT = ((uint64_t)vtimescale) * ((uint64_t) interframeDT);
-                    interframeDT = (uint32_t)(tmpinterframeDT / 1000000);
-                    // Time sync mgmt
-                    if (interframeDT != 0) {
-                        // not first frame
-                        if (interframeDT != groupInterFrameDT) {
-                            // new entry => save previous entry and create a new one
-                            if (groupInterFrameDT != 0) { // not first group
-                                frameTimeSyncBuffer[2*videosttsNentries] = htonl(groupNframes);
-                                frameTimeSyncBuffer[2*videosttsNentries+1] = htonl(groupInterFrameDT);
-                                videoDuration += groupNframes * groupInterFrameDT;
-                                videosttsNentries++;
-                            }
-                            groupNframes = 1;
-                            groupInterFrameDT = interframeDT;
-                        } else {
-                            // use previous entry
-                            groupNframes++;
-                        }
-
-                        // size mgmt
-                        if (videoUniqueSize != 0 && videoUniqueSize != fSize) {
-                            videoUniqueSize = 0;
-                        }
-                    } else {
-                        // first frame => no DT
-                        videoUniqueSize = fSize;
-                    }
-
-                    nbFrames++;
-
-                    if (('i' == fType) && (video->codec == CODEC_MPEG4_AVC))
-                    {
-                        iFrameIndexBuffer [nbIFrames++] = htonl (nbFrames);
-                    }
-                }
-                else if (dataType == ARMEDIA_ENCAPSULER_AUDIO_INFO_TAG) // audio
-                {
-                    uint64_t n_co_l = htonl(chunkOffset & 0xffffffff);
-                    uint64_t n_co_h = htonl(chunkOffset >> 32);
-                    audioOffsetBuffer[nbaChunks] = (n_co_l << 32) + n_co_h;
-                    nbaChunks++;
-
-                    if (lastChunkSize != fSize) {
-                        // add stsc entry
-                        uint32_t nSampleInChunk = fSize * 8*sizeof(uint8_t) / (audio->nchannel*audio->format);
-                        audioStscBuffer[3*cptAudioStsc] = htonl(nbaChunks);
-                        audioStscBuffer[3*cptAudioStsc+1] = htonl(nSampleInChunk);
-                        audioStscBuffer[3*cptAudioStsc+2] = htonl(1);
-                        cptAudioStsc++;
-                        lastChunkSize = fSize;
-                    }
-                }
-                else if (dataType == ARMEDIA_ENCAPSULER_METADATA_INFO_TAG)
-                {
-                    uint64_t n_co_l = htonl(chunkOffset & 0xffffffff);
-                    uint64_t n_co_h = htonl(chunkOffset >> 32);
-                    metadataOffsetBuffer[nbtFrames] = (n_co_l << 32) + n_co_h;
-
-                    // from microseconds to time units
-                    tmpinterframeDT = ((uint64_t)vtimescale) * ((uint64_t) interframeDT);
-                    interframeDT = (uint32_t)(tmpinterframeDT / 1000000);
-                    // Time sync mgmt
-                    if (interframeDT != 0) {
-                        // not first frame
-                        if (interframeDT != metadataGroupInterFrameDT) {
-                            // new entry => save previous entry and create a new one
-                            if (metadataGroupInterFrameDT != 0) { // not first group
-                                metadataTimeSyncBuffer[2*metadatasttsNentries] = htonl(metadataGroupNframes);
-                                metadataTimeSyncBuffer[2*metadatasttsNentries+1] = htonl(metadataGroupInterFrameDT);
-                                metadatasttsNentries++;
-                            }
-                            metadataGroupNframes = 1;
-                            metadataGroupInterFrameDT = interframeDT;
-                        } else {
-                            // use previous entry
-                            metadataGroupNframes++;
-                        }
-                    }
-
-                    nbtFrames++;
-                }
-                chunkOffset += fSize; // common computation of chunk offset
-            }
+            ENCAPSULER_ERROR ("Unable to allocate the NALU list");
+            return ARMEDIA_ERROR_ENCAPSULER;
         }
+        encapsuler->nalus = nalus;
+        encapsuler->naluCapacity = capacity;
+    }
+    return ARMEDIA_OK;
+}
 
-        // last frame to default DT + last entry
-        // from microseconds to time units
-        tmpinterframeDT = ((uint64_t)vtimescale) * ((uint64_t) video->defaultFrameDuration);
-        interframeDT = (uint32_t)(tmpinterframeDT / 1000000);
-        if (groupInterFrameDT == interframeDT) { // add last frame to previous entry
-            groupNframes++;
-        } else { // write previous entry then add last frame to new entry
-            if (groupInterFrameDT != 0) { // not first group
-                frameTimeSyncBuffer[2*videosttsNentries] = htonl(groupNframes);
-                frameTimeSyncBuffer[2*videosttsNentries+1] = htonl(groupInterFrameDT);
-                videoDuration += groupNframes * groupInterFrameDT;
-                videosttsNentries++;
-            }
-            groupNframes = 1;
-            groupInterFrameDT = interframeDT;
-        }
-        frameTimeSyncBuffer[2*videosttsNentries] = htonl(groupNframes);
-        frameTimeSyncBuffer[2*videosttsNentries+1] = htonl(groupInterFrameDT);
-        videoDuration += groupNframes * groupInterFrameDT;
-        videosttsNentries++;
-
-        // last frame to default DT + last entry
-        // from microseconds to time units
-        tmpinterframeDT = ((uint64_t)vtimescale) * ((uint64_t) video->defaultFrameDuration);
-        interframeDT = (uint32_t)(tmpinterframeDT / 1000000);
-        if (metadataGroupInterFrameDT == interframeDT) { // add last frame to previous entry
-            metadataGroupNframes++;
-        } else { // write previous entry then add last frame to new entry
-            if (metadataGroupInterFrameDT != 0) { // not first group
-                metadataTimeSyncBuffer[2*metadatasttsNentries] = htonl(metadataGroupNframes);
-                metadataTimeSyncBuffer[2*metadatasttsNentries+1] = htonl(metadataGroupInterFrameDT);
-                metadatasttsNentries++;
-            }
-            metadataGroupNframes = 1;
-            metadataGroupInterFrameDT = interframeDT;
-        }
-        metadataTimeSyncBuffer[2*metadatasttsNentries] = htonl(metadataGroupNframes);
-        metadataTimeSyncBuffer[2*metadatasttsNentries+1] = htonl(metadataGroupInterFrameDT);
-        metadatasttsNentries++;
+/* Size of the Annex-B start code of a NAL unit given as a whole, 0 if there is none */
+static uint32_t ARMEDIA_VideoEncapsuler_GetStartCodeSize (const uint8_t *data, uint32_t size)
+{
+    if ((size >= 3) && (0 == data[0]) && (0 == data[1]) && (1 == data[2]))
+    {
+        return 3;
+    }
+    if ((size >= 4) && (0 == data[0]) && (0 == data[1]) && (0 == data[2]) && (1 == data[3]))
+    {
+        return 4;
+    }
+    return 0;
+}
 
-        // get the local time value
-        nowTm = localtime (&(encaps->creationTime));
+/*
+ * List the parts of a frame into encapsuler->nalus. For H.264, these are the
+ * NALU payloads, written with a 4-byte size instead of their start code.
+ */
+static eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_CollectNalus (ARMEDIA_VideoEncapsuler_t *encapsuler, const ARMEDIA_Frame_Header_t *frameHeader, const struct iovec *iov, uint32_t iovCount)
+{
+    eARMEDIA_ERROR error;
+    uint32_t i, count, offset;
 
-        // create atoms
-        // Generating Atoms
-        moovAtom = atomFromData(0, "moov", NULL);
-
-        // Untimed metadata
-        if (encaps->got_untimed_metadata || strlen(encaps->thumbnailFilePath))
-        {
-            const char *key[ARMEDIA_UNTIMED_METADATA_KEY_MAX + ARMEDIA_ENCAPSULER_UNTIMED_METADATA_CUSTOM_MAX_COUNT];
-            uint32_t keyCount = 0;
-            udtaAtom = atomFromData(0, "udta", NULL);
-            uint32_t zero = 0;
-            metaUdtaAtom = atomFromData(4, "meta", (uint8_t*)&zero);
-            hdlrMetaUdtaAtom = hdlrAtomForUdtaMetadata();
-            ilstMetaUdtaAtom = atomFromData(0, "ilst", NULL);
-            metaAtom = atomFromData(0, "meta", NULL);
-            hdlrMetaAtom = hdlrAtomForMetadata();
-            ilstMetaAtom = atomFromData(0, "ilst", NULL);
-            if ((encaps->got_untimed_metadata) && strlen(encaps->untimed_metadata.artist))
-            {
-                artistMetaUdtaAtom = metadataAtomFromTagAndValue(0, "ART", encaps->untimed_metadata.artist, 1);
-                if (artistMetaUdtaAtom)
-                {
-                    insertAtomIntoAtom(ilstMetaUdtaAtom, &artistMetaUdtaAtom);
-                }
-                key[keyCount] = ARMEDIA_UntimedMetadataKey[ARMEDIA_UNTIMED_METADATA_KEY_ARTIST];
-                if (key[keyCount]) keyCount++;
-                artistMetaAtom = metadataAtomFromTagAndValue(keyCount, NULL, encaps->untimed_metadata.artist, 1);
-                if (artistMetaAtom)
-                {
-                    insertAtomIntoAtom(ilstMetaAtom, &artistMetaAtom);
-                }
-            }
-            else if ((encaps->got_untimed_metadata) && strlen(encaps->untimed_metadata.maker) && strlen(encaps->untimed_metadata.model))
-            {
-                // Build the artist string as maker + model
-                char artist[100];
-                snprintf(artist, sizeof(artist), "%s %s",
-                         encaps->untimed_metadata.maker,
-                         encaps->untimed_metadata.model);
-                artistMetaUdtaAtom = metadataAtomFromTagAndValue(0, "ART", artist, 1);
-                if (artistMetaUdtaAtom)
-                {
-                    insertAtomIntoAtom(ilstMetaUdtaAtom, &artistMetaUdtaAtom);
-                }
-                key[keyCount] = ARMEDIA_UntimedMetadataKey[ARMEDIA_UNTIMED_METADATA_KEY_ARTIST];
-                if (key[keyCount]) keyCount++;
-                artistMetaAtom = metadataAtomFromTagAndValue(keyCount, NULL, artist, 1);
-                if (artistMetaAtom)
-                {
-                    insertAtomIntoAtom(ilstMetaAtom, &artistMetaAtom);
-                }
-            }
-            if ((encaps->got_untimed_metadata) && strlen(encaps->untimed_metadata.title))
-            {
-                titleMetaUdtaAtom = metadataAtomFromTagAndValue(0, "nam", encaps->untimed_metadata.title, 1);
-                if (titleMetaUdtaAtom)
-                {
-                    insertAtomIntoAtom(ilstMetaUdtaAtom, &titleMetaUdtaAtom);
-                }
-                key[keyCount] = ARMEDIA_UntimedMetadataKey[ARMEDIA_UNTIMED_METADATA_KEY_TITLE];
-                if (key[keyCount]) keyCount++;
-                titleMetaAtom = metadataAtomFromTagAndValue(keyCount, NULL, encaps->untimed_metadata.title, 1);
-                if (titleMetaAtom)
-                {
-                    insertAtomIntoAtom(ilstMetaAtom, &titleMetaAtom);
-                }
-            }
-            else if ((encaps->got_untimed_metadata) && strlen(encaps->untimed_metadata.runDate))
-            {
-                // If no title is defined, used the run date
-                titleMetaUdtaAtom = metadataAtomFromTagAndValue(0, "nam", encaps->untimed_metadata.runDate, 1);
-                if (titleMetaUdtaAtom)
-                {
-                    insertAtomIntoAtom(ilstMetaUdtaAtom, &titleMetaUdtaAtom);
-                }
-                key[keyCount] = ARMEDIA_UntimedMetadataKey[ARMEDIA_UNTIMED_METADATA_KEY_TITLE];
-                if (key[keyCount]) keyCount++;
-                titleMetaAtom = metadataAtomFromTagAndValue(keyCount, NULL, encaps->untimed_metadata.runDate, 1);
-                if (titleMetaAtom)
-                {
-                    insertAtomIntoAtom(ilstMetaAtom, &titleMetaAtom);
-                }
-            }
-            if ((encaps->got_untimed_metadata) && strlen(encaps->untimed_metadata.mediaDate))
-            {
-                dateMetaUdtaAtom = metadataAtomFromTagAndValue(0, "day", encaps->untimed_metadata.mediaDate, 1);
-                if (dateMetaUdtaAtom)
-                {
-                    insertAtomIntoAtom(ilstMetaUdtaAtom, &dateMetaUdtaAtom);
-                }
-                key[keyCount] = ARMEDIA_UntimedMetadataKey[ARMEDIA_UNTIMED_METADATA_KEY_DATE];
-                if (key[keyCount]) keyCount++;
-                dateMetaAtom = metadataAtomFromTagAndValue(keyCount, NULL, encaps->untimed_metadata.mediaDate, 1);
-                if (dateMetaAtom)
-                {
-                    insertAtomIntoAtom(ilstMetaAtom, &dateMetaAtom);
-                }
-            }
-            if ((encaps->got_untimed_metadata) && (encaps->untimed_metadata.takeoffLatitude != 500.) && (encaps->untimed_metadata.takeoffLongitude != 500.))
-            {
-                char xyz[100];
-                char *location = xyz + 4;
-                /* ISO 6709 Annex H string expression */
-                snprintf(location, sizeof(xyz) - 4, "%+08.4f%+09.4f/",
-                         encaps->untimed_metadata.takeoffLatitude,
-                         encaps->untimed_metadata.takeoffLongitude);
-                xyz[0] = (strlen(location) >> 8) & 0xFF;
-                xyz[1] = strlen(location) & 0xFF;
-                xyz[2] = 0x15; // language code = 0x15c7
-                xyz[3] = 0xc7; // language code = 0x15c7
-                xyzUdtaAtom = atomFromData (4 + strlen(location), "\xA9xyz", (uint8_t*)xyz);
-                if (xyzUdtaAtom)
-                {
-                    insertAtomIntoAtom(udtaAtom, &xyzUdtaAtom);
-                }
-                key[keyCount] = ARMEDIA_UntimedMetadataKey[ARMEDIA_UNTIMED_METADATA_KEY_LOCATION];
-                if (key[keyCount]) keyCount++;
-                snprintf(xyz, sizeof(xyz), "%+012.8f%+013.8f%+.2f/",
-                         encaps->untimed_metadata.takeoffLatitude,
-                         encaps->untimed_metadata.takeoffLongitude,
-                         encaps->untimed_metadata.takeoffAltitude);
-                locationMetaAtom = metadataAtomFromTagAndValue(keyCount, NULL, xyz, 1);
-                if (locationMetaAtom)
-                {
-                    insertAtomIntoAtom(ilstMetaAtom, &locationMetaAtom);
-                }
-            }
-            if ((encaps->got_untimed_metadata) && strlen(encaps->untimed_metadata.maker))
-            {
-                makerMetaUdtaAtom = metadataAtomFromTagAndValue(0, "mak", encaps->untimed_metadata.maker, 1);
-                if (makerMetaUdtaAtom)
-                {
-                    insertAtomIntoAtom(ilstMetaUdtaAtom, &makerMetaUdtaAtom);
-                }
-                key[keyCount] = ARMEDIA_UntimedMetadataKey[ARMEDIA_UNTIMED_METADATA_KEY_MAKER];
-                if (key[keyCount]) keyCount++;
-                makerMetaAtom = metadataAtomFromTagAndValue(keyCount, NULL, encaps->untimed_metadata.maker, 1);
-                if (makerMetaAtom)
-                {
-                    insertAtomIntoAtom(ilstMetaAtom, &makerMetaAtom);
-                }
-            }
-            if ((encaps->got_untimed_metadata) && strlen(encaps->untimed_metadata.model))
+    encapsuler->naluCount = 0;
+    encapsuler->nalusInPlace = 0;
+    if (NULL != iov)
+    {
+        error = ARMEDIA_VideoEncapsuler_ReserveNalus (encapsuler, iovCount);
+        if (ARMEDIA_OK != error)
+        {
+            return error;
+        }
+        for (i = 0; i < iovCount; i++)
+        {
+            const uint8_t *data = iov[i].iov_base;
+            uint32_t size = (uint32_t)iov[i].iov_len;
+            uint32_t startCodeSize;
+            if (0 == size)
             {
-                modelMetaUdtaAtom = metadataAtomFromTagAndValue(0, "mod", encaps->untimed_metadata.model, 1);
-                if (modelMetaUdtaAtom)
-                {
-                    insertAtomIntoAtom(ilstMetaUdtaAtom, &modelMetaUdtaAtom);
-                }
-                key[keyCount] = ARMEDIA_UntimedMetadataKey[ARMEDIA_UNTIMED_METADATA_KEY_MODEL];
-                if (key[keyCount]) keyCount++;
-                modelMetaAtom = metadataAtomFromTagAndValue(keyCount, NULL, encaps->untimed_metadata.model, 1);
-                if (modelMetaAtom)
-                {
-                    insertAtomIntoAtom(ilstMetaAtom, &modelMetaAtom);
-                }
+                continue;
             }
-            if ((encaps->got_untimed_metadata) && strlen(encaps->untimed_metadata.modelId))
+            if (NULL == data)
             {
-                key[keyCount] = ARMEDIA_UntimedMetadataKey[ARMEDIA_UNTIMED_METADATA_KEY_MODEL_ID];
-                if (key[keyCount]) keyCount++;
-                modelidMetaAtom = metadataAtomFromTagAndValue(keyCount, NULL, encaps->untimed_metadata.modelId, 1);
-                if (modelidMetaAtom)
-                {
-                    insertAtomIntoAtom(ilstMetaAtom, &modelidMetaAtom);
-                }
+                ENCAPSULER_ERROR ("No valid pointer for iovec %u", i);
+                return ARMEDIA_ERROR_BAD_PARAMETER;
             }
-            if ((encaps->got_untimed_metadata) && strlen(encaps->untimed_metadata.buildId))
+            startCodeSize = (CODEC_MPEG4_AVC == frameHeader->codec) ? ARMEDIA_VideoEncapsuler_GetStartCodeSize (data, size) : 0;
+            encapsuler->nalus[encapsuler->naluCount].data = data + startCodeSize;
+            encapsuler->nalus[encapsuler->naluCount].size = size - startCodeSize;
+            encapsuler->naluCount++;
+        }
+    }
+    else if ((CODEC_MPEG4_AVC == frameHeader->codec) && (frameHeader->avc_nalu_count > 0))
+    {
+        error = ARMEDIA_VideoEncapsuler_ReserveNalus (encapsuler, frameHeader->avc_nalu_count);
+        if (ARMEDIA_OK != error)
+        {
+            return error;
+        }
+        for (i = 0, offset = 0; i < frameHeader->avc_nalu_count; i++)
+        {
+            // Each NALU starts with 4 bytes (start code or size) replaced by its size
+            const uint8_t *data = (frameHeader->frame) ? frameHeader->frame + offset : frameHeader->avc_nalu_data[i];
+            if (NULL == data)
             {
-                key[keyCount] = ARMEDIA_UntimedMetadataKey[ARMEDIA_UNTIMED_METADATA_KEY_BUILD_ID];
-                if (key[keyCount]) keyCount++;
-                buildidMetaAtom = metadataAtomFromTagAndValue(keyCount, NULL, encaps->untimed_metadata.buildId, 1);
-                if (buildidMetaAtom)
-                {
-                    insertAtomIntoAtom(ilstMetaAtom, &buildidMetaAtom);
-                }
+                ENCAPSULER_ERROR ("No valid pointer for NALU");
+                return ARMEDIA_ERROR_BAD_PARAMETER;
             }
-            if ((encaps->got_untimed_metadata) && strlen(encaps->untimed_metadata.softwareVersion))
+            encapsuler->nalus[i].data = data + 4;
+            encapsuler->nalus[i].size = (frameHeader->avc_nalu_size[i] > 4) ? frameHeader->avc_nalu_size[i] - 4 : 0;
+            offset += frameHeader->avc_nalu_size[i];
+        }
+        encapsuler->naluCount = frameHeader->avc_nalu_count;
+    }
+    else if (CODEC_MPEG4_AVC == frameHeader->codec)
+    {
+        // Annex-B frame: split it at its start codes
+        count = ARMEDIA_NaluScanner_Split (frameHeader->frame, frameHeader->frame_size, encapsuler->nalus, encapsuler->naluCapacity);
+        if (count > encapsuler->naluCapacity)
+        {
+            // More NAL units than ever before, grow and scan again
+            error = ARMEDIA_VideoEncapsuler_ReserveNalus (encapsuler, count);
+            if (ARMEDIA_OK != error)
             {
-                versionMetaUdtaAtom = metadataAtomFromTagAndValue(0, "swr", encaps->untimed_metadata.softwareVersion, 1);
-                if (versionMetaUdtaAtom)
-                {
-                    insertAtomIntoAtom(ilstMetaUdtaAtom, &versionMetaUdtaAtom);
-                }
-                key[keyCount] = ARMEDIA_UntimedMetadataKey[ARMEDIA_UNTIMED_METADATA_KEY_VERSION];
-                if (key[keyCount]) keyCount++;
-                versionMetaAtom = metadataAtomFromTagAndValue(keyCount, NULL, encaps->untimed_metadata.softwareVersion, 1);
-                if (versionMetaAtom)
-                {
-                    insertAtomIntoAtom(ilstMetaAtom, &versionMetaAtom);
-                }
+                return error;
             }
-            if ((encaps->got_untimed_metadata) && strlen(encaps->untimed_metadata.serialNumber))
-            {
-                encoderMetaUdtaAtom = metadataAtomFromTagAndValue(0, "too", encaps->untimed_metadata.serialNumber, 1);
-                if (encoderMetaUdtaAtom)
-                {
-                    insertAtomIntoAtom(ilstMetaUdtaAtom, &encoderMetaUdtaAtom);
-                }
-                key[keyCount] = ARMEDIA_UntimedMetadataKey[ARMEDIA_UNTIMED_METADATA_KEY_SERIAL];
-                if (key[keyCount]) keyCount++;
-                serialMetaAtom = metadataAtomFromTagAndValue(keyCount, NULL, encaps->untimed_metadata.serialNumber, 1);
-                if (serialMetaAtom)
-                {
-                    insertAtomIntoAtom(ilstMetaAtom, &serialMetaAtom);
-                }
-            }
-            if ((encaps->got_untimed_metadata) && strlen(encaps->untimed_metadata.comment))
-            {
-                commentMetaUdtaAtom = metadataAtomFromTagAndValue(0, "cmt", encaps->untimed_metadata.comment, 1);
-                if (commentMetaUdtaAtom)
-                {
-                    insertAtomIntoAtom(ilstMetaUdtaAtom, &commentMetaUdtaAtom);
-                }
-                key[keyCount] = ARMEDIA_UntimedMetadataKey[ARMEDIA_UNTIMED_METADATA_KEY_COMMENT];
-                if (key[keyCount]) keyCount++;
-                commentMetaAtom = metadataAtomFromTagAndValue(keyCount, NULL, encaps->untimed_metadata.comment, 1);
-                if (commentMetaAtom)
-                {
-                    insertAtomIntoAtom(ilstMetaAtom, &commentMetaAtom);
-                }
-            }
-            if ((encaps->got_untimed_metadata) && strlen(encaps->untimed_metadata.copyright))
-            {
-                copyrightMetaUdtaAtom = metadataAtomFromTagAndValue(0, "cpy", encaps->untimed_metadata.copyright, 1);
-                if (copyrightMetaUdtaAtom)
-                {
-                    insertAtomIntoAtom(ilstMetaUdtaAtom, &copyrightMetaUdtaAtom);
-                }
-                key[keyCount] = ARMEDIA_UntimedMetadataKey[ARMEDIA_UNTIMED_METADATA_KEY_COPYRIGHT];
-                if (key[keyCount]) keyCount++;
-                copyrightMetaAtom = metadataAtomFromTagAndValue(keyCount, NULL, encaps->untimed_metadata.copyright, 1);
-                if (copyrightMetaAtom)
-                {
-                    insertAtomIntoAtom(ilstMetaAtom, &copyrightMetaAtom);
-                }
-            }
-            if ((encaps->got_untimed_metadata) && strlen(encaps->untimed_metadata.runUuid))
+            ARMEDIA_NaluScanner_Split (frameHeader->frame, frameHeader->frame_size, encapsuler->nalus, encapsuler->naluCapacity);
+        }
+        encapsuler->naluCount = count;
+    }
+    else
+    {
+        error = ARMEDIA_VideoEncapsuler_ReserveNalus (encapsuler, 1);
+        if (ARMEDIA_OK != error)
+        {
+            return error;
+        }
+        encapsuler->nalus[0].data = frameHeader->frame;
+        encapsuler->nalus[0].size = frameHeader->frame_size;
+        encapsuler->naluCount = 1;
+    }
+
+    if (0 == encapsuler->naluCount)
+    {
+        ENCAPSULER_ERROR ("No NAL unit found in the frame");
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
+    return ARMEDIA_OK;
+}
+
+/*
+ * Replace the start codes of an Annex-B frame by the NALU sizes, in the frame
+ * buffer. This is only possible when all the start codes are 4 bytes long.
+ */
+static void ARMEDIA_VideoEncapsuler_ConvertInPlace (ARMEDIA_VideoEncapsuler_t *encapsuler, uint8_t *frame)
+{
+    const uint8_t *end = frame;
+    uint32_t i;
+
+    for (i = 0; i < encapsuler->naluCount; i++)
+    {
+        const uint8_t *data = encapsuler->nalus[i].data;
+        // Bytes before the first start code are skipped
+        if ((data - end < 4) || ((i > 0) && (data - end != 4)))
+        {
+            return;
+        }
+        end = data + encapsuler->nalus[i].size;
+    }
+    for (i = 0; i < encapsuler->naluCount; i++)
+    {
+        uint8_t *prefix = frame + (encapsuler->nalus[i].data - frame) - 4;
+        uint32_t size = encapsuler->nalus[i].size;
+        prefix[0] = (uint8_t)(size >> 24);
+        prefix[1] = (uint8_t)(size >> 16);
+        prefix[2] = (uint8_t)(size >> 8);
+        prefix[3] = (uint8_t)size;
+    }
+    encapsuler->nalusInPlace = 1;
+}
+
+static eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_SaveParameterSet (const ARMEDIA_Nalu_t *nalu, uint8_t **ps, uint16_t *psSize)
+{
+    // The parameter sets are kept with a 4-byte start code
+    if (nalu->size > UINT16_MAX - 4)
+    {
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
+    *ps = malloc (4 + nalu->size);
+    if (NULL == *ps)
+    {
+        return ARMEDIA_ERROR_ENCAPSULER;
+    }
+    (*ps)[0] = (*ps)[1] = (*ps)[2] = 0;
+    (*ps)[3] = 1;
+    memcpy (*ps + 4, nalu->data, nalu->size);
+    *psSize = 4 + nalu->size;
+    return ARMEDIA_OK;
+}
+
+static int ARMEDIA_VideoEncapsuler_WriteFreeAtomHeader (FILE *file, uint32_t size)
+{
+    // Header only, the content of the free atom is left as is
+    movie_atom_t *freeAtom = atomFromData (size - 8, "free", NULL);
+    return writeAtomToFile (&freeAtom, file);
+}
+
+// Start of the space reserved for the moov atom, after the ftyp and pvat atoms
+static off_t ARMEDIA_VideoEncapsuler_GetFastStartOffset (eARMEDIA_ENCAPSULER_VIDEO_CODEC codec)
+{
+    off_t offset = 0;
+    movie_atom_t *ftypAtom = ftypAtomForFormatAndCodecWithOffset (codec, &offset);
+
+    if (NULL == ftypAtom)
+    {
+        return -1;
+    }
+    freeAtom (&ftypAtom);
+    return offset + ARMEDIA_JSON_DESCRIPTION_MAXLENGTH + 8 - ENCAPSULER_MDAT_HEADER_SIZE;
+}
+
+/* Write the ftyp atom and reserve the space of the pvat atom (and of the moov
+   atom in fast start) before the media data */
+static eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_WriteFileHeader (ARMEDIA_VideoEncapsuler_t *encapsuler)
+{
+    movie_atom_t *ftypAtom;
+
+    rewind(encapsuler->dataFile);
+    ftypAtom = ftypAtomForFormatAndCodecWithOffset (encapsuler->video->codec, &(encapsuler->dataOffset));
+    if (NULL == ftypAtom)
+    {
+        ENCAPSULER_ERROR ("Unable to create ftyp atom");
+        return ARMEDIA_ERROR_ENCAPSULER;
+    }
+
+    if (-1 == writeAtomToFile (&ftypAtom, encapsuler->dataFile))
+    {
+        ENCAPSULER_ERROR ("Unable to write ftyp atom");
+        return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+    }
+
+    // Add an offset for PVAT at beginning
+    encapsuler->dataOffset += ARMEDIA_JSON_DESCRIPTION_MAXLENGTH+8;
+
+    // Reserve the space of the moov atom after the PVAT, as a free atom
+    if (0 != encapsuler->fastStartSize)
+    {
+        if ((-1 == fseeko (encapsuler->dataFile, encapsuler->dataOffset - ENCAPSULER_MDAT_HEADER_SIZE, SEEK_SET)) ||
+            (-1 == ARMEDIA_VideoEncapsuler_WriteFreeAtomHeader (encapsuler->dataFile, encapsuler->fastStartSize)))
+        {
+            ENCAPSULER_ERROR ("Unable to reserve %u bytes for the moov atom", encapsuler->fastStartSize);
+            return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+        }
+        encapsuler->dataOffset += encapsuler->fastStartSize;
+    }
+
+    // The pvat atom and the mdat atom header are written by Finish: in a fragmented
+    // media, which is valid before, their space is a free atom until then
+    if (encapsuler->fragmented)
+    {
+        off_t freeOffset = encapsuler->dataOffset - ENCAPSULER_MDAT_HEADER_SIZE - (ARMEDIA_JSON_DESCRIPTION_MAXLENGTH+8);
+        if ((-1 == fseeko (encapsuler->dataFile, freeOffset, SEEK_SET)) ||
+            (-1 == ARMEDIA_VideoEncapsuler_WriteFreeAtomHeader (encapsuler->dataFile, (uint32_t)(encapsuler->dataOffset - freeOffset))))
+        {
+            ENCAPSULER_ERROR ("Unable to write the free atom before the init segment");
+            return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+        }
+    }
+
+    if (-1 == fseeko(encapsuler->dataFile, encapsuler->dataOffset, SEEK_SET))
+    {
+        ENCAPSULER_ERROR ("Unable to set file write pointer to %zu", (size_t)encapsuler->dataOffset);
+        return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+    }
+    encapsuler->mdatAtomOffset = encapsuler->dataOffset - ENCAPSULER_MDAT_HEADER_SIZE;
+
+    // Write the recording descriptor to the info file header
+    return encapsuler->fragmented ? ARMEDIA_OK : ARMEDIA_VideoEncapsuler_WriteSidecarHeader (encapsuler);
+}
+
+/* Create the encapsuler of the segment after the current one, with the same settings */
+static eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_OpenNextSegment (ARMEDIA_VideoEncapsuler_t *encapsuler)
+{
+    ARMEDIA_VideoEncapsuler_Segmentation_t *segmentation = encapsuler->segmentation;
+    ARMEDIA_Video_t *video = encapsuler->video;
+    ARMEDIA_VideoEncapsuler_t *next;
+    char path[ARMEDIA_ENCAPSULER_VIDEO_PATH_SIZE];
+    const char *extension = strrchr (segmentation->mediaPath, '.');
+    const char *name = strrchr (segmentation->mediaPath, '/');
+    eARMEDIA_ERROR error = ARMEDIA_OK;
+    int length;
+
+    // The suffix goes before the extension of the file name, if any
+    if ((NULL == extension) || ((NULL != name) && (extension < name)))
+    {
+        extension = segmentation->mediaPath + strlen (segmentation->mediaPath);
+    }
+    length = snprintf (path, sizeof (path), "%.*s_%03u%s", (int)(extension - segmentation->mediaPath), segmentation->mediaPath,
+                       segmentation->index + 1, extension);
+    if ((0 > length) || (sizeof (path) <= (size_t)length))
+    {
+        ENCAPSULER_ERROR ("Segment path of %s too long", segmentation->mediaPath);
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
+
+    next = ARMEDIA_VideoEncapsuler_New (path, video->fps, encapsuler->uuid, encapsuler->runDate, encapsuler->product, &error);
+    if (NULL == next)
+    {
+        ENCAPSULER_ERROR ("Unable to open the segment %s", path);
+        return error;
+    }
+
+    if ((NULL != video->sps) && (NULL != video->pps))
+    {
+        error = ARMEDIA_VideoEncapsuler_SetAvcParameterSets (next, video->sps, video->spsSize, video->pps, video->ppsSize);
+    }
+    if ((ARMEDIA_OK == error) && (NULL != encapsuler->metadata))
+    {
+        error = ARMEDIA_VideoEncapsuler_SetMetadataInfo (next, encapsuler->metadata->content_encoding, encapsuler->metadata->mime_format,
+                                                         encapsuler->metadata->block_size);
+    }
+    if ((ARMEDIA_OK == error) && encapsuler->got_untimed_metadata)
+    {
+        error = ARMEDIA_VideoEncapsuler_SetUntimedMetadata (next, &encapsuler->untimed_metadata);
+    }
+    if ((ARMEDIA_OK == error) && ('\0' != encapsuler->thumbnailFilePath[0]))
+    {
+        error = ARMEDIA_VideoEncapsuler_SetVideoThumbnail (next, encapsuler->thumbnailFilePath);
+    }
+    if ((ARMEDIA_OK == error) && (0 != encapsuler->queueSize))
+    {
+        error = ARMEDIA_VideoEncapsuler_SetAsyncWriter (next, encapsuler->queueSize, encapsuler->overflowPolicy);
+    }
+    if ((ARMEDIA_OK == error) && (0 != encapsuler->directIoBufferSize))
+    {
+        error = ARMEDIA_VideoEncapsuler_SetDirectIo (next, encapsuler->directIoBufferSize);
+    }
+    if (ARMEDIA_OK == error)
+    {
+        next->preallocationSize = encapsuler->preallocationSize;
+        next->finishMemoryLimit = encapsuler->finishMemoryLimit;
+        next->finishThreadCount = encapsuler->finishThreadCount;
+        next->timestampTolerance = encapsuler->timestampTolerance;
+        error = ARMEDIA_VideoEncapsuler_SetDurabilityPolicy (next, encapsuler->durabilityPolicy, encapsuler->durabilityValue);
+    }
+    if (ARMEDIA_OK == error)
+    {
+        error = ARMEDIA_VideoEncapsuler_SetCheckpointInterval (next, encapsuler->checkpointInterval);
+    }
+    if ((ARMEDIA_OK == error) && encapsuler->fragmented)
+    {
+        error = ARMEDIA_VideoEncapsuler_SetFragmentation (next, encapsuler->fragmentDuration / 1000);
+    }
+    else if ((ARMEDIA_OK == error) && (NULL != encapsuler->tsMuxer))
+    {
+        error = ARMEDIA_VideoEncapsuler_SetTransportStream (next, encapsuler->tsBatchSize);
+    }
+    else if (ARMEDIA_OK == error)
+    {
+        next->chunkDuration = encapsuler->chunkDuration;
+        next->chunkMaxSize = encapsuler->chunkMaxSize;
+        error = ARMEDIA_VideoEncapsuler_SetFastStart (next, encapsuler->fastStartSize, encapsuler->fastStartCallback, encapsuler->fastStartUserData);
+    }
+    if (ARMEDIA_OK != error)
+    {
+        ENCAPSULER_ERROR ("Unable to set up the segment %s", path);
+        ARMEDIA_VideoEncapsuler_Cleanup (&next, false);
+        return error;
+    }
+
+    segmentation->next = next;
+    return ARMEDIA_OK;
+}
+
+/* The current segment ends before a sync frame of this timestamp */
+static int ARMEDIA_VideoEncapsuler_SegmentIsFull (ARMEDIA_VideoEncapsuler_t *encapsuler, uint64_t timestamp)
+{
+    ARMEDIA_VideoEncapsuler_Segmentation_t *segmentation = encapsuler->segmentation;
+    ARMEDIA_Video_t *video = encapsuler->video;
+    uint64_t size;
+
+    if (0 == timestamp)
+    {
+        timestamp = video->lastFrameTimestamp + video->defaultFrameDuration;
+    }
+    if ((0 != segmentation->maxDuration) &&
+        (timestamp + video->defaultFrameDuration / 2 >= video->firstFrameTimestamp + segmentation->maxDuration))
+    {
+        return 1;
+    }
+    if (0 == segmentation->maxSize)
+    {
+        return 0;
+    }
+
+    if (NULL != encapsuler->tsMuxer)
+    {
+        size = ARMEDIA_TsMuxer_GetSize (encapsuler->tsMuxer);
+    }
+    else
+    {
+        size = encapsuler->dataOffset + ARMEDIA_VideoEncapsuler_GetDataSize (encapsuler);
+        if (!encapsuler->fragmented)
+        {
+            // The moov atom is written at the end by the finish
+            size += ENCAPSULER_MOOV_FIXED_SIZE + (uint64_t)video->framesCount * ENCAPSULER_MOOV_VIDEO_SAMPLE_SIZE;
+            if (NULL != encapsuler->metadata)
             {
-                key[keyCount] = ARMEDIA_UntimedMetadataKey[ARMEDIA_UNTIMED_METADATA_KEY_RUN_ID];
-                if (key[keyCount]) keyCount++;
-                runidMetaAtom = metadataAtomFromTagAndValue(keyCount, NULL, encaps->untimed_metadata.runUuid, 1);
-                if (runidMetaAtom)
-                {
-                    insertAtomIntoAtom(ilstMetaAtom, &runidMetaAtom);
-                }
+                size += (uint64_t)encapsuler->metadata->framesCount * ENCAPSULER_MOOV_METADATA_SAMPLE_SIZE;
             }
-            if ((encaps->got_untimed_metadata) && strlen(encaps->untimed_metadata.runDate))
+            if (NULL != encapsuler->audio)
             {
-                key[keyCount] = ARMEDIA_UntimedMetadataKey[ARMEDIA_UNTIMED_METADATA_KEY_RUN_DATE];
-                if (key[keyCount]) keyCount++;
-                rundateMetaAtom = metadataAtomFromTagAndValue(keyCount, NULL, encaps->untimed_metadata.runDate, 1);
-                if (rundateMetaAtom)
-                {
-                    insertAtomIntoAtom(ilstMetaAtom, &rundateMetaAtom);
-                }
+                size += (uint64_t)encapsuler->audio->sampleCount * ENCAPSULER_MOOV_AUDIO_CHUNK_SIZE;
             }
-            if ((encaps->got_untimed_metadata) && (encaps->untimed_metadata.pictureHFov != 0.))
+        }
+    }
+    return (size >= segmentation->maxSize);
+}
+
+/* Finish the segment ended by the last cut in the background, if any */
+static void ARMEDIA_VideoEncapsuler_FinishPreviousSegment (ARMEDIA_VideoEncapsuler_Segmentation_t *segmentation)
+{
+    ARMEDIA_VideoEncapsuler_t *previous = segmentation->previous;
+    char mediaPath[ARMEDIA_ENCAPSULER_VIDEO_PATH_SIZE];
+    eARMEDIA_ERROR error;
+
+    if (NULL == previous)
+    {
+        return;
+    }
+    segmentation->previous = NULL;
+    if (ARMEDIA_OK != ARMEDIA_VideoEncapsuler_FinishAsync (&previous, NULL, segmentation->finishCallback, segmentation->userData))
+    {
+        snprintf (mediaPath, sizeof (mediaPath), "%s", previous->dataFilePath);
+        error = ARMEDIA_VideoEncapsuler_Finish (&previous);
+        if (NULL != segmentation->finishCallback)
+        {
+            segmentation->finishCallback (mediaPath, error, segmentation->userData);
+        }
+    }
+}
+
+/* Move the recording to the next segment, and finish the current one in the background */
+static eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_StartNextSegment (ARMEDIA_VideoEncapsuler_t *encapsuler)
+{
+    ARMEDIA_VideoEncapsuler_Segmentation_t *segmentation = encapsuler->segmentation;
+    ARMEDIA_VideoEncapsuler_t *previous;
+    ARMEDIA_VideoEncapsuler_t swap;
+    eARMEDIA_ERROR error = ARMEDIA_OK;
+
+    if (NULL == segmentation->next)
+    {
+        error = ARMEDIA_VideoEncapsuler_OpenNextSegment (encapsuler);
+        if (ARMEDIA_OK != error)
+        {
+            return error;
+        }
+    }
+    previous = segmentation->next;
+    segmentation->next = NULL;
+
+    // The handle of the caller records the next segment from now on
+    swap = *encapsuler;
+    *encapsuler = *previous;
+    *previous = swap;
+    encapsuler->segmentation = segmentation;
+    previous->segmentation = NULL;
+    encapsuler->videoGpsInfos = previous->videoGpsInfos;
+    // A reserved frame may be committed from the buffer of the handle
+    previous->reserveBuffer = encapsuler->reserveBuffer;
+    previous->reserveCapacity = encapsuler->reserveCapacity;
+    previous->reserveSize = encapsuler->reserveSize;
+    encapsuler->reserveBuffer = swap.reserveBuffer;
+    encapsuler->reserveCapacity = swap.reserveCapacity;
+    encapsuler->reserveSize = swap.reserveSize;
+    if (NULL != encapsuler->tsMuxer)
+    {
+        ARMEDIA_TsMuxer_SetUserData (encapsuler->tsMuxer, encapsuler);
+    }
+    if (NULL != previous->tsMuxer)
+    {
+        ARMEDIA_TsMuxer_SetUserData (previous->tsMuxer, previous);
+    }
+    segmentation->index++;
+
+    // The audio captured before the cut may still come: the segment is finished
+    // with the first sample after the cut (see ARMEDIA_VideoEncapsuler_AddSample())
+    ARMEDIA_VideoEncapsuler_FinishPreviousSegment (segmentation);
+    segmentation->previous = previous;
+    if (!previous->got_audio)
+    {
+        ARMEDIA_VideoEncapsuler_FinishPreviousSegment (segmentation);
+    }
+
+    return ARMEDIA_OK;
+}
+
+static eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_AddFrameInternal (ARMEDIA_VideoEncapsuler_t *encapsuler, ARMEDIA_Frame_Header_t *frameHeader, const struct iovec *iov, uint32_t iovCount, uint8_t *inPlaceFrame, const void *metadataBuffer)
+{
+    eARMEDIA_ERROR error, commitError;
+    ARMEDIA_Video_t* video = encapsuler->video;
+
+    if (NULL == video)
+    {
+        ENCAPSULER_ERROR ("video pointer must not be null");
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
+
+    // get frame data
+    if ((NULL == frameHeader->frame) && (0 == frameHeader->avc_nalu_count) && (NULL == iov))
+    {
+        ENCAPSULER_ERROR ("Unable to get frame data (%d bytes) ", frameHeader->frame_size);
+        return ARMEDIA_ERROR_ENCAPSULER;
+    }
+
+    if (((NULL != frameHeader->frame) || (NULL != iov)) && (!frameHeader->frame_size))
+    {
+        // Do nothing
+        ENCAPSULER_DEBUG ("Empty frame\n");
+        return ARMEDIA_OK;
+    }
+
+    if ((NULL != encapsuler->segmentation) && encapsuler->got_iframe)
+    {
+        ARMEDIA_VideoEncapsuler_Segmentation_t *segmentation = encapsuler->segmentation;
+        int syncFrame = (ARMEDIA_ENCAPSULER_FRAME_TYPE_I_FRAME == frameHeader->frame_type) || (CODEC_MOTION_JPEG == video->codec);
+
+        if (syncFrame && ARMEDIA_VideoEncapsuler_SegmentIsFull (encapsuler, frameHeader->timestamp))
+        {
+            // On failure, the recording goes on in the current segment
+            error = ARMEDIA_VideoEncapsuler_StartNextSegment (encapsuler);
+            if (ARMEDIA_OK != error)
             {
-                char hfov[20];
-                snprintf(hfov, 20, "%.2f", encaps->untimed_metadata.pictureHFov);
-                key[keyCount] = ARMEDIA_UntimedMetadataKey[ARMEDIA_UNTIMED_METADATA_KEY_PICTURE_HFOV];
-                if (key[keyCount]) keyCount++;
-                picturehfovMetaAtom = metadataAtomFromTagAndValue(keyCount, NULL, hfov, 1);
-                if (picturehfovMetaAtom)
-                {
-                    insertAtomIntoAtom(ilstMetaAtom, &picturehfovMetaAtom);
-                }
+                ENCAPSULER_ERROR ("Unable to start the next segment: error %d", error);
             }
-            if ((encaps->got_untimed_metadata) && (encaps->untimed_metadata.pictureVFov != 0.))
+            video = encapsuler->video;
+        }
+        else if ((NULL == segmentation->next) && (!segmentation->openFailed || syncFrame))
+        {
+            // Opened ahead, so that the cut does not wait for the files
+            error = ARMEDIA_VideoEncapsuler_OpenNextSegment (encapsuler);
+            segmentation->openFailed = (ARMEDIA_OK != error);
+        }
+    }
+
+    // First frame
+    if (!video->width)
+    {
+        // Ensure that the codec is h.264 or mjpeg (mp4 not supported)
+        if ((CODEC_MPEG4_AVC != frameHeader->codec) && (CODEC_MOTION_JPEG != frameHeader->codec))
+        {
+            ENCAPSULER_ERROR ("Only h.264 or mjpeg codec are supported");
+            return ARMEDIA_ERROR_ENCAPSULER_BAD_CODEC;
+        }
+        if ((NULL != encapsuler->tsMuxer) && (CODEC_MPEG4_AVC != frameHeader->codec))
+        {
+            ENCAPSULER_ERROR ("Only h.264 is supported in a transport stream");
+            return ARMEDIA_ERROR_ENCAPSULER_BAD_CODEC;
+        }
+
+        // Init video structure
+        video->width = frameHeader->width;
+        video->height = frameHeader->height;
+        video->codec = frameHeader->codec;
+
+        // If codec is H.264, save SPS/PPS
+        if (CODEC_MPEG4_AVC == video->codec)
+        {
+            if (ARMEDIA_ENCAPSULER_FRAME_TYPE_I_FRAME != frameHeader->frame_type)
             {
-                char vfov[20];
-                snprintf(vfov, 20, "%.2f", encaps->untimed_metadata.pictureVFov);
-                key[keyCount] = ARMEDIA_UntimedMetadataKey[ARMEDIA_UNTIMED_METADATA_KEY_PICTURE_VFOV];
-                if (key[keyCount]) keyCount++;
-                picturevfovMetaAtom = metadataAtomFromTagAndValue(keyCount, NULL, vfov, 1);
-                if (picturevfovMetaAtom)
-                {
-                    insertAtomIntoAtom(ilstMetaAtom, &picturevfovMetaAtom);
-                }
+                // Wait until we get an IFrame 1 to start the actual recording
+                video->width = video->height = frameHeader->codec = 0;
+                return ARMEDIA_ERROR_ENCAPSULER_WAITING_FOR_IFRAME;
             }
-            if (encaps->got_untimed_metadata)
+
+            if ((NULL == video->sps) && (NULL == video->pps))
             {
-                int i;
-                for (i = 0; i < ARMEDIA_ENCAPSULER_UNTIMED_METADATA_CUSTOM_MAX_COUNT; i++)
+                // We consider that on a I-Frame the first NALU is an SPS and the second NALU is a PPS
+                error = ARMEDIA_VideoEncapsuler_CollectNalus (encapsuler, frameHeader, iov, iovCount);
+                if ((ARMEDIA_OK == error) && (encapsuler->naluCount < 2))
                 {
-                    if ((strlen(encaps->untimed_metadata.custom[i].key)) && (strlen(encaps->untimed_metadata.custom[i].value)))
-                    {
-                        key[keyCount] = encaps->untimed_metadata.custom[i].key;
-                        keyCount++;
-                        customMetaAtom = metadataAtomFromTagAndValue(keyCount, NULL, encaps->untimed_metadata.custom[i].value, 1);
-                        if (customMetaAtom)
-                        {
-                            insertAtomIntoAtom(ilstMetaAtom, &customMetaAtom);
-                        }
-                    }
+                    ENCAPSULER_ERROR ("The first I-frame must start with an SPS and a PPS");
+                    error = ARMEDIA_ERROR_BAD_PARAMETER;
                 }
-            }
-            if (strlen(encaps->thumbnailFilePath))
-            {
-                coverMetaUdtaAtom = metadataAtomFromTagAndFile(0, "covr", encaps->thumbnailFilePath, 13);
-                if (coverMetaUdtaAtom)
+                if (ARMEDIA_OK != error)
                 {
-                    insertAtomIntoAtom(ilstMetaUdtaAtom, &coverMetaUdtaAtom);
+                    video->width = video->height = 0;
+                    return error;
                 }
-                key[keyCount] = ARMEDIA_UntimedMetadataKey[ARMEDIA_UNTIMED_METADATA_KEY_COVER];
-                if (key[keyCount]) keyCount++;
-                coverMetaAtom = metadataAtomFromTagAndFile(keyCount, NULL, encaps->thumbnailFilePath, 13);
-                if (coverMetaAtom)
+                if ((ARMEDIA_OK != ARMEDIA_VideoEncapsuler_SaveParameterSet (&encapsuler->nalus[0], &video->sps, &video->spsSize)) ||
+                    (ARMEDIA_OK != ARMEDIA_VideoEncapsuler_SaveParameterSet (&encapsuler->nalus[1], &video->pps, &video->ppsSize)))
                 {
-                    insertAtomIntoAtom(ilstMetaAtom, &coverMetaAtom);
+                    ENCAPSULER_ERROR ("Unable to allocate SPS/PPS buffers");
+                    ENCAPSULER_CLEANUP (free, video->sps);
+                    ENCAPSULER_CLEANUP (free, video->pps);
+                    video->width = video->height = 0;
+                    return ARMEDIA_ERROR_ENCAPSULER;
                 }
             }
+        }
+
+        // Start to write file
+        error = (NULL != encapsuler->tsMuxer) ? ARMEDIA_VideoEncapsuler_AddTsStreams (encapsuler) :
+                                                ARMEDIA_VideoEncapsuler_WriteFileHeader (encapsuler);
+        if (ARMEDIA_OK != error)
+        {
+            return error;
+        }
+        encapsuler->got_iframe = 1;
+        video->firstFrameTimestamp = frameHeader->timestamp;
+        if (NULL == encapsuler->tsMuxer)
+        {
+            ARMEDIA_VideoEncapsuler_BuildVideoTrack (encapsuler);
+        }
+    } // end first frame
+
+    // Normal operation : file pointer is at end of file
+    if (video->codec != frameHeader->codec ||
+        video->width != frameHeader->width ||
+        video->height != frameHeader->height)
+    {
+        ENCAPSULER_ERROR ("New frame don't match the video size/codec");
+        return ARMEDIA_ERROR_ENCAPSULER_BAD_VIDEO_FRAME;
+    }
+
+    // Once a frame has been dropped, the following P-frames can not be decoded
+    if (encapsuler->dropUntilIFrame &&
+        ARMEDIA_ENCAPSULER_FRAME_TYPE_I_FRAME != frameHeader->frame_type)
+    {
+        encapsuler->droppedCount++;
+        return ARMEDIA_ERROR_ENCAPSULER_QUEUE_FULL;
+    }
+
+    error = ARMEDIA_VideoEncapsuler_CollectNalus (encapsuler, frameHeader, iov, iovCount);
+    if (ARMEDIA_OK != error)
+    {
+        return error;
+    }
+    if ((NULL != inPlaceFrame) && (CODEC_MPEG4_AVC == video->codec) && (NULL == encapsuler->tsMuxer))
+    {
+        ARMEDIA_VideoEncapsuler_ConvertInPlace (encapsuler, inPlaceFrame);
+    }
+
+    // Make sure the frame fits on the storage before it is recorded
+    {
+        off_t size = ARMEDIA_VideoEncapsuler_GetFrameSize (encapsuler, frameHeader);
+        if ((NULL != metadataBuffer) && (NULL != encapsuler->metadata))
+        {
+            size += encapsuler->metadata->block_size;
+        }
+        if (NULL != encapsuler->tsMuxer)
+        {
+            size = ARMEDIA_VideoEncapsuler_GetTsFrameSize (encapsuler, frameHeader, metadataBuffer);
+        }
+        error = ARMEDIA_VideoEncapsuler_Preallocate (encapsuler, size);
+        if (ARMEDIA_ERROR_ENCAPSULER_DISK_FULL == error)
+        {
+            encapsuler->droppedCount++;
+            encapsuler->dropUntilIFrame = (CODEC_MPEG4_AVC == video->codec);
+            return error;
+        }
+    }
+
+    // A transport stream is written as the frames come, by batches of packets
+    if (NULL != encapsuler->tsMuxer)
+    {
+        return ARMEDIA_VideoEncapsuler_WriteTsFrame (encapsuler, frameHeader, metadataBuffer);
+    }
+
+    if (encapsuler->fragmented)
+    {
+        error = ARMEDIA_VideoEncapsuler_WriteFullFragment (encapsuler, frameHeader);
+    }
+    else
+    {
+        error = ARMEDIA_VideoEncapsuler_WriteFullChunks (encapsuler, (0 != frameHeader->timestamp) ? frameHeader->timestamp :
+                                                         video->lastFrameTimestamp + video->defaultFrameDuration);
+    }
+    if (ARMEDIA_OK != error)
+    {
+        return error;
+    }
+
+    // In a fragmented media, the frame is only kept until its fragment is written
+    if (!encapsuler->fragmented)
+    {
+        error = ARMEDIA_FileWriter_BeginJob (encapsuler->writer);
+        if (ARMEDIA_ERROR_ENCAPSULER_QUEUE_FULL == error)
+        {
+            encapsuler->droppedCount++;
+            encapsuler->dropUntilIFrame = (CODEC_MPEG4_AVC == video->codec);
+            return error;
+        }
+        else if (ARMEDIA_OK != error)
+        {
+            ENCAPSULER_ERROR ("Unable to write frame: writer error %d", error);
+            return error;
+        }
+    }
+    encapsuler->dropUntilIFrame = 0;
+
+    error = ARMEDIA_VideoEncapsuler_WriteFrame (encapsuler, frameHeader, metadataBuffer);
+    commitError = encapsuler->fragmented ? ARMEDIA_OK : ARMEDIA_FileWriter_CommitJob (encapsuler->writer);
+
+    return (ARMEDIA_OK != error) ? error : commitError;
+}
+
+eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_AddFrame (ARMEDIA_VideoEncapsuler_t *encapsuler, ARMEDIA_Frame_Header_t *frameHeader, const void *metadataBuffer)
+{
+    if (NULL == encapsuler)
+    {
+        ENCAPSULER_ERROR ("encapsuler pointer must not be null");
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
+    if (NULL == frameHeader)
+    {
+        ENCAPSULER_ERROR ("frame pointer must not be null");
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
+
+    return ARMEDIA_VideoEncapsuler_AddFrameInternal (encapsuler, frameHeader, NULL, 0, NULL, metadataBuffer);
+}
+
+eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_AddFrameIov (ARMEDIA_VideoEncapsuler_t *encapsuler, const ARMEDIA_Frame_Iov_Header_t *frameHeader, const void *metadataBuffer)
+{
+    ARMEDIA_Frame_Header_t header; // only the scalar fields are used with an iovec list
+    uint32_t i;
+
+    if (NULL == encapsuler)
+    {
+        ENCAPSULER_ERROR ("encapsuler pointer must not be null");
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
+    if ((NULL == frameHeader) || (NULL == frameHeader->iov))
+    {
+        ENCAPSULER_ERROR ("frame pointer must not be null");
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
+
+    header.codec = frameHeader->codec;
+    header.frame_size = 0;
+    for (i = 0; i < frameHeader->iov_count; i++)
+    {
+        header.frame_size += frameHeader->iov[i].iov_len;
+    }
+    header.frame_number = 0;
+    header.width = frameHeader->width;
+    header.height = frameHeader->height;
+    header.timestamp = frameHeader->timestamp;
+    header.frame_type = frameHeader->frame_type;
+    header.frame = NULL;
+    header.avc_nalu_count = 0;
+    header.avc_insert_ps = frameHeader->avc_insert_ps;
+
+    return ARMEDIA_VideoEncapsuler_AddFrameInternal (encapsuler, &header, frameHeader->iov, frameHeader->iov_count, NULL, metadataBuffer);
+}
+
+eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_ReserveFrame (ARMEDIA_VideoEncapsuler_t *encapsuler, uint32_t size, uint8_t **buffer)
+{
+    if ((NULL == encapsuler) || (NULL == buffer) || (0 == size))
+    {
+        ENCAPSULER_ERROR ("Bad parameters");
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
+
+    if (size > encapsuler->reserveCapacity)
+    {
+        // Grow by 64 KiB steps; the buffer is page aligned for the storage
+        uint32_t capacity = (size + ENCAPSULER_RESERVE_STEP - 1) & ~(ENCAPSULER_RESERVE_STEP - 1);
+        void *newBuffer = NULL;
+        if (0 != posix_memalign (&newBuffer, ENCAPSULER_RESERVE_ALIGNMENT, capacity))
+        {
+            ENCAPSULER_ERROR ("Unable to allocate a %u bytes frame buffer", capacity);
+            return ARMEDIA_ERROR_ENCAPSULER;
+        }
+        free (encapsuler->reserveBuffer);
+        encapsuler->reserveBuffer = newBuffer;
+        encapsuler->reserveCapacity = capacity;
+    }
+    encapsuler->reserveSize = size;
+    *buffer = encapsuler->reserveBuffer;
+
+    return ARMEDIA_OK;
+}
+
+eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_CommitFrame (ARMEDIA_VideoEncapsuler_t *encapsuler, const ARMEDIA_Frame_Info_t *frameInfo, const void *metadataBuffer)
+{
+    ARMEDIA_Frame_Header_t header; // only the scalar fields are used with a reserved frame
+
+    if ((NULL == encapsuler) || (NULL == frameInfo))
+    {
+        ENCAPSULER_ERROR ("Bad parameters");
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
+    if ((0 == encapsuler->reserveSize) || (frameInfo->frame_size > encapsuler->reserveSize))
+    {
+        ENCAPSULER_ERROR ("Frame of %u bytes committed without a reserved buffer", frameInfo->frame_size);
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
+    encapsuler->reserveSize = 0;
+
+    header.codec = frameInfo->codec;
+    header.frame_size = frameInfo->frame_size;
+    header.frame_number = 0;
+    header.width = frameInfo->width;
+    header.height = frameInfo->height;
+    header.timestamp = frameInfo->timestamp;
+    header.frame_type = frameInfo->frame_type;
+    header.frame = encapsuler->reserveBuffer;
+    header.avc_nalu_count = 0;
+    header.avc_insert_ps = frameInfo->avc_insert_ps;
+
+    return ARMEDIA_VideoEncapsuler_AddFrameInternal (encapsuler, &header, NULL, 0, encapsuler->reserveBuffer, metadataBuffer);
+}
+
+static off_t ARMEDIA_VideoEncapsuler_GetDataSize (ARMEDIA_VideoEncapsuler_t *encapsuler)
+{
+    off_t size = encapsuler->video->totalsize;
+    if (NULL != encapsuler->audio)
+    {
+        size += encapsuler->audio->totalsize;
+    }
+    if (NULL != encapsuler->metadata)
+    {
+        size += encapsuler->metadata->totalsize;
+    }
+    return size;
+}
+
+static off_t ARMEDIA_VideoEncapsuler_GetFrameSize (ARMEDIA_VideoEncapsuler_t *encapsuler, const ARMEDIA_Frame_Header_t *frameHeader)
+{
+    ARMEDIA_Video_t* video = encapsuler->video;
+    off_t size = 0;
+    uint32_t i;
+
+    for (i = 0; i < encapsuler->naluCount; i++)
+    {
+        size += encapsuler->nalus[i].size;
+        if (CODEC_MPEG4_AVC == video->codec)
+        {
+            size += 4;
+        }
+    }
+    if (frameHeader->avc_insert_ps)
+    {
+        if (video->spsSize > 4)
+            size += video->spsSize;
+        if (video->ppsSize > 4)
+            size += video->ppsSize;
+    }
+    return size;
+}
+
+static uint8_t ARMEDIA_VideoEncapsuler_GetEntryFlags (uint8_t recordFlags)
+{
+    uint8_t flags = 0;
+    if (recordFlags & ARMEDIA_SIDECAR_RECORD_FLAG_SYNC)
+    {
+        flags |= ARMEDIA_SAMPLETABLE_FLAG_SYNC;
+    }
+    if (recordFlags & ARMEDIA_SIDECAR_RECORD_FLAG_CHUNK_CONTINUE)
+    {
+        flags |= ARMEDIA_SAMPLETABLE_FLAG_CHUNK_CONTINUE;
+    }
+    return flags;
+}
+
+// The samples are kept in the chunks of the tracks until written, when chunking or fragmented
+static int ARMEDIA_VideoEncapsuler_KeepsChunks (ARMEDIA_VideoEncapsuler_t *encapsuler)
+{
+    return (0 != encapsuler->chunkDuration) || encapsuler->fragmented;
+}
+
+/* Append data of a track (zeros if data is NULL) to the data file, or to the
+   pending chunk of the track (see ARMEDIA_VideoEncapsuler_KeepsChunks()) */
+static eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_WriteData (ARMEDIA_VideoEncapsuler_t *encapsuler, eENCAPSULER_CHUNK track, const void *data, size_t size)
+{
+    ARMEDIA_VideoEncapsuler_Chunk_t *chunk = &encapsuler->chunks[track];
+
+    if (!ARMEDIA_VideoEncapsuler_KeepsChunks (encapsuler))
+    {
+        return (NULL != data) ? ARMEDIA_FileWriter_WriteData (encapsuler->writer, data, size) : ARMEDIA_FileWriter_WriteZeros (encapsuler->writer, size);
+    }
+
+    if (chunk->size + size > chunk->capacity)
+    {
+        size_t capacity = (0 == chunk->capacity) ? ENCAPSULER_CHUNK_MIN_CAPACITY : chunk->capacity;
+        uint8_t *newData;
+        while (capacity < chunk->size + size)
+        {
+            capacity *= 2;
+        }
+        newData = realloc (chunk->data, capacity);
+        if (NULL == newData)
+        {
+            ENCAPSULER_ERROR ("Unable to grow a chunk to %zu bytes", capacity);
+            return ARMEDIA_ERROR_ENCAPSULER;
+        }
+        chunk->data = newData;
+        chunk->capacity = capacity;
+    }
+    if (NULL != data)
+    {
+        memcpy (&chunk->data[chunk->size], data, size);
+    }
+    else
+    {
+        memset (&chunk->data[chunk->size], 0, size);
+    }
+    chunk->size += size;
+    encapsuler->chunkPendingSize += size;
+
+    return ARMEDIA_OK;
+}
+
+static eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_AddChunkRecord (ARMEDIA_VideoEncapsuler_t *encapsuler, eENCAPSULER_CHUNK track, const ARMEDIA_Sidecar_Record_t *record, uint64_t timestamp)
+{
+    ARMEDIA_VideoEncapsuler_Chunk_t *chunk = &encapsuler->chunks[track];
+
+    if (chunk->count == chunk->recordCapacity)
+    {
+        uint32_t capacity = (0 == chunk->recordCapacity) ? ENCAPSULER_CHUNK_MIN_RECORDS : 2 * chunk->recordCapacity;
+        ARMEDIA_Sidecar_Record_t *records = realloc (chunk->records, capacity * sizeof (*records));
+        if (NULL == records)
+        {
+            ENCAPSULER_ERROR ("Unable to grow the records of a chunk");
+            return ARMEDIA_ERROR_ENCAPSULER;
+        }
+        chunk->records = records;
+        chunk->recordCapacity = capacity;
+    }
+    if (0 == chunk->count)
+    {
+        chunk->firstTimestamp = timestamp;
+    }
+    chunk->records[chunk->count++] = *record;
+
+    return ARMEDIA_OK;
+}
+
+static ARMEDIA_SampleTable_t *ARMEDIA_VideoEncapsuler_GetTable (ARMEDIA_VideoEncapsuler_t *encapsuler, eENCAPSULER_CHUNK track)
+{
+    return (ENCAPSULER_CHUNK_VIDEO == track) ? &encapsuler->videoTable :
+           (ENCAPSULER_CHUNK_METADATA == track) ? &encapsuler->metadataTable : &encapsuler->audioTable;
+}
+
+// End of a sample table in a checkpoint, followed by the entries added since the previous checkpoint
+static void ARMEDIA_VideoEncapsuler_TransferCheckpointTable (ARMEDIA_Sidecar_Stream_t *stream, ARMEDIA_SampleTable_State_t *state, uint32_t *deltaSize)
+{
+    ARMEDIA_Sidecar_U32 (stream, &state->count);
+    ARMEDIA_Sidecar_U64 (stream, &state->lastEnd);
+    ARMEDIA_Sidecar_U32 (stream, &state->lastDuration);
+    ARMEDIA_Sidecar_U32 (stream, &state->usedBlocks);
+    ARMEDIA_Sidecar_U32 (stream, &state->blockUsed);
+    ARMEDIA_Sidecar_U64 (stream, &state->totalSize);
+    ARMEDIA_Sidecar_U32 (stream, deltaSize);
+}
+
+/* Append a checkpoint of the sample tables to the infos file once checkpointInterval
+   infos were written since the previous one; must be called within a writer job,
+   when the tables hold exactly the infos written */
+static eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_WriteCheckpoint (ARMEDIA_VideoEncapsuler_t *encapsuler)
+{
+    ARMEDIA_SampleTable_State_t states[ENCAPSULER_CHUNK_MAX];
+    uint32_t deltaSizes[ENCAPSULER_CHUNK_MAX];
+    ARMEDIA_Sidecar_Stream_t stream;
+    uint32_t index = encapsuler->checkpointRecords;
+    uint32_t added = 0;
+    size_t size;
+    int i;
+
+    if ((0 == encapsuler->checkpointInterval) || (NULL == encapsuler->metaFile))
+    {
+        return ARMEDIA_OK;
+    }
+
+    // Get the payload size
+    memset (&stream, 0, sizeof (stream));
+    for (i = 0; i < ENCAPSULER_CHUNK_MAX; i++)
+    {
+        ARMEDIA_SampleTable_GetState (ARMEDIA_VideoEncapsuler_GetTable (encapsuler, (eENCAPSULER_CHUNK)i), &states[i]);
+        added += states[i].count - encapsuler->checkpointStates[i].count;
+        index += states[i].count;
+        deltaSizes[i] = (uint32_t)ARMEDIA_SampleTable_GetDeltaSize (&encapsuler->checkpointStates[i], &states[i]);
+        ARMEDIA_VideoEncapsuler_TransferCheckpointTable (&stream, &states[i], &deltaSizes[i]);
+        stream.pos += deltaSizes[i];
+    }
+    if (added < encapsuler->checkpointInterval)
+    {
+        return ARMEDIA_OK;
+    }
+
+    size = (size_t)ARMEDIA_Sidecar_GetCheckpointRecords ((uint32_t)stream.pos) * ARMEDIA_SIDECAR_RECORD_SIZE;
+    if (size > encapsuler->checkpointCapacity)
+    {
+        uint8_t *buffer = realloc (encapsuler->checkpointBuffer, size);
+        if (NULL == buffer)
+        {
+            // Only the recovery gets longer
+            ENCAPSULER_ERROR ("Unable to allocate a checkpoint of %zu bytes", size);
+            return ARMEDIA_OK;
+        }
+        encapsuler->checkpointBuffer = buffer;
+        encapsuler->checkpointCapacity = size;
+    }
+
+    stream.buffer = encapsuler->checkpointBuffer + ARMEDIA_SIDECAR_RECORD_SIZE;
+    stream.size = stream.pos;
+    stream.pos = 0;
+    for (i = 0; i < ENCAPSULER_CHUNK_MAX; i++)
+    {
+        ARMEDIA_VideoEncapsuler_TransferCheckpointTable (&stream, &states[i], &deltaSizes[i]);
+        ARMEDIA_SampleTable_CopyDelta (ARMEDIA_VideoEncapsuler_GetTable (encapsuler, (eENCAPSULER_CHUNK)i), &encapsuler->checkpointStates[i],
+                                       stream.buffer + stream.pos);
+        stream.pos += deltaSizes[i];
+    }
+    ARMEDIA_Sidecar_EncodeCheckpoint (encapsuler->checkpointBuffer, (uint32_t)stream.size,
+                                      (0 != encapsuler->checkpointRecords) ? index - encapsuler->checkpointIndex : 0);
+    if (ARMEDIA_OK != ARMEDIA_FileWriter_WriteMeta (encapsuler->writer, encapsuler->checkpointBuffer, size))
+    {
+        ENCAPSULER_ERROR ("Unable to write a checkpoint into info file");
+        return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+    }
+
+    memcpy (encapsuler->checkpointStates, states, sizeof (states));
+    encapsuler->checkpointIndex = index;
+    encapsuler->checkpointRecords += (uint32_t)(size / ARMEDIA_SIDECAR_RECORD_SIZE);
+
+    return ARMEDIA_OK;
+}
+
+/* Index the samples of a pending chunk and write it after the data already
+   handed to the writer; must be called within a writer job */
+static eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_WriteChunk (ARMEDIA_VideoEncapsuler_t *encapsuler, eENCAPSULER_CHUNK track)
+{
+    ARMEDIA_VideoEncapsuler_Chunk_t *chunk = &encapsuler->chunks[track];
+    ARMEDIA_SampleTable_t *table = ARMEDIA_VideoEncapsuler_GetTable (encapsuler, track);
+    uint8_t records[ENCAPSULER_CHUNK_RECORD_BATCH * ARMEDIA_SIDECAR_RECORD_SIZE];
+    int withCrc = encapsuler->sidecarFlags & ARMEDIA_SIDECAR_FLAG_RECORD_CRC;
+    eARMEDIA_ERROR error = ARMEDIA_OK;
+    ARMEDIA_SampleTable_Entry_t entry;
+    size_t recordsSize = 0;
+    uint32_t i;
+
+    entry.offset = encapsuler->dataOffset + ARMEDIA_VideoEncapsuler_GetDataSize (encapsuler) - encapsuler->chunkPendingSize;
+    for (i = 0; (ARMEDIA_OK == error) && (i < chunk->count); i++)
+    {
+        ARMEDIA_Sidecar_Record_t *record = &chunk->records[i];
+        if (0 != i)
+        {
+            record->flags |= ARMEDIA_SIDECAR_RECORD_FLAG_CHUNK_CONTINUE;
+        }
+        entry.size = record->size;
+        entry.duration = record->duration;
+        entry.flags = ARMEDIA_VideoEncapsuler_GetEntryFlags (record->flags);
+        if (ARMEDIA_OK != ARMEDIA_SampleTable_Add (table, &entry))
+        {
+            ENCAPSULER_ERROR ("Unable to grow the sample table");
+            error = ARMEDIA_ERROR_ENCAPSULER;
+            break;
+        }
+        entry.offset += entry.size;
+
+        ARMEDIA_Sidecar_EncodeRecord (records + recordsSize, record, withCrc);
+        recordsSize += ARMEDIA_SIDECAR_RECORD_SIZE;
+        if ((sizeof (records) == recordsSize) || (i + 1 == chunk->count))
+        {
+            error = ARMEDIA_FileWriter_WriteMeta (encapsuler->writer, records, recordsSize);
+            recordsSize = 0;
+        }
+    }
+    if (ARMEDIA_OK == error)
+    {
+        error = ARMEDIA_FileWriter_WriteData (encapsuler->writer, chunk->data, chunk->size);
+    }
+    if (ARMEDIA_OK != error)
+    {
+        ENCAPSULER_ERROR ("Unable to write a chunk of %u samples", chunk->count);
+    }
+
+    // The buffer is kept: the writer may use it until the job is committed
+    encapsuler->chunkPendingSize -= chunk->size;
+    chunk->size = 0;
+    chunk->count = 0;
+
+    return error;
+}
+
+/* Write the pending chunks of the given tracks (ENCAPSULER_CHUNK_ALL, or a mask of
+   1 << eENCAPSULER_CHUNK) in the order of their first sample, as one writer job */
+static eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_WriteChunks (ARMEDIA_VideoEncapsuler_t *encapsuler, uint32_t tracks)
+{
+    eARMEDIA_ERROR error, commitError;
+    int i, next;
+
+    error = ARMEDIA_FileWriter_BeginJob (encapsuler->writer);
+    if (ARMEDIA_OK != error)
+    {
+        return error;
+    }
+    do
+    {
+        next = -1;
+        for (i = 0; i < ENCAPSULER_CHUNK_MAX; i++)
+        {
+            if ((tracks & (1 << i)) && (0 != encapsuler->chunks[i].count) &&
+                ((-1 == next) || (encapsuler->chunks[i].firstTimestamp < encapsuler->chunks[next].firstTimestamp)))
+            {
+                next = i;
+            }
+        }
+        if (-1 != next)
+        {
+            error = ARMEDIA_VideoEncapsuler_WriteChunk (encapsuler, (eENCAPSULER_CHUNK)next);
+        }
+    } while ((ARMEDIA_OK == error) && (-1 != next));
+    if (ARMEDIA_OK == error)
+    {
+        error = ARMEDIA_VideoEncapsuler_WriteCheckpoint (encapsuler);
+    }
+    commitError = ARMEDIA_FileWriter_CommitJob (encapsuler->writer);
+
+    return (ARMEDIA_OK != error) ? error : commitError;
+}
+
+/* Before a new sample: write all the pending chunks once the oldest one spans the
+   chunk duration, or the chunks which reached the chunk size */
+static eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_WriteFullChunks (ARMEDIA_VideoEncapsuler_t *encapsuler, uint64_t timestamp)
+{
+    eARMEDIA_ERROR error;
+    uint32_t tracks = 0;
+    int i;
+
+    if ((0 == encapsuler->chunkDuration) || encapsuler->fragmented)
+    {
+        return ARMEDIA_OK;
+    }
+    for (i = 0; i < ENCAPSULER_CHUNK_MAX; i++)
+    {
+        const ARMEDIA_VideoEncapsuler_Chunk_t *chunk = &encapsuler->chunks[i];
+        if (0 == chunk->count)
+        {
+            continue;
+        }
+        if (timestamp >= chunk->firstTimestamp + encapsuler->chunkDuration)
+        {
+            tracks = ENCAPSULER_CHUNK_ALL;
+            break;
+        }
+        if (chunk->size >= encapsuler->chunkMaxSize)
+        {
+            tracks |= 1 << i;
+        }
+    }
+    if (0 == tracks)
+    {
+        return ARMEDIA_OK;
+    }
+
+    // With a full queue, the chunks are written with the next samples
+    error = ARMEDIA_VideoEncapsuler_WriteChunks (encapsuler, tracks);
+    return (ARMEDIA_ERROR_ENCAPSULER_QUEUE_FULL == error) ? ARMEDIA_OK : error;
+}
+
+// Sync the current writer job, at the given media timestamp
+static void ARMEDIA_VideoEncapsuler_Sync (ARMEDIA_VideoEncapsuler_t *encapsuler, uint64_t timestamp)
+{
+    ARMEDIA_FileWriter_Sync (encapsuler->writer);
+    if ((0 != encapsuler->lastSyncTimestamp) &&
+        (timestamp - encapsuler->lastSyncTimestamp > encapsuler->maxSyncInterval))
+    {
+        encapsuler->maxSyncInterval = timestamp - encapsuler->lastSyncTimestamp;
+    }
+    encapsuler->lastSyncTimestamp = timestamp;
+    encapsuler->lastSyncSize = ARMEDIA_VideoEncapsuler_GetDataSize (encapsuler);
+}
+
+static void ARMEDIA_VideoEncapsuler_Clock_Init (ARMEDIA_VideoEncapsuler_Clock_t *clock, ARMEDIA_VideoEncapsuler_t *encapsuler)
+{
+    memset (clock, 0, sizeof (*clock));
+    clock->timescale = encapsuler->timescale;
+    clock->lastDelta = (uint32_t)(((uint64_t)encapsuler->timescale * encapsuler->video->defaultFrameDuration) / 1000000);
+    clock->tolerance = (uint32_t)(((uint64_t)encapsuler->timescale * encapsuler->timestampTolerance) / 1000000);
+    if ((0 != clock->tolerance) && (0 != encapsuler->video->fps))
+    {
+        // Exact frame duration: the timescale is a multiple of the frame rate
+        clock->lastDelta = encapsuler->timescale / encapsuler->video->fps;
+    }
+}
+
+static uint32_t ARMEDIA_VideoEncapsuler_Clock_Delta (ARMEDIA_VideoEncapsuler_Clock_t *clock, uint32_t duration)
+{
+    uint64_t exactTime;
+    uint32_t delta;
+
+    if ((0 == clock->tolerance) || (0 == duration))
+    {
+        return (uint32_t)(((uint64_t)clock->timescale * duration) / 1000000);
+    }
+
+    clock->exactTime += duration;
+    exactTime = (clock->exactTime * clock->timescale + 500000) / 1000000;
+    delta = (exactTime > clock->quantizedTime) ? (uint32_t)(exactTime - clock->quantizedTime) : 1;
+    if ((delta <= clock->lastDelta + clock->tolerance) && (delta + clock->tolerance >= clock->lastDelta))
+    {
+        delta = clock->lastDelta;
+    }
+    clock->quantizedTime += delta;
+    return delta;
+}
+
+/* Samples of a track in a fragment (traf atom), the durations are converted again when it is written */
+typedef struct
+{
+    uint32_t sampleCount;
+    uint32_t defaultDuration;
+    uint32_t defaultSize;
+    uint32_t defaultFlags;
+    uint32_t firstFlags;
+    uint32_t trunFlags;
+    uint64_t lastTimestamp; // timestamp of the last sample
+    size_t size; // size of the traf atom
+} ARMEDIA_VideoEncapsuler_Traf_t;
+
+static uint32_t ARMEDIA_VideoEncapsuler_GetTrackId (eENCAPSULER_CHUNK track)
+{
+    // Same as the tkhd atoms
+    switch (track)
+    {
+    case ENCAPSULER_CHUNK_METADATA:
+        return ARMEDIA_VIDEOATOM_MEDIATYPE_METADATA + 1;
+    case ENCAPSULER_CHUNK_AUDIO:
+        return ARMEDIA_VIDEOATOM_MEDIATYPE_SOUND + 1;
+    case ENCAPSULER_CHUNK_VIDEO:
+    default:
+        return ARMEDIA_VIDEOATOM_MEDIATYPE_VIDEO + 1;
+    }
+}
+
+// Duration of a sample of a fragment: up to the next sample, or to the end of the fragment for the last one
+static uint32_t ARMEDIA_VideoEncapsuler_GetSampleDuration (const ARMEDIA_VideoEncapsuler_Chunk_t *chunk, const ARMEDIA_VideoEncapsuler_Traf_t *traf, uint32_t index, uint64_t end)
+{
+    if (index + 1 < chunk->count)
+    {
+        return chunk->records[index + 1].duration;
+    }
+    return (end > traf->lastTimestamp) ? (uint32_t)(end - traf->lastTimestamp) : 0;
+}
+
+static void ARMEDIA_VideoEncapsuler_PrepareTraf (ARMEDIA_VideoEncapsuler_t *encapsuler, eENCAPSULER_CHUNK track, uint64_t end, ARMEDIA_VideoEncapsuler_Traf_t *traf)
+{
+    const ARMEDIA_VideoEncapsuler_Chunk_t *chunk = &encapsuler->chunks[track];
+    ARMEDIA_VideoEncapsuler_Clock_t clock = encapsuler->fragmentClocks[track]; // updated when the fragment is written
+    uint32_t syncCount = 0;
+    uint32_t fields = 0;
+    uint32_t i;
+
+    memset (traf, 0, sizeof (*traf));
+    traf->trunFlags = ENCAPSULER_TRUN_DATA_OFFSET;
+    traf->defaultFlags = ENCAPSULER_SAMPLE_FLAGS_SYNC;
+    if (ENCAPSULER_CHUNK_AUDIO == track)
+    {
+        // One PCM sample of all the channels per sample, as in the moov atom
+        traf->defaultSize = encapsuler->audio->nchannel * encapsuler->audio->format / 8;
+        traf->defaultDuration = 1;
+        traf->sampleCount = (uint32_t)(chunk->size / traf->defaultSize);
+    }
+    else
+    {
+        traf->sampleCount = chunk->count;
+        traf->lastTimestamp = chunk->firstTimestamp;
+        for (i = 1; i < chunk->count; i++)
+        {
+            traf->lastTimestamp += chunk->records[i].duration;
+        }
+        traf->defaultSize = chunk->records[0].size;
+        for (i = 0; i < chunk->count; i++)
+        {
+            uint32_t duration = ARMEDIA_VideoEncapsuler_Clock_Delta (&clock, ARMEDIA_VideoEncapsuler_GetSampleDuration (chunk, traf, i, end));
+            if (0 == i)
+            {
+                traf->defaultDuration = duration;
+            }
+            else if (duration != traf->defaultDuration)
+            {
+                traf->trunFlags |= ENCAPSULER_TRUN_DURATION;
+            }
+            if (chunk->records[i].size != traf->defaultSize)
+            {
+                traf->trunFlags |= ENCAPSULER_TRUN_SIZE;
+            }
+            if (chunk->records[i].flags & ARMEDIA_SIDECAR_RECORD_FLAG_SYNC)
+            {
+                syncCount++;
+            }
+        }
+
+        // The fragments start with a sync frame, followed by frames depending on it
+        if ((ENCAPSULER_CHUNK_VIDEO == track) && (syncCount != chunk->count))
+        {
+            if ((1 < syncCount) || ((1 == syncCount) && !(chunk->records[0].flags & ARMEDIA_SIDECAR_RECORD_FLAG_SYNC)))
+            {
+                traf->trunFlags |= ENCAPSULER_TRUN_FLAGS;
+            }
+            traf->defaultFlags = ENCAPSULER_SAMPLE_FLAGS_NON_SYNC;
+            if (1 == syncCount)
+            {
+                traf->trunFlags |= ENCAPSULER_TRUN_FIRST_FLAGS;
+                traf->firstFlags = ENCAPSULER_SAMPLE_FLAGS_SYNC;
+            }
+        }
+    }
+
+    for (i = ENCAPSULER_TRUN_DURATION; i <= ENCAPSULER_TRUN_FLAGS; i <<= 1)
+    {
+        fields += (traf->trunFlags & i) ? 1 : 0;
+    }
+    traf->size = ENCAPSULER_TRAF_HEADER_SIZE + ENCAPSULER_TRUN_HEADER_SIZE + sizeof (uint32_t) * (size_t)traf->sampleCount * fields;
+    if (traf->trunFlags & ENCAPSULER_TRUN_FIRST_FLAGS)
+    {
+        traf->size += sizeof (uint32_t);
+    }
+}
+
+static uint8_t *ARMEDIA_VideoEncapsuler_PutU32 (uint8_t *buffer, uint32_t value)
+{
+    uint32_t valueNE = htonl (value);
+    memcpy (buffer, &valueNE, sizeof (valueNE));
+    return buffer + sizeof (valueNE);
+}
+
+static uint8_t *ARMEDIA_VideoEncapsuler_PutAtomHeader (uint8_t *buffer, uint32_t size, const char *tag)
+{
+    buffer = ARMEDIA_VideoEncapsuler_PutU32 (buffer, size);
+    memcpy (buffer, tag, 4);
+    return buffer + 4;
+}
+
+static uint8_t *ARMEDIA_VideoEncapsuler_PutTraf (ARMEDIA_VideoEncapsuler_t *encapsuler, eENCAPSULER_CHUNK track, const ARMEDIA_VideoEncapsuler_Traf_t *traf,
+                                                 uint64_t end, uint32_t dataOffset, uint8_t *buffer)
+{
+    const ARMEDIA_VideoEncapsuler_Chunk_t *chunk = &encapsuler->chunks[track];
+    uint64_t decodeTime = encapsuler->fragmentTimes[track];
+    uint32_t i;
+
+    buffer = ARMEDIA_VideoEncapsuler_PutAtomHeader (buffer, (uint32_t)traf->size, "traf");
+    buffer = ARMEDIA_VideoEncapsuler_PutAtomHeader (buffer, 28, "tfhd");
+    buffer = ARMEDIA_VideoEncapsuler_PutU32 (buffer, ENCAPSULER_TFHD_FLAGS);
+    buffer = ARMEDIA_VideoEncapsuler_PutU32 (buffer, ARMEDIA_VideoEncapsuler_GetTrackId (track));
+    buffer = ARMEDIA_VideoEncapsuler_PutU32 (buffer, traf->defaultDuration);
+    buffer = ARMEDIA_VideoEncapsuler_PutU32 (buffer, traf->defaultSize);
+    buffer = ARMEDIA_VideoEncapsuler_PutU32 (buffer, traf->defaultFlags);
+    buffer = ARMEDIA_VideoEncapsuler_PutAtomHeader (buffer, 20, "tfdt");
+    buffer = ARMEDIA_VideoEncapsuler_PutU32 (buffer, 0x01000000); // version 1: 64 bits decode time
+    buffer = ARMEDIA_VideoEncapsuler_PutU32 (buffer, (uint32_t)(decodeTime >> 32));
+    buffer = ARMEDIA_VideoEncapsuler_PutU32 (buffer, (uint32_t)(decodeTime & 0xffffffff));
+    buffer = ARMEDIA_VideoEncapsuler_PutAtomHeader (buffer, (uint32_t)(traf->size - ENCAPSULER_TRAF_HEADER_SIZE), "trun");
+    buffer = ARMEDIA_VideoEncapsuler_PutU32 (buffer, traf->trunFlags);
+    buffer = ARMEDIA_VideoEncapsuler_PutU32 (buffer, traf->sampleCount);
+    buffer = ARMEDIA_VideoEncapsuler_PutU32 (buffer, dataOffset);
+    if (traf->trunFlags & ENCAPSULER_TRUN_FIRST_FLAGS)
+    {
+        buffer = ARMEDIA_VideoEncapsuler_PutU32 (buffer, traf->firstFlags);
+    }
+
+    if (ENCAPSULER_CHUNK_AUDIO == track)
+    {
+        encapsuler->fragmentTimes[track] += traf->sampleCount;
+        return buffer;
+    }
+    for (i = 0; i < chunk->count; i++)
+    {
+        uint32_t duration = ARMEDIA_VideoEncapsuler_Clock_Delta (&encapsuler->fragmentClocks[track],
+                                                                 ARMEDIA_VideoEncapsuler_GetSampleDuration (chunk, traf, i, end));
+        if (traf->trunFlags & ENCAPSULER_TRUN_DURATION)
+        {
+            buffer = ARMEDIA_VideoEncapsuler_PutU32 (buffer, duration);
+        }
+        if (traf->trunFlags & ENCAPSULER_TRUN_SIZE)
+        {
+            buffer = ARMEDIA_VideoEncapsuler_PutU32 (buffer, chunk->records[i].size);
+        }
+        if (traf->trunFlags & ENCAPSULER_TRUN_FLAGS)
+        {
+            buffer = ARMEDIA_VideoEncapsuler_PutU32 (buffer, (chunk->records[i].flags & ARMEDIA_SIDECAR_RECORD_FLAG_SYNC) ?
+                                                     ENCAPSULER_SAMPLE_FLAGS_SYNC : ENCAPSULER_SAMPLE_FLAGS_NON_SYNC);
+        }
+        encapsuler->fragmentTimes[track] += duration;
+    }
+    return buffer;
+}
+
+/* Write the pending samples of the tracks as a fragment: a moof atom, then an mdat
+   atom with the chunks of the tracks. end is the timestamp following the last frame.
+   The init segment is written before the first fragment. */
+static eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_WriteFragment (ARMEDIA_VideoEncapsuler_t *encapsuler, uint64_t end)
+{
+    ARMEDIA_VideoEncapsuler_Traf_t trafs[ENCAPSULER_CHUNK_MAX];
+    eARMEDIA_ERROR error, commitError;
+    size_t moofSize = ENCAPSULER_MOOF_HEADER_SIZE;
+    size_t headerSize;
+    uint64_t dataSize = 0;
+    uint64_t dataOffset;
+    uint8_t *buffer;
+    int i;
+
+    if (0 == encapsuler->fragmentCount)
+    {
+        error = ARMEDIA_VideoEncapsuler_WriteInitSegment (encapsuler);
+        if (ARMEDIA_OK != error)
+        {
+            return error;
+        }
+    }
+
+    for (i = 0; i < ENCAPSULER_CHUNK_MAX; i++)
+    {
+        ARMEDIA_VideoEncapsuler_Chunk_t *chunk = &encapsuler->chunks[i];
+        trafs[i].sampleCount = 0;
+        if (0 == chunk->count)
+        {
+            continue;
+        }
+        if (!(encapsuler->fragmentTracks & (1 << i)))
+        {
+            // Not declared by the init segment
+            encapsuler->chunkPendingSize -= chunk->size;
+            chunk->size = 0;
+            chunk->count = 0;
+            continue;
+        }
+        ARMEDIA_VideoEncapsuler_PrepareTraf (encapsuler, (eENCAPSULER_CHUNK)i, end, &trafs[i]);
+        if (0 != trafs[i].sampleCount)
+        {
+            moofSize += trafs[i].size;
+            dataSize += chunk->size;
+        }
+    }
+    if (0 == dataSize)
+    {
+        return ARMEDIA_OK;
+    }
+    headerSize = moofSize + ((UINT32_MAX < 8 + dataSize) ? 16 : 8);
+
+    if (headerSize > encapsuler->fragmentCapacity)
+    {
+        buffer = realloc (encapsuler->fragmentBuffer, headerSize);
+        if (NULL == buffer)
+        {
+            ENCAPSULER_ERROR ("Unable to allocate a moof atom of %zu bytes", moofSize);
+            return ARMEDIA_ERROR_ENCAPSULER;
+        }
+        encapsuler->fragmentBuffer = buffer;
+        encapsuler->fragmentCapacity = headerSize;
+    }
+
+    // With a full queue, the samples are kept for the next fragment
+    error = ARMEDIA_FileWriter_BeginJob (encapsuler->writer);
+    if (ARMEDIA_OK != error)
+    {
+        return error;
+    }
+
+    buffer = ARMEDIA_VideoEncapsuler_PutAtomHeader (encapsuler->fragmentBuffer, (uint32_t)moofSize, "moof");
+    buffer = ARMEDIA_VideoEncapsuler_PutAtomHeader (buffer, 16, "mfhd");
+    buffer = ARMEDIA_VideoEncapsuler_PutU32 (buffer, 0); // version & flags
+    buffer = ARMEDIA_VideoEncapsuler_PutU32 (buffer, encapsuler->fragmentCount + 1);
+    dataOffset = headerSize;
+    for (i = 0; i < ENCAPSULER_CHUNK_MAX; i++)
+    {
+        if (0 != trafs[i].sampleCount)
+        {
+            buffer = ARMEDIA_VideoEncapsuler_PutTraf (encapsuler, (eENCAPSULER_CHUNK)i, &trafs[i], end, (uint32_t)dataOffset, buffer);
+            dataOffset += encapsuler->chunks[i].size;
+        }
+    }
+    if (headerSize == moofSize + 8)
+    {
+        buffer = ARMEDIA_VideoEncapsuler_PutAtomHeader (buffer, (uint32_t)(8 + dataSize), "mdat");
+    }
+    else
+    {
+        buffer = ARMEDIA_VideoEncapsuler_PutAtomHeader (buffer, 1, "mdat");
+        buffer = ARMEDIA_VideoEncapsuler_PutU32 (buffer, (uint32_t)((16 + dataSize) >> 32));
+        buffer = ARMEDIA_VideoEncapsuler_PutU32 (buffer, (uint32_t)((16 + dataSize) & 0xffffffff));
+    }
+
+    // The buffers are kept: the writer may use them until the job is committed
+    error = ARMEDIA_FileWriter_WriteData (encapsuler->writer, encapsuler->fragmentBuffer, headerSize);
+    for (i = 0; i < ENCAPSULER_CHUNK_MAX; i++)
+    {
+        ARMEDIA_VideoEncapsuler_Chunk_t *chunk = &encapsuler->chunks[i];
+        if ((ARMEDIA_OK == error) && (0 != trafs[i].sampleCount))
+        {
+            error = ARMEDIA_FileWriter_WriteData (encapsuler->writer, chunk->data, chunk->size);
+        }
+        encapsuler->chunkPendingSize -= chunk->size;
+        chunk->size = 0;
+        chunk->count = 0;
+    }
+    if ((ARMEDIA_OK == error) && (ARMEDIA_ENCAPSULER_DURABILITY_NEVER != encapsuler->durabilityPolicy))
+    {
+        ARMEDIA_VideoEncapsuler_Sync (encapsuler, encapsuler->video->lastFrameTimestamp);
+    }
+    commitError = ARMEDIA_FileWriter_CommitJob (encapsuler->writer);
+    if (ARMEDIA_OK == error)
+    {
+        error = commitError;
+    }
+    if (ARMEDIA_OK != error)
+    {
+        ENCAPSULER_ERROR ("Unable to write fragment %u", encapsuler->fragmentCount + 1);
+        return error;
+    }
+    encapsuler->fragmentCount++;
+    encapsuler->fragmentEnd += headerSize + dataSize;
+
+    return ARMEDIA_OK;
+}
+
+/* Before a new frame: write the pending samples as a fragment when the frame is a
+   sync frame and the fragment spans the fragment duration */
+static eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_WriteFullFragment (ARMEDIA_VideoEncapsuler_t *encapsuler, const ARMEDIA_Frame_Header_t *frameHeader)
+{
+    const ARMEDIA_VideoEncapsuler_Chunk_t *chunk = &encapsuler->chunks[ENCAPSULER_CHUNK_VIDEO];
+    ARMEDIA_Video_t *video = encapsuler->video;
+    uint64_t timestamp = (0 != frameHeader->timestamp) ? frameHeader->timestamp : video->lastFrameTimestamp + video->defaultFrameDuration;
+    eARMEDIA_ERROR error;
+
+    // Half a frame of slack so that a whole GOP of rounded timestamps fills the duration
+    if ((0 == chunk->count) || (timestamp + video->defaultFrameDuration / 2 < chunk->firstTimestamp + encapsuler->fragmentDuration) ||
+        ((ARMEDIA_ENCAPSULER_FRAME_TYPE_I_FRAME != frameHeader->frame_type) && (ARMEDIA_ENCAPSULER_FRAME_TYPE_JPEG != frameHeader->frame_type)))
+    {
+        return ARMEDIA_OK;
+    }
+
+    // With a full queue, the fragment is written on the next sync frame
+    error = ARMEDIA_VideoEncapsuler_WriteFragment (encapsuler, timestamp);
+    return (ARMEDIA_ERROR_ENCAPSULER_QUEUE_FULL == error) ? ARMEDIA_OK : error;
+}
+
+static eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_WritePendingChunks (ARMEDIA_VideoEncapsuler_t *encapsuler)
+{
+    eARMEDIA_ERROR error;
+    uint64_t end;
+    uint32_t count = 0;
+    int i;
+
+    if ((NULL != encapsuler->tsMuxer) && (NULL != encapsuler->writer))
+    {
+        // The batch of a transport stream is written even with a full queue
+        return ARMEDIA_TsMuxer_Flush (encapsuler->tsMuxer);
+    }
+
+    for (i = 0; i < ENCAPSULER_CHUNK_MAX; i++)
+    {
+        count += encapsuler->chunks[i].count;
+    }
+    if ((0 == count) || (NULL == encapsuler->writer))
+    {
+        return ARMEDIA_OK;
+    }
+    // The last frame of a fragment gets the default duration
+    end = encapsuler->video->lastFrameTimestamp + encapsuler->video->defaultFrameDuration;
+    error = encapsuler->fragmented ? ARMEDIA_VideoEncapsuler_WriteFragment (encapsuler, end) :
+                                     ARMEDIA_VideoEncapsuler_WriteChunks (encapsuler, ENCAPSULER_CHUNK_ALL);
+    if (ARMEDIA_ERROR_ENCAPSULER_QUEUE_FULL == error)
+    {
+        error = ARMEDIA_FileWriter_Flush (encapsuler->writer);
+        if (ARMEDIA_OK == error)
+        {
+            error = encapsuler->fragmented ? ARMEDIA_VideoEncapsuler_WriteFragment (encapsuler, end) :
+                                             ARMEDIA_VideoEncapsuler_WriteChunks (encapsuler, ENCAPSULER_CHUNK_ALL);
+        }
+    }
+    return error;
+}
+
+static eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_Preallocate (ARMEDIA_VideoEncapsuler_t *encapsuler, off_t size)
+{
+    eARMEDIA_ERROR error;
+    off_t end = encapsuler->dataOffset + ARMEDIA_VideoEncapsuler_GetDataSize (encapsuler) + size;
+
+    if (NULL != encapsuler->tsMuxer)
+    {
+        // The size includes the packet headers
+        end = ARMEDIA_TsMuxer_GetSize (encapsuler->tsMuxer) + size;
+    }
+
+    if ((0 == encapsuler->preallocationSize) || (end <= encapsuler->preallocatedEnd))
+    {
+        return ARMEDIA_OK;
+    }
+
+    error = ARMEDIA_FileWriter_Allocate (encapsuler->writer, encapsuler->preallocatedEnd,
+                                         end + encapsuler->preallocationSize - encapsuler->preallocatedEnd);
+    if (ARMEDIA_OK == error)
+    {
+        encapsuler->preallocatedEnd = end + encapsuler->preallocationSize;
+        return ARMEDIA_OK;
+    }
+
+    if (ARMEDIA_ERROR_ENCAPSULER_DISK_FULL == error)
+    {
+        // Less than an increment is left: the last samples are allocated one by one
+        error = ARMEDIA_FileWriter_Allocate (encapsuler->writer, encapsuler->preallocatedEnd, end - encapsuler->preallocatedEnd);
+        if (ARMEDIA_OK == error)
+        {
+            encapsuler->preallocatedEnd = end;
+        }
+        else if (ARMEDIA_ERROR_ENCAPSULER_DISK_FULL == error)
+        {
+            ENCAPSULER_ERROR ("No space left on the storage for %lld bytes", (long long)size);
+        }
+    }
+    if ((ARMEDIA_OK != error) && (ARMEDIA_ERROR_ENCAPSULER_DISK_FULL != error))
+    {
+        // The data is still written, only without preallocation
+        ENCAPSULER_DEBUG ("Preallocation of the data file disabled (error %d)", error);
+        encapsuler->preallocationSize = 0;
+        error = ARMEDIA_OK;
+    }
+
+    return error;
+}
+
+static int ARMEDIA_VideoEncapsuler_NeedSync (ARMEDIA_VideoEncapsuler_t *encapsuler, ARMEDIA_Frame_Header_t *frameHeader)
+{
+    ARMEDIA_Video_t* video = encapsuler->video;
+
+    // A fragmented media is synced with each fragment
+    if (encapsuler->fragmented)
+    {
+        return 0;
+    }
+
+    // The file headers and descriptor are needed by ARMEDIA_VideoEncapsuler_TryFixMediaFile()
+    if (0 == video->framesCount)
+    {
+        return 1;
+    }
+
+    switch (encapsuler->durabilityPolicy)
+    {
+    case ARMEDIA_ENCAPSULER_DURABILITY_GOP:
+        // synchronisation every 10 frames in MJPEG or else before new I-Frames
+        return ((video->codec == CODEC_MOTION_JPEG && (video->framesCount % 10) == 0) ||
+                frameHeader->frame_type == ARMEDIA_ENCAPSULER_FRAME_TYPE_I_FRAME);
+    case ARMEDIA_ENCAPSULER_DURABILITY_PERIOD:
+        return (frameHeader->timestamp - encapsuler->lastSyncTimestamp >= (uint64_t)encapsuler->durabilityValue * 1000);
+    case ARMEDIA_ENCAPSULER_DURABILITY_SIZE:
+        return (ARMEDIA_VideoEncapsuler_GetDataSize (encapsuler) - encapsuler->lastSyncSize >= (off_t)encapsuler->durabilityValue);
+    case ARMEDIA_ENCAPSULER_DURABILITY_NEVER:
+    default:
+        return 0;
+    }
+}
+
+static eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_WriteFrame (ARMEDIA_VideoEncapsuler_t *encapsuler, ARMEDIA_Frame_Header_t *frameHeader, const void *metadataBuffer)
+{
+    ARMEDIA_Video_t* video = encapsuler->video;
+
+    // New frame, write all infos about last one
+    // if frame TS is null, set it as last TS + default duration (from fps)
+    if (frameHeader->timestamp == 0) {
+        frameHeader->timestamp = video->lastFrameTimestamp + video->defaultFrameDuration;
+    }
+    // For first frame, no previous timestamp => dt = 0
+    if (video->lastFrameTimestamp == 0) {
+        video->lastFrameTimestamp = frameHeader->timestamp;
+    }
+
+    ARMEDIA_Metadata_t *metadata = NULL;
+    if (encapsuler->metadata != NULL && encapsuler->metadata->block_size > 0)
+    {
+        metadata = encapsuler->metadata;
+
+        // Same as for video, no previous timestamp => dt = 0
+        if (metadataBuffer != NULL && metadata->lastFrameTimestamp == 0) {
+            metadata->lastFrameTimestamp = frameHeader->timestamp;
+        }
+    }
+
+    // Use frameHeader->frame_type to check that we don't write infos about a null frame
+
+    if (ARMEDIA_VideoEncapsuler_NeedSync (encapsuler, frameHeader))
+    {
+        ARMEDIA_VideoEncapsuler_Sync (encapsuler, frameHeader->timestamp);
+    }
+
+    if (ARMEDIA_ENCAPSULER_FRAME_TYPE_UNKNNOWN != frameHeader->frame_type)
+    {
+        uint8_t records[2 * ARMEDIA_SIDECAR_RECORD_SIZE];
+        ARMEDIA_Sidecar_Record_t record;
+        ARMEDIA_SampleTable_Entry_t entry;
+        int withCrc = encapsuler->sidecarFlags & ARMEDIA_SIDECAR_FLAG_RECORD_CRC;
+        size_t recordsSize = 0;
+        off_t totalFrameSize = ARMEDIA_VideoEncapsuler_GetFrameSize (encapsuler, frameHeader);
+
+        record.type = ARMEDIA_ENCAPSULER_VIDEO_INFO_TAG;
+        record.flags = 0;
+        if (ARMEDIA_ENCAPSULER_FRAME_TYPE_I_FRAME == frameHeader->frame_type ||
+                ARMEDIA_ENCAPSULER_FRAME_TYPE_JPEG == frameHeader->frame_type)
+        {
+            record.flags |= ARMEDIA_SIDECAR_RECORD_FLAG_SYNC;
+        }
+        record.size = (uint32_t)totalFrameSize;
+        record.duration = (uint32_t)(frameHeader->timestamp - video->lastFrameTimestamp); // frame duration
+        if (ARMEDIA_VideoEncapsuler_KeepsChunks (encapsuler))
+        {
+            // Indexed when the chunk is written
+            if (ARMEDIA_OK != ARMEDIA_VideoEncapsuler_AddChunkRecord (encapsuler, ENCAPSULER_CHUNK_VIDEO, &record, frameHeader->timestamp))
+            {
+                return ARMEDIA_ERROR_ENCAPSULER;
+            }
+        }
+        else
+        {
+            ARMEDIA_Sidecar_EncodeRecord (records, &record, withCrc);
+            recordsSize = ARMEDIA_SIDECAR_RECORD_SIZE;
+
+            entry.offset = encapsuler->dataOffset + ARMEDIA_VideoEncapsuler_GetDataSize (encapsuler);
+            entry.size = record.size;
+            entry.duration = record.duration;
+            entry.flags = ARMEDIA_VideoEncapsuler_GetEntryFlags (record.flags);
+            if (ARMEDIA_OK != ARMEDIA_SampleTable_Add (&encapsuler->videoTable, &entry))
+            {
+                ENCAPSULER_ERROR ("Unable to grow the video sample table");
+                return ARMEDIA_ERROR_ENCAPSULER;
+            }
+        }
+
+        if (metadataBuffer != NULL && metadata != NULL && metadata->block_size > 0)
+        {
+            record.type = ARMEDIA_ENCAPSULER_METADATA_INFO_TAG;
+            record.size = metadata->block_size;
+            record.duration = (uint32_t)(frameHeader->timestamp - metadata->lastFrameTimestamp);
+            if (ARMEDIA_VideoEncapsuler_KeepsChunks (encapsuler))
+            {
+                if (ARMEDIA_OK != ARMEDIA_VideoEncapsuler_AddChunkRecord (encapsuler, ENCAPSULER_CHUNK_METADATA, &record, frameHeader->timestamp))
+                {
+                    return ARMEDIA_ERROR_ENCAPSULER;
+                }
+            }
+            else
+            {
+                ARMEDIA_Sidecar_EncodeRecord (records + recordsSize, &record, withCrc);
+                recordsSize += ARMEDIA_SIDECAR_RECORD_SIZE;
+
+                // The metadata block follows the frame
+                entry.offset += entry.size;
+                entry.size = record.size;
+                entry.duration = record.duration;
+                entry.flags = 0;
+                if (ARMEDIA_OK != ARMEDIA_SampleTable_Add (&encapsuler->metadataTable, &entry))
+                {
+                    ENCAPSULER_ERROR ("Unable to grow the metadata sample table");
+                    return ARMEDIA_ERROR_ENCAPSULER;
+                }
+            }
+
+            metadata->lastFrameTimestamp = frameHeader->timestamp;
+            metadata->framesCount++;
+        }
+
+        // The frame and its metadata are indexed with a single write
+        if ((0 != recordsSize) && (ARMEDIA_OK != ARMEDIA_FileWriter_WriteMeta (encapsuler->writer, records, recordsSize)))
+        {
+            ENCAPSULER_ERROR ("Unable to write frameInfo into info file");
+            return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+        }
+        if ((0 != recordsSize) && (ARMEDIA_OK != ARMEDIA_VideoEncapsuler_WriteCheckpoint (encapsuler)))
+        {
+            return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+        }
+    }
+
+    video->lastFrameTimestamp = frameHeader->timestamp;
+    video->framesCount++;
+
+    if (frameHeader->avc_insert_ps)
+    {
+        // Force insertion of SPS and PPS before this frame
+        uint32_t naluSize, naluSizeNe;
+        if (video->spsSize > 4)
+        {
+            naluSize = video->spsSize - 4;
+            naluSizeNe = htonl(naluSize);
+            if (ARMEDIA_OK != ARMEDIA_VideoEncapsuler_WriteData (encapsuler, ENCAPSULER_CHUNK_VIDEO, &naluSizeNe, 4))
+            {
+                ENCAPSULER_ERROR ("Unable to write SPS into data file");
+                return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+            }
+            if (ARMEDIA_OK != ARMEDIA_VideoEncapsuler_WriteData (encapsuler, ENCAPSULER_CHUNK_VIDEO, video->sps + 4, naluSize))
+            {
+                ENCAPSULER_ERROR ("Unable to write SPS into data file");
+                return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+            }
+            video->totalsize += video->spsSize;
+        }
+        if (video->ppsSize > 4)
+        {
+            naluSize = video->ppsSize - 4;
+            naluSizeNe = htonl(naluSize);
+            if (ARMEDIA_OK != ARMEDIA_VideoEncapsuler_WriteData (encapsuler, ENCAPSULER_CHUNK_VIDEO, &naluSizeNe, 4))
+            {
+                ENCAPSULER_ERROR ("Unable to write PPS into data file");
+                return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+            }
+            if (ARMEDIA_OK != ARMEDIA_VideoEncapsuler_WriteData (encapsuler, ENCAPSULER_CHUNK_VIDEO, video->pps + 4, naluSize))
+            {
+                ENCAPSULER_ERROR ("Unable to write PPS into data file");
+                return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+            }
+            video->totalsize += video->ppsSize;
+        }
+    }
+
+    // Write the frame to the data file (and replace the NAL units start code by the NALU size in case of H.264)
+    {
+        uint32_t i, naluSizeNE;
+        for (i = 0; i < encapsuler->naluCount; i++)
+        {
+            if (encapsuler->nalusInPlace)
+            {
+                // The NALU size is already in place of the start code
+                if (ARMEDIA_OK != ARMEDIA_VideoEncapsuler_WriteData (encapsuler, ENCAPSULER_CHUNK_VIDEO, encapsuler->nalus[i].data - 4, 4 + encapsuler->nalus[i].size))
+                {
+                    ENCAPSULER_ERROR ("Unable to write frame into data file");
+                    return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+                }
+                video->totalsize += 4 + encapsuler->nalus[i].size;
+                continue;
+            }
+            if (video->codec == CODEC_MPEG4_AVC)
+            {
+                naluSizeNE = htonl(encapsuler->nalus[i].size);
+                if (ARMEDIA_OK != ARMEDIA_VideoEncapsuler_WriteData (encapsuler, ENCAPSULER_CHUNK_VIDEO, &naluSizeNE, 4))
+                {
+                    ENCAPSULER_ERROR ("Unable to write frame into data file");
+                    return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+                }
+                video->totalsize += 4;
+            }
+            if (ARMEDIA_OK != ARMEDIA_VideoEncapsuler_WriteData (encapsuler, ENCAPSULER_CHUNK_VIDEO, encapsuler->nalus[i].data, encapsuler->nalus[i].size))
+            {
+                ENCAPSULER_ERROR ("Unable to write frame into data file");
+                return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+            }
+            video->totalsize += encapsuler->nalus[i].size;
+        }
+    }
+
+    if (metadataBuffer != NULL && metadata != NULL && metadata->block_size > 0)
+    {
+        if (ARMEDIA_OK != ARMEDIA_VideoEncapsuler_WriteData (encapsuler, ENCAPSULER_CHUNK_METADATA, metadataBuffer, metadata->block_size))
+        {
+            ENCAPSULER_ERROR ("Unable to write metadata into file");
+            return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+        }
+        metadata->totalsize += metadata->block_size;
+    }
+
+#if ENCAPSULER_LOG_TIMESTAMPS
+    fprintf(tslogger, "V;%"PRIu64"\n", frameHeader->timestamp);
+#endif
+
+    return ARMEDIA_OK;
+}
+
+// Written before each frame without one, so that a decoder can find the frames in the PES packets
+static const uint8_t s_accessUnitDelimiter[6] = { 0, 0, 0, 1, ENCAPSULER_AVC_NALU_TYPE_AUD, 0xf0 };
+
+static eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_OutputTsPackets (const uint8_t *packets, size_t size, void *userData)
+{
+    ARMEDIA_VideoEncapsuler_t *encapsuler = (ARMEDIA_VideoEncapsuler_t *)userData;
+    eARMEDIA_ERROR error, commitError;
+
+    error = ARMEDIA_FileWriter_BeginJob (encapsuler->writer);
+    if ((ARMEDIA_ERROR_ENCAPSULER_QUEUE_FULL == error) && !encapsuler->tsMayDrop)
+    {
+        // The batch holds packets of frames already accepted: wait for the queue
+        error = ARMEDIA_FileWriter_Flush (encapsuler->writer);
+        if (ARMEDIA_OK == error)
+        {
+            error = ARMEDIA_FileWriter_BeginJob (encapsuler->writer);
+        }
+    }
+    if (ARMEDIA_OK != error)
+    {
+        return error;
+    }
+
+    if (0 != size)
+    {
+        error = ARMEDIA_FileWriter_WriteData (encapsuler->writer, packets, size);
+    }
+    if ((ARMEDIA_OK == error) && encapsuler->tsSyncPending)
+    {
+        encapsuler->tsSyncPending = 0;
+        ARMEDIA_VideoEncapsuler_Sync (encapsuler, encapsuler->tsSyncTimestamp);
+    }
+    commitError = ARMEDIA_FileWriter_CommitJob (encapsuler->writer);
+
+    return (ARMEDIA_OK != error) ? error : commitError;
+}
+
+// Write the current batch and sync it with the previous ones
+static eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_SyncTs (ARMEDIA_VideoEncapsuler_t *encapsuler, uint64_t timestamp)
+{
+    eARMEDIA_ERROR error;
+
+    encapsuler->tsSyncPending = 1;
+    encapsuler->tsSyncTimestamp = timestamp;
+    error = ARMEDIA_TsMuxer_Flush (encapsuler->tsMuxer);
+    if ((ARMEDIA_OK == error) && encapsuler->tsSyncPending)
+    {
+        // Empty batch: only the sync is queued
+        error = ARMEDIA_VideoEncapsuler_OutputTsPackets (NULL, 0, encapsuler);
+    }
+    encapsuler->tsSyncPending = 0;
+
+    return error;
+}
+
+/* Make room in the batch for size bytes of packets. With a full writer queue and the
+   drop policy, ARMEDIA_ERROR_ENCAPSULER_QUEUE_FULL is returned and the batch is kept */
+static eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_ReserveTsPackets (ARMEDIA_VideoEncapsuler_t *encapsuler, size_t size)
+{
+    eARMEDIA_ERROR error;
+
+    if (size <= ARMEDIA_TsMuxer_GetFreeSize (encapsuler->tsMuxer))
+    {
+        return ARMEDIA_OK;
+    }
+    encapsuler->tsMayDrop = 1;
+    error = ARMEDIA_TsMuxer_Flush (encapsuler->tsMuxer);
+    encapsuler->tsMayDrop = 0;
+
+    return error;
+}
+
+// Presentation time of a timestamp, from the first frame
+static uint64_t ARMEDIA_VideoEncapsuler_GetTsTime (ARMEDIA_VideoEncapsuler_t *encapsuler, uint64_t timestamp)
+{
+    uint64_t first = encapsuler->video->firstFrameTimestamp;
+    return (timestamp > first) ? ((timestamp - first) * ARMEDIA_TSMUXER_CLOCK_RATE + 500000) / 1000000 : 0;
+}
+
+static eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_AddTsStreams (ARMEDIA_VideoEncapsuler_t *encapsuler)
+{
+    ARMEDIA_Metadata_t *metadata = encapsuler->metadata;
+    uint8_t descriptors[ARMEDIA_TSMUXER_MAX_DESCRIPTORS_SIZE];
+    uint32_t mimeSize, blockSizeNe;
+    eARMEDIA_ERROR error;
+
+    error = ARMEDIA_TsMuxer_AddStream (encapsuler->tsMuxer, ARMEDIA_TSMUXER_STREAM_VIDEO, ENCAPSULER_TS_STREAM_TYPE_AVC, NULL, 0);
+    if ((ARMEDIA_OK != error) || (NULL == metadata) || (0 == metadata->block_size))
+    {
+        return error;
+    }
+
+    mimeSize = (uint32_t)strlen (metadata->mime_format);
+    descriptors[0] = ENCAPSULER_TS_REGISTRATION_DESCRIPTOR;
+    descriptors[1] = 4;
+    memcpy (&descriptors[2], ARMEDIA_ENCAPSULER_TS_METADATA_FORMAT_ID, 4);
+    descriptors[6] = ENCAPSULER_TS_FORMAT_DESCRIPTOR;
+    descriptors[7] = (uint8_t)(4 + mimeSize);
+    blockSizeNe = htonl (metadata->block_size);
+    memcpy (&descriptors[8], &blockSizeNe, 4);
+    memcpy (&descriptors[12], metadata->mime_format, mimeSize);
+    error = ARMEDIA_TsMuxer_AddStream (encapsuler->tsMuxer, ARMEDIA_TSMUXER_STREAM_METADATA, ENCAPSULER_TS_STREAM_TYPE_PRIVATE,
+                                       descriptors, 12 + mimeSize);
+    if (ARMEDIA_OK != error)
+    {
+        ENCAPSULER_ERROR ("Unable to add the metadata stream");
+    }
+
+    return error;
+}
+
+static eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_AddTsAudioStream (ARMEDIA_VideoEncapsuler_t *encapsuler, const ARMEDIA_Sample_Header_t *sampleHeader)
+{
+    uint8_t descriptors[16];
+    uint32_t frequencyNe = htonl (sampleHeader->frequency);
+    uint16_t nchannelNe = htons (sampleHeader->nchannel);
+    eARMEDIA_ERROR error;
+
+    descriptors[0] = ENCAPSULER_TS_REGISTRATION_DESCRIPTOR;
+    descriptors[1] = 4;
+    memcpy (&descriptors[2], ARMEDIA_ENCAPSULER_TS_AUDIO_FORMAT_ID, 4);
+    descriptors[6] = ENCAPSULER_TS_FORMAT_DESCRIPTOR;
+    descriptors[7] = 8;
+    memcpy (&descriptors[8], &frequencyNe, 4);
+    memcpy (&descriptors[12], &nchannelNe, 2);
+    descriptors[14] = (uint8_t)sampleHeader->format;
+    descriptors[15] = ENCAPSULER_TS_AUDIO_FLAG_LITTLE_ENDIAN;
+    error = ARMEDIA_TsMuxer_AddStream (encapsuler->tsMuxer, ARMEDIA_TSMUXER_STREAM_AUDIO, ENCAPSULER_TS_STREAM_TYPE_PRIVATE,
+                                       descriptors, sizeof (descriptors));
+    if (ARMEDIA_OK != error)
+    {
+        ENCAPSULER_ERROR ("Unable to add the audio stream");
+    }
+
+    return error;
+}
+
+static off_t ARMEDIA_VideoEncapsuler_GetTsFrameSize (ARMEDIA_VideoEncapsuler_t *encapsuler, const ARMEDIA_Frame_Header_t *frameHeader, const void *metadataBuffer)
+{
+    off_t size = ARMEDIA_TsMuxer_GetMaxPesSize (sizeof (s_accessUnitDelimiter) + ARMEDIA_VideoEncapsuler_GetFrameSize (encapsuler, frameHeader));
+
+    if ((NULL != metadataBuffer) && (NULL != encapsuler->metadata) && (0 != encapsuler->metadata->block_size))
+    {
+        size += ARMEDIA_TsMuxer_GetMaxPesSize (encapsuler->metadata->block_size);
+    }
+    return size;
+}
+
+static eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_WriteTsFrame (ARMEDIA_VideoEncapsuler_t *encapsuler, ARMEDIA_Frame_Header_t *frameHeader, const void *metadataBuffer)
+{
+    static const uint8_t startCode[4] = { 0, 0, 0, 1 };
+    ARMEDIA_Video_t* video = encapsuler->video;
+    ARMEDIA_Metadata_t *metadata = NULL;
+    struct iovec *iov;
+    uint32_t i, iovCount = 0;
+    uint64_t timestamp;
+    eARMEDIA_ERROR error;
+
+    if (frameHeader->timestamp == 0) {
+        frameHeader->timestamp = video->lastFrameTimestamp + video->defaultFrameDuration;
+    }
+    if ((NULL != metadataBuffer) && (NULL != encapsuler->metadata) && (0 != encapsuler->metadata->block_size))
+    {
+        metadata = encapsuler->metadata;
+    }
+
+    error = ARMEDIA_VideoEncapsuler_ReserveTsPackets (encapsuler, ARMEDIA_VideoEncapsuler_GetTsFrameSize (encapsuler, frameHeader, metadataBuffer));
+    if (ARMEDIA_ERROR_ENCAPSULER_QUEUE_FULL == error)
+    {
+        encapsuler->droppedCount++;
+        encapsuler->dropUntilIFrame = 1;
+        return error;
+    }
+    else if (ARMEDIA_OK != error)
+    {
+        ENCAPSULER_ERROR ("Unable to write frame: writer error %d", error);
+        return error;
+    }
+    encapsuler->dropUntilIFrame = 0;
+
+    // The stream is durable up to the previous frame
+    if ((0 != video->framesCount) && ARMEDIA_VideoEncapsuler_NeedSync (encapsuler, frameHeader))
+    {
+        error = ARMEDIA_VideoEncapsuler_SyncTs (encapsuler, frameHeader->timestamp);
+        if (ARMEDIA_OK != error)
+        {
+            ENCAPSULER_ERROR ("Unable to sync the transport stream: writer error %d", error);
+            return error;
+        }
+    }
+
+    // Access unit delimiter, parameter sets, then each NALU with a start code
+    if (2 * encapsuler->naluCount + 3 > encapsuler->tsIovCapacity)
+    {
+        iov = realloc (encapsuler->tsIov, (2 * encapsuler->naluCount + 3) * sizeof (*iov));
+        if (NULL == iov)
+        {
+            ENCAPSULER_ERROR ("Unable to allocate the frame parts");
+            return ARMEDIA_ERROR_ENCAPSULER;
+        }
+        encapsuler->tsIov = iov;
+        encapsuler->tsIovCapacity = 2 * encapsuler->naluCount + 3;
+    }
+    iov = encapsuler->tsIov;
+    if ((0 == encapsuler->naluCount) || (0 == encapsuler->nalus[0].size) ||
+        (ENCAPSULER_AVC_NALU_TYPE_AUD != (encapsuler->nalus[0].data[0] & 0x1f)))
+    {
+        iov[iovCount].iov_base = (void *)s_accessUnitDelimiter;
+        iov[iovCount++].iov_len = sizeof (s_accessUnitDelimiter);
+    }
+    if (frameHeader->avc_insert_ps && (video->spsSize > 4))
+    {
+        iov[iovCount].iov_base = video->sps;
+        iov[iovCount++].iov_len = video->spsSize;
+    }
+    if (frameHeader->avc_insert_ps && (video->ppsSize > 4))
+    {
+        iov[iovCount].iov_base = video->pps;
+        iov[iovCount++].iov_len = video->ppsSize;
+    }
+    for (i = 0; i < encapsuler->naluCount; i++)
+    {
+        iov[iovCount].iov_base = (void *)startCode;
+        iov[iovCount++].iov_len = sizeof (startCode);
+        iov[iovCount].iov_base = (void *)encapsuler->nalus[i].data;
+        iov[iovCount++].iov_len = encapsuler->nalus[i].size;
+    }
+
+    timestamp = ARMEDIA_VideoEncapsuler_GetTsTime (encapsuler, frameHeader->timestamp);
+    error = ARMEDIA_TsMuxer_WritePes (encapsuler->tsMuxer, ARMEDIA_TSMUXER_STREAM_VIDEO, timestamp, iov, iovCount,
+                                      ARMEDIA_ENCAPSULER_FRAME_TYPE_I_FRAME == frameHeader->frame_type);
+    if (ARMEDIA_OK != error)
+    {
+        ENCAPSULER_ERROR ("Unable to write frame into transport stream");
+        return error;
+    }
+    video->totalsize += ARMEDIA_VideoEncapsuler_GetFrameSize (encapsuler, frameHeader);
+    video->lastFrameTimestamp = frameHeader->timestamp;
+    video->framesCount++;
+
+    if (NULL != metadata)
+    {
+        iov[0].iov_base = (void *)metadataBuffer;
+        iov[0].iov_len = metadata->block_size;
+        error = ARMEDIA_TsMuxer_WritePes (encapsuler->tsMuxer, ARMEDIA_TSMUXER_STREAM_METADATA, timestamp, iov, 1, 0);
+        if (ARMEDIA_OK != error)
+        {
+            ENCAPSULER_ERROR ("Unable to write metadata into transport stream");
+            return error;
+        }
+        metadata->totalsize += metadata->block_size;
+        metadata->lastFrameTimestamp = frameHeader->timestamp;
+        metadata->framesCount++;
+    }
+
+#if ENCAPSULER_LOG_TIMESTAMPS
+    fprintf(tslogger, "V;%"PRIu64"\n", frameHeader->timestamp);
+#endif
+
+    return ARMEDIA_OK;
+}
+
+// The samples keep their timestamps: unlike in an MP4 media, a drift needs no silence
+static eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_WriteTsSample (ARMEDIA_VideoEncapsuler_t *encapsuler, ARMEDIA_Sample_Header_t *sampleHeader)
+{
+    ARMEDIA_Audio_t* audio = encapsuler->audio;
+    struct iovec iov;
+    eARMEDIA_ERROR error;
+
+    if (sampleHeader->timestamp == 0) {
+        sampleHeader->timestamp = audio->lastSampleTimestamp + audio->defaultSampleDuration;
+    }
+
+    error = ARMEDIA_VideoEncapsuler_ReserveTsPackets (encapsuler, ARMEDIA_TsMuxer_GetMaxPesSize (sampleHeader->sample_size));
+    if (ARMEDIA_ERROR_ENCAPSULER_QUEUE_FULL == error)
+    {
+        encapsuler->droppedCount++;
+        return error;
+    }
+    else if (ARMEDIA_OK != error)
+    {
+        ENCAPSULER_ERROR ("Unable to write sample: writer error %d", error);
+        return error;
+    }
+
+    iov.iov_base = sampleHeader->sample;
+    iov.iov_len = sampleHeader->sample_size;
+    error = ARMEDIA_TsMuxer_WritePes (encapsuler->tsMuxer, ARMEDIA_TSMUXER_STREAM_AUDIO,
+                                      ARMEDIA_VideoEncapsuler_GetTsTime (encapsuler, sampleHeader->timestamp), &iov, 1, 0);
+    if (ARMEDIA_OK != error)
+    {
+        ENCAPSULER_ERROR ("Unable to write sample into transport stream");
+        return error;
+    }
+    audio->theoreticalts = sampleHeader->timestamp + audio->defaultSampleDuration;
+    audio->lastSampleTimestamp = sampleHeader->timestamp;
+    audio->sampleCount++;
+    audio->totalsize += sampleHeader->sample_size;
+
+#if ENCAPSULER_LOG_TIMESTAMPS
+    fprintf(tslogger, "A;%"PRIu64"\n", sampleHeader->timestamp);
+#endif
+
+    return ARMEDIA_OK;
+}
+
+static eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_WriteSample (ARMEDIA_VideoEncapsuler_t *encapsuler, ARMEDIA_Sample_Header_t *sampleHeader);
+
+eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_AddSample (ARMEDIA_VideoEncapsuler_t *encapsuler, ARMEDIA_Sample_Header_t *sampleHeader)
+{
+    eARMEDIA_ERROR error, commitError;
+    if (NULL == encapsuler)
+    {
+        ENCAPSULER_ERROR ("encapsuler pointer must not be null");
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
+
+    if (encapsuler->got_iframe == 0)
+    {
+        ENCAPSULER_DEBUG("Waiting for Iframe");
+        return ARMEDIA_ERROR_ENCAPSULER_WAITING_FOR_IFRAME;
+    }
+
+    if (NULL == sampleHeader)
+    {
+        ENCAPSULER_ERROR ("sample pointer must not be null");
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
+
+    if (!sampleHeader->sample_size)
+    {
+        // Do nothing
+        ENCAPSULER_DEBUG ("Empty sample\n");
+        return ARMEDIA_OK;
+    }
+
+    // check sample data
+    if (NULL == sampleHeader->sample)
+    {
+        ENCAPSULER_ERROR ("Unable to get sample data (%d bytes)", sampleHeader->sample_size);
+        return ARMEDIA_ERROR_ENCAPSULER;
+    }
+
+    if ((NULL != encapsuler->segmentation) && (NULL != encapsuler->segmentation->previous))
+    {
+        // A sample captured before the cut belongs to the previous segment
+        if ((0 != sampleHeader->timestamp) && (sampleHeader->timestamp < encapsuler->video->firstFrameTimestamp))
+        {
+            return ARMEDIA_VideoEncapsuler_AddSample (encapsuler->segmentation->previous, sampleHeader);
+        }
+        ARMEDIA_VideoEncapsuler_FinishPreviousSegment (encapsuler->segmentation);
+    }
+
+    // First sample
+    if ((encapsuler->got_audio == 0) && (encapsuler->audio == NULL))
+    {
+        if (0 != encapsuler->fragmentCount)
+        {
+            ENCAPSULER_ERROR ("The audio track must start before the first fragment");
+            return ARMEDIA_ERROR_BAD_PARAMETER;
+        }
+        if (NULL != encapsuler->tsMuxer)
+        {
+            error = ARMEDIA_VideoEncapsuler_AddTsAudioStream (encapsuler, sampleHeader);
+            if (ARMEDIA_OK != error)
+            {
+                return error;
+            }
+        }
+
+        // Init audio data
+        encapsuler->audio = (ARMEDIA_Audio_t*) malloc (sizeof(ARMEDIA_Audio_t));
+        if (encapsuler->audio != NULL) {
+            encapsuler->got_audio = 1;
+        } else {
+            ENCAPSULER_ERROR ("Unable to allocate audio structure");
+            return ARMEDIA_ERROR_ENCAPSULER;
+        }
+        encapsuler->audio->format = sampleHeader->format;
+        encapsuler->audio->codec = sampleHeader->codec;
+        encapsuler->audio->nchannel = sampleHeader->nchannel;
+        encapsuler->audio->freq = sampleHeader->frequency;
+        encapsuler->audio->defaultSampleDuration = ((uint64_t)sampleHeader->sample_size*8000000 / (sampleHeader->nchannel*sampleHeader->format)) / sampleHeader->frequency;
+        encapsuler->audio->sampleCount = 0;
+        encapsuler->audio->totalsize = 0;
+        encapsuler->audio->lastSampleTimestamp = 0;
+        encapsuler->audio->theoreticalts = encapsuler->video->firstFrameTimestamp;
+        encapsuler->audio->stscEntries = 0;
+        encapsuler->audio->lastChunkSize = 0;
+
+        if (!encapsuler->fragmented && (NULL == encapsuler->tsMuxer))
+        {
+            // The descriptor is rewritten in place: wait for the pending frames first
+            error = ARMEDIA_FileWriter_Flush (encapsuler->writer);
+            if (ARMEDIA_OK != error)
+            {
+                ENCAPSULER_ERROR ("Unable to flush pending frames");
+                return error;
+            }
+
+            // Write Audio info
+            uint8_t audioDescriptor[ARMEDIA_SIDECAR_AUDIO_SIZE] = {0};
+            ARMEDIA_Sidecar_Stream_t stream = { audioDescriptor, sizeof (audioDescriptor), 0, 0, 0 };
+            ARMEDIA_VideoEncapsuler_TransferAudioDescriptor (encapsuler, &stream);
+            fseeko(encapsuler->metaFile, ARMEDIA_SIDECAR_AUDIO_OFFSET, SEEK_SET);
+            if (1 != fwrite (audioDescriptor, sizeof (audioDescriptor), 1, encapsuler->metaFile))
+            {
+                ENCAPSULER_ERROR ("Unable to write audio descriptor");
+                return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+            }
+            fseeko(encapsuler->metaFile, 0, SEEK_END); // return to the end of file
+        }
+        if (NULL == encapsuler->tsMuxer)
+        {
+            ARMEDIA_VideoEncapsuler_BuildAudioTrack (encapsuler);
+        }
+    }
+
+    error = ARMEDIA_VideoEncapsuler_Preallocate (encapsuler, (NULL != encapsuler->tsMuxer) ?
+                                                 (off_t)ARMEDIA_TsMuxer_GetMaxPesSize (sampleHeader->sample_size) :
+                                                 (off_t)sampleHeader->sample_size);
+    if (ARMEDIA_ERROR_ENCAPSULER_DISK_FULL == error)
+    {
+        encapsuler->droppedCount++;
+        return error;
+    }
+
+    if (NULL != encapsuler->tsMuxer)
+    {
+        return ARMEDIA_VideoEncapsuler_WriteTsSample (encapsuler, sampleHeader);
+    }
+
+    error = ARMEDIA_VideoEncapsuler_WriteFullChunks (encapsuler, (0 != sampleHeader->timestamp) ? sampleHeader->timestamp :
+                                                     encapsuler->audio->lastSampleTimestamp + encapsuler->audio->defaultSampleDuration);
+    if (ARMEDIA_OK != error)
+    {
+        return error;
+    }
+
+    // In a fragmented media, the sample is only kept until its fragment is written
+    if (encapsuler->fragmented)
+    {
+        return ARMEDIA_VideoEncapsuler_WriteSample (encapsuler, sampleHeader);
+    }
+
+    error = ARMEDIA_FileWriter_BeginJob (encapsuler->writer);
+    if (ARMEDIA_ERROR_ENCAPSULER_QUEUE_FULL == error)
+    {
+        // A missing sample is replaced by silence when the next one is written
+        encapsuler->droppedCount++;
+        return error;
+    }
+    else if (ARMEDIA_OK != error)
+    {
+        ENCAPSULER_ERROR ("Unable to write sample: writer error %d", error);
+        return error;
+    }
+
+    // The audio descriptor is needed by ARMEDIA_VideoEncapsuler_TryFixMediaFile()
+    if (0 == encapsuler->audio->sampleCount)
+    {
+        ARMEDIA_FileWriter_Sync (encapsuler->writer);
+    }
+
+    error = ARMEDIA_VideoEncapsuler_WriteSample (encapsuler, sampleHeader);
+    commitError = ARMEDIA_FileWriter_CommitJob (encapsuler->writer);
+
+    return (ARMEDIA_OK != error) ? error : commitError;
+}
+
+static eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_WriteSample (ARMEDIA_VideoEncapsuler_t *encapsuler, ARMEDIA_Sample_Header_t *sampleHeader)
+{
+    uint8_t *data = sampleHeader->sample;
+    ARMEDIA_Audio_t* audio = encapsuler->audio;
+
+    if ((encapsuler->got_audio != 0) && (audio != NULL))
+    {
+        // Write audio data
+
+        // if frame TS is null, set it as last TS + default duration (from fps)
+        if (sampleHeader->timestamp == 0) {
+            sampleHeader->timestamp = audio->lastSampleTimestamp + audio->defaultSampleDuration;
+        }
+        // For first frame, no previous timestamp => dt = 0
+        if (audio->lastSampleTimestamp == 0) {
+            audio->lastSampleTimestamp = sampleHeader->timestamp;
+        }
+
+#if ENCAPSULER_LOG_TIMESTAMPS
+        fprintf(tslogger, "A;%"PRIu64"\n", sampleHeader->timestamp);
+#endif
+        uint32_t newSize = sampleHeader->sample_size;
+        uint8_t* newData = data;
+
+        // synchronisation
+        int64_t tsdiff = sampleHeader->timestamp - audio->theoreticalts;
+        int32_t zlen = 0;
+        if (tsdiff > ADRIFT_LIMIT) {
+            ENCAPSULER_DEBUG("Audio drift too high (%"PRId64"µs) on %uth sample\n", tsdiff, audio->sampleCount);
+            audio->theoreticalts += tsdiff;
+            zlen = (tsdiff * audio->freq / 1000000) * (audio->nchannel * audio->format / 8);
+            eARMEDIA_ERROR error = ARMEDIA_VideoEncapsuler_WriteData (encapsuler, ENCAPSULER_CHUNK_AUDIO, NULL, zlen);
+            if (error != ARMEDIA_OK) {
+                ENCAPSULER_ERROR ("Unable to write zeros into data file");
+                return error;
+            }
+        }
+        else if (tsdiff < -ADRIFT_LIMIT)
+        {
+            ENCAPSULER_DEBUG("Audio drift too low (%"PRId64"µs) on %uth sample\n", tsdiff, audio->sampleCount);
+            audio->theoreticalts += tsdiff;
+            zlen = (tsdiff * audio->freq / 1000000) * (audio->nchannel * audio->format / 8);
+            if (((uint32_t)-zlen) >= sampleHeader->sample_size) {
+                ENCAPSULER_ERROR ("Timestamp anterior to previous sample");
+                return ARMEDIA_ERROR_ENCAPSULER_BAD_TIMESTAMP;
+            }
+            newSize += zlen;
+            newData -= zlen;
+        }
+        uint32_t newChunkSize = sampleHeader->sample_size + zlen;
+
+        if (audio->lastChunkSize != newChunkSize) {
+            audio->lastChunkSize = newChunkSize;
+            audio->stscEntries++;
+        }
+
+        uint8_t recordData[ARMEDIA_SIDECAR_RECORD_SIZE];
+        ARMEDIA_Sidecar_Record_t record;
+        record.type = ARMEDIA_ENCAPSULER_AUDIO_INFO_TAG;
+        record.flags = 0;
+        record.size = newChunkSize;
+        record.duration = (uint32_t)(sampleHeader->timestamp - audio->lastSampleTimestamp); // Chunk duration (in usec)
+        if (ARMEDIA_VideoEncapsuler_KeepsChunks (encapsuler))
+        {
+            // Indexed when the chunk is written
+            if (ARMEDIA_OK != ARMEDIA_VideoEncapsuler_AddChunkRecord (encapsuler, ENCAPSULER_CHUNK_AUDIO, &record, sampleHeader->timestamp))
+            {
+                return ARMEDIA_ERROR_ENCAPSULER;
+            }
+        }
+        else
+        {
+            ARMEDIA_Sidecar_EncodeRecord (recordData, &record, encapsuler->sidecarFlags & ARMEDIA_SIDECAR_FLAG_RECORD_CRC);
+
+            ARMEDIA_SampleTable_Entry_t entry;
+            entry.offset = encapsuler->dataOffset + ARMEDIA_VideoEncapsuler_GetDataSize (encapsuler);
+            entry.size = record.size;
+            entry.duration = record.duration;
+            entry.flags = 0;
+            if (ARMEDIA_OK != ARMEDIA_SampleTable_Add (&encapsuler->audioTable, &entry))
+            {
+                ENCAPSULER_ERROR ("Unable to grow the audio sample table");
+                return ARMEDIA_ERROR_ENCAPSULER;
+            }
+            if (ARMEDIA_OK != ARMEDIA_FileWriter_WriteMeta (encapsuler->writer, recordData, ARMEDIA_SIDECAR_RECORD_SIZE))
+            {
+                ENCAPSULER_ERROR ("Unable to write sampleInfo into info file");
+                return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+            }
+        }
+
+        audio->theoreticalts += audio->defaultSampleDuration;
+        audio->lastSampleTimestamp = sampleHeader->timestamp;
+        audio->sampleCount++;
+
+        if (ARMEDIA_OK != ARMEDIA_VideoEncapsuler_WriteData (encapsuler, ENCAPSULER_CHUNK_AUDIO, newData, newSize))
+        {
+            ENCAPSULER_ERROR ("Unable to write sample into data file");
+            return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+        }
+
+        audio->totalsize += sampleHeader->sample_size + zlen;
+    }
+    else
+    {
+        // issue
+        ENCAPSULER_ERROR ("Issue while getting audio sample (%u - %p)\n", encapsuler->got_audio, encapsuler->audio);
+        return ARMEDIA_ERROR_ENCAPSULER;
+    }
+
+    return ARMEDIA_OK;
+}
+
+/* Build the udta and meta atoms from the untimed metadata and the thumbnail,
+   so that Finish only has to generate the sample tables */
+static void ARMEDIA_VideoEncapsuler_BuildUntimedMetadataAtoms (ARMEDIA_VideoEncapsuler_t *encapsuler)
+{
+    ARMEDIA_AtomTree_Node_t* udtaAtom;         // > udta
+    movie_atom_t* xyzUdtaAtom;      // | > xyz
+    ARMEDIA_AtomTree_Node_t* metaUdtaAtom;     // | > meta
+    movie_atom_t* hdlrMetaUdtaAtom; // |   > hdlr
+    ARMEDIA_AtomTree_Node_t* ilstMetaUdtaAtom; // |   > ilst
+    movie_atom_t* artistMetaUdtaAtom;   // |     > ART
+    movie_atom_t* titleMetaUdtaAtom;    // |     > nam
+    movie_atom_t* dateMetaUdtaAtom;     // |     > day
+    movie_atom_t* commentMetaUdtaAtom;  // |     > cmt
+    movie_atom_t* copyrightMetaUdtaAtom;// |     > cpy
+    movie_atom_t* makerMetaUdtaAtom;    // |     > mak
+    movie_atom_t* modelMetaUdtaAtom;    // |     > mod
+    movie_atom_t* versionMetaUdtaAtom;  // |     > swr
+    movie_atom_t* encoderMetaUdtaAtom;  // |     > too
+    movie_atom_t* coverMetaUdtaAtom;    // |     > covr
+    movie_atom_t* freeUdtaAtom;         // | > free
+    ARMEDIA_AtomTree_Node_t* metaAtom;         // > meta
+    movie_atom_t* hdlrMetaAtom;     // | > hdlr
+    movie_atom_t* keysMetaAtom;     // | > keys
+    ARMEDIA_AtomTree_Node_t* ilstMetaAtom;     // | > ilst
+    movie_atom_t* locationMetaAtom; // |   > com.apple.quicktime.location.ISO6709
+    movie_atom_t* artistMetaAtom;   // |   > com.apple.quicktime.artist
+    movie_atom_t* titleMetaAtom;    // |   > com.apple.quicktime.title
+    movie_atom_t* dateMetaAtom;     // |   > com.apple.quicktime.creationdate
+    movie_atom_t* commentMetaAtom;  // |   > com.apple.quicktime.comment
+    movie_atom_t* copyrightMetaAtom;// |   > com.apple.quicktime.copyright
+    movie_atom_t* makerMetaAtom;    // |   > com.apple.quicktime.make
+    movie_atom_t* modelMetaAtom;    // |   > com.apple.quicktime.model
+    movie_atom_t* versionMetaAtom;  // |   > com.apple.quicktime.software
+    movie_atom_t* coverMetaAtom;    // |   > com.apple.quicktime.artwork
+    movie_atom_t* serialMetaAtom;   // |   > com.parrot.serial
+    movie_atom_t* modelidMetaAtom;  // |   > com.parrot.model.id
+    movie_atom_t* buildidMetaAtom;  // |   > com.parrot.build.id
+    movie_atom_t* runidMetaAtom;    // |   > com.parrot.run.id
+    movie_atom_t* rundateMetaAtom;  // |   > com.parrot.run.date
+    movie_atom_t* customMetaAtom;   // |   > user-defined
+    movie_atom_t* picturehfovMetaAtom;  // |   > com.parrot.picture.hfov
+    movie_atom_t* picturevfovMetaAtom;  // |   > com.parrot.picture.vfov
+    movie_atom_t* freeMetaAtom;         // | > free
+    struct stat thumbnailStat;
+
+    ARMEDIA_AtomTree_Delete (&encapsuler->udtaAtom);
+    ARMEDIA_AtomTree_Delete (&encapsuler->metaAtom);
+    encapsuler->thumbnailSize = -1;
+    encapsuler->thumbnailTime = 0;
+    if (strlen(encapsuler->thumbnailFilePath) && (0 == stat (encapsuler->thumbnailFilePath, &thumbnailStat)))
+    {
+        encapsuler->thumbnailSize = thumbnailStat.st_size;
+        encapsuler->thumbnailTime = thumbnailStat.st_mtime;
+    }
+
+    const char *key[ARMEDIA_UNTIMED_METADATA_KEY_MAX + ARMEDIA_ENCAPSULER_UNTIMED_METADATA_CUSTOM_MAX_COUNT];
+    uint32_t keyCount = 0;
+    udtaAtom = ARMEDIA_AtomTree_New("udta", NULL, 0, NULL, 0);
+    uint32_t zero = 0;
+    metaUdtaAtom = ARMEDIA_AtomTree_New("meta", &zero, sizeof(zero), NULL, 0);
+    hdlrMetaUdtaAtom = hdlrAtomForUdtaMetadata();
+    ilstMetaUdtaAtom = ARMEDIA_AtomTree_New("ilst", NULL, 0, NULL, 0);
+    metaAtom = ARMEDIA_AtomTree_New("meta", NULL, 0, NULL, 0);
+    hdlrMetaAtom = hdlrAtomForMetadata();
+    ilstMetaAtom = ARMEDIA_AtomTree_New("ilst", NULL, 0, NULL, 0);
+    if ((encapsuler->got_untimed_metadata) && strlen(encapsuler->untimed_metadata.artist))
+    {
+        artistMetaUdtaAtom = metadataAtomFromTagAndValue(0, "ART", encapsuler->untimed_metadata.artist, 1);
+        if (artistMetaUdtaAtom)
+        {
+            ARMEDIA_AtomTree_AppendAtom(ilstMetaUdtaAtom, &artistMetaUdtaAtom);
+        }
+        key[keyCount] = ARMEDIA_UntimedMetadataKey[ARMEDIA_UNTIMED_METADATA_KEY_ARTIST];
+        if (key[keyCount]) keyCount++;
+        artistMetaAtom = metadataAtomFromTagAndValue(keyCount, NULL, encapsuler->untimed_metadata.artist, 1);
+        if (artistMetaAtom)
+        {
+            ARMEDIA_AtomTree_AppendAtom(ilstMetaAtom, &artistMetaAtom);
+        }
+    }
+    else if ((encapsuler->got_untimed_metadata) && strlen(encapsuler->untimed_metadata.maker) && strlen(encapsuler->untimed_metadata.model))
+    {
+        // Build the artist string as maker + model
+        char artist[100];
+        snprintf(artist, sizeof(artist), "%s %s",
+                 encapsuler->untimed_metadata.maker,
+                 encapsuler->untimed_metadata.model);
+        artistMetaUdtaAtom = metadataAtomFromTagAndValue(0, "ART", artist, 1);
+        if (artistMetaUdtaAtom)
+        {
+            ARMEDIA_AtomTree_AppendAtom(ilstMetaUdtaAtom, &artistMetaUdtaAtom);
+        }
+        key[keyCount] = ARMEDIA_UntimedMetadataKey[ARMEDIA_UNTIMED_METADATA_KEY_ARTIST];
+        if (key[keyCount]) keyCount++;
+        artistMetaAtom = metadataAtomFromTagAndValue(keyCount, NULL, artist, 1);
+        if (artistMetaAtom)
+        {
+            ARMEDIA_AtomTree_AppendAtom(ilstMetaAtom, &artistMetaAtom);
+        }
+    }
+    if ((encapsuler->got_untimed_metadata) && strlen(encapsuler->untimed_metadata.title))
+    {
+        titleMetaUdtaAtom = metadataAtomFromTagAndValue(0, "nam", encapsuler->untimed_metadata.title, 1);
+        if (titleMetaUdtaAtom)
+        {
+            ARMEDIA_AtomTree_AppendAtom(ilstMetaUdtaAtom, &titleMetaUdtaAtom);
+        }
+        key[keyCount] = ARMEDIA_UntimedMetadataKey[ARMEDIA_UNTIMED_METADATA_KEY_TITLE];
+        if (key[keyCount]) keyCount++;
+        titleMetaAtom = metadataAtomFromTagAndValue(keyCount, NULL, encapsuler->untimed_metadata.title, 1);
+        if (titleMetaAtom)
+        {
+            ARMEDIA_AtomTree_AppendAtom(ilstMetaAtom, &titleMetaAtom);
+        }
+    }
+    else if ((encapsuler->got_untimed_metadata) && strlen(encapsuler->untimed_metadata.runDate))
+    {
+        // If no title is defined, used the run date
+        titleMetaUdtaAtom = metadataAtomFromTagAndValue(0, "nam", encapsuler->untimed_metadata.runDate, 1);
+        if (titleMetaUdtaAtom)
+        {
+            ARMEDIA_AtomTree_AppendAtom(ilstMetaUdtaAtom, &titleMetaUdtaAtom);
+        }
+        key[keyCount] = ARMEDIA_UntimedMetadataKey[ARMEDIA_UNTIMED_METADATA_KEY_TITLE];
+        if (key[keyCount]) keyCount++;
+        titleMetaAtom = metadataAtomFromTagAndValue(keyCount, NULL, encapsuler->untimed_metadata.runDate, 1);
+        if (titleMetaAtom)
+        {
+            ARMEDIA_AtomTree_AppendAtom(ilstMetaAtom, &titleMetaAtom);
+        }
+    }
+    if ((encapsuler->got_untimed_metadata) && strlen(encapsuler->untimed_metadata.mediaDate))
+    {
+        dateMetaUdtaAtom = metadataAtomFromTagAndValue(0, "day", encapsuler->untimed_metadata.mediaDate, 1);
+        if (dateMetaUdtaAtom)
+        {
+            ARMEDIA_AtomTree_AppendAtom(ilstMetaUdtaAtom, &dateMetaUdtaAtom);
+        }
+        key[keyCount] = ARMEDIA_UntimedMetadataKey[ARMEDIA_UNTIMED_METADATA_KEY_DATE];
+        if (key[keyCount]) keyCount++;
+        dateMetaAtom = metadataAtomFromTagAndValue(keyCount, NULL, encapsuler->untimed_metadata.mediaDate, 1);
+        if (dateMetaAtom)
+        {
+            ARMEDIA_AtomTree_AppendAtom(ilstMetaAtom, &dateMetaAtom);
+        }
+    }
+    if ((encapsuler->got_untimed_metadata) && (encapsuler->untimed_metadata.takeoffLatitude != 500.) && (encapsuler->untimed_metadata.takeoffLongitude != 500.))
+    {
+        char xyz[100];
+        char *location = xyz + 4;
+        /* ISO 6709 Annex H string expression */
+        snprintf(location, sizeof(xyz) - 4, "%+08.4f%+09.4f/",
+                 encapsuler->untimed_metadata.takeoffLatitude,
+                 encapsuler->untimed_metadata.takeoffLongitude);
+        xyz[0] = (strlen(location) >> 8) & 0xFF;
+        xyz[1] = strlen(location) & 0xFF;
+        xyz[2] = 0x15; // language code = 0x15c7
+        xyz[3] = 0xc7; // language code = 0x15c7
+        xyzUdtaAtom = atomFromData (4 + strlen(location), "\xA9xyz", (uint8_t*)xyz);
+        if (xyzUdtaAtom)
+        {
+            ARMEDIA_AtomTree_AppendAtom(udtaAtom, &xyzUdtaAtom);
+        }
+        key[keyCount] = ARMEDIA_UntimedMetadataKey[ARMEDIA_UNTIMED_METADATA_KEY_LOCATION];
+        if (key[keyCount]) keyCount++;
+        snprintf(xyz, sizeof(xyz), "%+012.8f%+013.8f%+.2f/",
+                 encapsuler->untimed_metadata.takeoffLatitude,
+                 encapsuler->untimed_metadata.takeoffLongitude,
+                 encapsuler->untimed_metadata.takeoffAltitude);
+        locationMetaAtom = metadataAtomFromTagAndValue(keyCount, NULL, xyz, 1);
+        if (locationMetaAtom)
+        {
+            ARMEDIA_AtomTree_AppendAtom(ilstMetaAtom, &locationMetaAtom);
+        }
+    }
+    if ((encapsuler->got_untimed_metadata) && strlen(encapsuler->untimed_metadata.maker))
+    {
+        makerMetaUdtaAtom = metadataAtomFromTagAndValue(0, "mak", encapsuler->untimed_metadata.maker, 1);
+        if (makerMetaUdtaAtom)
+        {
+            ARMEDIA_AtomTree_AppendAtom(ilstMetaUdtaAtom, &makerMetaUdtaAtom);
+        }
+        key[keyCount] = ARMEDIA_UntimedMetadataKey[ARMEDIA_UNTIMED_METADATA_KEY_MAKER];
+        if (key[keyCount]) keyCount++;
+        makerMetaAtom = metadataAtomFromTagAndValue(keyCount, NULL, encapsuler->untimed_metadata.maker, 1);
+        if (makerMetaAtom)
+        {
+            ARMEDIA_AtomTree_AppendAtom(ilstMetaAtom, &makerMetaAtom);
+        }
+    }
+    if ((encapsuler->got_untimed_metadata) && strlen(encapsuler->untimed_metadata.model))
+    {
+        modelMetaUdtaAtom = metadataAtomFromTagAndValue(0, "mod", encapsuler->untimed_metadata.model, 1);
+        if (modelMetaUdtaAtom)
+        {
+            ARMEDIA_AtomTree_AppendAtom(ilstMetaUdtaAtom, &modelMetaUdtaAtom);
+        }
+        key[keyCount] = ARMEDIA_UntimedMetadataKey[ARMEDIA_UNTIMED_METADATA_KEY_MODEL];
+        if (key[keyCount]) keyCount++;
+        modelMetaAtom = metadataAtomFromTagAndValue(keyCount, NULL, encapsuler->untimed_metadata.model, 1);
+        if (modelMetaAtom)
+        {
+            ARMEDIA_AtomTree_AppendAtom(ilstMetaAtom, &modelMetaAtom);
+        }
+    }
+    if ((encapsuler->got_untimed_metadata) && strlen(encapsuler->untimed_metadata.modelId))
+    {
+        key[keyCount] = ARMEDIA_UntimedMetadataKey[ARMEDIA_UNTIMED_METADATA_KEY_MODEL_ID];
+        if (key[keyCount]) keyCount++;
+        modelidMetaAtom = metadataAtomFromTagAndValue(keyCount, NULL, encapsuler->untimed_metadata.modelId, 1);
+        if (modelidMetaAtom)
+        {
+            ARMEDIA_AtomTree_AppendAtom(ilstMetaAtom, &modelidMetaAtom);
+        }
+    }
+    if ((encapsuler->got_untimed_metadata) && strlen(encapsuler->untimed_metadata.buildId))
+    {
+        key[keyCount] = ARMEDIA_UntimedMetadataKey[ARMEDIA_UNTIMED_METADATA_KEY_BUILD_ID];
+        if (key[keyCount]) keyCount++;
+        buildidMetaAtom = metadataAtomFromTagAndValue(keyCount, NULL, encapsuler->untimed_metadata.buildId, 1);
+        if (buildidMetaAtom)
+        {
+            ARMEDIA_AtomTree_AppendAtom(ilstMetaAtom, &buildidMetaAtom);
+        }
+    }
+    if ((encapsuler->got_untimed_metadata) && strlen(encapsuler->untimed_metadata.softwareVersion))
+    {
+        versionMetaUdtaAtom = metadataAtomFromTagAndValue(0, "swr", encapsuler->untimed_metadata.softwareVersion, 1);
+        if (versionMetaUdtaAtom)
+        {
+            ARMEDIA_AtomTree_AppendAtom(ilstMetaUdtaAtom, &versionMetaUdtaAtom);
+        }
+        key[keyCount] = ARMEDIA_UntimedMetadataKey[ARMEDIA_UNTIMED_METADATA_KEY_VERSION];
+        if (key[keyCount]) keyCount++;
+        versionMetaAtom = metadataAtomFromTagAndValue(keyCount, NULL, encapsuler->untimed_metadata.softwareVersion, 1);
+        if (versionMetaAtom)
+        {
+            ARMEDIA_AtomTree_AppendAtom(ilstMetaAtom, &versionMetaAtom);
+        }
+    }
+    if ((encapsuler->got_untimed_metadata) && strlen(encapsuler->untimed_metadata.serialNumber))
+    {
+        encoderMetaUdtaAtom = metadataAtomFromTagAndValue(0, "too", encapsuler->untimed_metadata.serialNumber, 1);
+        if (encoderMetaUdtaAtom)
+        {
+            ARMEDIA_AtomTree_AppendAtom(ilstMetaUdtaAtom, &encoderMetaUdtaAtom);
+        }
+        key[keyCount] = ARMEDIA_UntimedMetadataKey[ARMEDIA_UNTIMED_METADATA_KEY_SERIAL];
+        if (key[keyCount]) keyCount++;
+        serialMetaAtom = metadataAtomFromTagAndValue(keyCount, NULL, encapsuler->untimed_metadata.serialNumber, 1);
+        if (serialMetaAtom)
+        {
+            ARMEDIA_AtomTree_AppendAtom(ilstMetaAtom, &serialMetaAtom);
+        }
+    }
+    if ((encapsuler->got_untimed_metadata) && strlen(encapsuler->untimed_metadata.comment))
+    {
+        commentMetaUdtaAtom = metadataAtomFromTagAndValue(0, "cmt", encapsuler->untimed_metadata.comment, 1);
+        if (commentMetaUdtaAtom)
+        {
+            ARMEDIA_AtomTree_AppendAtom(ilstMetaUdtaAtom, &commentMetaUdtaAtom);
+        }
+        key[keyCount] = ARMEDIA_UntimedMetadataKey[ARMEDIA_UNTIMED_METADATA_KEY_COMMENT];
+        if (key[keyCount]) keyCount++;
+        commentMetaAtom = metadataAtomFromTagAndValue(keyCount, NULL, encapsuler->untimed_metadata.comment, 1);
+        if (commentMetaAtom)
+        {
+            ARMEDIA_AtomTree_AppendAtom(ilstMetaAtom, &commentMetaAtom);
+        }
+    }
+    if ((encapsuler->got_untimed_metadata) && strlen(encapsuler->untimed_metadata.copyright))
+    {
+        copyrightMetaUdtaAtom = metadataAtomFromTagAndValue(0, "cpy", encapsuler->untimed_metadata.copyright, 1);
+        if (copyrightMetaUdtaAtom)
+        {
+            ARMEDIA_AtomTree_AppendAtom(ilstMetaUdtaAtom, &copyrightMetaUdtaAtom);
+        }
+        key[keyCount] = ARMEDIA_UntimedMetadataKey[ARMEDIA_UNTIMED_METADATA_KEY_COPYRIGHT];
+        if (key[keyCount]) keyCount++;
+        copyrightMetaAtom = metadataAtomFromTagAndValue(keyCount, NULL, encapsuler->untimed_metadata.copyright, 1);
+        if (copyrightMetaAtom)
+        {
+            ARMEDIA_AtomTree_AppendAtom(ilstMetaAtom, &copyrightMetaAtom);
+        }
+    }
+    if ((encapsuler->got_untimed_metadata) && strlen(encapsuler->untimed_metadata.runUuid))
+    {
+        key[keyCount] = ARMEDIA_UntimedMetadataKey[ARMEDIA_UNTIMED_METADATA_KEY_RUN_ID];
+        if (key[keyCount]) keyCount++;
+        runidMetaAtom = metadataAtomFromTagAndValue(keyCount, NULL, encapsuler->untimed_metadata.runUuid, 1);
+        if (runidMetaAtom)
+        {
+            ARMEDIA_AtomTree_AppendAtom(ilstMetaAtom, &runidMetaAtom);
+        }
+    }
+    if ((encapsuler->got_untimed_metadata) && strlen(encapsuler->untimed_metadata.runDate))
+    {
+        key[keyCount] = ARMEDIA_UntimedMetadataKey[ARMEDIA_UNTIMED_METADATA_KEY_RUN_DATE];
+        if (key[keyCount]) keyCount++;
+        rundateMetaAtom = metadataAtomFromTagAndValue(keyCount, NULL, encapsuler->untimed_metadata.runDate, 1);
+        if (rundateMetaAtom)
+        {
+            ARMEDIA_AtomTree_AppendAtom(ilstMetaAtom, &rundateMetaAtom);
+        }
+    }
+    if ((encapsuler->got_untimed_metadata) && (encapsuler->untimed_metadata.pictureHFov != 0.))
+    {
+        char hfov[20];
+        snprintf(hfov, 20, "%.2f", encapsuler->untimed_metadata.pictureHFov);
+        key[keyCount] = ARMEDIA_UntimedMetadataKey[ARMEDIA_UNTIMED_METADATA_KEY_PICTURE_HFOV];
+        if (key[keyCount]) keyCount++;
+        picturehfovMetaAtom = metadataAtomFromTagAndValue(keyCount, NULL, hfov, 1);
+        if (picturehfovMetaAtom)
+        {
+            ARMEDIA_AtomTree_AppendAtom(ilstMetaAtom, &picturehfovMetaAtom);
+        }
+    }
+    if ((encapsuler->got_untimed_metadata) && (encapsuler->untimed_metadata.pictureVFov != 0.))
+    {
+        char vfov[20];
+        snprintf(vfov, 20, "%.2f", encapsuler->untimed_metadata.pictureVFov);
+        key[keyCount] = ARMEDIA_UntimedMetadataKey[ARMEDIA_UNTIMED_METADATA_KEY_PICTURE_VFOV];
+        if (key[keyCount]) keyCount++;
+        picturevfovMetaAtom = metadataAtomFromTagAndValue(keyCount, NULL, vfov, 1);
+        if (picturevfovMetaAtom)
+        {
+            ARMEDIA_AtomTree_AppendAtom(ilstMetaAtom, &picturevfovMetaAtom);
+        }
+    }
+    if (encapsuler->got_untimed_metadata)
+    {
+        int i;
+        for (i = 0; i < ARMEDIA_ENCAPSULER_UNTIMED_METADATA_CUSTOM_MAX_COUNT; i++)
+        {
+            if ((strlen(encapsuler->untimed_metadata.custom[i].key)) && (strlen(encapsuler->untimed_metadata.custom[i].value)))
+            {
+                key[keyCount] = encapsuler->untimed_metadata.custom[i].key;
+                keyCount++;
+                customMetaAtom = metadataAtomFromTagAndValue(keyCount, NULL, encapsuler->untimed_metadata.custom[i].value, 1);
+                if (customMetaAtom)
+                {
+                    ARMEDIA_AtomTree_AppendAtom(ilstMetaAtom, &customMetaAtom);
+                }
+            }
+        }
+    }
+    if (strlen(encapsuler->thumbnailFilePath))
+    {
+        coverMetaUdtaAtom = metadataAtomFromTagAndFile(0, "covr", encapsuler->thumbnailFilePath, 13);
+        if (coverMetaUdtaAtom)
+        {
+            ARMEDIA_AtomTree_AppendAtom(ilstMetaUdtaAtom, &coverMetaUdtaAtom);
+        }
+        key[keyCount] = ARMEDIA_UntimedMetadataKey[ARMEDIA_UNTIMED_METADATA_KEY_COVER];
+        if (key[keyCount]) keyCount++;
+        coverMetaAtom = metadataAtomFromTagAndFile(keyCount, NULL, encapsuler->thumbnailFilePath, 13);
+        if (coverMetaAtom)
+        {
+            ARMEDIA_AtomTree_AppendAtom(ilstMetaAtom, &coverMetaAtom);
+        }
+    }
+
+    keysMetaAtom = metadataKeysAtom(key, keyCount);
+
+    // Add 1kB free space at the end of the udta and meta boxes to allow post-editing of metadata
+    uint32_t emptydatasize = 1024 - 8; // remove 8 bytes for box size and type
+    uint8_t *emptydata = calloc(emptydatasize, sizeof(uint8_t));
+    if (emptydata == NULL) {
+        ENCAPSULER_ERROR("Error allocating free data");
+        freeUdtaAtom = NULL;
+        freeMetaAtom = NULL;
+    } else {
+        freeUdtaAtom = atomFromData(emptydatasize, "free", emptydata);
+        freeMetaAtom = atomFromData(emptydatasize, "free", emptydata);
+        free(emptydata);
+    }
+
+    ARMEDIA_AtomTree_AppendAtom(metaUdtaAtom, &hdlrMetaUdtaAtom);
+    ARMEDIA_AtomTree_Append(metaUdtaAtom, ilstMetaUdtaAtom);
+    ARMEDIA_AtomTree_Append(udtaAtom, metaUdtaAtom);
+    if (freeUdtaAtom) ARMEDIA_AtomTree_AppendAtom(udtaAtom, &freeUdtaAtom);
+    ARMEDIA_AtomTree_AppendAtom(metaAtom, &hdlrMetaAtom);
+    ARMEDIA_AtomTree_AppendAtom(metaAtom, &keysMetaAtom);
+    ARMEDIA_AtomTree_Append(metaAtom, ilstMetaAtom);
+    if (freeMetaAtom) ARMEDIA_AtomTree_AppendAtom(metaAtom, &freeMetaAtom);
+
+    encapsuler->udtaAtom = udtaAtom;
+    encapsuler->metaAtom = metaAtom;
+}
+
+/* The thumbnail file was written or removed after the untimed metadata atoms were built */
+static int ARMEDIA_VideoEncapsuler_ThumbnailChanged (ARMEDIA_VideoEncapsuler_t *encapsuler)
+{
+    struct stat thumbnailStat;
+
+    if (0 == strlen (encapsuler->thumbnailFilePath))
+    {
+        return 0;
+    }
+    if (0 != stat (encapsuler->thumbnailFilePath, &thumbnailStat))
+    {
+        return (-1 != encapsuler->thumbnailSize);
+    }
+    return ((thumbnailStat.st_size != encapsuler->thumbnailSize) || (thumbnailStat.st_mtime != encapsuler->thumbnailTime));
+}
+
+/* Build the trak skeleton shared by all the tracks, around the media header and the sample description */
+static void ARMEDIA_VideoEncapsuler_BuildTrack (ARMEDIA_VideoEncapsuler_Track_t *track, eARMEDIA_VIDEOATOM_MEDIATYPE mediaType,
+                                                movie_atom_t *mediaHeaderAtom, int minfHandler, movie_atom_t *stsdAtom)
+{
+    ARMEDIA_AtomTree_Node_t *minfAtom = ARMEDIA_AtomTree_New ("minf", NULL, 0, NULL, 0);
+    ARMEDIA_AtomTree_Node_t *dinfAtom = ARMEDIA_AtomTree_New ("dinf", NULL, 0, NULL, 0);
+    movie_atom_t *hdlrmdiaAtom = hdlrAtomForMdia (mediaType);
+    movie_atom_t *hdlrminfAtom = minfHandler ? hdlrAtomForMinf () : NULL;
+    movie_atom_t *drefAtom = drefAtomGen ();
+
+    ARMEDIA_AtomTree_Delete (&track->trak);
+    track->trak = ARMEDIA_AtomTree_New ("trak", NULL, 0, NULL, 0);
+    track->mdia = ARMEDIA_AtomTree_New ("mdia", NULL, 0, NULL, 0);
+    track->stbl = ARMEDIA_AtomTree_New ("stbl", NULL, 0, NULL, 0);
+    if ((NULL == track->trak) || (NULL == track->mdia) || (NULL == track->stbl) || (NULL == minfAtom) || (NULL == dinfAtom))
+    {
+        // Built again by Finish
+        ARMEDIA_AtomTree_Delete (&track->trak);
+        ARMEDIA_AtomTree_Delete (&track->mdia);
+        ARMEDIA_AtomTree_Delete (&track->stbl);
+        ARMEDIA_AtomTree_Delete (&minfAtom);
+        ARMEDIA_AtomTree_Delete (&dinfAtom);
+        freeAtom (&mediaHeaderAtom);
+        freeAtom (&stsdAtom);
+        freeAtom (&hdlrmdiaAtom);
+        freeAtom (&hdlrminfAtom);
+        freeAtom (&drefAtom);
+        return;
+    }
+
+    // A missing atom makes the write of the tree fail
+    ARMEDIA_AtomTree_AppendAtom (track->stbl, &stsdAtom);
+    ARMEDIA_AtomTree_AppendAtom (dinfAtom, &drefAtom);
+    ARMEDIA_AtomTree_AppendAtom (minfAtom, &mediaHeaderAtom);
+    if (minfHandler)
+    {
+        ARMEDIA_AtomTree_AppendAtom (minfAtom, &hdlrminfAtom);
+    }
+    ARMEDIA_AtomTree_Append (minfAtom, dinfAtom);
+    ARMEDIA_AtomTree_Append (minfAtom, track->stbl);
+    ARMEDIA_AtomTree_AppendAtom (track->mdia, &hdlrmdiaAtom);
+    ARMEDIA_AtomTree_Append (track->mdia, minfAtom);
+    ARMEDIA_AtomTree_Append (track->trak, track->mdia);
+}
+
+static void ARMEDIA_VideoEncapsuler_BuildVideoTrack (ARMEDIA_VideoEncapsuler_t *encapsuler)
+{
+    ARMEDIA_Video_t *video = encapsuler->video;
+
+    // The minf handler is used only with H264
+    ARMEDIA_VideoEncapsuler_BuildTrack (&encapsuler->videoTrack, ARMEDIA_VIDEOATOM_MEDIATYPE_VIDEO, vmhdAtomGen (), (CODEC_MPEG4_AVC == video->codec),
+                                        stsdAtomWithResolutionCodecSpsAndPps (video->width, video->height, video->codec, &video->sps[4], video->spsSize -4, &video->pps[4], video->ppsSize -4));
+}
+
+static void ARMEDIA_VideoEncapsuler_BuildMetadataTrack (ARMEDIA_VideoEncapsuler_t *encapsuler)
+{
+    ARMEDIA_Metadata_t *metadata = encapsuler->metadata;
+    ARMEDIA_AtomTree_Node_t *trefAtom;
+    movie_atom_t *cdscAtom;
+    uint32_t cdsc_track_id = ARMEDIA_VIDEOATOM_MEDIATYPE_VIDEO + 1;
+
+    ARMEDIA_VideoEncapsuler_BuildTrack (&encapsuler->metadataTrack, ARMEDIA_VIDEOATOM_MEDIATYPE_METADATA, nmhdAtomGen (), 0,
+                                        stsdAtomForMetadata (metadata->content_encoding, metadata->mime_format));
+    if (NULL != encapsuler->metadataTrack.trak)
+    {
+        // The metadata describe the video track
+        trefAtom = ARMEDIA_AtomTree_New ("tref", NULL, 0, NULL, 0);
+        cdscAtom = cdscAtomGen (&cdsc_track_id, 1);
+        ARMEDIA_AtomTree_AppendAtom (trefAtom, &cdscAtom);
+        ARMEDIA_AtomTree_Prepend (encapsuler->metadataTrack.trak, trefAtom);
+    }
+}
+
+static void ARMEDIA_VideoEncapsuler_BuildAudioTrack (ARMEDIA_VideoEncapsuler_t *encapsuler)
+{
+    ARMEDIA_Audio_t *audio = encapsuler->audio;
+
+    ARMEDIA_VideoEncapsuler_BuildTrack (&encapsuler->audioTrack, ARMEDIA_VIDEOATOM_MEDIATYPE_SOUND, smhdAtomGen (), 0,
+                                        stsdAtomWithAudioCodec (audio->codec, audio->format, audio->nchannel, audio->freq));
+}
+
+/* Untimed metadata of the moov atom, built when it was set unless the thumbnail has changed since */
+static void ARMEDIA_VideoEncapsuler_AppendUntimedMetadata (ARMEDIA_VideoEncapsuler_t *encapsuler, ARMEDIA_AtomTree_Node_t *moovAtom)
+{
+    if ((encapsuler->got_untimed_metadata || strlen(encapsuler->thumbnailFilePath)) &&
+        (((NULL == encapsuler->udtaAtom) && (NULL == encapsuler->metaAtom)) || ARMEDIA_VideoEncapsuler_ThumbnailChanged (encapsuler)))
+    {
+        ARMEDIA_VideoEncapsuler_BuildUntimedMetadataAtoms (encapsuler);
+    }
+    if (NULL != encapsuler->udtaAtom)
+    {
+        ARMEDIA_AtomTree_Append(moovAtom, encapsuler->udtaAtom);
+        encapsuler->udtaAtom = NULL;
+    }
+    if (NULL != encapsuler->metaAtom)
+    {
+        ARMEDIA_AtomTree_Append(moovAtom, encapsuler->metaAtom);
+        encapsuler->metaAtom = NULL;
+    }
+}
+
+/* Add a track without samples to the moov atom of a fragmented media, and its
+   defaults to the mvex atom: the samples are described by the fragments */
+static void ARMEDIA_VideoEncapsuler_AppendFragmentedTrack (ARMEDIA_VideoEncapsuler_t *encapsuler, eENCAPSULER_CHUNK trackType,
+                                                           ARMEDIA_AtomTree_Node_t *moovAtom, ARMEDIA_AtomTree_Node_t *mvexAtom)
+{
+    static const uint32_t emptyStsz[3] = { 0, 0, 0 };
+    static const uint32_t emptyTrexDefaults[2] = { 0, 0 }; // size, flags
+    ARMEDIA_VideoEncapsuler_Track_t track;
+    movie_atom_t *tkhdAtom;
+    movie_atom_t *mdhdAtom;
+    uint32_t trex[4];
+
+    switch (trackType)
+    {
+    case ENCAPSULER_CHUNK_METADATA:
+        if (NULL == encapsuler->metadataTrack.trak)
+        {
+            ARMEDIA_VideoEncapsuler_BuildMetadataTrack (encapsuler);
+        }
+        track = encapsuler->metadataTrack;
+        memset (&encapsuler->metadataTrack, 0, sizeof (encapsuler->metadataTrack));
+        tkhdAtom = tkhdAtomWithResolutionNumFramesFpsAndDate (0, 0, encapsuler->timescale, 0, encapsuler->creationTime, ARMEDIA_VIDEOATOM_MEDIATYPE_METADATA);
+        mdhdAtom = mdhdAtomFromFpsNumFramesAndDate (encapsuler->timescale, 0, encapsuler->creationTime);
+        break;
+    case ENCAPSULER_CHUNK_AUDIO:
+        if (NULL == encapsuler->audioTrack.trak)
+        {
+            ARMEDIA_VideoEncapsuler_BuildAudioTrack (encapsuler);
+        }
+        track = encapsuler->audioTrack;
+        memset (&encapsuler->audioTrack, 0, sizeof (encapsuler->audioTrack));
+        tkhdAtom = tkhdAtomWithResolutionNumFramesFpsAndDate (0, 0, encapsuler->timescale, 0, encapsuler->creationTime, ARMEDIA_VIDEOATOM_MEDIATYPE_SOUND);
+        mdhdAtom = mdhdAtomFromFpsNumFramesAndDate (encapsuler->audio->freq, 0, encapsuler->creationTime);
+        break;
+    case ENCAPSULER_CHUNK_VIDEO:
+    default:
+        if (NULL == encapsuler->videoTrack.trak)
+        {
+            ARMEDIA_VideoEncapsuler_BuildVideoTrack (encapsuler);
+        }
+        track = encapsuler->videoTrack;
+        memset (&encapsuler->videoTrack, 0, sizeof (encapsuler->videoTrack));
+        tkhdAtom = tkhdAtomWithResolutionNumFramesFpsAndDate (encapsuler->video->width, encapsuler->video->height, encapsuler->timescale, 0,
+                                                              encapsuler->creationTime, ARMEDIA_VIDEOATOM_MEDIATYPE_VIDEO);
+        mdhdAtom = mdhdAtomFromFpsNumFramesAndDate (encapsuler->timescale, 0, encapsuler->creationTime);
+        break;
+    }
+    if (NULL == track.trak)
+    {
+        // Makes the write of the tree fail
+        freeAtom (&tkhdAtom);
+        freeAtom (&mdhdAtom);
+        ARMEDIA_AtomTree_Append (moovAtom, NULL);
+        return;
+    }
+
+    ARMEDIA_AtomTree_Append (track.stbl, ARMEDIA_AtomTree_NewTable ("stts", 0, NULL, 8));
+    ARMEDIA_AtomTree_Append (track.stbl, ARMEDIA_AtomTree_NewTable ("stsc", 0, NULL, 12));
+    ARMEDIA_AtomTree_Append (track.stbl, ARMEDIA_AtomTree_New ("stsz", emptyStsz, sizeof (emptyStsz), NULL, 0));
+    ARMEDIA_AtomTree_Append (track.stbl, ARMEDIA_AtomTree_NewTable ("stco", 0, NULL, 4));
+    ARMEDIA_AtomTree_Prepend (track.mdia, ARMEDIA_AtomTree_NewFromAtom (&mdhdAtom));
+    ARMEDIA_AtomTree_Prepend (track.trak, ARMEDIA_AtomTree_NewFromAtom (&tkhdAtom));
+    ARMEDIA_AtomTree_Append (moovAtom, track.trak);
+
+    // trex atom: sample description index 1, the sample defaults are given by each fragment
+    trex[0] = 0; // version & flags
+    trex[1] = htonl (ARMEDIA_VideoEncapsuler_GetTrackId (trackType));
+    trex[2] = htonl (1);
+    trex[3] = 0; // duration
+    ARMEDIA_AtomTree_Append (mvexAtom, ARMEDIA_AtomTree_New ("trex", trex, sizeof (trex), emptyTrexDefaults, sizeof (emptyTrexDefaults)));
+}
+
+/* Write the moov atom of a fragmented media at the start of the data, declaring
+   the tracks which have started: the writer then appends the fragments after it */
+static eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_WriteInitSegment (ARMEDIA_VideoEncapsuler_t *encapsuler)
+{
+    ARMEDIA_AtomTree_Node_t *moovAtom;
+    ARMEDIA_AtomTree_Node_t *mvexAtom;
+    movie_atom_t *mvhdAtom;
+    eARMEDIA_ERROR error;
+    int i;
+
+    encapsuler->fragmentTracks = 1 << ENCAPSULER_CHUNK_VIDEO;
+    if (encapsuler->got_metadata && (NULL != encapsuler->metadata) && (0 < encapsuler->metadata->block_size))
+    {
+        encapsuler->fragmentTracks |= 1 << ENCAPSULER_CHUNK_METADATA;
+    }
+    if (encapsuler->got_audio && (NULL != encapsuler->audio))
+    {
+        encapsuler->fragmentTracks |= 1 << ENCAPSULER_CHUNK_AUDIO;
+    }
+
+    moovAtom = ARMEDIA_AtomTree_New ("moov", NULL, 0, NULL, 0);
+    mvexAtom = ARMEDIA_AtomTree_New ("mvex", NULL, 0, NULL, 0);
+    if ((NULL == moovAtom) || (NULL == mvexAtom))
+    {
+        ENCAPSULER_ERROR ("Unable to allocate the init segment");
+        ARMEDIA_AtomTree_Delete (&moovAtom);
+        ARMEDIA_AtomTree_Delete (&mvexAtom);
+        return ARMEDIA_ERROR_ENCAPSULER;
+    }
+    ARMEDIA_VideoEncapsuler_AppendUntimedMetadata (encapsuler, moovAtom);
+    mvhdAtom = mvhdAtomFromFpsNumFramesAndDate (encapsuler->timescale, 0, encapsuler->creationTime);
+    ARMEDIA_AtomTree_AppendAtom (moovAtom, &mvhdAtom);
+    for (i = 0; i < ENCAPSULER_CHUNK_MAX; i++)
+    {
+        if (encapsuler->fragmentTracks & (1 << i))
+        {
+            ARMEDIA_VideoEncapsuler_AppendFragmentedTrack (encapsuler, (eENCAPSULER_CHUNK)i, moovAtom, mvexAtom);
+            ARMEDIA_VideoEncapsuler_Clock_Init (&encapsuler->fragmentClocks[i], encapsuler);
+            encapsuler->fragmentTimes[i] = 0;
+        }
+    }
+    ARMEDIA_AtomTree_Append (moovAtom, mvexAtom);
+
+    // Nothing is written by the writer before the first fragment
+    error = ARMEDIA_FileWriter_Flush (encapsuler->writer);
+    if ((ARMEDIA_OK != error) || (-1 == fseeko (encapsuler->dataFile, encapsuler->dataOffset, SEEK_SET)))
+    {
+        ENCAPSULER_ERROR ("Unable to seek to the init segment");
+        ARMEDIA_AtomTree_Delete (&moovAtom);
+        return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+    }
+    if (-1 == ARMEDIA_AtomTree_WriteToFile (&moovAtom, encapsuler->dataFile, encapsuler->finishMemoryLimit, 1))
+    {
+        ENCAPSULER_ERROR ("Unable to write the init segment");
+        return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+    }
+    encapsuler->fragmentEnd = ftello (encapsuler->dataFile);
+
+    return ARMEDIA_OK;
+}
+
+// Finish progress steps, in percent
+#define ENCAPSULER_FINISH_PROGRESS_WRITER   (10)  // pending frames written
+#define ENCAPSULER_FINISH_PROGRESS_MOOV     (90)  // moov atom written
+#define ENCAPSULER_FINISH_PROGRESS_MDAT     (95)  // mdat atom header written
+#define ENCAPSULER_FINISH_PROGRESS_DONE     (100) // media renamed, reported by the finish worker
+
+static void ARMEDIA_VideoEncapsuler_SetFinishProgress (ARMEDIA_VideoEncapsuler_t *encapsuler, uint8_t percent)
+{
+    if ((NULL != encapsuler->finishProgressCallback) && (percent > encapsuler->finishProgress))
+    {
+        encapsuler->finishProgress = percent;
+        encapsuler->finishProgressCallback (percent, encapsuler->finishUserData);
+    }
+}
+
+// Called by the threads generating the tables
+static void ARMEDIA_VideoEncapsuler_AddFinishedSize (ARMEDIA_VideoEncapsuler_t *encapsuler, size_t size)
+{
+    if (NULL == encapsuler->finishProgressCallback)
+    {
+        return;
+    }
+    if (encapsuler->finishLocked)
+    {
+        ARSAL_Mutex_Lock (&encapsuler->finishMutex);
+    }
+    encapsuler->finishDoneSize += size;
+    if (0 != encapsuler->finishTotalSize)
+    {
+        uint64_t range = ENCAPSULER_FINISH_PROGRESS_MOOV - ENCAPSULER_FINISH_PROGRESS_WRITER;
+        ARMEDIA_VideoEncapsuler_SetFinishProgress (encapsuler, (uint8_t)(ENCAPSULER_FINISH_PROGRESS_WRITER +
+                                                                         range * encapsuler->finishDoneSize / encapsuler->finishTotalSize));
+    }
+    if (encapsuler->finishLocked)
+    {
+        ARSAL_Mutex_Unlock (&encapsuler->finishMutex);
+    }
+}
+
+typedef enum
+{
+    ENCAPSULER_TABLE_STTS = 0, // durations, run-length encoded
+    ENCAPSULER_TABLE_STSS, // indexes of the sync samples
+    ENCAPSULER_TABLE_STSZ, // sample sizes
+    ENCAPSULER_TABLE_CO64, // chunk offsets
+    ENCAPSULER_TABLE_STSC, // samples per chunk, one entry per change
+    ENCAPSULER_TABLE_STCO, // chunk offsets, 32 bits
+    ENCAPSULER_TABLE_STZ2_16, // sample sizes, 16 bits
+    ENCAPSULER_TABLE_STZ2_8, // sample sizes, 8 bits
+    ENCAPSULER_TABLE_MAX,
+} eENCAPSULER_TABLE;
+
+static const size_t ENCAPSULER_TABLE_ENTRY_SIZE[ENCAPSULER_TABLE_MAX] = { 8, 4, 4, 8, 12, 4, 2, 1 };
+
+// Produces the entries of a moov table from a sample table
+typedef struct
+{
+    eENCAPSULER_TABLE type;
+    ARMEDIA_VideoEncapsuler_t *encapsuler;
+    ARMEDIA_SampleTable_Iterator_t iterator;
+    ARMEDIA_VideoEncapsuler_Clock_t clock; // STTS
+    uint32_t groupCount;    // STTS: current run of samples with the same duration
+    uint32_t groupDelta;
+    int tail;               // STTS: 0 while reading, 1 when the last sample entry is pending, 2 at the end
+    uint32_t index;         // STSS, STSC: number of samples or chunks read
+    uint32_t lastSamples;   // STSC: number of samples of the previous chunk
+    uint32_t sampleBits;    // STSC: size of an audio sample (all channels), 0 for one sample per entry
+    ARMEDIA_SampleTable_Entry_t next; // STSC, CO64, STCO: first entry of the next chunk
+    int hasNext;
+} ARMEDIA_VideoEncapsuler_TableReader_t;
+
+static void ARMEDIA_VideoEncapsuler_TableReader_Init (ARMEDIA_VideoEncapsuler_TableReader_t *reader, eENCAPSULER_TABLE type, ARMEDIA_VideoEncapsuler_t *encapsuler, const ARMEDIA_SampleTable_t *table)
+{
+    memset (reader, 0, sizeof (*reader));
+    reader->type = type;
+    reader->encapsuler = encapsuler;
+    ARMEDIA_VideoEncapsuler_Clock_Init (&reader->clock, encapsuler);
+    if ((NULL != encapsuler->audio) && (&encapsuler->audioTable == table))
+    {
+        reader->sampleBits = encapsuler->audio->nchannel * encapsuler->audio->format;
+    }
+    ARMEDIA_SampleTable_Begin (table, &reader->iterator);
+    if ((ENCAPSULER_TABLE_STSC == type) || (ENCAPSULER_TABLE_CO64 == type) || (ENCAPSULER_TABLE_STCO == type))
+    {
+        reader->hasNext = ARMEDIA_SampleTable_Next (&reader->iterator, &reader->next);
+    }
+}
+
+/* Read a chunk: the entries which follow its first one with the continue flag */
+static int ARMEDIA_VideoEncapsuler_TableReader_NextChunk (ARMEDIA_VideoEncapsuler_TableReader_t *reader, off_t *offset, uint32_t *samples)
+{
+    if (!reader->hasNext)
+    {
+        return 0;
+    }
+    *offset = reader->next.offset;
+    *samples = 0;
+    do
+    {
+        *samples += (0 != reader->sampleBits) ? reader->next.size * 8 / reader->sampleBits : 1;
+        reader->hasNext = ARMEDIA_SampleTable_Next (&reader->iterator, &reader->next);
+    } while (reader->hasNext && (reader->next.flags & ARMEDIA_SAMPLETABLE_FLAG_CHUNK_CONTINUE));
+    reader->index++;
+    return 1;
+}
+
+/* From microseconds to time units. With a tolerance, the duration is the nominal one
+   while the table time stays within the tolerance of the captured time: the jitter
+   is carried to the next samples instead of starting new entries, without drift */
+static int ARMEDIA_VideoEncapsuler_TableReader_NextStts (ARMEDIA_VideoEncapsuler_TableReader_t *reader, uint32_t *count, uint32_t *delta)
+{
+    ARMEDIA_SampleTable_Entry_t entry;
+
+    while ((0 == reader->tail) && ARMEDIA_SampleTable_Next (&reader->iterator, &entry))
+    {
+        uint32_t sampleDelta = ARMEDIA_VideoEncapsuler_Clock_Delta (&reader->clock, entry.duration);
+        if (0 == sampleDelta)
+        {
+            // first sample => no DT
+            continue;
+        }
+        if (sampleDelta == reader->groupDelta)
+        {
+            reader->groupCount++;
+            continue;
+        }
+        *count = reader->groupCount;
+        *delta = reader->groupDelta;
+        reader->groupCount = 1;
+        reader->groupDelta = sampleDelta;
+        if (0 != *delta)
+        {
+            // new entry => return the previous one
+            return 1;
+        }
+    }
+
+    // last sample to default DT + last entry
+    switch (reader->tail)
+    {
+    case 0:
+        if (reader->groupDelta == reader->clock.lastDelta)
+        {
+            reader->groupCount++;
+            reader->tail = 2;
+        }
+        else if (0 == reader->groupDelta)
+        {
+            reader->groupCount = 1;
+            reader->groupDelta = reader->clock.lastDelta;
+            reader->tail = 2;
+        }
+        else
+        {
+            reader->tail = 1;
+        }
+        *count = reader->groupCount;
+        *delta = reader->groupDelta;
+        return 1;
+    case 1:
+        *count = 1;
+        *delta = reader->clock.lastDelta;
+        reader->tail = 2;
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+static int ARMEDIA_VideoEncapsuler_TableReader_Next (ARMEDIA_VideoEncapsuler_TableReader_t *reader, uint32_t *values)
+{
+    ARMEDIA_SampleTable_Entry_t entry;
+    uint32_t count, delta, samples;
+    off_t offset;
+
+    switch (reader->type)
+    {
+    case ENCAPSULER_TABLE_STTS:
+        if (!ARMEDIA_VideoEncapsuler_TableReader_NextStts (reader, &count, &delta))
+            return 0;
+        values[0] = count;
+        values[1] = delta;
+        return 1;
+    case ENCAPSULER_TABLE_STSS:
+        while (ARMEDIA_SampleTable_Next (&reader->iterator, &entry))
+        {
+            reader->index++;
+            if (entry.flags & ARMEDIA_SAMPLETABLE_FLAG_SYNC)
+            {
+                values[0] = reader->index;
+                return 1;
+            }
+        }
+        return 0;
+    case ENCAPSULER_TABLE_STSZ:
+    case ENCAPSULER_TABLE_STZ2_16:
+    case ENCAPSULER_TABLE_STZ2_8:
+        if (!ARMEDIA_SampleTable_Next (&reader->iterator, &entry))
+            return 0;
+        values[0] = entry.size;
+        return 1;
+    case ENCAPSULER_TABLE_CO64:
+        if (!ARMEDIA_VideoEncapsuler_TableReader_NextChunk (reader, &offset, &samples))
+            return 0;
+        values[0] = (uint32_t)((uint64_t)offset >> 32);
+        values[1] = (uint32_t)(offset & 0xffffffff);
+        return 1;
+    case ENCAPSULER_TABLE_STCO:
+        if (!ARMEDIA_VideoEncapsuler_TableReader_NextChunk (reader, &offset, &samples))
+            return 0;
+        values[0] = (uint32_t)offset;
+        return 1;
+    case ENCAPSULER_TABLE_STSC:
+        while (ARMEDIA_VideoEncapsuler_TableReader_NextChunk (reader, &offset, &samples))
+        {
+            if (reader->lastSamples != samples)
+            {
+                reader->lastSamples = samples;
+                values[0] = reader->index;
+                values[1] = samples;
+                values[2] = 1;
+                return 1;
+            }
+        }
+        return 0;
+    default:
+        return 0;
+    }
+}
+
+static uint32_t ARMEDIA_VideoEncapsuler_TableReader_Count (ARMEDIA_VideoEncapsuler_TableReader_t *reader, uint64_t *duration)
+{
+    uint32_t values[3];
+    uint32_t count = 0;
+
+    while (ARMEDIA_VideoEncapsuler_TableReader_Next (reader, values))
+    {
+        if ((NULL != duration) && (ENCAPSULER_TABLE_STTS == reader->type))
+        {
+            *duration += (uint64_t)values[0] * values[1];
+        }
+        count++;
+    }
+    return count;
+}
+
+// First pass on the sample tables, one independent task per table of each track
+typedef enum
+{
+    ENCAPSULER_COUNT_VIDEO_STTS = 0,
+    ENCAPSULER_COUNT_VIDEO_STSS,
+    ENCAPSULER_COUNT_VIDEO_STSZ, // unique and largest sample sizes only
+    ENCAPSULER_COUNT_VIDEO_STSC,
+    ENCAPSULER_COUNT_METADATA_STTS,
+    ENCAPSULER_COUNT_METADATA_STSC,
+    ENCAPSULER_COUNT_AUDIO_STSC,
+    ENCAPSULER_COUNT_MAX,
+} eENCAPSULER_COUNT;
+
+typedef struct
+{
+    ARMEDIA_VideoEncapsuler_TableReader_t reader;
+    uint32_t count;         // number of entries of the table
+    uint64_t duration;      // STTS: sum of the durations
+    uint32_t chunks;        // STSC: number of chunks
+    uint32_t uniqueSize;    // STSZ: size of all the samples, 0 if they differ
+    uint32_t maxSize;       // STSZ: size of the largest sample
+} ARMEDIA_VideoEncapsuler_TableCount_t;
+
+static void ARMEDIA_VideoEncapsuler_CountTable (void *context)
+{
+    ARMEDIA_VideoEncapsuler_TableCount_t *count = context;
+    ARMEDIA_SampleTable_Entry_t entry;
+
+    if (ENCAPSULER_TABLE_STSZ != count->reader.type)
+    {
+        count->count = ARMEDIA_VideoEncapsuler_TableReader_Count (&count->reader, &count->duration);
+        count->chunks = count->reader.index;
+        return;
+    }
+
+    // All the frames have the same size: no stsz table, else the largest
+    // size gives the narrowest field of the table
+    if (ARMEDIA_SampleTable_Next (&count->reader.iterator, &entry))
+    {
+        count->uniqueSize = entry.size;
+        count->maxSize = entry.size;
+    }
+    while (ARMEDIA_SampleTable_Next (&count->reader.iterator, &entry))
+    {
+        if (count->uniqueSize != entry.size)
+        {
+            count->uniqueSize = 0;
+        }
+        if (count->maxSize < entry.size)
+        {
+            count->maxSize = entry.size;
+        }
+    }
+}
 
-            keysMetaAtom = metadataKeysAtom(key, keyCount);
+static size_t ARMEDIA_VideoEncapsuler_GenerateTable (void *context, uint8_t *buffer, size_t size)
+{
+    ARMEDIA_VideoEncapsuler_TableReader_t *reader = context;
+    size_t entrySize = ENCAPSULER_TABLE_ENTRY_SIZE[reader->type];
+    uint32_t values[3];
+    size_t used = 0;
+    size_t i;
 
-            // Add 1kB free space at the end of the udta and meta boxes to allow post-editing of metadata
-            uint32_t emptydatasize = 1024 - 8; // remove 8 bytes for box size and type
-            uint8_t *emptydata = calloc(emptydatasize, sizeof(uint8_t));
-            if (emptydata == NULL) {
-                ENCAPSULER_ERROR("Error allocating free data");
-                freeUdtaAtom = NULL;
-                freeMetaAtom = NULL;
-            } else {
-                freeUdtaAtom = atomFromData(emptydatasize, "free", emptydata);
-                freeMetaAtom = atomFromData(emptydatasize, "free", emptydata);
-                free(emptydata);
+    while ((used + entrySize <= size) && ARMEDIA_VideoEncapsuler_TableReader_Next (reader, values))
+    {
+        if (sizeof (uint16_t) == entrySize)
+        {
+            uint16_t value = htons ((uint16_t)values[0]);
+            memcpy (&buffer[used], &value, entrySize);
+        }
+        else if (sizeof (uint8_t) == entrySize)
+        {
+            buffer[used] = (uint8_t)values[0];
+        }
+        else
+        {
+            for (i = 0; i < entrySize / sizeof (uint32_t); i++)
+            {
+                values[i] = htonl (values[i]);
             }
-
-            insertAtomIntoAtom(metaUdtaAtom, &hdlrMetaUdtaAtom);
-            insertAtomIntoAtom(metaUdtaAtom, &ilstMetaUdtaAtom);
-            insertAtomIntoAtom(udtaAtom, &metaUdtaAtom);
-            if (freeUdtaAtom) insertAtomIntoAtom(udtaAtom, &freeUdtaAtom);
-            insertAtomIntoAtom(moovAtom, &udtaAtom);
-            insertAtomIntoAtom(metaAtom, &hdlrMetaAtom);
-            insertAtomIntoAtom(metaAtom, &keysMetaAtom);
-            insertAtomIntoAtom(metaAtom, &ilstMetaAtom);
-            if (freeMetaAtom) insertAtomIntoAtom(metaAtom, &freeMetaAtom);
-            insertAtomIntoAtom(moovAtom, &metaAtom);
+            memcpy (&buffer[used], values, entrySize);
         }
+        used += entrySize;
+    }
+    ARMEDIA_VideoEncapsuler_AddFinishedSize (reader->encapsuler, used);
+    return used;
+}
 
-        mvhdAtom = mvhdAtomFromFpsNumFramesAndDate (encaps->timescale, videoDuration, encaps->creationTime);
-        trakAtom = atomFromData(0, "trak", NULL);
-        tkhdAtom = tkhdAtomWithResolutionNumFramesFpsAndDate (video->width, video->height, encaps->timescale, videoDuration, encaps->creationTime, ARMEDIA_VIDEOATOM_MEDIATYPE_VIDEO);
-        mdiaAtom = atomFromData(0, "mdia", NULL);
-        mdhdAtom = mdhdAtomFromFpsNumFramesAndDate (encaps->timescale, videoDuration, encaps->creationTime);
-        hdlrmdiaAtom = hdlrAtomForMdia (ARMEDIA_VIDEOATOM_MEDIATYPE_VIDEO);
-        minfAtom = atomFromData(0, "minf", NULL);
-        vmhdAtom = vmhdAtomGen ();
-        if (CODEC_MPEG4_AVC == video->codec)
-            hdlrminfAtom = hdlrAtomForMinf();
-        dinfAtom = atomFromData(0, "dinf", NULL);
-        drefAtom = drefAtomGen ();
-        stblAtom = atomFromData(0, "stbl", NULL);
-        stsdAtom = stsdAtomWithResolutionCodecSpsAndPps (video->width, video->height, video->codec, &video->sps[4], video->spsSize -4, &video->pps[4], video->ppsSize -4);
-
-        // Generate stts atom from frameTimeSyncBuffer
-        sttsDataLen = (8 + 2 * videosttsNentries * sizeof(uint32_t));
-        sttsBuffer = (uint8_t*) calloc (sttsDataLen, 1);
-        sttsNentriesNE = htonl(videosttsNentries);
-        memcpy (&sttsBuffer[4], &sttsNentriesNE, sizeof(uint32_t));
-        memcpy (&sttsBuffer[8], frameTimeSyncBuffer, 2 * videosttsNentries * sizeof(uint32_t));
-        sttsAtom = atomFromData (sttsDataLen, "stts", sttsBuffer);
-        free(sttsBuffer);
-
-        if (CODEC_MPEG4_AVC == video->codec) {
-            // Generate stss atom from iFramesIndexBuffer and nbIFrames
-            stssDataLen = (8 + (nbIFrames * sizeof (uint32_t)));
-            stssBuffer = (uint8_t*) calloc (stssDataLen, 1);
-            nenbIFrames = htonl (nbIFrames);
-            memcpy (&stssBuffer[4], &nenbIFrames, sizeof (uint32_t));
-            memcpy (&stssBuffer[8], iFrameIndexBuffer, nbIFrames * sizeof (uint32_t));
-            stssAtom = atomFromData (stssDataLen, "stss", stssBuffer);
-            free (stssBuffer);
-        }
-
-        stscAtom = stscAtomGen(1, NULL, 1); // 1 video frame = 1 chunk
-
-        // Generate stsz atom from frameSizeBufferNE and nbFrames
-        stszAtom = stszAtomGen(videoUniqueSize, frameSizeBufferNE, nbFrames);
-
-        // Generate stco atom from videoOffsetBuffer and nbFrames
-        nbFramesNE = htonl (nbFrames);
-        stcoDataLen = (8 + (nbFrames * sizeof (uint64_t)));
-        stcoBuffer = (uint8_t*) calloc (stcoDataLen, 1);
-        memcpy (&stcoBuffer[4], &nbFramesNE, sizeof (uint32_t));
-        memcpy (&stcoBuffer[8], videoOffsetBuffer, nbFrames * sizeof (uint64_t));
-        stcoAtom = atomFromData (stcoDataLen, "co64", stcoBuffer);
-        free (stcoBuffer);
-
-        // Create atom tree
-        insertAtomIntoAtom(stblAtom, &stsdAtom);
-        insertAtomIntoAtom(stblAtom, &sttsAtom);
-        if (CODEC_MPEG4_AVC == video->codec)
-            insertAtomIntoAtom(stblAtom, &stssAtom);
+static ARMEDIA_AtomTree_Node_t *ARMEDIA_VideoEncapsuler_NewTableAtom (const char *tag, uint32_t count, ARMEDIA_VideoEncapsuler_TableReader_t *reader)
+{
+    uint32_t prefix[2];
 
-        insertAtomIntoAtom(stblAtom, &stscAtom);
-        insertAtomIntoAtom(stblAtom, &stszAtom);
-        insertAtomIntoAtom(stblAtom, &stcoAtom);
+    prefix[0] = 0; // version & flags
+    prefix[1] = htonl (count);
+    return ARMEDIA_AtomTree_NewGenerated (tag, prefix, sizeof (prefix), (uint64_t)count * ENCAPSULER_TABLE_ENTRY_SIZE[reader->type],
+                                          ARMEDIA_VideoEncapsuler_GenerateTable, reader);
+}
 
-        insertAtomIntoAtom(dinfAtom, &drefAtom);
+/* Replace the space of the mdat atom header of a fragmented media by a free atom
+   (the pvat atom is written before it by Finish) and release the preallocated space */
+static eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_FinishFragments (ARMEDIA_VideoEncapsuler_t *encaps)
+{
+    eARMEDIA_ERROR error = ARMEDIA_OK;
 
-        insertAtomIntoAtom(minfAtom, &vmhdAtom);
-        if (CODEC_MPEG4_AVC == video->codec)
-            insertAtomIntoAtom(minfAtom, &hdlrminfAtom);
-        insertAtomIntoAtom(minfAtom, &dinfAtom);
-        insertAtomIntoAtom(minfAtom, &stblAtom);
+    if (0 == encaps->fragmentCount)
+    {
+        ENCAPSULER_ERROR ("No fragment was written");
+        return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+    }
+    if ((-1 == fseeko (encaps->dataFile, encaps->mdatAtomOffset, SEEK_SET)) ||
+        (-1 == ARMEDIA_VideoEncapsuler_WriteFreeAtomHeader (encaps->dataFile, ENCAPSULER_MDAT_HEADER_SIZE)))
+    {
+        ENCAPSULER_ERROR ("Error while writing the free atom before the init segment");
+        error = ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+    }
+    fflush (encaps->dataFile);
+    if ((0 != encaps->preallocatedEnd) && (0 != ftruncate (fileno (encaps->dataFile), encaps->fragmentEnd)))
+    {
+        ENCAPSULER_ERROR ("Unable to release the preallocated space");
+    }
+    fsync (fileno (encaps->dataFile));
+    ARMEDIA_VideoEncapsuler_SetFinishProgress (encaps, ENCAPSULER_FINISH_PROGRESS_MDAT);
 
-        insertAtomIntoAtom(mdiaAtom, &mdhdAtom);
-        insertAtomIntoAtom(mdiaAtom, &hdlrmdiaAtom);
-        insertAtomIntoAtom(mdiaAtom, &minfAtom);
+    return error;
+}
 
-        insertAtomIntoAtom(trakAtom, &tkhdAtom);
-        insertAtomIntoAtom(trakAtom, &mdiaAtom);
+// Release the preallocated space after the last packet of a transport stream
+static eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_FinishTransportStream (ARMEDIA_VideoEncapsuler_t *encaps)
+{
+    off_t size = ARMEDIA_TsMuxer_GetSize (encaps->tsMuxer);
 
-        insertAtomIntoAtom(moovAtom, &mvhdAtom);
-        insertAtomIntoAtom(moovAtom, &trakAtom);
+    if (0 == size)
+    {
+        ENCAPSULER_ERROR ("No packet was written");
+        return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+    }
+    fflush (encaps->dataFile);
+    if ((0 != encaps->preallocatedEnd) && (0 != ftruncate (fileno (encaps->dataFile), size)))
+    {
+        ENCAPSULER_ERROR ("Unable to release the preallocated space");
+    }
+    fsync (fileno (encaps->dataFile));
+    ARMEDIA_VideoEncapsuler_SetFinishProgress (encaps, ENCAPSULER_FINISH_PROGRESS_MDAT);
 
-        if (encaps->got_metadata && metadata != NULL && metadata->block_size > 0)
-        {
-            uint32_t nbtFramesNE = htonl(nbtFrames);
-            movie_atom_t* nmhdAtom;
+    return ARMEDIA_OK;
+}
 
-            stblAtom = atomFromData(0, "stbl", NULL);
+eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_Finish (ARMEDIA_VideoEncapsuler_t **encapsuler)
+{
+    eARMEDIA_ERROR localError = ARMEDIA_OK;
+    ARMEDIA_VideoEncapsuler_t* encaps = NULL;
+    ARMEDIA_Video_t *video = NULL;
+    ARMEDIA_Audio_t *audio = NULL;
+    ARMEDIA_Metadata_t *metadata = NULL;
 
-            stsdAtom = stsdAtomForMetadata (
-                    metadata->content_encoding, metadata->mime_format);
+    struct tm localTime;
+    struct tm *nowTm = NULL;
+    off_t pvatOffset = 0;
 
-            // Generate stts atom from metadataTimeSyncBuffer
-            sttsDataLen = (8 + 2 * metadatasttsNentries * sizeof(uint32_t));
-            sttsBuffer = (uint8_t*) calloc (sttsDataLen, 1);
-            sttsNentriesNE = htonl(metadatasttsNentries);
-            memcpy (&sttsBuffer[4], &sttsNentriesNE, sizeof(uint32_t));
-            memcpy (&sttsBuffer[8], metadataTimeSyncBuffer, 2 * metadatasttsNentries * sizeof(uint32_t));
-            sttsAtom = atomFromData (sttsDataLen, "stts", sttsBuffer);
-            free(sttsBuffer);
+#if ENCAPSULER_LOG_TIMESTAMPS
+    fclose(tslogger);
+#endif
 
-            stscAtom = stscAtomGen(1, NULL, 1); // 1 metadata frame = 1 chunk
+    if (NULL == encapsuler)
+    {
+        ENCAPSULER_ERROR ("encapsuler double pointer must not be null");
+        localError = ARMEDIA_ERROR_BAD_PARAMETER;
+    }
 
-            // Generate stsz atom from of metadata blocks_size and nbtFrames
-            stszAtom = stszAtomGen(metadata->block_size, NULL, nbtFrames);
+    if (encapsuler && (NULL == *encapsuler))
+    {
+        ENCAPSULER_ERROR ("encapsuler pointer must not be null");
+        localError = ARMEDIA_ERROR_BAD_PARAMETER;
+    }
+    else
+    {
+        encaps = *encapsuler;
+        if (NULL == encaps->video)
+        {
+            ENCAPSULER_ERROR ("video pointer must not be null");
+            localError = ARMEDIA_ERROR_BAD_PARAMETER;
+        }
+    }
 
-            // Generate stco atom from metadataOffsetBuffer and nbFrames
-            stcoDataLen = (8 + (nbtFrames * sizeof (uint64_t)));
-            stcoBuffer = (uint8_t*) calloc (stcoDataLen, 1);
-            memcpy (&stcoBuffer[4], &nbtFramesNE, sizeof (uint32_t));
-            memcpy (&stcoBuffer[8], metadataOffsetBuffer, nbtFrames * sizeof (uint64_t));
-            stcoAtom = atomFromData (stcoDataLen, "co64", stcoBuffer);
-            free (stcoBuffer);
+    if ((NULL != encaps) && (NULL != encaps->writer))
+    {
+        // Write the pending chunks and frames and stop the writer thread
+        eARMEDIA_ERROR writerError = ARMEDIA_VideoEncapsuler_WritePendingChunks (encaps);
+        if (ARMEDIA_OK != writerError)
+        {
+            ENCAPSULER_ERROR ("Error %d while writing the pending chunks", writerError);
+        }
+        writerError = ARMEDIA_FileWriter_Delete (&encaps->writer);
+        if (ARMEDIA_OK != writerError)
+        {
+            ENCAPSULER_ERROR ("Error %d while writing frames, the media may be incomplete", writerError);
+        }
+    }
+    if (NULL != encaps)
+    {
+        ARMEDIA_VideoEncapsuler_SetFinishProgress (encaps, ENCAPSULER_FINISH_PROGRESS_WRITER);
+    }
 
-            insertAtomIntoAtom(stblAtom, &stsdAtom);
-            insertAtomIntoAtom(stblAtom, &sttsAtom); // Same as video
-            insertAtomIntoAtom(stblAtom, &stscAtom);
-            insertAtomIntoAtom(stblAtom, &stszAtom);
-            insertAtomIntoAtom(stblAtom, &stcoAtom);
+    if (ARMEDIA_OK == localError)
+    {
+        video = encaps->video; // ease of reading
+        audio = encaps->audio; // ease of reading
+        metadata = encaps->metadata; // ease of reading
+        if (!video->width)
+        {
+            // Video was not initialized
+            ENCAPSULER_ERROR ("video was not initialized");
+            localError =  ARMEDIA_ERROR_BAD_PARAMETER;
+        } // No else
+    }
 
+    if ((ARMEDIA_OK == localError) && encaps->fragmented)
+    {
+        // The init segment and the fragments are written: only the pvat atom is missing
+        nowTm = localtime_r (&(encaps->creationTime), &localTime);
+        pvatOffset = encaps->mdatAtomOffset - (ARMEDIA_JSON_DESCRIPTION_MAXLENGTH+8);
+        localError = ARMEDIA_VideoEncapsuler_FinishFragments (encaps);
+    }
+    else if ((ARMEDIA_OK == localError) && (NULL != encaps->tsMuxer))
+    {
+        // All the packets are written: the stream has no index
+        localError = ARMEDIA_VideoEncapsuler_FinishTransportStream (encaps);
+    }
+    else if (ARMEDIA_OK == localError)
+    {
+        // Init internal counters
+        uint32_t nbFrames = encaps->videoTable.count;
+        uint32_t nbtFrames = encaps->metadataTable.count;
+        uint32_t nbIFrames;
+        uint32_t cptVideoStsc, nbvChunks;
+        uint32_t cptMetadataStsc, nbtChunks;
+        uint32_t cptAudioStsc, nbaChunks;
+        ARMEDIA_VideoEncapsuler_TableCount_t counts[ENCAPSULER_COUNT_MAX];
 
-            dinfAtom = atomFromData(0, "dinf", NULL);
-            drefAtom = drefAtomGen ();
+        // Video time management
+        uint32_t videosttsNentries;
+        uint32_t metadatasttsNentries;
+        uint64_t videoDuration = 0; // version 1 mvhd, tkhd and mdhd atoms beyond 32 bits
+        off_t videoUniqueSize = 0;
+        uint32_t videoMaxSize;
+        eENCAPSULER_TABLE videoSizeTable = ENCAPSULER_TABLE_STSZ;
+        eENCAPSULER_TABLE offsetTable = ENCAPSULER_TABLE_CO64;
+        const char *offsetTag = "co64";
+
+        // The tables are streamed from the sample tables when the moov atom is written
+        ARMEDIA_VideoEncapsuler_TableReader_t videoStts, videoStss, videoStsz, videoStsc, videoCo64;
+        ARMEDIA_VideoEncapsuler_TableReader_t metadataStts, metadataStsc, metadataCo64;
+        ARMEDIA_VideoEncapsuler_TableReader_t audioStsc, audioCo64;
+
+        ARMEDIA_AtomTree_Node_t* moovAtom;         // root
+        uint64_t moovSize;
+        off_t dataEnd;
+        off_t fastStartOffset;
+        uint64_t fastStartSize = 0;
+        int fastStart;
+        movie_atom_t* mvhdAtom;         // > mvhd
+        ARMEDIA_VideoEncapsuler_Track_t track;     // > trak, built before Finish
+        movie_atom_t* tkhdAtom;         // | > tkhd
+        movie_atom_t* mdhdAtom;         // |   > mdhd
+        ARMEDIA_AtomTree_Node_t* sttsAtom;         // |       > stts
+        ARMEDIA_AtomTree_Node_t* stssAtom = NULL;  // |       > stss (used only with H264)
+        ARMEDIA_AtomTree_Node_t* stscAtom;         // |       > stsc
+        ARMEDIA_AtomTree_Node_t* stszAtom;         // |       > stsz or stz2
+        ARMEDIA_AtomTree_Node_t* stcoAtom;         // |       > stco or co64
+
+        // The small tables are written from these buffers when the tree is written
+        uint32_t stszPrefix[3];
+        uint32_t sttsAudioEntry[2];
+
+        // First pass on the sample tables: size of the tables and duration
+        memset (counts, 0, sizeof (counts));
+        ARMEDIA_VideoEncapsuler_TableReader_Init (&counts[ENCAPSULER_COUNT_VIDEO_STTS].reader, ENCAPSULER_TABLE_STTS, encaps, &encaps->videoTable);
+        ARMEDIA_VideoEncapsuler_TableReader_Init (&counts[ENCAPSULER_COUNT_VIDEO_STSS].reader, ENCAPSULER_TABLE_STSS, encaps, &encaps->videoTable);
+        ARMEDIA_VideoEncapsuler_TableReader_Init (&counts[ENCAPSULER_COUNT_VIDEO_STSZ].reader, ENCAPSULER_TABLE_STSZ, encaps, &encaps->videoTable);
+        ARMEDIA_VideoEncapsuler_TableReader_Init (&counts[ENCAPSULER_COUNT_VIDEO_STSC].reader, ENCAPSULER_TABLE_STSC, encaps, &encaps->videoTable);
+        ARMEDIA_VideoEncapsuler_TableReader_Init (&counts[ENCAPSULER_COUNT_METADATA_STTS].reader, ENCAPSULER_TABLE_STTS, encaps, &encaps->metadataTable);
+        ARMEDIA_VideoEncapsuler_TableReader_Init (&counts[ENCAPSULER_COUNT_METADATA_STSC].reader, ENCAPSULER_TABLE_STSC, encaps, &encaps->metadataTable);
+        ARMEDIA_VideoEncapsuler_TableReader_Init (&counts[ENCAPSULER_COUNT_AUDIO_STSC].reader, ENCAPSULER_TABLE_STSC, encaps, &encaps->audioTable);
+        ARMEDIA_TaskPool_Run (ARMEDIA_VideoEncapsuler_CountTable, counts, sizeof (counts[0]), ENCAPSULER_COUNT_MAX, encaps->finishThreadCount);
+        videosttsNentries = counts[ENCAPSULER_COUNT_VIDEO_STTS].count;
+        videoDuration = counts[ENCAPSULER_COUNT_VIDEO_STTS].duration;
+        nbIFrames = counts[ENCAPSULER_COUNT_VIDEO_STSS].count;
+        videoUniqueSize = counts[ENCAPSULER_COUNT_VIDEO_STSZ].uniqueSize;
+        videoMaxSize = counts[ENCAPSULER_COUNT_VIDEO_STSZ].maxSize;
+        cptVideoStsc = counts[ENCAPSULER_COUNT_VIDEO_STSC].count;
+        nbvChunks = counts[ENCAPSULER_COUNT_VIDEO_STSC].chunks;
+        metadatasttsNentries = counts[ENCAPSULER_COUNT_METADATA_STTS].count;
+        cptMetadataStsc = counts[ENCAPSULER_COUNT_METADATA_STSC].count;
+        nbtChunks = counts[ENCAPSULER_COUNT_METADATA_STSC].chunks;
+        cptAudioStsc = counts[ENCAPSULER_COUNT_AUDIO_STSC].count;
+        nbaChunks = counts[ENCAPSULER_COUNT_AUDIO_STSC].chunks;
+
+        // Narrowest tables: 32 bits chunk offsets when all the data is below 4GB,
+        // 8 or 16 bits sample sizes (stz2 atom) when all the frames fit
+        dataEnd = ftello (encaps->dataFile);
+        if ((0 <= dataEnd) && (ENCAPSULER_STCO_MAX_DATA_END >= dataEnd))
+        {
+            offsetTable = ENCAPSULER_TABLE_STCO;
+            offsetTag = "stco";
+        }
+        if ((0 == videoUniqueSize) && (0 < nbFrames))
+        {
+            if (UINT8_MAX >= videoMaxSize)
+            {
+                videoSizeTable = ENCAPSULER_TABLE_STZ2_8;
+            }
+            else if (UINT16_MAX >= videoMaxSize)
+            {
+                videoSizeTable = ENCAPSULER_TABLE_STZ2_16;
+            }
+        }
 
-            insertAtomIntoAtom(dinfAtom, &drefAtom);
+        ARMEDIA_VideoEncapsuler_TableReader_Init (&videoStts, ENCAPSULER_TABLE_STTS, encaps, &encaps->videoTable);
+        ARMEDIA_VideoEncapsuler_TableReader_Init (&videoStss, ENCAPSULER_TABLE_STSS, encaps, &encaps->videoTable);
+        ARMEDIA_VideoEncapsuler_TableReader_Init (&videoStsz, videoSizeTable, encaps, &encaps->videoTable);
+        ARMEDIA_VideoEncapsuler_TableReader_Init (&videoStsc, ENCAPSULER_TABLE_STSC, encaps, &encaps->videoTable);
+        ARMEDIA_VideoEncapsuler_TableReader_Init (&videoCo64, offsetTable, encaps, &encaps->videoTable);
+        ARMEDIA_VideoEncapsuler_TableReader_Init (&metadataStts, ENCAPSULER_TABLE_STTS, encaps, &encaps->metadataTable);
+        ARMEDIA_VideoEncapsuler_TableReader_Init (&metadataStsc, ENCAPSULER_TABLE_STSC, encaps, &encaps->metadataTable);
+        ARMEDIA_VideoEncapsuler_TableReader_Init (&metadataCo64, offsetTable, encaps, &encaps->metadataTable);
+        ARMEDIA_VideoEncapsuler_TableReader_Init (&audioStsc, ENCAPSULER_TABLE_STSC, encaps, &encaps->audioTable);
+        ARMEDIA_VideoEncapsuler_TableReader_Init (&audioCo64, offsetTable, encaps, &encaps->audioTable);
 
-            minfAtom = atomFromData(0, "minf", NULL);
-            nmhdAtom = nmhdAtomGen();
+        // get the local time value
+        nowTm = localtime_r (&(encaps->creationTime), &localTime);
 
-            insertAtomIntoAtom(minfAtom, &nmhdAtom);
-            insertAtomIntoAtom(minfAtom, &dinfAtom);
-            insertAtomIntoAtom(minfAtom, &stblAtom);
+        // create atoms
+        // Generating Atoms
+        moovAtom = ARMEDIA_AtomTree_New("moov", NULL, 0, NULL, 0);
 
+        ARMEDIA_VideoEncapsuler_AppendUntimedMetadata (encaps, moovAtom);
 
-            mdiaAtom = atomFromData(0, "mdia", NULL);
-            mdhdAtom = mdhdAtomFromFpsNumFramesAndDate (encaps->timescale, videoDuration, encaps->creationTime);
-            hdlrmdiaAtom = hdlrAtomForMdia (ARMEDIA_VIDEOATOM_MEDIATYPE_METADATA);
+        mvhdAtom = mvhdAtomFromFpsNumFramesAndDate (encaps->timescale, videoDuration, encaps->creationTime);
+        ARMEDIA_AtomTree_AppendAtom(moovAtom, &mvhdAtom);
 
-            insertAtomIntoAtom(mdiaAtom, &mdhdAtom);
-            insertAtomIntoAtom(mdiaAtom, &hdlrmdiaAtom);
-            insertAtomIntoAtom(mdiaAtom, &minfAtom);
+        if (NULL == encaps->videoTrack.trak)
+        {
+            ARMEDIA_VideoEncapsuler_BuildVideoTrack (encaps);
+        }
+        track = encaps->videoTrack;
+        memset (&encaps->videoTrack, 0, sizeof (encaps->videoTrack));
+        tkhdAtom = tkhdAtomWithResolutionNumFramesFpsAndDate (video->width, video->height, encaps->timescale, videoDuration, encaps->creationTime, ARMEDIA_VIDEOATOM_MEDIATYPE_VIDEO);
+        mdhdAtom = mdhdAtomFromFpsNumFramesAndDate (encaps->timescale, videoDuration, encaps->creationTime);
 
+        // Generate stts atom from the video durations
+        sttsAtom = ARMEDIA_VideoEncapsuler_NewTableAtom ("stts", videosttsNentries, &videoStts);
 
-            trakAtom = atomFromData(0, "trak", NULL);
-            tkhdAtom = tkhdAtomWithResolutionNumFramesFpsAndDate (0, 0, encaps->timescale, videoDuration, encaps->creationTime, ARMEDIA_VIDEOATOM_MEDIATYPE_METADATA);
-            trefAtom = atomFromData(0, "tref", NULL);
-            uint32_t cdsc_track_id = ARMEDIA_VIDEOATOM_MEDIATYPE_VIDEO + 1;
-            cdscAtom = cdscAtomGen (&cdsc_track_id, 1);
-            insertAtomIntoAtom(trakAtom, &tkhdAtom);
-            insertAtomIntoAtom(trefAtom, &cdscAtom);
-            insertAtomIntoAtom(trakAtom, &trefAtom);
-            insertAtomIntoAtom(trakAtom, &mdiaAtom);
-            insertAtomIntoAtom(moovAtom, &trakAtom);
+        if (CODEC_MPEG4_AVC == video->codec) {
+            // Generate stss atom from the video sync samples
+            stssAtom = ARMEDIA_VideoEncapsuler_NewTableAtom ("stss", nbIFrames, &videoStss);
         }
 
-        if(encaps->got_audio)
+        // Generate stsc atom from the video chunks
+        stscAtom = ARMEDIA_VideoEncapsuler_NewTableAtom ("stsc", cptVideoStsc, &videoStsc);
+
+        // Generate stsz atom from the video sizes
+        stszPrefix[0] = 0; // version & flags
+        stszPrefix[1] = htonl ((uint32_t)videoUniqueSize); // null if table
+        stszPrefix[2] = htonl (nbFrames);
+        if (ENCAPSULER_TABLE_STSZ != videoSizeTable)
         {
-            uint32_t nbSamples = audio->totalsize * 8*sizeof(uint8_t) / (audio->format * audio->nchannel);
-            uint32_t nbSamplesNE = htonl(nbSamples);
-            uint32_t nbaChunksNE = htonl(nbaChunks);
-            movie_atom_t* smhdAtom;
+            // Compact table: reserved (24 bits) and field size (8 bits) instead of the sample size
+            stszPrefix[1] = htonl ((uint32_t)(8 * ENCAPSULER_TABLE_ENTRY_SIZE[videoSizeTable]));
+            stszAtom = ARMEDIA_AtomTree_NewGenerated ("stz2", stszPrefix, sizeof (stszPrefix), (uint64_t)nbFrames * ENCAPSULER_TABLE_ENTRY_SIZE[videoSizeTable],
+                                                      ARMEDIA_VideoEncapsuler_GenerateTable, &videoStsz);
+        }
+        else if (0 == videoUniqueSize)
+        {
+            stszAtom = ARMEDIA_AtomTree_NewGenerated ("stsz", stszPrefix, sizeof (stszPrefix), (uint64_t)nbFrames * sizeof (uint32_t),
+                                                      ARMEDIA_VideoEncapsuler_GenerateTable, &videoStsz);
+        }
+        else
+        {
+            stszAtom = ARMEDIA_AtomTree_New ("stsz", stszPrefix, sizeof (stszPrefix), NULL, 0);
+        }
+
+        // Generate stco atom from the video offsets
+        stcoAtom = ARMEDIA_VideoEncapsuler_NewTableAtom (offsetTag, nbvChunks, &videoCo64);
 
-            stblAtom = atomFromData(0, "stbl", NULL);
+        // Complete the track: sample tables after the stsd atom, durations first in mdia and trak
+        ARMEDIA_AtomTree_Append(track.stbl, sttsAtom);
+        if (CODEC_MPEG4_AVC == video->codec)
+            ARMEDIA_AtomTree_Append(track.stbl, stssAtom);
 
-            stsdAtom = stsdAtomWithAudioCodec(audio->codec, audio->format, audio->nchannel, audio->freq);
+        ARMEDIA_AtomTree_Append(track.stbl, stscAtom);
+        ARMEDIA_AtomTree_Append(track.stbl, stszAtom);
+        ARMEDIA_AtomTree_Append(track.stbl, stcoAtom);
+        ARMEDIA_AtomTree_Prepend(track.mdia, ARMEDIA_AtomTree_NewFromAtom (&mdhdAtom));
+        ARMEDIA_AtomTree_Prepend(track.trak, ARMEDIA_AtomTree_NewFromAtom (&tkhdAtom));
+        ARMEDIA_AtomTree_Append(moovAtom, track.trak);
 
-            sttsDataLen = (8 + 2 * sizeof(uint32_t));
-            sttsBuffer = (uint8_t*) calloc (sttsDataLen, 1);
-            sttsNentriesNE = htonl(1);
-            memcpy (&sttsBuffer[4], &sttsNentriesNE, sizeof(uint32_t));
-            memcpy (&sttsBuffer[8], &nbSamplesNE, sizeof(uint32_t));
-            memcpy (&sttsBuffer[12], &sttsNentriesNE, sizeof(uint32_t));
-            sttsAtom = atomFromData (sttsDataLen, "stts", sttsBuffer);
-            free(sttsBuffer);
+        if (encaps->got_metadata && metadata != NULL && metadata->block_size > 0)
+        {
+            uint32_t nbtFramesNE = htonl(nbtFrames);
 
-            stscAtom = stscAtomGen(0, audioStscBuffer, cptAudioStsc);
+            if (NULL == encaps->metadataTrack.trak)
+            {
+                ARMEDIA_VideoEncapsuler_BuildMetadataTrack (encaps);
+            }
+            track = encaps->metadataTrack;
+            memset (&encaps->metadataTrack, 0, sizeof (encaps->metadataTrack));
 
-            // Generate stsz atom
-            stszAtom = stszAtomGen(audio->nchannel * audio->format/(8*sizeof(uint8_t)), NULL, nbSamples);
+            // Generate stts atom from the metadata durations
+            sttsAtom = ARMEDIA_VideoEncapsuler_NewTableAtom ("stts", metadatasttsNentries, &metadataStts);
 
-            // Generate stco atom from audioOffsetBuffer and nbFrames
-            stcoDataLen = (8 + (nbaChunks * sizeof (uint64_t)));
-            stcoBuffer = (uint8_t*) calloc (stcoDataLen, 1);
-            memcpy (&stcoBuffer[4], &nbaChunksNE, sizeof (uint32_t));
-            memcpy (&stcoBuffer[8], audioOffsetBuffer, nbaChunks * sizeof (uint64_t));
-            stcoAtom = atomFromData (stcoDataLen, "co64", stcoBuffer);
-            free (stcoBuffer);
+            // Generate stsc atom from the metadata chunks
+            stscAtom = ARMEDIA_VideoEncapsuler_NewTableAtom ("stsc", cptMetadataStsc, &metadataStsc);
 
-            insertAtomIntoAtom(stblAtom, &stsdAtom);
-            insertAtomIntoAtom(stblAtom, &sttsAtom);
-            insertAtomIntoAtom(stblAtom, &stscAtom);
-            insertAtomIntoAtom(stblAtom, &stszAtom);
-            insertAtomIntoAtom(stblAtom, &stcoAtom);
+            // Generate stsz atom from of metadata blocks_size and nbtFrames
+            stszPrefix[0] = 0; // version & flags
+            stszPrefix[1] = htonl (metadata->block_size);
+            stszPrefix[2] = nbtFramesNE;
+            stszAtom = ARMEDIA_AtomTree_New ("stsz", stszPrefix, sizeof (stszPrefix), NULL, 0);
 
+            // Generate stco atom from the metadata offsets
+            stcoAtom = ARMEDIA_VideoEncapsuler_NewTableAtom (offsetTag, nbtChunks, &metadataCo64);
 
-            dinfAtom = atomFromData(0, "dinf", NULL);
-            drefAtom = drefAtomGen ();
+            ARMEDIA_AtomTree_Append(track.stbl, sttsAtom); // Same as video
+            ARMEDIA_AtomTree_Append(track.stbl, stscAtom);
+            ARMEDIA_AtomTree_Append(track.stbl, stszAtom);
+            ARMEDIA_AtomTree_Append(track.stbl, stcoAtom);
 
-            insertAtomIntoAtom(dinfAtom, &drefAtom);
+            mdhdAtom = mdhdAtomFromFpsNumFramesAndDate (encaps->timescale, videoDuration, encaps->creationTime);
+            tkhdAtom = tkhdAtomWithResolutionNumFramesFpsAndDate (0, 0, encaps->timescale, videoDuration, encaps->creationTime, ARMEDIA_VIDEOATOM_MEDIATYPE_METADATA);
+            ARMEDIA_AtomTree_Prepend(track.mdia, ARMEDIA_AtomTree_NewFromAtom (&mdhdAtom));
+            ARMEDIA_AtomTree_Prepend(track.trak, ARMEDIA_AtomTree_NewFromAtom (&tkhdAtom));
+            ARMEDIA_AtomTree_Append(moovAtom, track.trak);
+        }
 
+        if(encaps->got_audio)
+        {
+            uint32_t nbSamples = audio->totalsize * 8*sizeof(uint8_t) / (audio->format * audio->nchannel);
+            uint32_t nbSamplesNE = htonl(nbSamples);
 
-            minfAtom = atomFromData(0, "minf", NULL);
-            smhdAtom = smhdAtomGen();
+            if (NULL == encaps->audioTrack.trak)
+            {
+                ARMEDIA_VideoEncapsuler_BuildAudioTrack (encaps);
+            }
+            track = encaps->audioTrack;
+            memset (&encaps->audioTrack, 0, sizeof (encaps->audioTrack));
 
-            insertAtomIntoAtom(minfAtom, &smhdAtom);
-            insertAtomIntoAtom(minfAtom, &dinfAtom);
-            insertAtomIntoAtom(minfAtom, &stblAtom);
+            sttsAudioEntry[0] = nbSamplesNE;
+            sttsAudioEntry[1] = htonl (1);
+            sttsAtom = ARMEDIA_AtomTree_NewTable ("stts", 1, sttsAudioEntry, sizeof (sttsAudioEntry));
 
+            stscAtom = ARMEDIA_VideoEncapsuler_NewTableAtom ("stsc", cptAudioStsc, &audioStsc);
 
-            mdiaAtom = atomFromData(0, "mdia", NULL);
-            mdhdAtom = mdhdAtomFromFpsNumFramesAndDate (audio->freq, nbSamples, encaps->creationTime);
-            hdlrmdiaAtom = hdlrAtomForMdia (ARMEDIA_VIDEOATOM_MEDIATYPE_SOUND);
+            // Generate stsz atom
+            stszPrefix[0] = 0; // version & flags
+            stszPrefix[1] = htonl (audio->nchannel * audio->format/(8*sizeof(uint8_t)));
+            stszPrefix[2] = nbSamplesNE;
+            stszAtom = ARMEDIA_AtomTree_New ("stsz", stszPrefix, sizeof (stszPrefix), NULL, 0);
 
-            insertAtomIntoAtom(mdiaAtom, &mdhdAtom);
-            insertAtomIntoAtom(mdiaAtom, &hdlrmdiaAtom);
-            insertAtomIntoAtom(mdiaAtom, &minfAtom);
+            // Generate stco atom from the audio offsets
+            stcoAtom = ARMEDIA_VideoEncapsuler_NewTableAtom (offsetTag, nbaChunks, &audioCo64);
 
+            ARMEDIA_AtomTree_Append(track.stbl, sttsAtom);
+            ARMEDIA_AtomTree_Append(track.stbl, stscAtom);
+            ARMEDIA_AtomTree_Append(track.stbl, stszAtom);
+            ARMEDIA_AtomTree_Append(track.stbl, stcoAtom);
 
-            trakAtom = atomFromData(0, "trak", NULL);
+            mdhdAtom = mdhdAtomFromFpsNumFramesAndDate (audio->freq, nbSamples, encaps->creationTime);
             tkhdAtom = tkhdAtomWithResolutionNumFramesFpsAndDate (0, 0, encaps->timescale, videoDuration, encaps->creationTime, ARMEDIA_VIDEOATOM_MEDIATYPE_SOUND);
-            insertAtomIntoAtom(trakAtom, &tkhdAtom);
-            insertAtomIntoAtom(trakAtom, &mdiaAtom);
-            insertAtomIntoAtom(moovAtom, &trakAtom);
+            ARMEDIA_AtomTree_Prepend(track.mdia, ARMEDIA_AtomTree_NewFromAtom (&mdhdAtom));
+            ARMEDIA_AtomTree_Prepend(track.trak, ARMEDIA_AtomTree_NewFromAtom (&tkhdAtom));
+            ARMEDIA_AtomTree_Append(moovAtom, track.trak);
+        }
+
+        // Fast start: the moov atom is written in the reserved space if it fits, followed
+        // by a free atom for the rest of the space (the size is derived from the mdat
+        // offset, so that a recovered media keeps its layout)
+        moovSize = ARMEDIA_AtomTree_GetSize (moovAtom);
+        fastStartOffset = ARMEDIA_VideoEncapsuler_GetFastStartOffset (video->codec);
+        if ((0 <= fastStartOffset) && (fastStartOffset < encaps->mdatAtomOffset))
+        {
+            fastStartSize = (uint64_t)(encaps->mdatAtomOffset - fastStartOffset);
+        }
+        fastStart = (0 != fastStartSize) && ((moovSize == fastStartSize) || (moovSize + 8 <= fastStartSize));
+        pvatOffset = encaps->mdatAtomOffset - (off_t)fastStartSize - (ARMEDIA_JSON_DESCRIPTION_MAXLENGTH+8);
+        if (fastStart && (-1 == fseeko (encaps->dataFile, fastStartOffset, SEEK_SET)))
+        {
+            ENCAPSULER_ERROR ("Unable to seek to the fast start space");
+            fastStart = 0;
+            fseeko (encaps->dataFile, dataEnd, SEEK_SET);
         }
 
-        if (-1 == writeAtomToFile (&moovAtom, encaps->dataFile))
+        // The tables of the tracks are generated on the finish threads
+        encaps->finishTotalSize = moovSize;
+        encaps->finishDoneSize = 0;
+        encaps->finishLocked = (0 == ARSAL_Mutex_Init (&encaps->finishMutex));
+        if (-1 == ARMEDIA_AtomTree_WriteToFile (&moovAtom, encaps->dataFile, encaps->finishMemoryLimit,
+                                                encaps->finishLocked ? encaps->finishThreadCount : 1))
         {
             ENCAPSULER_ERROR ("Error while writing moovAtom");
             localError = ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
         }
+        if (encaps->finishLocked)
+        {
+            ARSAL_Mutex_Destroy (&encaps->finishMutex);
+            encaps->finishLocked = 0;
+        }
+        if ((ARMEDIA_OK == localError) && fastStart && (moovSize != fastStartSize) &&
+            (-1 == ARMEDIA_VideoEncapsuler_WriteFreeAtomHeader (encaps->dataFile, (uint32_t)(fastStartSize - moovSize))))
+        {
+            ENCAPSULER_ERROR ("Error while writing the free atom after moovAtom");
+            localError = ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+        }
         fflush(encaps->dataFile);
+        // Release the preallocated space after the moov atom (or after the data in fast start)
+        if ((0 != encaps->preallocatedEnd) &&
+            (0 != ftruncate (fileno (encaps->dataFile), fastStart ? dataEnd : ftello (encaps->dataFile))))
+        {
+            ENCAPSULER_ERROR ("Unable to release the preallocated space");
+        }
+        if (0 != fastStartSize)
+        {
+            ENCAPSULER_DEBUG ("moov atom (%" PRIu64 " bytes) written %s", moovSize,
+                              fastStart ? "before the mdat atom" : "at the end of the file, the reserved space is too small");
+            if ((ARMEDIA_OK == localError) && (NULL != encaps->fastStartCallback))
+            {
+                encaps->fastStartCallback (encaps->dataFilePath, (uint8_t)fastStart, (uint32_t)moovSize, encaps->fastStartUserData);
+            }
+        }
         fsync(fileno(encaps->dataFile));
+        ARMEDIA_VideoEncapsuler_SetFinishProgress (encaps, ENCAPSULER_FINISH_PROGRESS_MOOV);
     }
 
-    if (ARMEDIA_OK == localError)
+    if ((ARMEDIA_OK == localError) && !encaps->fragmented && (NULL == encaps->tsMuxer))
     {
         off_t mdatsize = video->totalsize + 8;
         if (encaps->got_audio) mdatsize += audio->totalsize;
@@ -2236,16 +5493,17 @@ eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_Finish (ARMEDIA_VideoEncapsuler_t **encap
         }
         fflush(encaps->dataFile);
         fsync(fileno(encaps->dataFile));
+        ARMEDIA_VideoEncapsuler_SetFinishProgress (encaps, ENCAPSULER_FINISH_PROGRESS_MDAT);
     }
 
     /* pvat insertion at the benning of the file */
-    if (ARMEDIA_OK == localError)
+    if ((ARMEDIA_OK == localError) && (NULL == encaps->tsMuxer))
     {
         char* pvatstr = ARMEDIA_VideoAtom_GetPVATString(encaps->product, encaps->uuid, encaps->runDate, encaps->dataFilePath, nowTm);
         if (pvatstr != NULL) {
             size_t len = strlen(pvatstr);
             movie_atom_t *pvatAtom = pvatAtomGen(pvatstr);
-            fseeko(encaps->dataFile, encaps->mdatAtomOffset - (ARMEDIA_JSON_DESCRIPTION_MAXLENGTH+8), SEEK_SET);
+            fseeko(encaps->dataFile, pvatOffset, SEEK_SET);
             if (-1 == writeAtomToFile (&pvatAtom, encaps->dataFile))
             {
                 ENCAPSULER_ERROR ("Error while writing pvatAtom");
@@ -2275,20 +5533,197 @@ eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_Finish (ARMEDIA_VideoEncapsuler_t **encap
         fsync(fileno(encaps->dataFile));
     }
 
-    bool rename_tempFile = (ARMEDIA_OK == localError);
-    ENCAPSULER_CLEANUP(free, frameSizeBufferNE);
-    ENCAPSULER_CLEANUP(free, videoOffsetBuffer);
-    ENCAPSULER_CLEANUP(free, frameTimeSyncBuffer);
-    ENCAPSULER_CLEANUP(free, metadataTimeSyncBuffer);
-    ENCAPSULER_CLEANUP(free, iFrameIndexBuffer);
-    ENCAPSULER_CLEANUP(free, metadataOffsetBuffer);
-    ENCAPSULER_CLEANUP(free, audioOffsetBuffer);
-    ENCAPSULER_CLEANUP(free, audioStscBuffer);
+    // A fragmented media or a transport stream is kept: it is valid up to its last fragment or packet
+    bool rename_tempFile = (ARMEDIA_OK == localError) ||
+        ((NULL != encaps) && ((0 != encaps->fragmentCount) ||
+                              ((NULL != encaps->tsMuxer) && (0 != ARMEDIA_TsMuxer_GetSize (encaps->tsMuxer)))));
     ARMEDIA_VideoEncapsuler_Cleanup (encapsuler, rename_tempFile);
 
     return localError;
 }
 
+// Encapsulers queued by ARMEDIA_VideoEncapsuler_FinishAsync()
+typedef struct ARMEDIA_VideoEncapsuler_FinishJob_t
+{
+    ARMEDIA_VideoEncapsuler_t *encapsuler;
+    ARMEDIA_VideoEncapsuler_FinishProgressCallback_t progressCallback;
+    ARMEDIA_VideoEncapsuler_FinishCallback_t finishCallback;
+    void *userData;
+    struct ARMEDIA_VideoEncapsuler_FinishJob_t *next;
+} ARMEDIA_VideoEncapsuler_FinishJob_t;
+
+// Library-owned worker finishing the queued encapsulers one after the other.
+// The thread exits when the queue is empty and is joined when it is restarted.
+static struct
+{
+    pthread_once_t once;
+    ARSAL_Mutex_t mutex;
+    ARSAL_Cond_t cond; // signaled when a job is done and when the thread returns
+    ARSAL_Thread_t thread;
+    uint8_t threadCreated; // thread not joined yet
+    uint8_t running; // thread still reading the queue
+    uint32_t pendingCount; // jobs queued or running
+    ARMEDIA_VideoEncapsuler_FinishJob_t *head;
+    ARMEDIA_VideoEncapsuler_FinishJob_t *tail;
+} ARMEDIA_VideoEncapsuler_FinishWorker = { .once = PTHREAD_ONCE_INIT };
+
+static void ARMEDIA_VideoEncapsuler_FinishWorkerInit (void)
+{
+    ARSAL_Mutex_Init (&ARMEDIA_VideoEncapsuler_FinishWorker.mutex);
+    ARSAL_Cond_Init (&ARMEDIA_VideoEncapsuler_FinishWorker.cond);
+}
+
+static void* ARMEDIA_VideoEncapsuler_FinishWorkerRun (void *arg)
+{
+    ARMEDIA_VideoEncapsuler_FinishJob_t *job;
+    char mediaPath[ARMEDIA_ENCAPSULER_VIDEO_PATH_SIZE];
+    eARMEDIA_ERROR error;
+
+    (void)arg; // the jobs are taken from the queue
+
+    ARSAL_Mutex_Lock (&ARMEDIA_VideoEncapsuler_FinishWorker.mutex);
+    while (NULL != ARMEDIA_VideoEncapsuler_FinishWorker.head)
+    {
+        job = ARMEDIA_VideoEncapsuler_FinishWorker.head;
+        ARMEDIA_VideoEncapsuler_FinishWorker.head = job->next;
+        if (NULL == ARMEDIA_VideoEncapsuler_FinishWorker.head)
+        {
+            ARMEDIA_VideoEncapsuler_FinishWorker.tail = NULL;
+        }
+        ARSAL_Mutex_Unlock (&ARMEDIA_VideoEncapsuler_FinishWorker.mutex);
+
+        // The encapsuler is freed by the finish
+        snprintf (mediaPath, sizeof (mediaPath), "%s", job->encapsuler->dataFilePath);
+        error = ARMEDIA_VideoEncapsuler_Finish (&job->encapsuler);
+        if ((ARMEDIA_OK == error) && (NULL != job->progressCallback))
+        {
+            job->progressCallback (ENCAPSULER_FINISH_PROGRESS_DONE, job->userData);
+        }
+        if (NULL != job->finishCallback)
+        {
+            job->finishCallback (mediaPath, error, job->userData);
+        }
+        free (job);
+
+        ARSAL_Mutex_Lock (&ARMEDIA_VideoEncapsuler_FinishWorker.mutex);
+        ARMEDIA_VideoEncapsuler_FinishWorker.pendingCount--;
+        ARSAL_Cond_Broadcast (&ARMEDIA_VideoEncapsuler_FinishWorker.cond);
+    }
+    ARMEDIA_VideoEncapsuler_FinishWorker.running = 0;
+    ARSAL_Cond_Broadcast (&ARMEDIA_VideoEncapsuler_FinishWorker.cond);
+    ARSAL_Mutex_Unlock (&ARMEDIA_VideoEncapsuler_FinishWorker.mutex);
+
+    return NULL;
+}
+
+eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_FinishAsync (ARMEDIA_VideoEncapsuler_t **encapsuler,
+                                                    ARMEDIA_VideoEncapsuler_FinishProgressCallback_t progressCallback,
+                                                    ARMEDIA_VideoEncapsuler_FinishCallback_t finishCallback,
+                                                    void *userData)
+{
+    ARMEDIA_VideoEncapsuler_FinishJob_t *job;
+    eARMEDIA_ERROR error = ARMEDIA_OK;
+
+    if (NULL == encapsuler)
+    {
+        ENCAPSULER_ERROR ("encapsuler double pointer must not be null");
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
+    if (NULL == *encapsuler)
+    {
+        ENCAPSULER_ERROR ("encapsuler pointer must not be null");
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
+    if (NULL != (*encapsuler)->segmentation)
+    {
+        // Queued before the last segment
+        ARMEDIA_VideoEncapsuler_FinishPreviousSegment ((*encapsuler)->segmentation);
+    }
+
+    job = (ARMEDIA_VideoEncapsuler_FinishJob_t*) calloc (1, sizeof (ARMEDIA_VideoEncapsuler_FinishJob_t));
+    if (NULL == job)
+    {
+        ENCAPSULER_ERROR ("Unable to allocate the finish job");
+        return ARMEDIA_ERROR_ENCAPSULER;
+    }
+    job->encapsuler = *encapsuler;
+    job->progressCallback = progressCallback;
+    job->finishCallback = finishCallback;
+    job->userData = userData;
+
+    pthread_once (&ARMEDIA_VideoEncapsuler_FinishWorker.once, ARMEDIA_VideoEncapsuler_FinishWorkerInit);
+
+    ARSAL_Mutex_Lock (&ARMEDIA_VideoEncapsuler_FinishWorker.mutex);
+    if (!ARMEDIA_VideoEncapsuler_FinishWorker.running)
+    {
+        if (ARMEDIA_VideoEncapsuler_FinishWorker.threadCreated)
+        {
+            // The previous worker has emptied the queue and is returning
+            ARSAL_Thread_Join (ARMEDIA_VideoEncapsuler_FinishWorker.thread, NULL);
+            ARSAL_Thread_Destroy (&ARMEDIA_VideoEncapsuler_FinishWorker.thread);
+            ARMEDIA_VideoEncapsuler_FinishWorker.threadCreated = 0;
+        }
+        if (0 != ARSAL_Thread_Create (&ARMEDIA_VideoEncapsuler_FinishWorker.thread, ARMEDIA_VideoEncapsuler_FinishWorkerRun, NULL))
+        {
+            ENCAPSULER_ERROR ("Unable to create the finish thread");
+            error = ARMEDIA_ERROR_ENCAPSULER;
+        }
+        else
+        {
+            ARMEDIA_VideoEncapsuler_FinishWorker.threadCreated = 1;
+            ARMEDIA_VideoEncapsuler_FinishWorker.running = 1;
+        }
+    }
+    if (ARMEDIA_OK == error)
+    {
+        job->encapsuler->finishProgressCallback = progressCallback;
+        job->encapsuler->finishUserData = userData;
+        if (NULL != ARMEDIA_VideoEncapsuler_FinishWorker.tail)
+        {
+            ARMEDIA_VideoEncapsuler_FinishWorker.tail->next = job;
+        }
+        else
+        {
+            ARMEDIA_VideoEncapsuler_FinishWorker.head = job;
+        }
+        ARMEDIA_VideoEncapsuler_FinishWorker.tail = job;
+        ARMEDIA_VideoEncapsuler_FinishWorker.pendingCount++;
+        *encapsuler = NULL;
+    }
+    ARSAL_Mutex_Unlock (&ARMEDIA_VideoEncapsuler_FinishWorker.mutex);
+
+    if (ARMEDIA_OK != error)
+    {
+        // The encapsuler is left to the caller, which can still finish it synchronously
+        free (job);
+    }
+
+    return error;
+}
+
+void ARMEDIA_VideoEncapsuler_FinishAsyncWait (void)
+{
+    pthread_once (&ARMEDIA_VideoEncapsuler_FinishWorker.once, ARMEDIA_VideoEncapsuler_FinishWorkerInit);
+
+    ARSAL_Mutex_Lock (&ARMEDIA_VideoEncapsuler_FinishWorker.mutex);
+    while (0 != ARMEDIA_VideoEncapsuler_FinishWorker.pendingCount)
+    {
+        ARSAL_Cond_Wait (&ARMEDIA_VideoEncapsuler_FinishWorker.cond, &ARMEDIA_VideoEncapsuler_FinishWorker.mutex);
+    }
+    if (ARMEDIA_VideoEncapsuler_FinishWorker.threadCreated)
+    {
+        // Wait for the worker to return, so that no thread is left behind
+        while (ARMEDIA_VideoEncapsuler_FinishWorker.running)
+        {
+            ARSAL_Cond_Wait (&ARMEDIA_VideoEncapsuler_FinishWorker.cond, &ARMEDIA_VideoEncapsuler_FinishWorker.mutex);
+        }
+        ARSAL_Thread_Join (ARMEDIA_VideoEncapsuler_FinishWorker.thread, NULL);
+        ARSAL_Thread_Destroy (&ARMEDIA_VideoEncapsuler_FinishWorker.thread);
+        ARMEDIA_VideoEncapsuler_FinishWorker.threadCreated = 0;
+    }
+    ARSAL_Mutex_Unlock (&ARMEDIA_VideoEncapsuler_FinishWorker.mutex);
+}
+
 /**
  * Abort a video recording
  * This will delete all created files
@@ -2297,6 +5732,7 @@ eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_Finish (ARMEDIA_VideoEncapsuler_t **encap
 eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_Cleanup (ARMEDIA_VideoEncapsuler_t **encapsuler, bool rename_tempFile)
 {
     ARMEDIA_VideoEncapsuler_t* encaps = NULL;
+    uint32_t i;
 
     if (NULL == encapsuler)
     {
@@ -2310,7 +5746,27 @@ eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_Cleanup (ARMEDIA_VideoEncapsuler_t **enca
     } else {
         encaps = *encapsuler;
     }
-
+
+    if (NULL != encaps->writer)
+    {
+        if (rename_tempFile)
+        {
+            // Keep the pending chunks for a later recovery
+            ARMEDIA_VideoEncapsuler_WritePendingChunks (encaps);
+        }
+        ARMEDIA_FileWriter_Delete (&encaps->writer);
+    }
+    ARMEDIA_TsMuxer_Delete (&encaps->tsMuxer);
+    if (NULL != encaps->segmentation)
+    {
+        ARMEDIA_VideoEncapsuler_FinishPreviousSegment (encaps->segmentation);
+        // The segment opened ahead was never recorded
+        if (NULL != encaps->segmentation->next)
+        {
+            ARMEDIA_VideoEncapsuler_Cleanup (&encaps->segmentation->next, false);
+        }
+        ENCAPSULER_CLEANUP(free, encaps->segmentation);
+    }
     ENCAPSULER_CLEANUP(fclose, encaps->dataFile);
     ENCAPSULER_CLEANUP(fclose, encaps->metaFile);
     remove (encaps->metaFilePath);
@@ -2333,6 +5789,24 @@ eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_Cleanup (ARMEDIA_VideoEncapsuler_t **enca
 
     ENCAPSULER_CLEANUP(free, encaps->video->sps);
     ENCAPSULER_CLEANUP(free, encaps->video->pps);
+    ARMEDIA_SampleTable_Clear (&encaps->videoTable);
+    ARMEDIA_SampleTable_Clear (&encaps->audioTable);
+    ARMEDIA_SampleTable_Clear (&encaps->metadataTable);
+    ENCAPSULER_CLEANUP(free, encaps->nalus);
+    ENCAPSULER_CLEANUP(free, encaps->reserveBuffer);
+    ENCAPSULER_CLEANUP(free, encaps->fragmentBuffer);
+    ENCAPSULER_CLEANUP(free, encaps->tsIov);
+    ENCAPSULER_CLEANUP(free, encaps->checkpointBuffer);
+    for (i = 0; i < ENCAPSULER_CHUNK_MAX; i++)
+    {
+        ENCAPSULER_CLEANUP(free, encaps->chunks[i].data);
+        ENCAPSULER_CLEANUP(free, encaps->chunks[i].records);
+    }
+    ARMEDIA_AtomTree_Delete (&encaps->udtaAtom);
+    ARMEDIA_AtomTree_Delete (&encaps->metaAtom);
+    ARMEDIA_AtomTree_Delete (&encaps->videoTrack.trak);
+    ARMEDIA_AtomTree_Delete (&encaps->metadataTrack.trak);
+    ARMEDIA_AtomTree_Delete (&encaps->audioTrack.trak);
 
     ENCAPSULER_CLEANUP(free, encaps->audio);
     ENCAPSULER_CLEANUP(free, encaps->video);
@@ -2355,159 +5829,417 @@ void ARMEDIA_VideoEncapsuler_SetGPSInfos (ARMEDIA_VideoEncapsuler_t* encapsuler,
     }
 }
 
-int ARMEDIA_VideoEncapsuler_TryFixMediaFile (const char *metaFilePath)
+/* Rewrite a version 5 info file (raw descriptor and ASCII frame infos)
+ * in the binary format, so that it can be recovered like a recent one */
+static int ARMEDIA_VideoEncapsuler_ConvertLegacyMetaFile (const char *metaFilePath)
 {
-    // Local values
+    ARMEDIA_VideoEncapsuler_v5_t legacy;
     ARMEDIA_VideoEncapsuler_t *encapsuler = NULL;
     ARMEDIA_Video_t *video = NULL;
     ARMEDIA_Audio_t *audio = NULL;
     ARMEDIA_Metadata_t *metadata = NULL;
-    FILE *metaFile = NULL;
-    int ret = 1;
-    uint32_t frameNumber = 0;
-    uint32_t sampleNumber = 0;
-    uint32_t frameTNumber = 0;
-    off_t dataSize = 0;
-    off_t tmpvidSize = 0;
+    FILE *legacyFile = NULL;
+    char newFilePath[ARMEDIA_ENCAPSULER_VIDEO_PATH_SIZE + 4];
     uint32_t descriptorSize = 0;
-    off_t vsize = 0;
-    off_t asize = 0;
-    off_t tsize = 0;
-    uint32_t stscEntries = 0;
-    int endOfSearch = 0;
-    off_t fSize = 0;
+    uint8_t recordData[ARMEDIA_SIDECAR_RECORD_SIZE];
+    ARMEDIA_Sidecar_Record_t record;
     long long fSize_tmp = 0;
     uint32_t interDT = 0;
     char fType = '\0';
     char dataType = '\0';
-    off_t prevInfoIndex = 0;
-    off_t prevSize = 0;
+    int ret = 1;
 
-    // Open file for reading
-    metaFile = fopen(metaFilePath, "r+b");
-    if (NULL == metaFile)
+    snprintf (newFilePath, sizeof (newFilePath), "%s.new", metaFilePath);
+
+    legacyFile = fopen (metaFilePath, "rb");
+    encapsuler = (ARMEDIA_VideoEncapsuler_t*) calloc (1, sizeof (ARMEDIA_VideoEncapsuler_t));
+    video = (ARMEDIA_Video_t*) calloc (1, sizeof (ARMEDIA_Video_t));
+    audio = (ARMEDIA_Audio_t*) calloc (1, sizeof (ARMEDIA_Audio_t));
+    metadata = (ARMEDIA_Metadata_t*) calloc (1, sizeof (ARMEDIA_Metadata_t));
+    if (NULL == legacyFile || NULL == encapsuler || NULL == video || NULL == audio || NULL == metadata)
     {
+        ENCAPSULER_DEBUG ("Unable to open legacy metaFile");
         ret = 0;
-        ENCAPSULER_DEBUG ("Unable to open metaFile");
         goto cleanup;
     }
 
-    // Read size from info descriptor
-    if (1 != fread (&descriptorSize, sizeof (uint32_t), 1, metaFile))
+    if ((1 != fread (&descriptorSize, sizeof (uint32_t), 1, legacyFile)) ||
+        (descriptorSize < sizeof (ARMEDIA_VideoEncapsuler_v5_t) + sizeof (ARMEDIA_Video_t) + sizeof (ARMEDIA_Audio_t) + sizeof (ARMEDIA_Metadata_t)) ||
+        (1 != fread (&legacy, sizeof (ARMEDIA_VideoEncapsuler_v5_t), 1, legacyFile)))
     {
+        ENCAPSULER_DEBUG ("Unable to read legacy descriptor");
         ret = 0;
-        ENCAPSULER_DEBUG ("Unable to read descriptorSize");
         goto cleanup;
     }
-    else if (descriptorSize < sizeof(ARMEDIA_VideoEncapsuler_t) + sizeof(ARMEDIA_Video_t) + sizeof(ARMEDIA_Audio_t) + sizeof(ARMEDIA_Metadata_t))
+    if (ARMEDIA_ENCAPSULER_LEGACY_VERSION_NUMBER != legacy.version)
     {
+        ENCAPSULER_DEBUG ("Encapsuler version number differ\n");
         ret = 0;
-        ENCAPSULER_DEBUG ("Descriptor size (%d) is not the right size supported by this software\n", descriptorSize);
         goto cleanup;
     }
 
-    // Alloc local video pointer
-    encapsuler = (ARMEDIA_VideoEncapsuler_t*) calloc(1, sizeof(ARMEDIA_VideoEncapsuler_t));
-    video = (ARMEDIA_Video_t*) calloc(1, sizeof(ARMEDIA_Video_t));
-    audio = (ARMEDIA_Audio_t*) calloc(1, sizeof(ARMEDIA_Audio_t));
-    metadata = (ARMEDIA_Metadata_t*) calloc(1, sizeof(ARMEDIA_Metadata_t));
-    if (NULL == video || NULL == audio || NULL == metadata || NULL == encapsuler)
+    if (1 != fread (video, sizeof (ARMEDIA_Video_t), 1, legacyFile))
     {
+        ENCAPSULER_DEBUG ("Unable to read ARMEDIA_Video_t from metaFile\n");
         ret = 0;
-        ENCAPSULER_DEBUG ("Unable to alloc structures pointers\n");
         goto cleanup;
     }
-
-    // Read encapsuler
-    if (1 != fread (encapsuler, sizeof (ARMEDIA_VideoEncapsuler_t), 1, metaFile))
+    video->sps = NULL;
+    video->pps = NULL;
+    if (video->codec == CODEC_MPEG4_AVC)
+    {
+        video->sps = (uint8_t*) malloc (video->spsSize);
+        video->pps = (uint8_t*) malloc (video->ppsSize);
+        if ((0 == video->spsSize) || (0 == video->ppsSize) ||
+            (NULL == video->sps) || (NULL == video->pps) ||
+            (1 != fread (video->sps, video->spsSize, 1, legacyFile)) ||
+            (1 != fread (video->pps, video->ppsSize, 1, legacyFile)))
+        {
+            ENCAPSULER_DEBUG ("Unable to read video SPS/PPS");
+            ret = 0;
+            goto cleanup;
+        }
+    }
+    if ((1 != fread (metadata, sizeof (ARMEDIA_Metadata_t), 1, legacyFile)) ||
+        (1 != fread (audio, sizeof (ARMEDIA_Audio_t), 1, legacyFile)))
     {
+        ENCAPSULER_DEBUG ("Unable to read ARMEDIA_Metadata_t/ARMEDIA_Audio_t from metaFile\n");
         ret = 0;
-        ENCAPSULER_DEBUG ("Unable to read ARMEDIA_VideoEncapsuler_t from metaFile\n");
         goto cleanup;
     }
-    else
+
+    encapsuler->version = ARMEDIA_ENCAPSULER_VERSION_NUMBER;
+    encapsuler->timescale = legacy.timescale;
+    encapsuler->got_audio = legacy.got_audio;
+    encapsuler->got_metadata = (metadata->block_size > 0);
+    encapsuler->video = video;
+    encapsuler->audio = audio;
+    encapsuler->metadata = metadata;
+    encapsuler->creationTime = legacy.creationTime;
+    encapsuler->untimed_metadata = legacy.untimed_metadata;
+    encapsuler->got_untimed_metadata = legacy.got_untimed_metadata;
+    memcpy (encapsuler->thumbnailFilePath, legacy.thumbnailFilePath, sizeof (encapsuler->thumbnailFilePath));
+    encapsuler->mdatAtomOffset = legacy.mdatAtomOffset;
+    encapsuler->dataOffset = legacy.dataOffset;
+    memcpy (encapsuler->uuid, legacy.uuid, sizeof (encapsuler->uuid));
+    memcpy (encapsuler->runDate, legacy.runDate, sizeof (encapsuler->runDate));
+    encapsuler->product = legacy.product;
+    memcpy (encapsuler->dataFilePath, legacy.dataFilePath, sizeof (encapsuler->dataFilePath));
+    memcpy (encapsuler->tempFilePath, legacy.tempFilePath, sizeof (encapsuler->tempFilePath));
+    encapsuler->sidecarFlags = ARMEDIA_SIDECAR_FLAG_RECORD_CRC;
+
+    encapsuler->metaFile = fopen (newFilePath, "wb");
+    if (NULL == encapsuler->metaFile)
     {
-        encapsuler->metaFile = metaFile;
-        encapsuler->dataFile = NULL;
-        encapsuler->video = video;
-        encapsuler->audio = audio;
-        encapsuler->metadata = metadata;
+        ENCAPSULER_DEBUG ("Unable to open %s", newFilePath);
+        ret = 0;
+        goto cleanup;
     }
-
-    if (ARMEDIA_ENCAPSULER_VERSION_NUMBER != encapsuler->version)
+    if (ARMEDIA_OK != ARMEDIA_VideoEncapsuler_WriteSidecarHeader (encapsuler))
     {
         ret = 0;
-        ENCAPSULER_DEBUG ("Encapsuler version number differ\n");
         goto cleanup;
     }
 
-    // Read video
-    if (1 != fread (video, sizeof (ARMEDIA_Video_t), 1, metaFile))
+    // Convert the frame infos, the recovery will drop the incomplete ones
+    while (ARMEDIA_ENCAPSULER_NUM_MATCH_PATTERN ==
+           fscanf (legacyFile, ARMEDIA_ENCAPSULER_INFO_PATTERN, &dataType, &fSize_tmp, &fType, &interDT))
     {
+        record.type = dataType;
+        record.flags = ('i' == fType) ? ARMEDIA_SIDECAR_RECORD_FLAG_SYNC : 0;
+        record.size = (uint32_t)fSize_tmp;
+        record.duration = interDT;
+        ARMEDIA_Sidecar_EncodeRecord (recordData, &record, 1);
+        if (1 != fwrite (recordData, sizeof (recordData), 1, encapsuler->metaFile))
+        {
+            ENCAPSULER_DEBUG ("Unable to write %s", newFilePath);
+            ret = 0;
+            goto cleanup;
+        }
+    }
+
+    if (0 != fclose (encapsuler->metaFile))
+    {
+        encapsuler->metaFile = NULL;
         ret = 0;
-        ENCAPSULER_DEBUG ("Unable to read ARMEDIA_Video_t from metaFile\n");
         goto cleanup;
     }
-    else
+    encapsuler->metaFile = NULL;
+    if (0 != rename (newFilePath, metaFilePath))
+    {
+        ENCAPSULER_DEBUG ("Unable to replace %s", metaFilePath);
+        ret = 0;
+    }
+
+cleanup:
+    if (NULL != encapsuler)
+    {
+        ENCAPSULER_CLEANUP (fclose, encapsuler->metaFile);
+    }
+    if (!ret)
+    {
+        remove (newFilePath);
+    }
+    ENCAPSULER_CLEANUP (fclose, legacyFile);
+    if (NULL != video)
+    {
+        ENCAPSULER_CLEANUP (free, video->sps);
+        ENCAPSULER_CLEANUP (free, video->pps);
+    }
+    ENCAPSULER_CLEANUP (free, audio);
+    ENCAPSULER_CLEANUP (free, video);
+    ENCAPSULER_CLEANUP (free, metadata);
+    ENCAPSULER_CLEANUP (free, encapsuler);
+
+    return ret;
+}
+
+/* Load the sample tables from the checkpoints of an infos file, up to the last one
+   whose samples are all in the data file; returns the index of the first record to
+   replay after it, 0 if no checkpoint can be used */
+static uint32_t ARMEDIA_VideoEncapsuler_LoadCheckpoints (ARMEDIA_VideoEncapsuler_t *encapsuler, const ARMEDIA_Sidecar_Map_t *map, off_t dataSize)
+{
+    ARMEDIA_SampleTable_State_t states[ENCAPSULER_CHUNK_MAX];
+    ARMEDIA_SampleTable_State_t current;
+    uint32_t deltaSizes[ENCAPSULER_CHUNK_MAX];
+    const uint8_t *deltas[ENCAPSULER_CHUNK_MAX];
+    ARMEDIA_Sidecar_Stream_t stream;
+    const uint8_t *payload;
+    uint32_t payloadSize, previous, records;
+    uint32_t *chain = NULL;
+    uint32_t chainCount = 0;
+    uint32_t chainCapacity = 0;
+    uint32_t index;
+    uint32_t next = 0;
+    uint64_t end;
+    int i;
+
+    if (!ARMEDIA_Sidecar_FindLastCheckpoint (map, &index))
     {
-        video->sps = NULL;
-        video->pps = NULL;
+        return 0;
     }
 
-    // Allocate / copy SPS/PPS pointers
-    if(video->codec == CODEC_MPEG4_AVC) {
-        if (0 != video->spsSize && 0 != video->ppsSize)
+    // Each checkpoint only holds the entries added since the previous one: walk back to the first one
+    do
+    {
+        records = ARMEDIA_Sidecar_DecodeCheckpoint (map->records + (size_t)index * ARMEDIA_SIDECAR_RECORD_SIZE, map->count - index,
+                                                    &payload, &payloadSize, &previous);
+        if ((0 == records) || (previous > index))
         {
-            video->sps = (uint8_t*) malloc (video->spsSize);
-            video->pps = (uint8_t*) malloc (video->ppsSize);
-            if (NULL == video->sps ||
-                    NULL == video->pps)
+            ENCAPSULER_DEBUG ("Broken checkpoint chain at info #%u", index);
+            chainCount = 0;
+            break;
+        }
+        if (chainCount == chainCapacity)
+        {
+            uint32_t capacity = (0 == chainCapacity) ? 64 : 2 * chainCapacity;
+            uint32_t *newChain = realloc (chain, capacity * sizeof (*newChain));
+            if (NULL == newChain)
             {
-                ret = 0;
-                ENCAPSULER_DEBUG ("Unable to allocate video sps/pps");
-                free (video->sps);
-                free (video->pps);
-                video->sps = NULL;
-                video->pps = NULL;
-                goto cleanup;
+                chainCount = 0;
+                break;
             }
-            else
+            chain = newChain;
+            chainCapacity = capacity;
+        }
+        chain[chainCount++] = index;
+        index -= previous;
+    } while (0 != previous);
+
+    while (0 != chainCount)
+    {
+        index = chain[--chainCount];
+        records = ARMEDIA_Sidecar_DecodeCheckpoint (map->records + (size_t)index * ARMEDIA_SIDECAR_RECORD_SIZE, map->count - index,
+                                                    &payload, &payloadSize, &previous);
+        memset (&stream, 0, sizeof (stream));
+        stream.buffer = (uint8_t *)payload;
+        stream.size = payloadSize;
+        stream.reading = 1;
+        end = encapsuler->dataOffset;
+        for (i = 0; (i < ENCAPSULER_CHUNK_MAX) && !stream.error; i++)
+        {
+            ARMEDIA_VideoEncapsuler_TransferCheckpointTable (&stream, &states[i], &deltaSizes[i]);
+            ARMEDIA_SampleTable_GetState (ARMEDIA_VideoEncapsuler_GetTable (encapsuler, (eENCAPSULER_CHUNK)i), &current);
+            if (stream.error || (deltaSizes[i] > stream.size - stream.pos) ||
+                (deltaSizes[i] != ARMEDIA_SampleTable_GetDeltaSize (&current, &states[i])))
             {
-                if (1 != fread (video->sps, video->spsSize, 1, encapsuler->metaFile))
-                {
-                    ENCAPSULER_DEBUG ("Unable to read video SPS");
-                    ret = 0;
-                    goto cleanup;
-                }
-                else if (1 != fread (video->pps, video->ppsSize, 1, encapsuler->metaFile))
-                {
-                    ENCAPSULER_DEBUG ("Unable to read video PPS");
-                    ret = 0;
-                    goto cleanup;
-                } // No else
+                stream.error = 1;
+                break;
             }
+            deltas[i] = payload + stream.pos;
+            stream.pos += deltaSizes[i];
+            end += states[i].totalSize;
         }
-        else
+        if (stream.error)
+        {
+            ENCAPSULER_DEBUG ("Checkpoint at info #%u does not follow the previous one", index);
+            break;
+        }
+        if (end > (uint64_t)dataSize)
+        {
+            // The infos are written before the data: replay from the previous checkpoint
+            break;
+        }
+        for (i = 0; i < ENCAPSULER_CHUNK_MAX; i++)
+        {
+            if (ARMEDIA_OK != ARMEDIA_SampleTable_AppendDelta (ARMEDIA_VideoEncapsuler_GetTable (encapsuler, (eENCAPSULER_CHUNK)i), &states[i], deltas[i]))
+            {
+                // The tables may be partly loaded: replay all the infos
+                ENCAPSULER_DEBUG ("Unable to load the checkpoint at info #%u", index);
+                ARMEDIA_SampleTable_Clear (&encapsuler->videoTable);
+                ARMEDIA_SampleTable_Clear (&encapsuler->audioTable);
+                ARMEDIA_SampleTable_Clear (&encapsuler->metadataTable);
+                next = 0;
+                chainCount = 0;
+                break;
+            }
+        }
+        if (i == ENCAPSULER_CHUNK_MAX)
+        {
+            next = index + records;
+        }
+    }
+    free (chain);
+
+    return next;
+}
+
+/*
+ * Fix the recording of an infos file, building its moov tables on at most
+ * finishThreadCount threads (0 for the default).
+ */
+static int ARMEDIA_VideoEncapsuler_TryFix (const char *metaFilePath, uint32_t finishThreadCount)
+{
+    // Local values
+    ARMEDIA_VideoEncapsuler_t *encapsuler = NULL;
+    ARMEDIA_Video_t *video = NULL;
+    ARMEDIA_Audio_t *audio = NULL;
+    ARMEDIA_Metadata_t *metadata = NULL;
+    FILE *metaFile = NULL;
+    int ret = 1;
+    off_t dataSize = 0;
+    off_t tmpvidSize = 0;
+    off_t vsize = 0;
+    off_t asize = 0;
+    off_t tsize = 0;
+    off_t fSize = 0;
+    uint8_t prefixData[ARMEDIA_SIDECAR_PREFIX_SIZE];
+    ARMEDIA_Sidecar_Prefix_t prefix;
+    ARMEDIA_Sidecar_Stream_t stream;
+    ARMEDIA_Sidecar_Map_t sidecarMap;
+    ARMEDIA_Sidecar_Record_t record;
+    ARMEDIA_SampleTable_Entry_t entry;
+    eARMEDIA_ERROR tableError;
+    uint8_t *header = NULL;
+    uint32_t recordCount = 0;
+    const uint8_t *recordData;
+    const uint8_t *payload;
+    uint32_t payloadSize, previous, checkpointRecords;
+
+    memset (&sidecarMap, 0, sizeof (sidecarMap));
+
+    // Open file for reading
+    metaFile = fopen(metaFilePath, "r+b");
+    if (NULL == metaFile)
+    {
+        ret = 0;
+        ENCAPSULER_DEBUG ("Unable to open metaFile");
+        goto cleanup;
+    }
+
+    // Read the header prefix
+    if (1 != fread (prefixData, sizeof (prefixData), 1, metaFile))
+    {
+        ret = 0;
+        ENCAPSULER_DEBUG ("Unable to read the descriptor");
+        goto cleanup;
+    }
+    if (!ARMEDIA_Sidecar_DecodePrefix (prefixData, &prefix))
+    {
+        // Info file written by an older version
+        fclose (metaFile);
+        metaFile = NULL;
+        if (!ARMEDIA_VideoEncapsuler_ConvertLegacyMetaFile (metaFilePath))
         {
-            ENCAPSULER_DEBUG ("Video SPS/PPS sizes are bad");
             ret = 0;
             goto cleanup;
         }
+        metaFile = fopen(metaFilePath, "r+b");
+        if ((NULL == metaFile) ||
+            (1 != fread (prefixData, sizeof (prefixData), 1, metaFile)) ||
+            (!ARMEDIA_Sidecar_DecodePrefix (prefixData, &prefix)))
+        {
+            ret = 0;
+            ENCAPSULER_DEBUG ("Unable to read the converted descriptor");
+            goto cleanup;
+        }
     }
-
-    // Read metadata
-    if (1 != fread (metadata, sizeof (ARMEDIA_Metadata_t), 1, metaFile))
+    if (ARMEDIA_ENCAPSULER_VERSION_NUMBER != prefix.version)
+    {
+        ret = 0;
+        ENCAPSULER_DEBUG ("Encapsuler version number differ\n");
+        goto cleanup;
+    }
+    if ((ARMEDIA_SIDECAR_RECORD_SIZE != prefix.recordSize) ||
+        (prefix.headerSize <= ARMEDIA_SIDECAR_PREFIX_SIZE + ARMEDIA_SIDECAR_AUDIO_SIZE))
     {
         ret = 0;
-        ENCAPSULER_DEBUG ("Unable to read ARMEDIA_Metadata_t from metaFile\n");
+        ENCAPSULER_DEBUG ("Descriptor size (%u) is not the right size supported by this software\n", prefix.headerSize);
         goto cleanup;
     }
 
-    // Read audio
-    if (1 != fread (audio, sizeof (ARMEDIA_Audio_t), 1, metaFile))
+    // Alloc local video pointer
+    encapsuler = (ARMEDIA_VideoEncapsuler_t*) calloc(1, sizeof(ARMEDIA_VideoEncapsuler_t));
+    video = (ARMEDIA_Video_t*) calloc(1, sizeof(ARMEDIA_Video_t));
+    audio = (ARMEDIA_Audio_t*) calloc(1, sizeof(ARMEDIA_Audio_t));
+    metadata = (ARMEDIA_Metadata_t*) calloc(1, sizeof(ARMEDIA_Metadata_t));
+    header = (uint8_t*) malloc (prefix.headerSize);
+    if (NULL == video || NULL == audio || NULL == metadata || NULL == encapsuler || NULL == header)
+    {
+        ret = 0;
+        ENCAPSULER_DEBUG ("Unable to alloc structures pointers\n");
+        goto cleanup;
+    }
+    encapsuler->version = ARMEDIA_ENCAPSULER_VERSION_NUMBER;
+    encapsuler->got_iframe = 1;
+    encapsuler->metaFile = metaFile;
+    encapsuler->video = video;
+    encapsuler->audio = audio;
+    encapsuler->metadata = metadata;
+    encapsuler->sidecarHeaderSize = prefix.headerSize;
+    encapsuler->sidecarFlags = prefix.flags;
+    encapsuler->finishMemoryLimit = ARMEDIA_ENCAPSULER_DEFAULT_FINISH_MEMORY_LIMIT;
+    encapsuler->finishThreadCount = finishThreadCount;
+    snprintf (encapsuler->metaFilePath, ARMEDIA_ENCAPSULER_VIDEO_PATH_SIZE, "%s", metaFilePath);
+
+    // Read the descriptors
+    fseeko (metaFile, 0, SEEK_SET);
+    if (1 != fread (header, prefix.headerSize, 1, metaFile))
+    {
+        ret = 0;
+        ENCAPSULER_DEBUG ("Unable to read the descriptor from metaFile\n");
+        goto cleanup;
+    }
+    memset (&stream, 0, sizeof (stream));
+    stream.buffer = header + ARMEDIA_SIDECAR_AUDIO_OFFSET;
+    stream.size = ARMEDIA_SIDECAR_AUDIO_SIZE;
+    stream.reading = 1;
+    ARMEDIA_VideoEncapsuler_TransferAudioDescriptor (encapsuler, &stream);
+
+    memset (&stream, 0, sizeof (stream));
+    stream.buffer = header + ARMEDIA_SIDECAR_PREFIX_SIZE + ARMEDIA_SIDECAR_AUDIO_SIZE;
+    stream.size = prefix.headerSize - ARMEDIA_SIDECAR_PREFIX_SIZE - ARMEDIA_SIDECAR_AUDIO_SIZE;
+    stream.reading = 1;
+    if (ARMEDIA_OK != ARMEDIA_VideoEncapsuler_TransferDescriptor (encapsuler, &stream))
     {
         ret = 0;
-        ENCAPSULER_DEBUG ("Unable to read ARMEDIA_Audio_t from metaFile\n");
+        ENCAPSULER_DEBUG ("Unable to decode the descriptor\n");
+        goto cleanup;
+    }
+    if ((video->codec == CODEC_MPEG4_AVC) && ((0 == video->spsSize) || (0 == video->ppsSize)))
+    {
+        ENCAPSULER_DEBUG ("Video SPS/PPS sizes are bad");
+        ret = 0;
         goto cleanup;
     }
 
@@ -2524,48 +6256,86 @@ int ARMEDIA_VideoEncapsuler_TryFixMediaFile (const char *metaFilePath)
     fseeko(encapsuler->dataFile, 0, SEEK_END);
     tmpvidSize = ftello(encapsuler->dataFile);
 
-    prevSize = 0;
-    while (!endOfSearch)
+    if (ARMEDIA_OK != ARMEDIA_Sidecar_Map (metaFile, prefix.headerSize, &sidecarMap))
+    {
+        ret = 0;
+        goto cleanup;
+    }
+
+    // Start from the last usable checkpoint, if any
+    if (prefix.flags & ARMEDIA_SIDECAR_FLAG_CHECKPOINTS)
+    {
+        recordCount = ARMEDIA_VideoEncapsuler_LoadCheckpoints (encapsuler, &sidecarMap, tmpvidSize);
+        ENCAPSULER_DEBUG ("Replaying the infos from #%u\n", recordCount);
+    }
+    vsize = (off_t)encapsuler->videoTable.totalSize;
+    asize = (off_t)encapsuler->audioTable.totalSize;
+    tsize = (off_t)encapsuler->metadataTable.totalSize;
+
+    for (; recordCount < sidecarMap.count; recordCount++)
     {
-        prevInfoIndex = ftello(encapsuler->metaFile);
-        if ((!feof (encapsuler->metaFile)) &&
-                ARMEDIA_ENCAPSULER_NUM_MATCH_PATTERN ==
-                fscanf (encapsuler->metaFile, ARMEDIA_ENCAPSULER_INFO_PATTERN, &dataType, &fSize_tmp, &fType, &interDT))
+        recordData = sidecarMap.records + (size_t)recordCount * ARMEDIA_SIDECAR_RECORD_SIZE;
+        if ((prefix.flags & ARMEDIA_SIDECAR_FLAG_CHECKPOINTS) && (ARMEDIA_SIDECAR_CHECKPOINT_TAG == (char)recordData[0]))
         {
-            fSize = fSize_tmp;
-            if ((asize + vsize + tsize + encapsuler->dataOffset + fSize) > tmpvidSize)
-            {
-                ENCAPSULER_DEBUG ("Too many infos : truncate at %zu\n", (size_t)prevInfoIndex);
-                fseeko(encapsuler->metaFile, 0, SEEK_SET);
-                if (0 != ftruncate (fileno (encapsuler->metaFile), prevInfoIndex))
-                {
-                    ENCAPSULER_DEBUG ("Unable to truncate metaFile");
-                    ret = 0;
-                    goto cleanup;
-                }
-                endOfSearch = 1;
-            }
-            else
+            // Checkpoint of the infos already replayed
+            checkpointRecords = ARMEDIA_Sidecar_DecodeCheckpoint (recordData, sidecarMap.count - recordCount, &payload, &payloadSize, &previous);
+            if (0 == checkpointRecords)
             {
-                if (dataType == ARMEDIA_ENCAPSULER_AUDIO_INFO_TAG) {
-                    asize += fSize;
-                    if (prevSize != fSize) {
-                        prevSize = fSize;
-                        stscEntries++;
-                    }
-                    sampleNumber++;
-                } else if (dataType == ARMEDIA_ENCAPSULER_VIDEO_INFO_TAG) {
-                    vsize += fSize;
-                    frameNumber++;
-                } else if (dataType == ARMEDIA_ENCAPSULER_METADATA_INFO_TAG) {
-                    tsize += fSize;
-                    frameTNumber++;
-                }
+                ENCAPSULER_DEBUG ("Corrupted checkpoint #%u\n", recordCount);
+                break;
             }
+            recordCount += checkpointRecords - 1;
+            continue;
         }
-        else
+
+        // Stop at the first torn record or at the first frame missing from the data file
+        if (!ARMEDIA_Sidecar_DecodeRecord (recordData, &record, prefix.flags & ARMEDIA_SIDECAR_FLAG_RECORD_CRC))
+        {
+            ENCAPSULER_DEBUG ("Corrupted info #%u\n", recordCount);
+            break;
+        }
+        fSize = record.size;
+        if ((asize + vsize + tsize + encapsuler->dataOffset + fSize) > tmpvidSize)
+        {
+            break;
+        }
+
+        // Rebuild the sample tables
+        entry.offset = encapsuler->dataOffset + asize + vsize + tsize;
+        entry.size = record.size;
+        entry.duration = record.duration;
+        entry.flags = ARMEDIA_VideoEncapsuler_GetEntryFlags (record.flags);
+        tableError = ARMEDIA_OK;
+
+        if (record.type == ARMEDIA_ENCAPSULER_AUDIO_INFO_TAG) {
+            tableError = ARMEDIA_SampleTable_Add (&encapsuler->audioTable, &entry);
+            asize += fSize;
+        } else if (record.type == ARMEDIA_ENCAPSULER_VIDEO_INFO_TAG) {
+            tableError = ARMEDIA_SampleTable_Add (&encapsuler->videoTable, &entry);
+            vsize += fSize;
+        } else if (record.type == ARMEDIA_ENCAPSULER_METADATA_INFO_TAG) {
+            tableError = ARMEDIA_SampleTable_Add (&encapsuler->metadataTable, &entry);
+            tsize += fSize;
+        }
+        if (ARMEDIA_OK != tableError)
+        {
+            ENCAPSULER_DEBUG ("Unable to grow the sample tables");
+            ret = 0;
+            goto cleanup;
+        }
+    }
+    ARMEDIA_Sidecar_Unmap (&sidecarMap);
+
+    // Remove the infos of the missing frames (and any partial record)
+    fseeko(metaFile, 0, SEEK_END);
+    if (ftello(metaFile) != (off_t)prefix.headerSize + (off_t)recordCount * ARMEDIA_SIDECAR_RECORD_SIZE)
+    {
+        ENCAPSULER_DEBUG ("Too many infos : truncate at %u records\n", recordCount);
+        if (0 != ftruncate (fileno (metaFile), (off_t)prefix.headerSize + (off_t)recordCount * ARMEDIA_SIDECAR_RECORD_SIZE))
         {
-            endOfSearch = 1;
+            ENCAPSULER_DEBUG ("Unable to truncate metaFile");
+            ret = 0;
+            goto cleanup;
         }
     }
 
@@ -2574,9 +6344,9 @@ int ARMEDIA_VideoEncapsuler_TryFixMediaFile (const char *metaFilePath)
     metadata->totalsize = tsize;
     dataSize = asize + vsize + tsize;
 
-    // If needed remove unused frames from .dat file
+    // Remove unused frames from .dat file, this also releases the preallocated space
     dataSize += encapsuler->dataOffset;
-    if (tmpvidSize > dataSize)
+    if (tmpvidSize >= dataSize)
     {
         if (0 != ftruncate (fileno (encapsuler->dataFile), dataSize))
         {
@@ -2588,10 +6358,10 @@ int ARMEDIA_VideoEncapsuler_TryFixMediaFile (const char *metaFilePath)
 
     fseeko(encapsuler->dataFile, 0, SEEK_END);
 
-    audio->sampleCount = sampleNumber;
-    video->framesCount = frameNumber;
-    metadata->framesCount = frameTNumber;
-    audio->stscEntries = stscEntries;
+    audio->sampleCount = encapsuler->audioTable.count;
+    video->framesCount = encapsuler->videoTable.count;
+    metadata->framesCount = encapsuler->metadataTable.count;
+    ENCAPSULER_CLEANUP (free, header);
     if (ARMEDIA_OK != ARMEDIA_VideoEncapsuler_Finish (&encapsuler))
     {
         ENCAPSULER_DEBUG ("Unable to finish video");
@@ -2603,10 +6373,13 @@ int ARMEDIA_VideoEncapsuler_TryFixMediaFile (const char *metaFilePath)
     goto no_cleanup;
 
 cleanup:
+    ARMEDIA_Sidecar_Unmap (&sidecarMap);
+    ENCAPSULER_CLEANUP (free, header);
     if (!ret)
     {
-        uint32_t pathLen;
-        char *tmpVidFilePath;
+        size_t pathLen;
+        size_t extLen = strlen (METAFILE_EXT);
+        char tempFilePath[ARMEDIA_ENCAPSULER_VIDEO_PATH_SIZE];
 
         if (NULL != video)
         {
@@ -2615,10 +6388,13 @@ cleanup:
             video->sps = NULL;
             ENCAPSULER_CLEANUP (free, video->pps);
             video->pps = NULL;
-            ENCAPSULER_CLEANUP (fclose, encapsuler->metaFile);
+        }
+        if (NULL != encapsuler)
+        {
             ENCAPSULER_CLEANUP (fclose, encapsuler->dataFile);
-            ENCAPSULER_CLEANUP (free ,video);
-            video = NULL;
+            ARMEDIA_SampleTable_Clear (&encapsuler->videoTable);
+            ARMEDIA_SampleTable_Clear (&encapsuler->audioTable);
+            ARMEDIA_SampleTable_Clear (&encapsuler->metadataTable);
         }
 
         if (NULL != metaFile)
@@ -2631,20 +6407,12 @@ cleanup:
         ENCAPSULER_DEBUG ("removing %s", metaFilePath);
         remove (metaFilePath);
         pathLen = strlen (metaFilePath);
-        tmpVidFilePath = (char*) malloc (pathLen + 1);
-
-        if (NULL != tmpVidFilePath)
-        {
-            strncpy (tmpVidFilePath, metaFilePath, pathLen);
-            tmpVidFilePath[pathLen] = 0;
-            strncpy (&tmpVidFilePath[pathLen-7], "tmpvid", 7);
-            ENCAPSULER_DEBUG ("removing %s", tmpVidFilePath);
-            remove (tmpVidFilePath);
-            ENCAPSULER_CLEANUP (free, tmpVidFilePath);
-        }
-        else
+        // The data file may not be known from the descriptor: remove the one named after the infos file
+        if ((pathLen > extLen) && (0 == strcmp (&metaFilePath[pathLen - extLen], METAFILE_EXT)) &&
+            (sizeof (tempFilePath) > (size_t)snprintf (tempFilePath, sizeof (tempFilePath), "%.*s%s", (int)(pathLen - extLen), metaFilePath, TEMPFILE_EXT)))
         {
-            ENCAPSULER_DEBUG ("Unable to allocate filename buffer, cleanup was not complete");
+            ENCAPSULER_DEBUG ("removing %s", tempFilePath);
+            remove (tempFilePath);
         }
     }
     ENCAPSULER_CLEANUP (free, audio);
@@ -2656,6 +6424,178 @@ no_cleanup:
     return ret;
 }
 
+int ARMEDIA_VideoEncapsuler_TryFixMediaFile (const char *metaFilePath)
+{
+    return ARMEDIA_VideoEncapsuler_TryFix (metaFilePath, 0);
+}
+
+typedef struct ARMEDIA_VideoEncapsuler_FixBatch_t ARMEDIA_VideoEncapsuler_FixBatch_t;
+
+typedef struct
+{
+    char metaFilePath[ARMEDIA_ENCAPSULER_VIDEO_PATH_SIZE];
+    off_t size; // infos file + data file
+    ARMEDIA_VideoEncapsuler_FixBatch_t *batch;
+} ARMEDIA_VideoEncapsuler_FixJob_t;
+
+struct ARMEDIA_VideoEncapsuler_FixBatch_t
+{
+    ARSAL_Mutex_t mutex; // serializes the callbacks
+    off_t totalSize;
+    off_t doneSize;
+    uint32_t fixedCount;
+    uint8_t progress;
+    ARMEDIA_VideoEncapsuler_FinishProgressCallback_t progressCallback;
+    ARMEDIA_VideoEncapsuler_FinishCallback_t fixCallback;
+    void *userData;
+};
+
+static int ARMEDIA_VideoEncapsuler_CompareFixJobs (const void *a, const void *b)
+{
+    const ARMEDIA_VideoEncapsuler_FixJob_t *jobA = a;
+    const ARMEDIA_VideoEncapsuler_FixJob_t *jobB = b;
+    if (jobA->size != jobB->size)
+    {
+        return (jobA->size < jobB->size) ? -1 : 1;
+    }
+    return strcmp (jobA->metaFilePath, jobB->metaFilePath);
+}
+
+static void ARMEDIA_VideoEncapsuler_RunFixJob (void *context)
+{
+    ARMEDIA_VideoEncapsuler_FixJob_t *job = context;
+    ARMEDIA_VideoEncapsuler_FixBatch_t *batch = job->batch;
+    char mediaPath[ARMEDIA_ENCAPSULER_VIDEO_PATH_SIZE];
+    // The pool already runs one Finish per worker: no nested pool
+    int fixed = ARMEDIA_VideoEncapsuler_TryFix (job->metaFilePath, 1);
+    uint8_t percent;
+
+    // The infos file is named after the media
+    snprintf (mediaPath, sizeof (mediaPath), "%.*s", (int)(strlen (job->metaFilePath) - strlen (METAFILE_EXT)), job->metaFilePath);
+
+    ARSAL_Mutex_Lock (&batch->mutex);
+    batch->doneSize += job->size;
+    if (fixed)
+    {
+        batch->fixedCount++;
+    }
+    if (NULL != batch->fixCallback)
+    {
+        batch->fixCallback (mediaPath, fixed ? ARMEDIA_OK : ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR, batch->userData);
+    }
+    percent = (0 < batch->totalSize) ? (uint8_t)((100 * batch->doneSize) / batch->totalSize) : 100;
+    if ((NULL != batch->progressCallback) && (percent > batch->progress))
+    {
+        batch->progress = percent;
+        batch->progressCallback (percent, batch->userData);
+    }
+    ARSAL_Mutex_Unlock (&batch->mutex);
+}
+
+eARMEDIA_ERROR ARMEDIA_VideoEncapsuler_TryFixDirectory (const char *directory, uint32_t threadCount,
+                                                        ARMEDIA_VideoEncapsuler_FinishProgressCallback_t progressCallback,
+                                                        ARMEDIA_VideoEncapsuler_FinishCallback_t fixCallback,
+                                                        void *userData, uint32_t *fixedCount)
+{
+    ARMEDIA_VideoEncapsuler_FixBatch_t batch;
+    ARMEDIA_VideoEncapsuler_FixJob_t *jobs = NULL;
+    uint32_t count = 0, capacity = 0;
+    char tempFilePath[ARMEDIA_ENCAPSULER_VIDEO_PATH_SIZE];
+    size_t extLen = strlen (METAFILE_EXT);
+    eARMEDIA_ERROR error = ARMEDIA_OK;
+    struct dirent *entry;
+    struct stat st;
+    DIR *dir;
+
+    if (NULL != fixedCount)
+    {
+        *fixedCount = 0;
+    }
+    if (NULL == directory)
+    {
+        return ARMEDIA_ERROR_BAD_PARAMETER;
+    }
+    dir = opendir (directory);
+    if (NULL == dir)
+    {
+        ENCAPSULER_ERROR ("Unable to open %s", directory);
+        return ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR;
+    }
+
+    memset (&batch, 0, sizeof (batch));
+    batch.progressCallback = progressCallback;
+    batch.fixCallback = fixCallback;
+    batch.userData = userData;
+
+    // Find the infos files left by interrupted recordings
+    while (NULL != (entry = readdir (dir)))
+    {
+        ARMEDIA_VideoEncapsuler_FixJob_t *job;
+        size_t nameLen = strlen (entry->d_name);
+        if ((nameLen <= extLen) || (0 != strcmp (entry->d_name + nameLen - extLen, METAFILE_EXT)))
+        {
+            continue;
+        }
+        if (count == capacity)
+        {
+            uint32_t newCapacity = (0 == capacity) ? 16 : 2 * capacity;
+            ARMEDIA_VideoEncapsuler_FixJob_t *newJobs = realloc (jobs, newCapacity * sizeof (*jobs));
+            if (NULL == newJobs)
+            {
+                error = ARMEDIA_ERROR;
+                break;
+            }
+            jobs = newJobs;
+            capacity = newCapacity;
+        }
+        job = &jobs[count];
+        if (sizeof (job->metaFilePath) <= (size_t)snprintf (job->metaFilePath, sizeof (job->metaFilePath), "%s/%s", directory, entry->d_name))
+        {
+            ENCAPSULER_ERROR ("%s/%s: path too long", directory, entry->d_name);
+            continue;
+        }
+        if ((0 != stat (job->metaFilePath, &st)) || !S_ISREG (st.st_mode))
+        {
+            continue;
+        }
+        job->size = st.st_size;
+        // The data file may be missing, the infos file is removed then
+        snprintf (tempFilePath, sizeof (tempFilePath), "%.*s%s", (int)(strlen (job->metaFilePath) - extLen), job->metaFilePath, TEMPFILE_EXT);
+        if (0 == stat (tempFilePath, &st))
+        {
+            job->size += st.st_size;
+        }
+        job->batch = &batch;
+        batch.totalSize += job->size;
+        count++;
+    }
+    closedir (dir);
+
+    if ((ARMEDIA_OK == error) && (0 < count))
+    {
+        // Smallest recordings first: most medias are available early
+        qsort (jobs, count, sizeof (*jobs), ARMEDIA_VideoEncapsuler_CompareFixJobs);
+        ENCAPSULER_DEBUG ("Fixing %u recordings (%lld bytes) in %s", count, (long long)batch.totalSize, directory);
+
+        if (0 != ARSAL_Mutex_Init (&batch.mutex))
+        {
+            error = ARMEDIA_ERROR;
+        }
+        else
+        {
+            error = ARMEDIA_TaskPool_Run (ARMEDIA_VideoEncapsuler_RunFixJob, jobs, sizeof (*jobs), count, threadCount);
+            ARSAL_Mutex_Destroy (&batch.mutex);
+        }
+        if (NULL != fixedCount)
+        {
+            *fixedCount = batch.fixedCount;
+        }
+    }
+    free (jobs);
+
+    return error;
+}
+
 int ARMEDIA_VideoEncapsuler_changePVATAtomDate (FILE *videoFile, const char *videoDate)
 {
     int result = 0;
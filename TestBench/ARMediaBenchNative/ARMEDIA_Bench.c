@@ -0,0 +1,1135 @@
+/*
+    Copyright (C) 2014 Parrot SA
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the
+      distribution.
+    * Neither the name of Parrot nor the names
+      of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written
+      permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+    "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+    LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+    FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+    COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+    BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+    OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+    AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+    OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+    SUCH DAMAGE.
+*/
+/**
+ * @file ARMEDIA_Bench.c
+ * @brief Native benchmarks of the video encapsuler internals.
+ *
+ * usage: armedia-bench <name> [options]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <libARMedia/ARMedia.h>
+#include <libARMedia/ARMEDIA_VideoEncapsuler.h>
+#include "ARMEDIA_SampleTable.h"
+#include "ARMEDIA_NaluScanner.h"
+
+typedef int (*ARMEDIA_Bench_Function_t) (int argc, char *argv[]);
+
+typedef struct
+{
+    const char *name;
+    const char *usage;
+    ARMEDIA_Bench_Function_t function;
+} ARMEDIA_Bench_t;
+
+static double ARMEDIA_Bench_Now (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Pseudo random generator, so that the runs are reproducible */
+static uint32_t ARMEDIA_Bench_Random (uint32_t *state)
+{
+    *state = *state * 1103515245 + 12345;
+    return (*state >> 8);
+}
+
+/* Parameter sets of the synthetic H.264 frames, repeated before each IDR slice */
+static const uint8_t ARMEDIA_Bench_Sps[] = { 0, 0, 0, 1, 0x67, 0x64, 0x00, 0x28, 0xac, 0xd9, 0x40, 0x50, 0x05, 0xbb, 0x01, 0x10 };
+static const uint8_t ARMEDIA_Bench_Pps[] = { 0, 0, 0, 1, 0x68, 0xeb, 0xe3, 0xcb, 0x22, 0xc0 };
+
+/* Largest synthetic frame size, in bytes, for a slice of sliceSize bytes */
+#define ARMEDIA_BENCH_FRAME_SIZE(sliceSize) (sizeof (ARMEDIA_Bench_Sps) + sizeof (ARMEDIA_Bench_Pps) + 5 + (sliceSize))
+
+/* Encapsuler of a 30 fps recording of a Bebop 2, in an MP4 media or in a transport stream */
+static ARMEDIA_VideoEncapsuler_t *ARMEDIA_Bench_NewEncapsuler (const char *mediaPath, uint8_t transportStream, eARMEDIA_ERROR *error)
+{
+    ARMEDIA_VideoEncapsuler_t *encapsuler = ARMEDIA_VideoEncapsuler_New (mediaPath, 30, "0123456789abcdef0123456789abcdef", "2016-11-21T165500+0100", ARDISCOVERY_PRODUCT_BEBOP_2, error);
+
+    if ((NULL != encapsuler) && transportStream)
+    {
+        *error = ARMEDIA_VideoEncapsuler_SetTransportStream (encapsuler, 0);
+        if (ARMEDIA_OK != *error)
+        {
+            // Nothing recorded: the files are removed
+            ARMEDIA_VideoEncapsuler_Finish (&encapsuler);
+        }
+    }
+    return encapsuler;
+}
+
+/*
+ * Synthetic H.264 frame number index of a 720p recording with an IDR frame
+ * every 30 frames: a slice of sliceSize bytes, after the parameter sets for an
+ * IDR frame. frame must hold ARMEDIA_BENCH_FRAME_SIZE (sliceSize) bytes.
+ */
+static void ARMEDIA_Bench_MakeFrame (ARMEDIA_Frame_Header_t *header, uint8_t *frame, uint32_t index, uint32_t sliceSize, uint64_t timestamp)
+{
+    int iFrame = (0 == index % 30);
+    uint32_t size = 0;
+
+    memset (header, 0, sizeof (*header));
+    if (iFrame)
+    {
+        memcpy (frame, ARMEDIA_Bench_Sps, sizeof (ARMEDIA_Bench_Sps));
+        memcpy (frame + sizeof (ARMEDIA_Bench_Sps), ARMEDIA_Bench_Pps, sizeof (ARMEDIA_Bench_Pps));
+        size = sizeof (ARMEDIA_Bench_Sps) + sizeof (ARMEDIA_Bench_Pps);
+    }
+    frame[size] = 0;
+    frame[size + 1] = 0;
+    frame[size + 2] = 0;
+    frame[size + 3] = 1;
+    frame[size + 4] = iFrame ? 0x65 : 0x41;
+    memset (frame + size + 5, 0xa5, sliceSize);
+    header->codec = CODEC_MPEG4_AVC;
+    header->width = 1280;
+    header->height = 720;
+    header->timestamp = timestamp;
+    header->frame_type = iFrame ? ARMEDIA_ENCAPSULER_FRAME_TYPE_I_FRAME : ARMEDIA_ENCAPSULER_FRAME_TYPE_P_FRAME;
+    header->frame = frame;
+    header->frame_size = size + 5 + sliceSize;
+}
+
+/*
+ * sampletable: memory used by the in-memory sample tables for one hour of
+ * recording, compared to the expanded tables (4 bytes of stsz, 8 bytes of
+ * co64 and 8 bytes of stts per sample).
+ */
+static int ARMEDIA_Bench_SampleTable (int argc, char *argv[])
+{
+    uint32_t fps = (argc > 0) ? (uint32_t)atoi (argv[0]) : 30;
+    uint32_t jitter = (argc > 1) ? (uint32_t)atoi (argv[1]) : 2000; // usec
+    uint32_t gop = fps;
+    uint32_t frames = fps * 3600;
+    uint32_t audioChunks = (uint32_t)(3600 * 44100 / 1024);
+    uint32_t seed = 42;
+    uint64_t offset = 0;
+    uint64_t audioTime = 0, videoTime = 0;
+    uint32_t i;
+    size_t memory, expanded;
+    double start, elapsed;
+    ARMEDIA_SampleTable_t video, audio, metadata;
+    ARMEDIA_SampleTable_Entry_t entry;
+    ARMEDIA_SampleTable_Iterator_t iterator;
+    uint64_t checksum = 0;
+
+    if (0 == fps)
+    {
+        fprintf (stderr, "invalid fps\n");
+        return 1;
+    }
+
+    ARMEDIA_SampleTable_Init (&video);
+    ARMEDIA_SampleTable_Init (&audio);
+    ARMEDIA_SampleTable_Init (&metadata);
+
+    start = ARMEDIA_Bench_Now ();
+    for (i = 0; i < frames; i++)
+    {
+        uint32_t period = 1000000 / fps;
+        int iFrame = (0 == i % gop);
+
+        entry.size = iFrame ? 60000 + ARMEDIA_Bench_Random (&seed) % 40000 : 8000 + ARMEDIA_Bench_Random (&seed) % 16000;
+        entry.duration = (0 == i) ? 0 : period - jitter / 2 + ((0 == jitter) ? 0 : ARMEDIA_Bench_Random (&seed) % jitter);
+        entry.flags = iFrame ? ARMEDIA_SAMPLETABLE_FLAG_SYNC : 0;
+        entry.offset = offset;
+        videoTime += entry.duration;
+        offset += entry.size;
+        if (ARMEDIA_OK != ARMEDIA_SampleTable_Add (&video, &entry))
+        {
+            fprintf (stderr, "out of memory\n");
+            return 1;
+        }
+
+        entry.offset = offset;
+        entry.size = 64;
+        entry.flags = 0;
+        offset += entry.size;
+        ARMEDIA_SampleTable_Add (&metadata, &entry);
+
+        // Audio chunks interleaved with the video frames
+        while ((audio.count < audioChunks) && (audioTime <= videoTime))
+        {
+            entry.offset = offset;
+            entry.size = 2048;
+            entry.duration = 1024 * 1000000 / 44100;
+            entry.flags = 0;
+            offset += entry.size;
+            audioTime += entry.duration;
+            ARMEDIA_SampleTable_Add (&audio, &entry);
+        }
+    }
+    elapsed = ARMEDIA_Bench_Now () - start;
+
+    memory = ARMEDIA_SampleTable_GetMemorySize (&video) + ARMEDIA_SampleTable_GetMemorySize (&audio) + ARMEDIA_SampleTable_GetMemorySize (&metadata);
+    expanded = (size_t)(video.count + audio.count + metadata.count) * (4 + 8 + 8);
+
+    printf ("1 hour at %u fps, %u usec jitter: %u video, %u metadata, %u audio samples\n", fps, jitter, video.count, metadata.count, audio.count);
+    printf ("append:  %.1f ns/sample\n", elapsed * 1e9 / (video.count + audio.count + metadata.count));
+    printf ("compact: %.2f MiB/hour (video %zu, metadata %zu, audio %zu bytes)\n", memory / 1048576.,
+            ARMEDIA_SampleTable_GetMemorySize (&video), ARMEDIA_SampleTable_GetMemorySize (&metadata), ARMEDIA_SampleTable_GetMemorySize (&audio));
+    printf ("expanded: %.2f MiB/hour\n", expanded / 1048576.);
+
+    start = ARMEDIA_Bench_Now ();
+    for (ARMEDIA_SampleTable_Begin (&video, &iterator); ARMEDIA_SampleTable_Next (&iterator, &entry); )
+    {
+        checksum += entry.offset + entry.size + entry.duration;
+    }
+    elapsed = ARMEDIA_Bench_Now () - start;
+    printf ("expand:  %.1f ns/sample (checksum %llu)\n", elapsed * 1e9 / video.count, (unsigned long long)checksum);
+
+    ARMEDIA_SampleTable_Clear (&video);
+    ARMEDIA_SampleTable_Clear (&audio);
+    ARMEDIA_SampleTable_Clear (&metadata);
+    return 0;
+}
+
+/* Start code search of the encapsuler before ARMEDIA_NaluScanner */
+static int ARMEDIA_Bench_LegacyStartcodeMatch (const uint8_t* pBuf, unsigned int bufSize)
+{
+    int pos = 0, end = bufSize;
+    uint32_t shiftVal = 0;
+    const uint8_t* ptr = pBuf;
+
+    if (bufSize < 4) return -2;
+    do
+    {
+        shiftVal <<= 8;
+        shiftVal |= (*ptr++) & 0xFF;
+        pos++;
+    }
+    while (((shiftVal != 0x00000001) && (pos < end)) || (pos < 4));
+
+    return (shiftVal == 0x00000001) ? pos - 4 : -2;
+}
+
+/* Count the start codes of a frame, the way the encapsuler walks it */
+static uint32_t ARMEDIA_Bench_CountStartCodes (int (*find) (const uint8_t *, size_t, uint32_t *), const uint8_t *buf, size_t size)
+{
+    uint32_t count = 0, startCodeSize = 0;
+    size_t pos = 0;
+    int found;
+    while ((found = find (buf + pos, size - pos, &startCodeSize)) >= 0)
+    {
+        count++;
+        pos += found + startCodeSize;
+    }
+    return count;
+}
+
+static uint32_t ARMEDIA_Bench_CountLegacy (const uint8_t *buf, size_t size)
+{
+    uint32_t count = 0;
+    size_t pos = 0;
+    int found;
+    while ((size - pos >= 4) && ((found = ARMEDIA_Bench_LegacyStartcodeMatch (buf + pos, size - pos)) >= 0))
+    {
+        count++;
+        pos += found + 4;
+    }
+    return count;
+}
+
+/*
+ * startcode: Annex-B start code search on a frame made of slices of
+ * random bytes (without emulated start codes), compared to the legacy
+ * byte-per-byte loop.
+ */
+static int ARMEDIA_Bench_StartCode (int argc, char *argv[])
+{
+    size_t size = (argc > 0) ? (size_t)atoi (argv[0]) * 1024 : 1024 * 1024;
+    uint32_t slices = (argc > 1) ? (uint32_t)atoi (argv[1]) : 4;
+    uint32_t iterations = 200;
+    uint32_t seed = 1234;
+    uint32_t i, expected, count = 0;
+    uint8_t *frame;
+    double start, legacy, scalar, vector;
+    ARMEDIA_Nalu_t nalus[64];
+
+    if ((0 == slices) || (slices > 64) || (size < 64 * slices))
+    {
+        fprintf (stderr, "invalid frame size or slice count\n");
+        return 1;
+    }
+    frame = malloc (size);
+    if (NULL == frame)
+    {
+        return 1;
+    }
+    for (i = 0; i < size; i++)
+    {
+        uint8_t byte = (uint8_t)ARMEDIA_Bench_Random (&seed);
+        // Emulation prevention: never two zeros in a row
+        frame[i] = ((0 == byte) && (i > 0) && (0 == frame[i - 1])) ? 3 : byte;
+    }
+    for (i = 0; i < slices; i++)
+    {
+        size_t pos = i * (size / slices);
+        frame[pos] = 0;
+        frame[pos + 1] = 0;
+        frame[pos + 2] = 0;
+        frame[pos + 3] = 1;
+    }
+
+    expected = ARMEDIA_Bench_CountLegacy (frame, size);
+    if ((expected != slices) ||
+        (ARMEDIA_Bench_CountStartCodes (ARMEDIA_NaluScanner_FindScalar, frame, size) != slices) ||
+        (ARMEDIA_Bench_CountStartCodes (ARMEDIA_NaluScanner_Find, frame, size) != slices) ||
+        (ARMEDIA_NaluScanner_Split (frame, size, nalus, 64) != slices))
+    {
+        fprintf (stderr, "start code count mismatch\n");
+        free (frame);
+        return 1;
+    }
+
+    start = ARMEDIA_Bench_Now ();
+    for (i = 0; i < iterations; i++)
+    {
+        count += ARMEDIA_Bench_CountLegacy (frame, size);
+    }
+    legacy = ARMEDIA_Bench_Now () - start;
+
+    start = ARMEDIA_Bench_Now ();
+    for (i = 0; i < iterations; i++)
+    {
+        count += ARMEDIA_Bench_CountStartCodes (ARMEDIA_NaluScanner_FindScalar, frame, size);
+    }
+    scalar = ARMEDIA_Bench_Now () - start;
+
+    start = ARMEDIA_Bench_Now ();
+    for (i = 0; i < iterations; i++)
+    {
+        count += ARMEDIA_NaluScanner_Split (frame, size, nalus, 64);
+    }
+    vector = ARMEDIA_Bench_Now () - start;
+
+    printf ("%zu KiB frame, %u slices, %u iterations (count %u)\n", size / 1024, slices, iterations, count);
+    printf ("legacy: %8.1f MB/s\n", size * (double)iterations / legacy / 1e6);
+    printf ("scalar: %8.1f MB/s\n", size * (double)iterations / scalar / 1e6);
+    printf ("%-6s: %8.1f MB/s\n", ARMEDIA_NaluScanner_GetImplementation (), size * (double)iterations / vector / 1e6);
+
+    free (frame);
+    return 0;
+}
+
+/*
+ * finish: time spent in the configuration calls and stop-to-playable latency
+ * (ARMEDIA_VideoEncapsuler_Finish()) of short recordings with a full set of
+ * untimed metadata and a thumbnail.
+ */
+static int ARMEDIA_Bench_Finish (int argc, char *argv[])
+{
+    uint32_t frames = (argc > 0) ? (uint32_t)atoi (argv[0]) : 300;
+    size_t thumbnailSize = (argc > 1) ? (size_t)atoi (argv[1]) * 1024 : 64 * 1024;
+    const char *directory = (argc > 2) ? argv[2] : "/tmp";
+    uint32_t iterations = 20;
+    uint32_t seed = 7;
+    uint32_t i, n;
+    char mediaPath[256], thumbnailPath[256];
+    uint8_t frame[ARMEDIA_BENCH_FRAME_SIZE (512 + 2048)];
+    uint8_t *thumbnail;
+    FILE *file;
+    double start, configure = 0, finish = 0, worst = 0;
+    ARMEDIA_Untimed_Metadata_t metadata;
+    eARMEDIA_ERROR error = ARMEDIA_OK;
+
+    snprintf (mediaPath, sizeof (mediaPath), "%s/armedia-bench-finish.mp4", directory);
+    snprintf (thumbnailPath, sizeof (thumbnailPath), "%s/armedia-bench-finish.jpg", directory);
+    thumbnail = malloc (thumbnailSize + 1);
+    file = fopen (thumbnailPath, "wb");
+    if ((NULL == thumbnail) || (NULL == file))
+    {
+        fprintf (stderr, "unable to create %s\n", thumbnailPath);
+        free (thumbnail);
+        return 1;
+    }
+    for (i = 0; i < thumbnailSize; i++)
+    {
+        thumbnail[i] = (uint8_t)ARMEDIA_Bench_Random (&seed);
+    }
+    fwrite (thumbnail, 1, thumbnailSize, file);
+    fclose (file);
+    free (thumbnail);
+
+    memset (&metadata, 0, sizeof (metadata));
+    snprintf (metadata.maker, sizeof (metadata.maker), "Parrot");
+    snprintf (metadata.model, sizeof (metadata.model), "Bebop 2");
+    snprintf (metadata.modelId, sizeof (metadata.modelId), "090c");
+    snprintf (metadata.serialNumber, sizeof (metadata.serialNumber), "PI040416AA6L000000");
+    snprintf (metadata.softwareVersion, sizeof (metadata.softwareVersion), "4.0.6");
+    snprintf (metadata.buildId, sizeof (metadata.buildId), "bebop2-4.0.6-release");
+    snprintf (metadata.artist, sizeof (metadata.artist), "Parrot Bebop 2");
+    snprintf (metadata.title, sizeof (metadata.title), "Benchmark");
+    snprintf (metadata.comment, sizeof (metadata.comment), "Finish latency benchmark");
+    snprintf (metadata.copyright, sizeof (metadata.copyright), "Parrot");
+    snprintf (metadata.mediaDate, sizeof (metadata.mediaDate), "2016-11-21T165545+0100");
+    snprintf (metadata.runDate, sizeof (metadata.runDate), "2016-11-21T165500+0100");
+    snprintf (metadata.runUuid, sizeof (metadata.runUuid), "0123456789ABCDEF0123456789ABCDEF");
+    metadata.takeoffLatitude = 48.8790;
+    metadata.takeoffLongitude = 2.3677;
+    metadata.takeoffAltitude = 35.;
+    metadata.pictureHFov = 80.;
+    metadata.pictureVFov = 50.;
+    for (i = 0; i < ARMEDIA_ENCAPSULER_UNTIMED_METADATA_CUSTOM_MAX_COUNT; i++)
+    {
+        snprintf (metadata.custom[i].key, sizeof (metadata.custom[i].key), "com.parrot.bench.%u", i);
+        snprintf (metadata.custom[i].value, sizeof (metadata.custom[i].value), "value %u", i);
+    }
+
+    for (n = 0; (n < iterations) && (ARMEDIA_OK == error); n++)
+    {
+        ARMEDIA_VideoEncapsuler_t *encapsuler = ARMEDIA_Bench_NewEncapsuler (mediaPath, 0, &error);
+        double elapsed;
+        if (NULL == encapsuler)
+        {
+            break;
+        }
+
+        start = ARMEDIA_Bench_Now ();
+        ARMEDIA_VideoEncapsuler_SetUntimedMetadata (encapsuler, &metadata);
+        ARMEDIA_VideoEncapsuler_SetVideoThumbnail (encapsuler, thumbnailPath);
+        ARMEDIA_VideoEncapsuler_SetMetadataInfo (encapsuler, "", "application/octet-stream", 64);
+        configure += ARMEDIA_Bench_Now () - start;
+
+        for (i = 0; (i < frames) && (ARMEDIA_OK == error); i++)
+        {
+            ARMEDIA_Frame_Header_t header;
+            uint8_t metadataBlock[64] = { 0 };
+            uint32_t sliceSize = 512 + ARMEDIA_Bench_Random (&seed) % 2048;
+
+            ARMEDIA_Bench_MakeFrame (&header, frame, i, sliceSize, 1000000 + (uint64_t)i * 33333);
+            error = ARMEDIA_VideoEncapsuler_AddFrame (encapsuler, &header, metadataBlock);
+        }
+
+        start = ARMEDIA_Bench_Now ();
+        if (ARMEDIA_OK == error)
+        {
+            error = ARMEDIA_VideoEncapsuler_Finish (&encapsuler);
+        }
+        else
+        {
+            ARMEDIA_VideoEncapsuler_Finish (&encapsuler);
+        }
+        elapsed = ARMEDIA_Bench_Now () - start;
+        finish += elapsed;
+        worst = (elapsed > worst) ? elapsed : worst;
+    }
+    unlink (mediaPath);
+    unlink (thumbnailPath);
+    if ((ARMEDIA_OK != error) || (0 == n))
+    {
+        fprintf (stderr, "recording failed: %s\n", ARMEDIA_Error_ToString (error));
+        return 1;
+    }
+
+    printf ("%u recordings of %u frames, %zu KiB thumbnail in %s\n", n, frames, thumbnailSize / 1024, directory);
+    printf ("configure: %8.3f ms\n", configure * 1e3 / n);
+    printf ("finish:    %8.3f ms (worst %.3f ms)\n", finish * 1e3 / n, worst * 1e3);
+    return 0;
+}
+
+/*
+ * tracks: stop-to-playable latency of a long recording with video, timed
+ * metadata and audio tracks, for each number of finish threads. The tables
+ * of the three tracks are built concurrently when there are several threads.
+ */
+static int ARMEDIA_Bench_Tracks (int argc, char *argv[])
+{
+    uint32_t minutes = (argc > 0) ? (uint32_t)atoi (argv[0]) : 60;
+    uint32_t maxThreads = (argc > 1) ? (uint32_t)atoi (argv[1]) : ARMEDIA_ENCAPSULER_MAX_FINISH_THREAD_COUNT;
+    const char *directory = (argc > 2) ? argv[2] : "/tmp";
+    uint32_t frames = minutes * 60 * 30;
+    uint32_t iterations = 3;
+    uint32_t threads, i, n;
+    char mediaPath[256];
+    uint8_t frame[ARMEDIA_BENCH_FRAME_SIZE (16 + 128)];
+    uint8_t audio[1024] = { 0 };
+    uint8_t metadataBlock[64] = { 0 };
+    eARMEDIA_ERROR error = ARMEDIA_OK;
+
+    if (ARMEDIA_ENCAPSULER_MAX_FINISH_THREAD_COUNT < maxThreads)
+    {
+        maxThreads = ARMEDIA_ENCAPSULER_MAX_FINISH_THREAD_COUNT;
+    }
+    snprintf (mediaPath, sizeof (mediaPath), "%s/armedia-bench-tracks.mp4", directory);
+    printf ("%u minutes recording (%u frames, 3 tracks) in %s\n", minutes, frames, directory);
+
+    for (threads = 1; (threads <= maxThreads) && (ARMEDIA_OK == error); threads++)
+    {
+        double best = 0;
+
+        for (n = 0; (n < iterations) && (ARMEDIA_OK == error); n++)
+        {
+            ARMEDIA_VideoEncapsuler_t *encapsuler = ARMEDIA_Bench_NewEncapsuler (mediaPath, 0, &error);
+            uint64_t audioTimestamp = 1000000;
+            uint32_t seed = 7;
+            double start, elapsed;
+
+            if (NULL == encapsuler)
+            {
+                break;
+            }
+            ARMEDIA_VideoEncapsuler_SetFinishThreadCount (encapsuler, threads);
+            ARMEDIA_VideoEncapsuler_SetMetadataInfo (encapsuler, "", "application/octet-stream", sizeof (metadataBlock));
+
+            for (i = 0; (i < frames) && (ARMEDIA_OK == error); i++)
+            {
+                ARMEDIA_Frame_Header_t header;
+                uint32_t sliceSize = 16 + ARMEDIA_Bench_Random (&seed) % 128;
+
+                // A few ms of jitter: the stts table is not a single entry
+                ARMEDIA_Bench_MakeFrame (&header, frame, i, sliceSize, 1000000 + (uint64_t)i * 33333 + ARMEDIA_Bench_Random (&seed) % 2000);
+                error = ARMEDIA_VideoEncapsuler_AddFrame (encapsuler, &header, metadataBlock);
+
+                while ((ARMEDIA_OK == error) && (audioTimestamp < header.timestamp))
+                {
+                    ARMEDIA_Sample_Header_t sample;
+
+                    // 16 kHz mono, chunks of 512 or 1024 bytes
+                    memset (&sample, 0, sizeof (sample));
+                    sample.codec = ACODEC_PCM;
+                    sample.format = AFORMAT_16BITS;
+                    sample.frequency = 16000;
+                    sample.nchannel = 1;
+                    sample.timestamp = audioTimestamp;
+                    sample.sample_size = (ARMEDIA_Bench_Random (&seed) & 1) ? 1024 : 512;
+                    sample.sample = audio;
+                    error = ARMEDIA_VideoEncapsuler_AddSample (encapsuler, &sample);
+                    audioTimestamp += (uint64_t)sample.sample_size * 1000000 / (2 * 16000);
+                }
+            }
+
+            start = ARMEDIA_Bench_Now ();
+            if (ARMEDIA_OK == error)
+            {
+                error = ARMEDIA_VideoEncapsuler_Finish (&encapsuler);
+            }
+            else
+            {
+                ARMEDIA_VideoEncapsuler_Finish (&encapsuler);
+            }
+            elapsed = ARMEDIA_Bench_Now () - start;
+            best = ((0 == n) || (elapsed < best)) ? elapsed : best;
+        }
+        if (ARMEDIA_OK == error)
+        {
+            printf ("%u thread(s): finish %8.3f ms (best of %u)\n", threads, best * 1e3, iterations);
+        }
+    }
+    unlink (mediaPath);
+    if (ARMEDIA_OK != error)
+    {
+        fprintf (stderr, "recording failed: %s\n", ARMEDIA_Error_ToString (error));
+        return 1;
+    }
+    return 0;
+}
+
+static uint32_t ARMEDIA_Bench_ReadU32 (const uint8_t *data)
+{
+    return ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+}
+
+/* Payload of the first child atom of the given type, NULL if none */
+static const uint8_t *ARMEDIA_Bench_FindAtom (const uint8_t *data, size_t size, const char *tag, size_t *atomSize)
+{
+    size_t pos = 0;
+
+    while (pos + 8 <= size)
+    {
+        size_t length = ARMEDIA_Bench_ReadU32 (data + pos);
+        if ((length < 8) || (pos + length > size))
+        {
+            return NULL;
+        }
+        if (0 == memcmp (data + pos + 4, tag, 4))
+        {
+            *atomSize = length - 8;
+            return data + pos + 8;
+        }
+        pos += length;
+    }
+    return NULL;
+}
+
+/* Read the moov atom of a media with the moov atom at the end of the file */
+static uint8_t *ARMEDIA_Bench_ReadMoov (const char *path, size_t *moovSize)
+{
+    FILE *file = fopen (path, "rb");
+    uint8_t header[8];
+    uint8_t *moov = NULL;
+    off_t pos = 0;
+
+    while ((NULL != file) && (NULL == moov) && (0 == fseeko (file, pos, SEEK_SET)) && (1 == fread (header, sizeof (header), 1, file)))
+    {
+        size_t length = ARMEDIA_Bench_ReadU32 (header);
+        if (length < 8)
+        {
+            break;
+        }
+        if (0 == memcmp (header + 4, "moov", 4))
+        {
+            moov = malloc (length);
+            if ((NULL != moov) && (1 != fread (moov, length - 8, 1, file)))
+            {
+                free (moov);
+                moov = NULL;
+                break;
+            }
+            *moovSize = length - 8;
+        }
+        pos += length;
+    }
+    if (NULL != file)
+    {
+        fclose (file);
+    }
+    return moov;
+}
+
+/*
+ * stts: size of the video time to sample table of a recording with jittered
+ * capture timestamps, with the captured durations and with the durations
+ * snapped to the frame rate (ARMEDIA_VideoEncapsuler_SetTimestampTolerance()),
+ * and the largest error of the presentation times against the timestamps.
+ */
+static int ARMEDIA_Bench_Stts (int argc, char *argv[])
+{
+    uint32_t minutes = (argc > 0) ? (uint32_t)atoi (argv[0]) : 10;
+    uint32_t jitter = (argc > 1) ? (uint32_t)atoi (argv[1]) : 2000; // usec
+    uint32_t tolerance = (argc > 2) ? (uint32_t)atoi (argv[2]) : 4000; // usec
+    const char *directory = (argc > 3) ? argv[3] : "/tmp";
+    uint32_t frames = minutes * 60 * 30;
+    uint64_t *timestamps;
+    uint32_t pass, i;
+    char mediaPath[256];
+    uint8_t frame[ARMEDIA_BENCH_FRAME_SIZE (16 + 128)];
+    eARMEDIA_ERROR error = ARMEDIA_OK;
+
+    timestamps = malloc ((size_t)(frames + 1) * sizeof (*timestamps));
+    if ((NULL == timestamps) || (0 == frames))
+    {
+        fprintf (stderr, "invalid duration\n");
+        free (timestamps);
+        return 1;
+    }
+    snprintf (mediaPath, sizeof (mediaPath), "%s/armedia-bench-stts.mp4", directory);
+    printf ("%u minutes at 30 fps (%u frames), %u usec jitter in %s\n", minutes, frames, jitter, directory);
+
+    for (pass = 0; (pass < 2) && (ARMEDIA_OK == error); pass++)
+    {
+        ARMEDIA_VideoEncapsuler_t *encapsuler = ARMEDIA_Bench_NewEncapsuler (mediaPath, 0, &error);
+        const uint8_t *trak, *mdia, *mdhd, *stts;
+        uint8_t *moov;
+        size_t moovSize = 0, size;
+        uint32_t seed = 7, timescale, entries, e, n;
+        uint64_t time = 0;
+        double maxError = 0, start, elapsed;
+
+        if (NULL == encapsuler)
+        {
+            break;
+        }
+        if (1 == pass)
+        {
+            error = ARMEDIA_VideoEncapsuler_SetTimestampTolerance (encapsuler, tolerance);
+        }
+
+        for (i = 0; (i < frames) && (ARMEDIA_OK == error); i++)
+        {
+            ARMEDIA_Frame_Header_t header;
+            uint32_t sliceSize = 16 + ARMEDIA_Bench_Random (&seed) % 128;
+
+            ARMEDIA_Bench_MakeFrame (&header, frame, i, sliceSize,
+                                     1000000 + (uint64_t)i * 1000000 / 30 + ((0 == jitter) ? 0 : ARMEDIA_Bench_Random (&seed) % jitter));
+            timestamps[i] = header.timestamp;
+            error = ARMEDIA_VideoEncapsuler_AddFrame (encapsuler, &header, NULL);
+        }
+
+        start = ARMEDIA_Bench_Now ();
+        if (ARMEDIA_OK == error)
+        {
+            error = ARMEDIA_VideoEncapsuler_Finish (&encapsuler);
+        }
+        else
+        {
+            ARMEDIA_VideoEncapsuler_Finish (&encapsuler);
+        }
+        elapsed = ARMEDIA_Bench_Now () - start;
+        if (ARMEDIA_OK != error)
+        {
+            break;
+        }
+
+        // The video track is the first one
+        moov = ARMEDIA_Bench_ReadMoov (mediaPath, &moovSize);
+        trak = (NULL != moov) ? ARMEDIA_Bench_FindAtom (moov, moovSize, "trak", &size) : NULL;
+        mdia = (NULL != trak) ? ARMEDIA_Bench_FindAtom (trak, size, "mdia", &size) : NULL;
+        mdhd = (NULL != mdia) ? ARMEDIA_Bench_FindAtom (mdia, size, "mdhd", &moovSize) : NULL;
+        mdia = (NULL != mdia) ? ARMEDIA_Bench_FindAtom (mdia, size, "minf", &size) : NULL;
+        mdia = (NULL != mdia) ? ARMEDIA_Bench_FindAtom (mdia, size, "stbl", &size) : NULL;
+        stts = (NULL != mdia) ? ARMEDIA_Bench_FindAtom (mdia, size, "stts", &size) : NULL;
+        if ((NULL == mdhd) || (NULL == stts) || (size < 8))
+        {
+            fprintf (stderr, "unable to read the stts atom of %s\n", mediaPath);
+            free (moov);
+            error = ARMEDIA_ERROR_ENCAPSULER;
+            break;
+        }
+        timescale = ARMEDIA_Bench_ReadU32 (mdhd + 12);
+        entries = ARMEDIA_Bench_ReadU32 (stts + 4);
+
+        // Presentation time of each frame against its capture timestamp
+        for (e = 0, i = 0; (e < entries) && (8 + 8 * (size_t)(e + 1) <= size); e++)
+        {
+            uint32_t count = ARMEDIA_Bench_ReadU32 (stts + 8 + 8 * e);
+            uint32_t delta = ARMEDIA_Bench_ReadU32 (stts + 12 + 8 * e);
+            for (n = 0; (n < count) && (i < frames); n++, i++)
+            {
+                double captured = (double)(timestamps[i] - timestamps[0]);
+                double presented = time * 1e6 / timescale;
+                double timeError = (presented > captured) ? presented - captured : captured - presented;
+                maxError = (timeError > maxError) ? timeError : maxError;
+                time += delta;
+            }
+        }
+        free (moov);
+
+        printf ("%-22s stts %7u entries (%8u bytes), max error %7.1f usec, finish %8.3f ms\n",
+                (0 == pass) ? "captured durations:" : "snapped durations:", entries, 8 * entries, maxError, elapsed * 1e3);
+        if (1 == pass)
+        {
+            printf ("(tolerance %u usec)\n", tolerance);
+        }
+    }
+    unlink (mediaPath);
+    free (timestamps);
+    if (ARMEDIA_OK != error)
+    {
+        fprintf (stderr, "recording failed: %s\n", ARMEDIA_Error_ToString (error));
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * container: cost of recording the same frames as an MP4 media and as a
+ * transport stream (ARMEDIA_VideoEncapsuler_SetTransportStream()): time spent
+ * in AddFrame per frame, time of Finish and size of the media.
+ */
+static int ARMEDIA_Bench_Container (int argc, char *argv[])
+{
+    uint32_t frames = (argc > 0) ? (uint32_t)atoi (argv[0]) : 9000;
+    uint32_t frameSize = (argc > 1) ? (uint32_t)atoi (argv[1]) * 1024 : 16 * 1024;
+    const char *directory = (argc > 2) ? argv[2] : "/tmp";
+    static const char *names[] = { "mp4:", "transport stream:" };
+    uint8_t metadata[64];
+    uint8_t *frame;
+    uint32_t pass, i;
+    char mediaPath[256];
+    eARMEDIA_ERROR error = ARMEDIA_OK;
+
+    frame = malloc (ARMEDIA_BENCH_FRAME_SIZE ((size_t)frameSize));
+    if ((NULL == frame) || (0 == frames) || (0 == frameSize))
+    {
+        fprintf (stderr, "invalid frame count or size\n");
+        free (frame);
+        return 1;
+    }
+    memset (metadata, 0x5a, sizeof (metadata));
+    printf ("%u frames of %u KiB at 30 fps with 64-byte metadata in %s\n", frames, frameSize / 1024, directory);
+
+    for (pass = 0; (pass < 2) && (ARMEDIA_OK == error); pass++)
+    {
+        ARMEDIA_VideoEncapsuler_t *encapsuler;
+        double addTime = 0, start, elapsed;
+        struct stat st;
+
+        snprintf (mediaPath, sizeof (mediaPath), "%s/armedia-bench-container.%s", directory, (0 == pass) ? "mp4" : "ts");
+        encapsuler = ARMEDIA_Bench_NewEncapsuler (mediaPath, (1 == pass), &error);
+        if (NULL == encapsuler)
+        {
+            break;
+        }
+        error = ARMEDIA_VideoEncapsuler_SetMetadataInfo (encapsuler, "", "application/octet-stream", sizeof (metadata));
+
+        for (i = 0; (i < frames) && (ARMEDIA_OK == error); i++)
+        {
+            ARMEDIA_Frame_Header_t header;
+
+            ARMEDIA_Bench_MakeFrame (&header, frame, i, frameSize, 1000000 + (uint64_t)i * 1000000 / 30);
+            start = ARMEDIA_Bench_Now ();
+            error = ARMEDIA_VideoEncapsuler_AddFrame (encapsuler, &header, metadata);
+            addTime += ARMEDIA_Bench_Now () - start;
+        }
+
+        start = ARMEDIA_Bench_Now ();
+        if (ARMEDIA_OK == error)
+        {
+            error = ARMEDIA_VideoEncapsuler_Finish (&encapsuler);
+        }
+        else
+        {
+            ARMEDIA_VideoEncapsuler_Finish (&encapsuler);
+        }
+        elapsed = ARMEDIA_Bench_Now () - start;
+        if (ARMEDIA_OK != error)
+        {
+            break;
+        }
+
+        printf ("%-18s add %7.2f usec/frame, finish %8.3f ms, size %11lld bytes\n", names[pass],
+                addTime * 1e6 / frames, elapsed * 1e3, (0 == stat (mediaPath, &st)) ? (long long)st.st_size : -1LL);
+        unlink (mediaPath);
+    }
+    free (frame);
+    if (ARMEDIA_OK != error)
+    {
+        fprintf (stderr, "recording failed: %s\n", ARMEDIA_Error_ToString (error));
+        return 1;
+    }
+    return 0;
+}
+
+/* Sum of the sample sizes of the tracks of a handler type ("vide", "soun") in a media */
+static uint64_t ARMEDIA_Bench_GetTrackSize (const char *path, const char *handler)
+{
+    size_t moovSize = 0, pos = 0;
+    uint8_t *moov = ARMEDIA_Bench_ReadMoov (path, &moovSize);
+    uint64_t total = 0;
+
+    while ((NULL != moov) && (pos + 8 <= moovSize))
+    {
+        size_t length = ARMEDIA_Bench_ReadU32 (moov + pos), size = 0, hdlrSize = 0, stszSize = 0;
+        const uint8_t *mdia, *hdlr, *stbl, *stsz, *stz2;
+        uint32_t sampleSize, count, i;
+
+        if ((length < 8) || (pos + length > moovSize))
+        {
+            break;
+        }
+        mdia = (0 == memcmp (moov + pos + 4, "trak", 4)) ? ARMEDIA_Bench_FindAtom (moov + pos + 8, length - 8, "mdia", &size) : NULL;
+        hdlr = (NULL != mdia) ? ARMEDIA_Bench_FindAtom (mdia, size, "hdlr", &hdlrSize) : NULL;
+        stbl = (NULL != mdia) ? ARMEDIA_Bench_FindAtom (mdia, size, "minf", &size) : NULL;
+        stbl = (NULL != stbl) ? ARMEDIA_Bench_FindAtom (stbl, size, "stbl", &size) : NULL;
+        stsz = (NULL != stbl) ? ARMEDIA_Bench_FindAtom (stbl, size, "stsz", &stszSize) : NULL;
+        stz2 = (NULL != stbl) ? ARMEDIA_Bench_FindAtom (stbl, size, "stz2", &size) : NULL;
+        pos += length;
+        if ((NULL == hdlr) || (hdlrSize < 12) || (0 != memcmp (hdlr + 8, handler, 4)))
+        {
+            continue;
+        }
+        if ((NULL != stsz) && (stszSize >= 12))
+        {
+            sampleSize = ARMEDIA_Bench_ReadU32 (stsz + 4);
+            count = ARMEDIA_Bench_ReadU32 (stsz + 8);
+            if (0 != sampleSize)
+            {
+                total += (uint64_t)sampleSize * count;
+            }
+            for (i = 0; (0 == sampleSize) && (i < count) && (12 + 4 * (size_t)(i + 1) <= stszSize); i++)
+            {
+                total += ARMEDIA_Bench_ReadU32 (stsz + 12 + 4 * i);
+            }
+        }
+        else if ((NULL != stz2) && (size >= 12))
+        {
+            // Compact sizes of 4, 8 or 16 bits
+            uint32_t fieldSize = stz2[7];
+            count = ARMEDIA_Bench_ReadU32 (stz2 + 8);
+            for (i = 0; (i < count) && (12 + ((size_t)(i + 1) * fieldSize + 7) / 8 <= size); i++)
+            {
+                const uint8_t *field = stz2 + 12 + (size_t)i * fieldSize / 8;
+                total += (16 == fieldSize) ? (uint32_t)((field[0] << 8) | field[1]) :
+                         (8 == fieldSize) ? field[0] : (0 == (i & 1)) ? (uint32_t)(field[0] >> 4) : (uint32_t)(field[0] & 0xf);
+            }
+        }
+    }
+    free (moov);
+    return total;
+}
+
+/*
+ * segment: the same recording with audio as a single media and split into
+ * segments (ARMEDIA_VideoEncapsuler_SetSegmentation()), with the audio
+ * captured before each cut delivered after the I-frame starting the next
+ * segment. The segments must hold all the video and audio bytes of the
+ * single media; the audio of a segment only gains the silence aligning its
+ * first sample on its first frame.
+ */
+static int ARMEDIA_Bench_Segment (int argc, char *argv[])
+{
+    uint32_t seconds = (argc > 0) ? (uint32_t)atoi (argv[0]) : 60;
+    uint32_t segmentSeconds = (argc > 1) ? (uint32_t)atoi (argv[1]) : 10;
+    const char *directory = (argc > 2) ? argv[2] : "/tmp";
+    static const char *names[] = { "single media:", "segments:" };
+    uint32_t frames = seconds * 30;
+    uint64_t videoSize[2] = { 0, 0 }, audioSize[2] = { 0, 0 };
+    uint32_t segmentCount = 0, pass, i, n;
+    uint8_t frame[ARMEDIA_BENCH_FRAME_SIZE (16 + 128)];
+    uint8_t audio[1024] = { 0 };
+    char mediaPath[256], path[256];
+    eARMEDIA_ERROR error = ARMEDIA_OK;
+    struct stat st;
+
+    if ((0 == frames) || (0 == segmentSeconds))
+    {
+        fprintf (stderr, "invalid duration\n");
+        return 1;
+    }
+    snprintf (mediaPath, sizeof (mediaPath), "%s/armedia-bench-segment.mp4", directory);
+    printf ("%u s at 30 fps with 16 kHz audio in chunks of 32 ms, segments of %u s in %s\n", seconds, segmentSeconds, directory);
+
+    for (pass = 0; (pass < 2) && (ARMEDIA_OK == error); pass++)
+    {
+        ARMEDIA_VideoEncapsuler_t *encapsuler = ARMEDIA_Bench_NewEncapsuler (mediaPath, 0, &error);
+        uint64_t audioTimestamp = 1000000;
+        uint32_t seed = 7;
+        double start, elapsed;
+
+        if (NULL == encapsuler)
+        {
+            break;
+        }
+        if (1 == pass)
+        {
+            error = ARMEDIA_VideoEncapsuler_SetSegmentation (encapsuler, 0, segmentSeconds * 1000, NULL, NULL);
+        }
+
+        start = ARMEDIA_Bench_Now ();
+        for (i = 0; (i < frames) && (ARMEDIA_OK == error); i++)
+        {
+            ARMEDIA_Frame_Header_t header;
+
+            ARMEDIA_Bench_MakeFrame (&header, frame, i, 16 + ARMEDIA_Bench_Random (&seed) % 128, 1000000 + (uint64_t)i * 1000000 / 30);
+            error = ARMEDIA_VideoEncapsuler_AddFrame (encapsuler, &header, NULL);
+
+            // The audio captured before the frame is delivered after it
+            while ((ARMEDIA_OK == error) && (audioTimestamp < header.timestamp))
+            {
+                ARMEDIA_Sample_Header_t sample;
+
+                memset (&sample, 0, sizeof (sample));
+                sample.codec = ACODEC_PCM;
+                sample.format = AFORMAT_16BITS;
+                sample.frequency = 16000;
+                sample.nchannel = 1;
+                sample.timestamp = audioTimestamp;
+                sample.sample_size = sizeof (audio);
+                sample.sample = audio;
+                error = ARMEDIA_VideoEncapsuler_AddSample (encapsuler, &sample);
+                audioTimestamp += (uint64_t)sample.sample_size * 1000000 / (2 * 16000);
+            }
+        }
+        if (ARMEDIA_OK == error)
+        {
+            error = ARMEDIA_VideoEncapsuler_Finish (&encapsuler);
+        }
+        else
+        {
+            ARMEDIA_VideoEncapsuler_Finish (&encapsuler);
+        }
+        ARMEDIA_VideoEncapsuler_FinishAsyncWait ();
+        elapsed = ARMEDIA_Bench_Now () - start;
+
+        // The segment n is named with a "_%03u" suffix
+        for (n = 0; ; n++)
+        {
+            if (0 == n)
+            {
+                snprintf (path, sizeof (path), "%s", mediaPath);
+            }
+            else
+            {
+                snprintf (path, sizeof (path), "%.*s_%03u.mp4", (int)(strlen (mediaPath) - 4), mediaPath, n);
+            }
+            if (0 != stat (path, &st))
+            {
+                break;
+            }
+            videoSize[pass] += ARMEDIA_Bench_GetTrackSize (path, "vide");
+            audioSize[pass] += ARMEDIA_Bench_GetTrackSize (path, "soun");
+            unlink (path);
+        }
+        segmentCount = n;
+        if (ARMEDIA_OK == error)
+        {
+            printf ("%-14s %3u media(s), video %10llu bytes, audio %10llu bytes, %8.3f ms\n", names[pass], n,
+                    (unsigned long long)videoSize[pass], (unsigned long long)audioSize[pass], elapsed * 1e3);
+        }
+    }
+    if (ARMEDIA_OK != error)
+    {
+        fprintf (stderr, "recording failed: %s\n", ARMEDIA_Error_ToString (error));
+        return 1;
+    }
+
+    // At most one sample of silence per cut
+    if ((videoSize[1] != videoSize[0]) || (audioSize[1] < audioSize[0]) ||
+        (audioSize[1] - audioSize[0] > (uint64_t)(segmentCount - 1) * sizeof (audio)))
+    {
+        fprintf (stderr, "the segments do not hold the bytes of the single media\n");
+        return 1;
+    }
+    printf ("audio silence at the cuts: %llu bytes\n", (unsigned long long)(audioSize[1] - audioSize[0]));
+    return 0;
+}
+
+/*
+ * recover: time of ARMEDIA_VideoEncapsuler_TryFixMediaFile() on a recording
+ * interrupted without Finish, with and without checkpoints of the sample tables
+ * in the infos file (ARMEDIA_VideoEncapsuler_SetCheckpointInterval()). The
+ * recording process exits without finishing, as on a crash.
+ */
+static int ARMEDIA_Bench_Recover (int argc, char *argv[])
+{
+    uint32_t minutes = (argc > 0) ? (uint32_t)atoi (argv[0]) : 30;
+    uint32_t interval = (argc > 1) ? (uint32_t)atoi (argv[1]) : ARMEDIA_ENCAPSULER_DEFAULT_CHECKPOINT_INTERVAL;
+    const char *directory = (argc > 2) ? argv[2] : "/tmp";
+    static const char *names[] = { "no checkpoint:", "checkpoints:" };
+    uint32_t frames = minutes * 60 * 30;
+    uint32_t pass;
+    char mediaPath[256];
+    char infoPath[sizeof (mediaPath) + sizeof (METAFILE_EXT)];
+    struct stat st;
+    int ret = 0;
+
+    printf ("%u min at 30 fps with 64-byte metadata, a checkpoint every %u infos, in %s\n", minutes, interval, directory);
+    snprintf (mediaPath, sizeof (mediaPath), "%s/armedia-bench-recover.mp4", directory);
+    snprintf (infoPath, sizeof (infoPath), "%s%s", mediaPath, METAFILE_EXT);
+
+    for (pass = 0; (pass < 2) && (0 == ret); pass++)
+    {
+        double start, elapsed;
+        off_t infoSize;
+        int status = 0;
+        pid_t pid = fork ();
+
+        if (0 == pid)
+        {
+            eARMEDIA_ERROR error = ARMEDIA_OK;
+            ARMEDIA_VideoEncapsuler_t *encapsuler = ARMEDIA_Bench_NewEncapsuler (mediaPath, 0, &error);
+            uint8_t frame[ARMEDIA_BENCH_FRAME_SIZE (64)];
+            uint8_t metadata[64] = { 0 };
+            uint32_t i;
+
+            if (NULL == encapsuler)
+            {
+                _exit (1);
+            }
+            error = ARMEDIA_VideoEncapsuler_SetMetadataInfo (encapsuler, "", "application/octet-stream", sizeof (metadata));
+            if (ARMEDIA_OK == error)
+            {
+                error = ARMEDIA_VideoEncapsuler_SetCheckpointInterval (encapsuler, (0 == pass) ? 0 : interval);
+            }
+            // Small frames: the recovery time only depends on the number of infos
+            for (i = 0; (i < frames) && (ARMEDIA_OK == error); i++)
+            {
+                ARMEDIA_Frame_Header_t header;
+
+                ARMEDIA_Bench_MakeFrame (&header, frame, i, 64, 1000000 + (uint64_t)i * 1000000 / 30);
+                error = ARMEDIA_VideoEncapsuler_AddFrame (encapsuler, &header, metadata);
+            }
+            if (ARMEDIA_OK == error)
+            {
+                error = ARMEDIA_VideoEncapsuler_Flush (encapsuler);
+            }
+            _exit ((ARMEDIA_OK == error) ? 0 : 1);
+        }
+        if ((0 > pid) || (pid != waitpid (pid, &status, 0)) || !WIFEXITED (status) || (0 != WEXITSTATUS (status)))
+        {
+            fprintf (stderr, "recording failed\n");
+            ret = 1;
+            break;
+        }
+
+        infoSize = (0 == stat (infoPath, &st)) ? st.st_size : -1;
+        start = ARMEDIA_Bench_Now ();
+        if (1 != ARMEDIA_VideoEncapsuler_TryFixMediaFile (infoPath))
+        {
+            fprintf (stderr, "recovery failed\n");
+            ret = 1;
+        }
+        elapsed = ARMEDIA_Bench_Now () - start;
+        if (0 == ret)
+        {
+            printf ("%-15s recovery %8.3f ms, infos %9lld bytes, media %11lld bytes\n", names[pass], elapsed * 1e3,
+                    (long long)infoSize, (0 == stat (mediaPath, &st)) ? (long long)st.st_size : -1LL);
+        }
+        unlink (mediaPath);
+    }
+    return ret;
+}
+
+static const ARMEDIA_Bench_t ARMEDIA_Bench_List[] = {
+    { "sampletable", "[fps] [jitter usec]", ARMEDIA_Bench_SampleTable },
+    { "startcode", "[frame KiB] [slices]", ARMEDIA_Bench_StartCode },
+    { "finish", "[frames] [thumbnail KiB] [directory]", ARMEDIA_Bench_Finish },
+    { "tracks", "[minutes] [max threads] [directory]", ARMEDIA_Bench_Tracks },
+    { "stts", "[minutes] [jitter usec] [tolerance usec] [directory]", ARMEDIA_Bench_Stts },
+    { "container", "[frames] [frame KiB] [directory]", ARMEDIA_Bench_Container },
+    { "segment", "[seconds] [segment seconds] [directory]", ARMEDIA_Bench_Segment },
+    { "recover", "[minutes] [checkpoint interval] [directory]", ARMEDIA_Bench_Recover },
+};
+
+int main (int argc, char *argv[])
+{
+    size_t i;
+    size_t count = sizeof (ARMEDIA_Bench_List) / sizeof (ARMEDIA_Bench_List[0]);
+
+    if (argc >= 2)
+    {
+        for (i = 0; i < count; i++)
+        {
+            if (0 == strcmp (argv[1], ARMEDIA_Bench_List[i].name))
+            {
+                return ARMEDIA_Bench_List[i].function (argc - 2, argv + 2);
+            }
+        }
+    }
+
+    fprintf (stderr, "usage: %s <benchmark> [options]\n", argv[0]);
+    for (i = 0; i < count; i++)
+    {
+        fprintf (stderr, "    %s %s\n", ARMEDIA_Bench_List[i].name, ARMEDIA_Bench_List[i].usage);
+    }
+    return 1;
+}
@@ -0,0 +1,20 @@
+LOCAL_PATH := $(call my-dir)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := armedia-bench
+LOCAL_DESCRIPTION := Native benchmarks of libARMedia
+LOCAL_CATEGORY_PATH := dragon/tools
+
+LOCAL_LIBRARIES := \
+	libARMedia
+
+# The benchmarks use the private modules of the library
+LOCAL_C_INCLUDES := \
+	$(LOCAL_PATH)/../../Includes \
+	$(LOCAL_PATH)/../../Sources
+
+LOCAL_SRC_FILES := \
+	ARMEDIA_Bench.c
+
+include $(BUILD_EXECUTABLE)
@@ -0,0 +1,221 @@
+/*
+    Copyright (C) 2014 Parrot SA
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the
+      distribution.
+    * Neither the name of Parrot nor the names
+      of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written
+      permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+    "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+    LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+    FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+    COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+    BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+    OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+    AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+    OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+    SUCH DAMAGE.
+*/
+/**
+ * @file ARMEDIA_FastStartTool.c
+ * @brief Move the moov atom of recorded medias before their mdat atom.
+ *
+ * usage: armedia-faststart [-j threads] [-c] <media or directory>...
+ * The .mp4 medias of the directories are processed (not recursively).
+ * Each job holds the moov atom of its media in memory: the peak memory is
+ * about the sum of the moov atoms of the medias processed in parallel.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <libARMedia/ARMedia.h>
+#include <libARMedia/ARMEDIA_VideoEncapsuler.h>
+#include "ARMEDIA_TaskPool.h"
+
+typedef struct
+{
+    char path[ARMEDIA_ENCAPSULER_VIDEO_PATH_SIZE];
+    uint8_t forceCopy;
+    eARMEDIA_ERROR error;
+    eARMEDIA_ENCAPSULER_FASTSTART_METHOD method;
+} ARMEDIA_FastStartTool_Media_t;
+
+static const char *ARMEDIA_FastStartTool_MethodName[ARMEDIA_ENCAPSULER_FASTSTART_METHOD_MAX] = {
+    "already fast start",
+    "free space",
+    "insert range",
+    "copy",
+};
+
+static void ARMEDIA_FastStartTool_Process (void *context)
+{
+    ARMEDIA_FastStartTool_Media_t *media = context;
+    media->error = ARMEDIA_VideoEncapsuler_FastStartMediaFile (media->path, media->forceCopy, &media->method);
+}
+
+static int ARMEDIA_FastStartTool_Add (ARMEDIA_FastStartTool_Media_t **medias, uint32_t *count, uint32_t *capacity, const char *path, uint8_t forceCopy)
+{
+    if (*count == *capacity)
+    {
+        uint32_t newCapacity = (0 == *capacity) ? 64 : 2 * *capacity;
+        ARMEDIA_FastStartTool_Media_t *newMedias = realloc (*medias, newCapacity * sizeof (**medias));
+        if (NULL == newMedias)
+        {
+            return -1;
+        }
+        *medias = newMedias;
+        *capacity = newCapacity;
+    }
+    if (sizeof ((*medias)[0].path) <= (size_t)snprintf ((*medias)[*count].path, sizeof ((*medias)[0].path), "%s", path))
+    {
+        fprintf (stderr, "%s: path too long\n", path);
+        return 0;
+    }
+    (*medias)[*count].forceCopy = forceCopy;
+    (*medias)[*count].error = ARMEDIA_OK;
+    (*medias)[*count].method = ARMEDIA_ENCAPSULER_FASTSTART_METHOD_NONE;
+    (*count)++;
+    return 0;
+}
+
+static int ARMEDIA_FastStartTool_AddDirectory (ARMEDIA_FastStartTool_Media_t **medias, uint32_t *count, uint32_t *capacity, const char *directory, uint8_t forceCopy)
+{
+    char path[ARMEDIA_ENCAPSULER_VIDEO_PATH_SIZE];
+    struct dirent *entry;
+    DIR *dir = opendir (directory);
+    int ret = 0;
+
+    if (NULL == dir)
+    {
+        perror (directory);
+        return 0;
+    }
+    while ((0 == ret) && (NULL != (entry = readdir (dir))))
+    {
+        const char *ext = strrchr (entry->d_name, '.');
+        struct stat st;
+        if ((NULL == ext) || (0 != strcasecmp (ext + 1, ARMEDIA_MP4_EXTENSION)))
+        {
+            continue;
+        }
+        if (sizeof (path) <= (size_t)snprintf (path, sizeof (path), "%s/%s", directory, entry->d_name))
+        {
+            fprintf (stderr, "%s/%s: path too long\n", directory, entry->d_name);
+            continue;
+        }
+        if ((0 == stat (path, &st)) && S_ISREG (st.st_mode))
+        {
+            ret = ARMEDIA_FastStartTool_Add (medias, count, capacity, path, forceCopy);
+        }
+    }
+    closedir (dir);
+    return ret;
+}
+
+static void ARMEDIA_FastStartTool_Usage (const char *name)
+{
+    fprintf (stderr, "usage: %s [-j threads] [-c] <media or directory>...\n", name);
+    fprintf (stderr, "  -j threads: number of medias processed in parallel (default: number of CPUs up to %d, max %d)\n", ARMEDIA_TASKPOOL_DEFAULT_MAX_THREADS, ARMEDIA_TASKPOOL_MAX_THREADS);
+    fprintf (stderr, "  -c: always write a copy of the media instead of modifying it in place\n");
+}
+
+int main (int argc, char *argv[])
+{
+    ARMEDIA_FastStartTool_Media_t *medias = NULL;
+    uint32_t count = 0, capacity = 0, threadCount = 0, i;
+    uint32_t methodCount[ARMEDIA_ENCAPSULER_FASTSTART_METHOD_MAX] = { 0 };
+    uint32_t failed = 0;
+    uint8_t forceCopy = 0;
+    int opt;
+
+    while (-1 != (opt = getopt (argc, argv, "j:ch")))
+    {
+        switch (opt)
+        {
+        case 'j':
+            threadCount = (uint32_t)atoi (optarg);
+            break;
+        case 'c':
+            forceCopy = 1;
+            break;
+        default:
+            ARMEDIA_FastStartTool_Usage (argv[0]);
+            return (('h' == opt) ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+    if (optind >= argc)
+    {
+        ARMEDIA_FastStartTool_Usage (argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    for (; optind < argc; optind++)
+    {
+        struct stat st;
+        int ret;
+        if (0 != stat (argv[optind], &st))
+        {
+            perror (argv[optind]);
+            failed++;
+            continue;
+        }
+        ret = S_ISDIR (st.st_mode)
+            ? ARMEDIA_FastStartTool_AddDirectory (&medias, &count, &capacity, argv[optind], forceCopy)
+            : ARMEDIA_FastStartTool_Add (&medias, &count, &capacity, argv[optind], forceCopy);
+        if (0 != ret)
+        {
+            fprintf (stderr, "out of memory\n");
+            free (medias);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if ((0 < count) &&
+        (ARMEDIA_OK != ARMEDIA_TaskPool_Run (ARMEDIA_FastStartTool_Process, medias, sizeof (*medias), count, threadCount)))
+    {
+        fprintf (stderr, "unable to process the medias\n");
+        free (medias);
+        return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        if (ARMEDIA_OK == medias[i].error)
+        {
+            printf ("%s: %s\n", medias[i].path, ARMEDIA_FastStartTool_MethodName[medias[i].method]);
+            methodCount[medias[i].method]++;
+        }
+        else
+        {
+            printf ("%s: %s\n", medias[i].path, ARMEDIA_Error_ToString (medias[i].error));
+            failed++;
+        }
+    }
+    printf ("%u medias: %u already fast start, %u free space, %u insert range, %u copy, %u failed\n",
+            count, methodCount[ARMEDIA_ENCAPSULER_FASTSTART_METHOD_NONE],
+            methodCount[ARMEDIA_ENCAPSULER_FASTSTART_METHOD_FREE_SPACE],
+            methodCount[ARMEDIA_ENCAPSULER_FASTSTART_METHOD_INSERT_RANGE],
+            methodCount[ARMEDIA_ENCAPSULER_FASTSTART_METHOD_COPY], failed);
+
+    free (medias);
+    return ((0 == failed) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,20 @@
+LOCAL_PATH := $(call my-dir)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := armedia-faststart
+LOCAL_DESCRIPTION := Move the moov atom of recorded medias before their mdat atom
+LOCAL_CATEGORY_PATH := dragon/tools
+
+LOCAL_LIBRARIES := \
+	libARMedia
+
+# The tool uses the private task pool of the library
+LOCAL_C_INCLUDES := \
+	$(LOCAL_PATH)/../../Includes \
+	$(LOCAL_PATH)/../../Sources
+
+LOCAL_SRC_FILES := \
+	ARMEDIA_FastStartTool.c
+
+include $(BUILD_EXECUTABLE)
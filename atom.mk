@@ -25,7 +25,16 @@ LOCAL_CFLAGS := \
 LOCAL_SRC_FILES := \
 	gen/Sources/ARMEDIA_Error.c \
 	Sources/ARMEDIA_VideoEncapsuler.c \
-	Sources/ARMEDIA_VideoAtoms.c
+	Sources/ARMEDIA_VideoAtoms.c \
+	Sources/ARMEDIA_FileWriter.c \
+	Sources/ARMEDIA_Sidecar.c \
+	Sources/ARMEDIA_SampleTable.c \
+	Sources/ARMEDIA_NaluScanner.c \
+	Sources/ARMEDIA_DirectWriter.c \
+	Sources/ARMEDIA_AtomTree.c \
+	Sources/ARMEDIA_TaskPool.c \
+	Sources/ARMEDIA_FastStart.c \
+	Sources/ARMEDIA_TsMuxer.c
 
 LOCAL_INSTALL_HEADERS := \
 	Includes/libARMedia/ARMEDIA_VideoAtoms.h:usr/include/libARMedia/ \
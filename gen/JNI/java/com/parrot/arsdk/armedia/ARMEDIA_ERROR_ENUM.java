@@ -70,7 +70,11 @@ public enum ARMEDIA_ERROR_ENUM {
    /** File error while encapsulating */
     ARMEDIA_ERROR_ENCAPSULER_FILE_ERROR (-2995, "File error while encapsulating"),
    /** Timestamp is before previous sample */
-    ARMEDIA_ERROR_ENCAPSULER_BAD_TIMESTAMP (-2994, "Timestamp is before previous sample");
+    ARMEDIA_ERROR_ENCAPSULER_BAD_TIMESTAMP (-2994, "Timestamp is before previous sample"),
+   /** Writer queue is full, frame dropped */
+    ARMEDIA_ERROR_ENCAPSULER_QUEUE_FULL (-2993, "Writer queue is full, frame dropped"),
+   /** No space left on the storage, frame dropped */
+    ARMEDIA_ERROR_ENCAPSULER_DISK_FULL (-2992, "No space left on the storage, frame dropped");
 
     private final int value;
     private final String comment;
@@ -86,6 +86,12 @@ const char* ARMEDIA_Error_ToString (eARMEDIA_ERROR error)
     case ARMEDIA_ERROR_ENCAPSULER_BAD_TIMESTAMP:
         return "Timestamp is before previous sample";
         break;
+    case ARMEDIA_ERROR_ENCAPSULER_QUEUE_FULL:
+        return "Writer queue is full, frame dropped";
+        break;
+    case ARMEDIA_ERROR_ENCAPSULER_DISK_FULL:
+        return "No space left on the storage, frame dropped";
+        break;
     default:
         break;
     }